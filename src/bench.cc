@@ -0,0 +1,829 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "bench.h"
+#include "bvh.h"
+#include "ensemble.h"
+#include "hair.h"
+#include "hair_kern.h"
+#include "mesh.h"
+#include "sdf.h"
+#include "timer.h"
+#include "wind.h"
+
+#define BENCH_ITER 200
+
+/* skinning: vertices of the synthetic mesh, and its bones */
+#define BENCH_SKIN_VERTS 100000
+#define BENCH_SKIN_BONES 32
+
+/* ensemble: root darts thrown on the head of every instance, and updates */
+#define BENCH_ENS_DARTS 20000
+#define BENCH_ENS_FRAMES 60
+
+/* grooming: edits of each kind, the strands added by each, the radius of
+ * the edited regions, the root spacing, and the LOD they're made at */
+#define BENCH_GROOM_EDITS 50
+#define BENCH_GROOM_ADD 200
+#define BENCH_GROOM_RADIUS 0.1
+#define BENCH_GROOM_MIN_DIST 0.004
+#define BENCH_GROOM_LOD 0.5
+
+/* bvh: resolution of the test head */
+#define BENCH_BVH_SLICES 128
+#define BENCH_BVH_STACKS 64
+
+struct BenchStrands {
+	std::vector<HairStrand> hair;
+	std::vector<HairSpawn> spawns;
+	std::vector<KernSpawn> packed;
+};
+
+/* a random query of each kind: the point, or the ray origin and direction.
+ * Odd ones are limited to max_dist (or tmax), even ones aren't */
+struct BvhQuery {
+	Vec3 p;
+	Vec3 dir;
+	float max_dist;
+	float rad;	/* for find_sphere */
+};
+
+static void init_strands(BenchStrands *bs, int num, KernParams *kp);
+static double time_update(const HairKernels *kern, BenchStrands *bs, bool compact, const KernParams *kp);
+static double time_wind(const HairKernels *kern, BenchStrands *bs, const KernParams *kp);
+static double time_collide(const HairKernels *kern, std::vector<HairStrand> *hair, const KernParams *kp);
+static double time_tess(const HairKernels *kern, const BenchStrands *bs, const KernParams *kp);
+static double time_skin(int num_verts);
+static void make_head(Mesh *m, int slices, int stacks);
+static void ens_transform(Mat4 *xform, int inst, int frame);
+static bool groom_center(Hair *hair, const Mesh *head, Vec3 *center);
+static void warp_head(Mesh *m, const std::vector<Vec3> &orig, float phase);
+static bool check_bvh(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries);
+static int check_closest(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries,
+		unsigned long *bvh_usec, unsigned long *scan_usec);
+static int check_ray(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries,
+		unsigned long *bvh_usec, unsigned long *scan_usec);
+static int check_sphere(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries,
+		unsigned long *bvh_usec, unsigned long *scan_usec);
+static bool scan_ray_triangle(const Vec3 &org, const Vec3 &dir, const Vec3 &a, const Vec3 &b,
+		const Vec3 &c, float *t);
+static inline float randf(float lo, float hi);
+
+int run_bench(int num_strands)
+{
+	if(!kern_init()) {
+		return 1;
+	}
+
+	BenchStrands bs;
+
+	Mat4 xform = Mat4::identity;
+	xform.rotate_x(gph::deg_to_rad(10.0));
+
+	KernParams kp;
+	kern_set_xform(&kp, xform);
+	kp.hair_length = 0.5;
+	kp.k_anc = 4.0;
+	kp.damping = 1.5;
+	kp.wind_drag = 1.0;
+	kp.dt = 1.0 / 60.0;
+	kp.max_speed = kp.hair_length * 2.0 / kp.dt;
+	kp.max_stretch = kp.hair_length * 4.0;
+	kp.substeps = kp.max_substeps = 1;
+
+	printf("%d strands, %d iterations\n", num_strands, BENCH_ITER);
+	printf("isa       update (Mstrands/s)   compact (Mstrands/s)  wind (Mstrands/s)     collide (Mstrands/s)  tess (Mstrands/s)  wind cost\n");
+
+	for(int i=0; i<NUM_KERN_ISA; i++) {
+		const HairKernels *kern = kern_get(i);
+		if(!kern) continue;
+
+		init_strands(&bs, num_strands, &kp);
+		double upd = time_update(kern, &bs, false, &kp);
+		init_strands(&bs, num_strands, &kp);
+		double cupd = time_update(kern, &bs, true, &kp);
+		init_strands(&bs, num_strands, &kp);
+		double wupd = time_wind(kern, &bs, &kp);
+		double col = time_collide(kern, &bs.hair, &kp);
+		double tess = time_tess(kern, &bs, &kp);
+
+		/* the wind cost is what turbulence adds to the update */
+		printf("%-8s  %10.2f            %10.2f            %10.2f            %10.2f            %10.2f       %5.1f%%%s\n",
+				kern->name,
+				(double)num_strands * BENCH_ITER / upd,
+				(double)num_strands * BENCH_ITER / cupd,
+				(double)num_strands * BENCH_ITER / wupd,
+				(double)num_strands * BENCH_ITER / col,
+				(double)num_strands * BENCH_ITER / tess,
+				(wupd - upd) / upd * 100.0,
+				kern == hair_kern ? "  (selected)" : "");
+	}
+
+	/* skinning isn't built per instruction set, it's SSE */
+	double skin = time_skin(BENCH_SKIN_VERTS);
+	printf("skinning %d vertices, %d bones, 4 influences: %.3f ms (%.2f Mverts/s)\n",
+			BENCH_SKIN_VERTS, BENCH_SKIN_BONES, skin / BENCH_ITER / 1000.0,
+			(double)BENCH_SKIN_VERTS * BENCH_ITER / skin);
+	return 0;
+}
+
+/* random strands on the upper half of a unit sphere */
+static void init_strands(BenchStrands *bs, int num, KernParams *kp)
+{
+	srand(1);
+	bs->hair.resize(num);
+	bs->spawns.resize(num);
+	bs->packed.resize(num);
+
+	for(int i=0; i<num; i++) {
+		HairStrand *s = &bs->hair[i];
+		HairSpawn *sp = &bs->spawns[i];
+
+		Vec3 dir;
+		do {
+			dir.x = (float)rand() / RAND_MAX * 2.0 - 1.0;
+			dir.y = (float)rand() / RAND_MAX;
+			dir.z = (float)rand() / RAND_MAX * 2.0 - 1.0;
+		} while(length_sq(dir) < 1e-4 || length_sq(dir) > 1.0);
+		dir.normalize();
+
+		sp->pt = dir;
+		sp->dir = dir;
+		sp->tri = 0;
+		sp->bary = Vec3(1, 0, 0);
+		sp->id = i;
+		s->pos = dir * 1.5;
+		s->velocity = Vec3(0, 0, 0);
+	}
+
+	Aabb box;
+	box.v0 = Vec3(-1, 0, -1);
+	box.v1 = Vec3(1, 1, 1);
+	kern_set_spawn_box(kp, box);
+	kern_pack_spawns(&bs->packed[0], &bs->spawns[0], num, box);
+}
+
+/* returns microseconds */
+static double time_update(const HairKernels *kern, BenchStrands *bs, bool compact, const KernParams *kp)
+{
+	KernStats stats;
+	KernUpdateFunc update = kern->update[INTEG_SYMPLECTIC][1][1][compact ? 1 : 0][0];
+	int num = bs->hair.size();
+	update(&bs->hair[0], &bs->spawns[0], &bs->packed[0], 0, num, kp, &stats);	/* warm up */
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<BENCH_ITER; i++) {
+		update(&bs->hair[0], &bs->spawns[0], &bs->packed[0], 0, num, kp, &stats);
+	}
+	return get_time_usec() - start;
+}
+
+/* the update with turbulence, as in Hair: every wind_interval updates the
+ * wind grid and sampling it at a part of the strands in turns, and the
+ * wind variant of the update kernel */
+static double time_wind(const HairKernels *kern, BenchStrands *bs, const KernParams *kp)
+{
+	HairParams params;
+	default_params(&params);
+	params.turb_speed = 1.0;
+
+	Aabb box;
+	box.v0 = Vec3(-1.5, -0.5, -1.5);
+	box.v1 = Vec3(1.5, 1.5, 1.5);
+
+	WindGrid grid;
+	KernWind kwind;
+	KernStats stats;
+	KernUpdateFunc update = kern->update[INTEG_SYMPLECTIC][1][1][0][1];
+	int num = bs->hair.size();
+	std::vector<float> vel(num * 3);
+	int part = (num + WIND_REFRESH - 1) / WIND_REFRESH;
+
+	unsigned long start = 0;
+	int builds = 0;
+	for(int i=-1; i<BENCH_ITER; i++) {
+		if(i == 0) {
+			start = get_time_usec();	/* after a warm up */
+		}
+		if(i >= 0 && (i + 1) % kern->wind_interval) {
+			update(&bs->hair[0], &bs->spawns[0], &bs->packed[0], &vel[0], num, kp, &stats);
+			continue;
+		}
+		build_wind(&grid, kern, params, box, i * kp->dt);
+		kwind.vel = &grid.vel[0];
+		kwind.xsz = grid.xsz;
+		kwind.ysz = grid.ysz;
+		kwind.zsz = grid.zsz;
+		kwind.origin[0] = grid.origin.x;
+		kwind.origin[1] = grid.origin.y;
+		kwind.origin[2] = grid.origin.z;
+		kwind.cell = grid.cell;
+
+		if(i < 0) {
+			kern->sample_wind(&bs->hair[0], num, &kwind, &vel[0]);
+		} else {
+			int lo = part * (builds++ % WIND_REFRESH);
+			int hi = lo + part < num ? lo + part : num;
+			kern->sample_wind(&bs->hair[lo], hi - lo, &kwind, &vel[lo * 3]);
+		}
+		update(&bs->hair[0], &bs->spawns[0], &bs->packed[0], &vel[0], num, kp, &stats);
+	}
+	return get_time_usec() - start;
+}
+
+static double time_collide(const HairKernels *kern, std::vector<HairStrand> *hair, const KernParams *kp)
+{
+	KernSphere spheres[2] = {
+		{0, 0.6, 0.53, 1.0},
+		{0, 0, 0, 1.2}
+	};
+	kern->collide(&(*hair)[0], hair->size(), kp, spheres, 2);
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<BENCH_ITER; i++) {
+		kern->collide(&(*hair)[0], hair->size(), kp, spheres, 2);
+	}
+	return get_time_usec() - start;
+}
+
+/* the tessellation of Hair::draw, with every strand at 8 segments, into
+ * memory instead of a vertex buffer */
+static double time_tess(const HairKernels *kern, const BenchStrands *bs, const KernParams *kp)
+{
+	int num = bs->hair.size();
+	std::vector<Vec3> tips(num);
+	for(int i=0; i<num; i++) {
+		tips[i] = bs->hair[i].pos;
+	}
+
+	Mat4 xform = Mat4::identity;
+	xform.rotate_x(gph::deg_to_rad(10.0));
+
+	KernTess tp;
+	kern_set_tess_xform(&tp, xform, Mat4::identity);
+	tp.hair_length = kp->hair_length;
+	tp.cam[0] = tp.cam[1] = tp.cam[2] = 0;
+	tp.seg_scale = 0;
+	tp.max_segs = 8;
+	tp.fade_start = num;
+	tp.fade_scale = 0;
+
+	std::vector<KernCurve> curves(num);
+	std::vector<float> pos(num * 9 * 3);
+	std::vector<uint32_t> color(num * 9);
+	kern->fit_curves(&bs->spawns[0], &tips[0], 0, 0, num, &tp, &curves[0]);
+	kern->tessellate(&curves[0], num, &pos[0], &color[0]);
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<BENCH_ITER; i++) {
+		kern->fit_curves(&bs->spawns[0], &tips[0], 0, 0, num, &tp, &curves[0]);
+		kern->tessellate(&curves[0], num, &pos[0], &color[0]);
+	}
+	return get_time_usec() - start;
+}
+
+/* Mesh::skin of a mesh with every vertex bound to 4 bones of a chain */
+static double time_skin(int num_verts)
+{
+	Skeleton skel;
+	skel.nodes.resize(BENCH_SKIN_BONES);
+
+	Mesh mesh;
+	mesh.bones.resize(BENCH_SKIN_BONES);
+	for(int i=0; i<BENCH_SKIN_BONES; i++) {
+		SkelNode *node = &skel.nodes[i];
+		node->parent = i - 1;
+		node->global_xform = Mat4::identity;
+		node->global_xform.rotate_z(i * 0.05);
+		node->global_xform.translate(Vec3(0, i * 0.1, 0));
+
+		mesh.bones[i].node = i;
+		mesh.bones[i].offset = Mat4::identity;
+	}
+
+	srand(1);
+	mesh.bind_vertices.resize(num_verts);
+	mesh.bind_normals.resize(num_verts);
+	mesh.weights.resize(num_verts);
+	for(int i=0; i<num_verts; i++) {
+		Vec3 v = Vec3((float)rand() / RAND_MAX, (float)rand() / RAND_MAX, (float)rand() / RAND_MAX);
+		mesh.bind_vertices[i] = v;
+		mesh.bind_normals[i] = normalize(v - Vec3(0.5, 0.5, 0.5));
+
+		VertexWeights *vw = &mesh.weights[i];
+		int first = rand() % (BENCH_SKIN_BONES - MAX_BONE_INFLUENCES);
+		for(int j=0; j<MAX_BONE_INFLUENCES; j++) {
+			vw->bone[j] = first + j;
+			vw->weight[j] = 0.4 - j * 0.1;	/* sorted, sums to 1 */
+		}
+	}
+	mesh.vertices = mesh.bind_vertices;
+	mesh.normals = mesh.bind_normals;
+
+	mesh.skin(&skel);	/* warm up */
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<BENCH_ITER; i++) {
+		mesh.skin(&skel);
+	}
+	return get_time_usec() - start;
+}
+
+/* the same parameter sweep stepped by a Hair::update per instance, and by
+ * a HairEnsemble. Both must end up with the same positions */
+int run_bench_ensemble(int num_inst)
+{
+	if(!kern_init()) {
+		return 1;
+	}
+
+	Mesh head;
+	make_head(&head, 128, 64);
+
+	std::vector<Hair*> single(num_inst), batch(num_inst);
+	HairEnsemble ens;
+	int num_strands = 0;
+
+	for(int i=0; i<num_inst; i++) {
+		HairParams p;
+		default_params(&p);
+		p.hair_length = 0.3 + 0.05 * (i % 5);
+		p.k_anc = 2.0 + i % 4;
+		p.damping = 0.5 + 0.5 * (i % 3);
+		p.rest_speed = 1e-3 * (1 + i % 2);
+		p.min_dist = 0.01;
+
+		single[i] = new Hair;
+		batch[i] = new Hair;
+		single[i]->set_params(p);
+		batch[i]->set_params(p);
+
+		/* the seed picks the roots, both get the same ones */
+		srand(i + 1);
+		bool ok = single[i]->init(&head, BENCH_ENS_DARTS, p.thresh);
+		srand(i + 1);
+		if(!ok || !batch[i]->init(&head, BENCH_ENS_DARTS, p.thresh)) {
+			return 1;
+		}
+		ens.add(batch[i]);
+		num_strands += single[i]->get_num_active();
+	}
+
+	printf("%d instances, %d strands, %d frames\n", num_inst, num_strands, BENCH_ENS_FRAMES);
+
+	float dt = 1.0 / 60.0;
+	unsigned long single_usec = 0, batch_usec = 0;
+
+	for(int i=0; i<BENCH_ENS_FRAMES; i++) {
+		for(int j=0; j<num_inst; j++) {
+			Mat4 xform;
+			ens_transform(&xform, j, i);
+			single[j]->set_transform(xform);
+			batch[j]->set_transform(xform);
+		}
+
+		unsigned long start = get_time_usec();
+		for(int j=0; j<num_inst; j++) {
+			single[j]->update(dt);
+		}
+		unsigned long mid = get_time_usec();
+		ens.update(dt);
+		unsigned long end = get_time_usec();
+
+		single_usec += mid - start;
+		batch_usec += end - mid;
+	}
+
+	printf("separate updates: %8.3f ms/frame (%.2f Mstrands/s)\n",
+			single_usec / 1000.0 / BENCH_ENS_FRAMES,
+			(double)num_strands * BENCH_ENS_FRAMES / single_usec);
+	printf("ensemble update:  %8.3f ms/frame (%.2f Mstrands/s)\n",
+			batch_usec / 1000.0 / BENCH_ENS_FRAMES,
+			(double)num_strands * BENCH_ENS_FRAMES / batch_usec);
+
+	/* same blocks through the same kernels, so the results are identical */
+	int mismatch = 0;
+	float max_diff = 0;
+	for(int i=0; i<num_inst; i++) {
+		const HairFrame *fa = single[i]->get_frame();
+		const HairFrame *fb = batch[i]->get_frame();
+		if(fa->num_active != fb->num_active || fa->at_rest != fb->at_rest) {
+			mismatch++;
+			continue;
+		}
+		for(int j=0; j<fa->num_active; j++) {
+			float d = length(fa->pos[j] - fb->pos[j]);
+			if(d > max_diff) max_diff = d;
+		}
+	}
+	printf("max position difference %g, %d instances differ: %s\n", max_diff, mismatch,
+			mismatch || max_diff > 0 ? "FAILED" : "ok");
+
+	for(int i=0; i<num_inst; i++) {
+		delete single[i];
+		delete batch[i];
+	}
+	return mismatch || max_diff > 0 ? 1 : 0;
+}
+
+/* edits regions of a head at half LOD, picked by casting rays at it, and
+ * times each kind of edit. Fails if a pick misses, if the added strands
+ * aren't spread through the LOD order like the rest, or if any roots end
+ * up closer than min_dist */
+int run_bench_groom(int num_strands)
+{
+	if(!kern_init()) {
+		return 1;
+	}
+
+	Mesh head;
+	make_head(&head, 256, 128);
+
+	HairParams p;
+	default_params(&p);
+	p.min_dist = BENCH_GROOM_MIN_DIST;
+
+	Hair hair;
+	hair.set_params(p);
+	srand(1);
+	if(!hair.init(&head, num_strands, p.thresh)) {
+		return 1;
+	}
+	/* init gives the ids in order, the added strands get the next ones */
+	int next_id = hair.get_num_active();
+
+	Mat4 xform = Mat4::identity;
+	hair.set_transform(xform);
+	hair.set_lod(BENCH_GROOM_LOD);
+	float dt = 1.0 / 60.0;
+	for(int i=0; i<1000 && hair.get_frame()->lod != BENCH_GROOM_LOD; i++) {
+		hair.update(dt);
+	}
+	printf("%d strands, %d active, %d edits of each kind\n", next_id, hair.get_num_active(),
+			BENCH_GROOM_EDITS);
+
+	bool failed = false;
+	int misses = 0;
+	int added = 0, added_active = 0;
+	unsigned long first_usec = 0, add_usec = 0, remove_usec = 0, thin_usec = 0, id_usec = 0;
+
+	for(int i=0; i<=BENCH_GROOM_EDITS; i++) {
+		Vec3 c;
+		if(!groom_center(&hair, &head, &c)) {
+			misses++;
+			continue;
+		}
+		unsigned long start = get_time_usec();
+		int num = hair.add_strands(&head, c, BENCH_GROOM_RADIUS, BENCH_GROOM_ADD);
+		unsigned long end = get_time_usec();
+
+		/* the first edit builds the index */
+		if(i == 0) {
+			first_usec = end - start;
+		} else {
+			add_usec += end - start;
+		}
+
+		const HairFrame *frm = hair.get_frame();
+		for(int j=0; j<frm->num_active; j++) {
+			int id = hair.get_strand_id(j);
+			if(id >= next_id && id < next_id + num) {
+				added_active++;
+			}
+		}
+		added += num;
+		next_id += num;
+		if(i == 0) continue;
+
+		hair.update(dt);
+
+		if(!groom_center(&hair, &head, &c)) {
+			misses++;
+			continue;
+		}
+		start = get_time_usec();
+		hair.remove_strands(c, BENCH_GROOM_RADIUS * 0.5);
+		remove_usec += get_time_usec() - start;
+
+		if(!groom_center(&hair, &head, &c)) {
+			misses++;
+			continue;
+		}
+		start = get_time_usec();
+		hair.scale_density(&head, c, BENCH_GROOM_RADIUS, 0.5);
+		thin_usec += get_time_usec() - start;
+
+		start = get_time_usec();
+		hair.remove_strand(rand() % next_id);
+		id_usec += get_time_usec() - start;
+
+		hair.update(dt);
+	}
+
+	printf("first edit (builds the index): %8.3f ms\n", first_usec / 1000.0);
+	printf("add %d strands:               %8.3f ms\n", BENCH_GROOM_ADD, add_usec / 1000.0 / BENCH_GROOM_EDITS);
+	printf("remove region:                 %8.3f ms\n", remove_usec / 1000.0 / BENCH_GROOM_EDITS);
+	printf("thin region to half:           %8.3f ms\n", thin_usec / 1000.0 / BENCH_GROOM_EDITS);
+	printf("remove by id:                  %8.3f ms\n", id_usec / 1000.0 / BENCH_GROOM_EDITS);
+
+	if(misses) {
+		printf("%d picks missed the head: FAILED\n", misses);
+		failed = true;
+	}
+
+	float frac = added > 0 ? (float)added_active / added : 0;
+	bool spread = fabs(frac - BENCH_GROOM_LOD) < 0.1;
+	printf("%d of %d added strands active at LOD %g: %s\n", added_active, added, BENCH_GROOM_LOD,
+			spread ? "ok" : "FAILED");
+	failed |= !spread;
+
+	int close = hair.count_close_roots(&head, p.min_dist);
+	printf("%d roots closer than min_dist: %s\n", close, close ? "FAILED" : "ok");
+	failed |= close > 0;
+
+	return failed ? 1 : 0;
+}
+
+/* picks a random point of the hairy upper half of the head, by casting a
+ * ray at it from outside. It must land on the unit sphere */
+static bool groom_center(Hair *hair, const Mesh *head, Vec3 *center)
+{
+	float phi = (float)rand() / (float)RAND_MAX * 2.0 * M_PI;
+	float y = 0.2 + (float)rand() / (float)RAND_MAX * 0.8;
+	float r = sqrt(1.0 - y * y);
+	Vec3 dir = Vec3(r * cos(phi), y, r * sin(phi));
+
+	if(!hair->pick(head, dir * 3.0, -dir, center)) {
+		return false;
+	}
+	return fabs(length(*center) - 1.0) < 0.01;
+}
+
+/* answers random queries with the bvh of a bumpy head, and with a scan
+ * over all its triangles, once built and once refit to moved vertices.
+ * Fails if any answer differs */
+int run_bench_bvh(int num_queries)
+{
+	Mesh head;
+	make_head(&head, BENCH_BVH_SLICES, BENCH_BVH_STACKS);
+	std::vector<Vec3> orig = head.vertices;
+	warp_head(&head, orig, 0);
+
+	Bvh bvh;
+	unsigned long start = get_time_usec();
+	if(!bvh.build(&head)) {
+		return 1;
+	}
+	printf("%d triangles, %d nodes, built in %.3f ms, %d queries of each kind\n",
+			(int)head.indices.size() / 3, bvh.get_node_count(),
+			(get_time_usec() - start) / 1000.0, num_queries);
+
+	/* points and ray origins around the head, the rays aimed inside it */
+	srand(1);
+	std::vector<BvhQuery> queries(num_queries);
+	for(int i=0; i<num_queries; i++) {
+		BvhQuery *q = &queries[i];
+		q->p = Vec3(randf(-2, 2), randf(-2, 2), randf(-2, 2));
+		Vec3 target = Vec3(randf(-1, 1), randf(-1, 1), randf(-1, 1));
+		q->dir = normalize(target - q->p);
+		q->max_dist = (i & 1) ? randf(0, 1) : FLT_MAX;
+		q->rad = randf(0, 0.5);
+	}
+
+	printf("built:\n");
+	bool ok = check_bvh(&bvh, &head, queries);
+
+	/* moved like a skinned head, which refits instead of building again */
+	warp_head(&head, orig, 1.0);
+	bvh.refit();
+	printf("refit:\n");
+	ok &= check_bvh(&bvh, &head, queries);
+
+	return ok ? 0 : 1;
+}
+
+/* the unit sphere of make_head with bumps, which move with the phase. A
+ * function of the position, so the seam stays closed */
+static void warp_head(Mesh *m, const std::vector<Vec3> &orig, float phase)
+{
+	for(size_t i=0; i<orig.size(); i++) {
+		const Vec3 &v = orig[i];
+		float s = 1.0 + 0.15 * sin(5.0 * v.x + phase) * cos(4.0 * v.z + 2.0 * phase) + 0.05 * sin(9.0 * v.y);
+		m->vertices[i] = v * s;
+	}
+	m->calc_bbox();
+}
+
+static bool check_bvh(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries)
+{
+	const char *names[] = {"closest_point", "intersect_ray", "find_sphere"};
+	int num = queries.size();
+	bool ok = true;
+
+	for(int i=0; i<3; i++) {
+		unsigned long bvh_usec = 0, scan_usec = 0;
+		int bad;
+		switch(i) {
+		case 0:
+			bad = check_closest(bvh, m, queries, &bvh_usec, &scan_usec);
+			break;
+		case 1:
+			bad = check_ray(bvh, m, queries, &bvh_usec, &scan_usec);
+			break;
+		default:
+			bad = check_sphere(bvh, m, queries, &bvh_usec, &scan_usec);
+		}
+		printf("  %-14s bvh %8.3f us, scan %8.3f us, %d differ: %s\n", names[i],
+				(double)bvh_usec / num, (double)scan_usec / num, bad, bad ? "FAILED" : "ok");
+		ok &= bad == 0;
+	}
+	return ok;
+}
+
+static int check_closest(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries,
+		unsigned long *bvh_usec, unsigned long *scan_usec)
+{
+	int num = queries.size();
+	int num_tris = m->indices.size() / 3;
+	std::vector<BvhHit> hits(num);
+	std::vector<char> found(num);
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<num; i++) {
+		found[i] = bvh->closest_point(queries[i].p, queries[i].max_dist, &hits[i]);
+	}
+	*bvh_usec = get_time_usec() - start;
+
+	int bad = 0;
+	start = get_time_usec();
+	for(int i=0; i<num; i++) {
+		const Vec3 &p = queries[i].p;
+		float best = FLT_MAX;
+		for(int j=0; j<num_tris; j++) {
+			const uint32_t *idx = &m->indices[j * 3];
+			Vec3 cp = closest_point_triangle(p, m->vertices[idx[0]], m->vertices[idx[1]], m->vertices[idx[2]]);
+			float d = distance_sq(p, cp);
+			if(d < best) best = d;
+		}
+		best = sqrt(best);
+
+		/* the limit may go either way for a point right at it */
+		float eps = 1e-5 * (1.0 + best);
+		if(fabs(best - queries[i].max_dist) < eps) continue;
+
+		if(found[i] != (best <= queries[i].max_dist)) {
+			bad++;
+		} else if(found[i] && (fabs(hits[i].dist - best) > eps ||
+					fabs(distance(hits[i].pos, p) - best) > eps)) {
+			bad++;
+		}
+	}
+	*scan_usec = get_time_usec() - start;
+	return bad;
+}
+
+static int check_ray(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries,
+		unsigned long *bvh_usec, unsigned long *scan_usec)
+{
+	int num = queries.size();
+	int num_tris = m->indices.size() / 3;
+	std::vector<BvhHit> hits(num);
+	std::vector<char> found(num);
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<num; i++) {
+		found[i] = bvh->intersect_ray(queries[i].p, queries[i].dir, queries[i].max_dist, &hits[i]);
+	}
+	*bvh_usec = get_time_usec() - start;
+
+	int bad = 0;
+	start = get_time_usec();
+	for(int i=0; i<num; i++) {
+		const BvhQuery *q = &queries[i];
+		float best = FLT_MAX;
+		bool any = false;
+		for(int j=0; j<num_tris; j++) {
+			const uint32_t *idx = &m->indices[j * 3];
+			float t;
+			if(scan_ray_triangle(q->p, q->dir, m->vertices[idx[0]], m->vertices[idx[1]],
+						m->vertices[idx[2]], &t) && t <= q->max_dist && t < best) {
+				best = t;
+				any = true;
+			}
+		}
+
+		float eps = 1e-4 * (1.0 + (any ? best : 0));
+		if(any && fabs(best - q->max_dist) < eps) continue;
+
+		if(found[i] != any) {
+			bad++;
+		} else if(any && fabs(hits[i].dist - best) > eps) {
+			bad++;
+		}
+	}
+	*scan_usec = get_time_usec() - start;
+	return bad;
+}
+
+static int check_sphere(const Bvh *bvh, const Mesh *m, const std::vector<BvhQuery> &queries,
+		unsigned long *bvh_usec, unsigned long *scan_usec)
+{
+	int num = queries.size();
+	int num_tris = m->indices.size() / 3;
+	std::vector<std::vector<int> > res(num);
+
+	unsigned long start = get_time_usec();
+	for(int i=0; i<num; i++) {
+		bvh->find_sphere(queries[i].p, queries[i].rad, &res[i]);
+	}
+	*bvh_usec = get_time_usec() - start;
+
+	int bad = 0;
+	std::vector<int> scan;
+	start = get_time_usec();
+	for(int i=0; i<num; i++) {
+		const Vec3 &p = queries[i].p;
+		float rsq = queries[i].rad * queries[i].rad;
+		scan.clear();
+		for(int j=0; j<num_tris; j++) {
+			const uint32_t *idx = &m->indices[j * 3];
+			Vec3 cp = closest_point_triangle(p, m->vertices[idx[0]], m->vertices[idx[1]], m->vertices[idx[2]]);
+			if(distance_sq(p, cp) <= rsq) {
+				scan.push_back(j);
+			}
+		}
+
+		/* the scan finds them in order */
+		std::sort(res[i].begin(), res[i].end());
+		if(res[i] != scan) {
+			bad++;
+		}
+	}
+	*scan_usec = get_time_usec() - start;
+	return bad;
+}
+
+/* ray against the plane of the triangle, then inside its three edges. Not
+ * the test of the bvh, so that the two check each other */
+static bool scan_ray_triangle(const Vec3 &org, const Vec3 &dir, const Vec3 &a, const Vec3 &b,
+		const Vec3 &c, float *t)
+{
+	Vec3 n = cross(b - a, c - a);
+	float ndir = dot(n, dir);
+	if(fabs(ndir) < 1e-12) return false;
+
+	*t = dot(n, a - org) / ndir;
+	if(*t < 0) return false;
+
+	Vec3 p = org + dir * *t;
+	return dot(cross(b - a, p - a), n) >= 0 && dot(cross(c - b, p - b), n) >= 0 &&
+		dot(cross(a - c, p - c), n) >= 0;
+}
+
+static inline float randf(float lo, float hi)
+{
+	return lo + (float)rand() / (float)RAND_MAX * (hi - lo);
+}
+
+/* unit sphere with dark vertices (which grow hair) on its upper half */
+static void make_head(Mesh *m, int slices, int stacks)
+{
+	for(int i=0; i<=stacks; i++) {
+		float theta = M_PI * i / stacks;
+		for(int j=0; j<=slices; j++) {
+			float phi = 2.0 * M_PI * j / slices;
+			Vec3 n = Vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+			float c = n.y > -0.2 ? 0.1 : 0.9;
+
+			m->vertices.push_back(n);
+			m->normals.push_back(n);
+			m->colors.push_back(Vec3(c, c, c));
+			m->texcoords.push_back(Vec2((float)j / slices, (float)i / stacks));
+		}
+	}
+	for(int i=0; i<stacks; i++) {
+		for(int j=0; j<slices; j++) {
+			int a = i * (slices + 1) + j;
+			int b = a + slices + 1;
+			m->indices.push_back(a);
+			m->indices.push_back(b);
+			m->indices.push_back(a + 1);
+			m->indices.push_back(a + 1);
+			m->indices.push_back(b);
+			m->indices.push_back(b + 1);
+		}
+	}
+	m->calc_bbox();
+}
+
+/* every instance nods its head with its own phase */
+static void ens_transform(Mat4 *xform, int inst, int frame)
+{
+	*xform = Mat4::identity;
+	xform->rotate_x(sin(frame * 0.1 + inst) * 0.5);
+	xform->translate(Vec3(inst * 2.5, 0, 0));
+}
@@ -0,0 +1,23 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+/* runs the strand kernels for every instruction set the cpu supports on
+ * num_strands synthetic strands and reports their throughput, followed by
+ * the mesh skinning */
+int run_bench(int num_strands);
+
+/* steps num_instances heads with different parameters and transforms by
+ * calling Hair::update on each and with a HairEnsemble, reports both and
+ * fails if they don't give the same strand positions */
+int run_bench_ensemble(int num_instances);
+
+/* adds, removes and thins out strands in regions picked on a head of about
+ * num_strands, reports the time of each kind of edit, and fails if a pick
+ * misses or the edits break the root spacing or the LOD order */
+int run_bench_groom(int num_strands);
+
+/* times num_queries random closest point, ray and sphere queries of the
+ * Bvh against a scan over all the triangles, and fails if any differ */
+int run_bench_bvh(int num_queries);
+
+#endif // BENCH_H_
@@ -0,0 +1,690 @@
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "bvh.h"
+#include "sdf.h"
+
+/* SAH binning, and the relative cost of a node visit and a triangle test */
+#define SAH_BINS		16
+#define SAH_NODE_COST	1.0
+#define SAH_TRI_COST	1.0
+
+/* leaves never have more than BVH_MAX_LEAF triangles, and stop splitting
+ * at BVH_MIN_LEAF */
+#define BVH_MIN_LEAF	2
+#define BVH_MAX_LEAF	8
+
+/* past this depth nodes are split at the median, which bounds the depth
+ * of the tree and so the traversal stack */
+#define BVH_MAX_DEPTH	48
+#define BVH_STACK		256
+
+/* subtrees bigger than this are built as separate tasks */
+#define BVH_TASK_TRIS	4096
+
+struct BuildRef {
+	Vec3 bmin, bmax;
+	Vec3 cent;
+};
+
+struct BuildNode {
+	Aabb box;
+	int left, right;	/* -1 for leaves */
+	int first, count;
+};
+
+struct BuildContext {
+	std::vector<BuildRef> refs;
+	std::vector<int> *tris;
+	std::vector<BuildNode> nodes;
+	int num_nodes;
+};
+
+struct CentroidLess {
+	const BuildRef *refs;
+	int axis;
+
+	bool operator ()(int a, int b) const
+	{
+		return refs[a].cent[axis] < refs[b].cent[axis];
+	}
+};
+
+struct StackItem {
+	int node;
+	float dist;
+};
+
+static void build_node(BuildContext *ctx, int idx, int first, int count, int depth);
+static int find_split(const BuildContext *ctx, const BuildNode *node, int first, int count,
+		int *axis, float *pos);
+static int alloc_nodes(BuildContext *ctx, int num);
+static int collapse(const BuildContext *ctx, int bidx, std::vector<BvhNode> *out);
+static float surface_area(const Aabb &box);
+static void grow_box(Aabb *box, const Vec3 &bmin, const Vec3 &bmax);
+static void set_slot(BvhNode *n, int slot, const Aabb &box);
+static int test_boxes(const BvhNode *n, const Vec3 &p, float max_dsq, float *dsq);
+static int test_ray(const BvhNode *n, const Vec3 &org, const Vec3 &inv_dir, float tmax, float *tnear);
+static bool ray_triangle(const Vec3 &org, const Vec3 &dir, const Vec3 &a, const Vec3 &b,
+		const Vec3 &c, float *t);
+
+Bvh::Bvh()
+{
+	mesh = 0;
+}
+
+inline void Bvh::get_tri(int tri, Vec3 *a, Vec3 *b, Vec3 *c) const
+{
+	if(mesh->indices.empty()) {
+		*a = mesh->vertices[tri * 3];
+		*b = mesh->vertices[tri * 3 + 1];
+		*c = mesh->vertices[tri * 3 + 2];
+	} else {
+		const uint32_t *idx = &mesh->indices[tri * 3];
+		*a = mesh->vertices[idx[0]];
+		*b = mesh->vertices[idx[1]];
+		*c = mesh->vertices[idx[2]];
+	}
+}
+
+bool Bvh::build(const Mesh *m)
+{
+	nodes.clear();
+	tris.clear();
+	mesh = m;
+
+	int num_tri = m->indices.empty() ? m->vertices.size() / 3 : m->indices.size() / 3;
+	if(!num_tri) {
+		fprintf(stderr, "Bvh::build: empty mesh\n");
+		mesh = 0;
+		return false;
+	}
+
+	BuildContext ctx;
+	ctx.tris = &tris;
+	ctx.refs.resize(num_tri);
+	tris.resize(num_tri);
+
+#pragma omp parallel for schedule(static, 4096)
+	for(int i=0; i<num_tri; i++) {
+		Vec3 a, b, c;
+		get_tri(i, &a, &b, &c);
+		BuildRef *ref = &ctx.refs[i];
+		for(int j=0; j<3; j++) {
+			ref->bmin[j] = std::min(a[j], std::min(b[j], c[j]));
+			ref->bmax[j] = std::max(a[j], std::max(b[j], c[j]));
+		}
+		ref->cent = (ref->bmin + ref->bmax) * 0.5;
+		tris[i] = i;
+	}
+
+	/* a binary tree has at most 2n - 1 nodes */
+	ctx.nodes.resize(num_tri * 2);
+	ctx.num_nodes = 1;
+
+#pragma omp parallel
+#pragma omp single
+	build_node(&ctx, 0, 0, num_tri, 0);
+
+	collapse(&ctx, 0, &nodes);
+	return true;
+}
+
+/* builds node idx over triangles [first, first + count) of the list */
+static void build_node(BuildContext *ctx, int idx, int first, int count, int depth)
+{
+	BuildNode *node = &ctx->nodes[idx];
+	const int *tris = &(*ctx->tris)[first];
+
+	node->box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	node->box.v1 = -node->box.v0;
+	for(int i=0; i<count; i++) {
+		const BuildRef &ref = ctx->refs[tris[i]];
+		grow_box(&node->box, ref.bmin, ref.bmax);
+	}
+	node->left = node->right = -1;
+	node->first = first;
+	node->count = count;
+
+	if(count <= BVH_MIN_LEAF) {
+		return;
+	}
+
+	int axis;
+	float pos;
+	int num_left = find_split(ctx, node, first, count, &axis, &pos);
+	if(num_left == 0 && count <= BVH_MAX_LEAF) {
+		return;	/* cheaper as a leaf */
+	}
+
+	int *begin = &(*ctx->tris)[first];
+	int *mid = begin;
+	if(num_left > 0 && depth < BVH_MAX_DEPTH) {
+		for(int i=0; i<count; i++) {
+			if(ctx->refs[begin[i]].cent[axis] < pos) {
+				std::swap(*mid++, begin[i]);
+			}
+		}
+	}
+	if(mid == begin || mid == begin + count) {
+		/* no useful split, or too deep: median along the longest axis */
+		Vec3 ext = node->box.v1 - node->box.v0;
+		mid = begin + count / 2;
+		CentroidLess less;
+		less.refs = &ctx->refs[0];
+		less.axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) : (ext.y > ext.z ? 1 : 2);
+		std::nth_element(begin, mid, begin + count, less);
+	}
+	num_left = mid - begin;
+
+	int left = alloc_nodes(ctx, 2);
+	node->left = left;
+	node->right = left + 1;
+
+	if(count > BVH_TASK_TRIS) {
+#pragma omp task
+		build_node(ctx, left, first, num_left, depth + 1);
+		build_node(ctx, left + 1, first + num_left, count - num_left, depth + 1);
+#pragma omp taskwait
+	} else {
+		build_node(ctx, left, first, num_left, depth + 1);
+		build_node(ctx, left + 1, first + num_left, count - num_left, depth + 1);
+	}
+}
+
+/* binned SAH split of a node. Returns the number of triangles left of the
+ * split, or 0 if a leaf is cheaper (or the centroids can't be split) */
+static int find_split(const BuildContext *ctx, const BuildNode *node, int first, int count,
+		int *axis, float *pos)
+{
+	const int *tris = &(*ctx->tris)[first];
+
+	Vec3 cmin = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vec3 cmax = -cmin;
+	for(int i=0; i<count; i++) {
+		const Vec3 &c = ctx->refs[tris[i]].cent;
+		for(int j=0; j<3; j++) {
+			cmin[j] = std::min(cmin[j], c[j]);
+			cmax[j] = std::max(cmax[j], c[j]);
+		}
+	}
+
+	float best_cost = count * SAH_TRI_COST;
+	int best_left = 0;
+	float inv_area = 1.0 / surface_area(node->box);
+
+	for(int ax=0; ax<3; ax++) {
+		float ext = cmax[ax] - cmin[ax];
+		if(ext <= 0) continue;
+		float scale = SAH_BINS / ext;
+
+		int bin_count[SAH_BINS] = {0};
+		Aabb bin_box[SAH_BINS];
+		for(int i=0; i<SAH_BINS; i++) {
+			bin_box[i].v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+			bin_box[i].v1 = -bin_box[i].v0;
+		}
+		for(int i=0; i<count; i++) {
+			const BuildRef &ref = ctx->refs[tris[i]];
+			int b = std::min((int)((ref.cent[ax] - cmin[ax]) * scale), SAH_BINS - 1);
+			bin_count[b]++;
+			grow_box(&bin_box[b], ref.bmin, ref.bmax);
+		}
+
+		/* areas of the right side of every split, then sweep from the left */
+		float right_area[SAH_BINS];
+		Aabb box;
+		box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		box.v1 = -box.v0;
+		for(int i=SAH_BINS-1; i>0; i--) {
+			grow_box(&box, bin_box[i].v0, bin_box[i].v1);
+			right_area[i] = surface_area(box);
+		}
+
+		box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		box.v1 = -box.v0;
+		int num_left = 0;
+		for(int i=1; i<SAH_BINS; i++) {
+			grow_box(&box, bin_box[i - 1].v0, bin_box[i - 1].v1);
+			num_left += bin_count[i - 1];
+			int num_right = count - num_left;
+			if(!num_left || !num_right) continue;
+
+			float cost = SAH_NODE_COST + (surface_area(box) * num_left +
+					right_area[i] * num_right) * inv_area * SAH_TRI_COST;
+			if(cost < best_cost) {
+				best_cost = cost;
+				best_left = num_left;
+				*axis = ax;
+				*pos = cmin[ax] + i / scale;
+			}
+		}
+	}
+	return best_left;
+}
+
+static int alloc_nodes(BuildContext *ctx, int num)
+{
+	int idx;
+#pragma omp atomic capture
+	{
+		idx = ctx->num_nodes;
+		ctx->num_nodes += num;
+	}
+	return idx;
+}
+
+/* turns the binary subtree at bidx into 4-wide nodes, appended to out.
+ * Returns the index of its root */
+static int collapse(const BuildContext *ctx, int bidx, std::vector<BvhNode> *out)
+{
+	int child[BVH_WIDTH];
+	int num = 0;
+
+	const BuildNode *bn = &ctx->nodes[bidx];
+	if(bn->left == -1) {
+		child[num++] = bidx;	/* the whole tree is a single leaf */
+	} else {
+		child[num++] = bn->left;
+		child[num++] = bn->right;
+	}
+
+	/* pull up grandchildren, opening the biggest inner child first */
+	while(num < BVH_WIDTH) {
+		int best = -1;
+		float best_area = -1;
+		for(int i=0; i<num; i++) {
+			const BuildNode *c = &ctx->nodes[child[i]];
+			if(c->left != -1 && surface_area(c->box) > best_area) {
+				best_area = surface_area(c->box);
+				best = i;
+			}
+		}
+		if(best == -1) break;
+
+		const BuildNode *c = &ctx->nodes[child[best]];
+		child[best] = c->left;
+		child[num++] = c->right;
+	}
+
+	int idx = out->size();
+	out->resize(idx + 1);
+
+	for(int i=0; i<BVH_WIDTH; i++) {
+		Aabb box;
+		int32_t cidx = 0, count = -1;
+		if(i < num) {
+			const BuildNode *c = &ctx->nodes[child[i]];
+			box = c->box;
+			if(c->left == -1) {
+				cidx = c->first;
+				count = c->count;
+			} else {
+				cidx = collapse(ctx, child[i], out);
+				count = 0;
+			}
+		} else {
+			box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+			box.v1 = -box.v0;
+		}
+
+		BvhNode *n = &(*out)[idx];	/* collapse may have moved it */
+		set_slot(n, i, box);
+		n->child[i] = cidx;
+		n->count[i] = count;
+	}
+	return idx;
+}
+
+void Bvh::refit()
+{
+	int num = nodes.size();
+
+	/* leaves from the vertices first, in parallel */
+#pragma omp parallel for schedule(dynamic, 64)
+	for(int i=0; i<num; i++) {
+		BvhNode *n = &nodes[i];
+		for(int j=0; j<BVH_WIDTH; j++) {
+			if(n->count[j] <= 0) continue;
+
+			Aabb box;
+			box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+			box.v1 = -box.v0;
+			for(int k=0; k<n->count[j]; k++) {
+				Vec3 a, b, c;
+				get_tri(tris[n->child[j] + k], &a, &b, &c);
+				grow_box(&box, a, a);
+				grow_box(&box, b, b);
+				grow_box(&box, c, c);
+			}
+			set_slot(n, j, box);
+		}
+	}
+
+	/* then the inner slots bottom up, children come after their parent */
+	for(int i=num-1; i>=0; i--) {
+		BvhNode *n = &nodes[i];
+		for(int j=0; j<BVH_WIDTH; j++) {
+			if(n->count[j] != 0) continue;
+
+			const BvhNode *c = &nodes[n->child[j]];
+			Aabb box;
+			box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+			box.v1 = -box.v0;
+			for(int k=0; k<BVH_WIDTH; k++) {
+				if(c->count[k] < 0) continue;
+				grow_box(&box, Vec3(c->bmin[0][k], c->bmin[1][k], c->bmin[2][k]),
+						Vec3(c->bmax[0][k], c->bmax[1][k], c->bmax[2][k]));
+			}
+			set_slot(n, j, box);
+		}
+	}
+}
+
+bool Bvh::is_empty() const
+{
+	return nodes.empty();
+}
+
+const Mesh *Bvh::get_mesh() const
+{
+	return mesh;
+}
+
+int Bvh::get_node_count() const
+{
+	return nodes.size();
+}
+
+bool Bvh::closest_point(const Vec3 &p, float max_dist, BvhHit *hit) const
+{
+	if(nodes.empty()) return false;
+
+	float best_dsq = max_dist * max_dist;
+	bool found = false;
+
+	StackItem stack[BVH_STACK];
+	int sp = 0;
+	stack[sp].node = 0;
+	stack[sp++].dist = 0;
+
+	while(sp > 0) {
+		StackItem item = stack[--sp];
+		if(item.dist >= best_dsq) continue;
+
+		const BvhNode *n = &nodes[item.node];
+		float dsq[BVH_WIDTH];
+		int mask = test_boxes(n, p, best_dsq, dsq);
+
+		/* visit the nearest first: leaves now, inner nodes pushed farthest
+		 * first so that the nearest one pops next */
+		int order[BVH_WIDTH], num = 0;
+		for(int i=0; i<BVH_WIDTH; i++) {
+			if(mask & (1 << i)) {
+				int j = num++;
+				for(; j>0 && dsq[order[j - 1]] > dsq[i]; j--) {
+					order[j] = order[j - 1];
+				}
+				order[j] = i;
+			}
+		}
+
+		for(int i=0; i<num; i++) {
+			int s = order[i];
+			if(n->count[s] == 0 || dsq[s] >= best_dsq) continue;
+
+			for(int j=0; j<n->count[s]; j++) {
+				int tri = tris[n->child[s] + j];
+				Vec3 a, b, c;
+				get_tri(tri, &a, &b, &c);
+				Vec3 cp = closest_point_triangle(p, a, b, c);
+				float d = distance_sq(p, cp);
+				if(d < best_dsq) {
+					best_dsq = d;
+					hit->tri = tri;
+					hit->pos = cp;
+					found = true;
+				}
+			}
+		}
+		for(int i=num-1; i>=0; i--) {
+			int s = order[i];
+			if(n->count[s] == 0 && dsq[s] < best_dsq) {
+				stack[sp].node = n->child[s];
+				stack[sp++].dist = dsq[s];
+			}
+		}
+	}
+
+	if(found) {
+		hit->dist = sqrt(best_dsq);
+	}
+	return found;
+}
+
+bool Bvh::intersect_ray(const Vec3 &org, const Vec3 &dir, float tmax, BvhHit *hit) const
+{
+	if(nodes.empty()) return false;
+
+	Vec3 inv_dir;
+	for(int i=0; i<3; i++) {
+		inv_dir[i] = dir[i] != 0 ? 1.0 / dir[i] : FLT_MAX;
+	}
+	bool found = false;
+
+	StackItem stack[BVH_STACK];
+	int sp = 0;
+	stack[sp].node = 0;
+	stack[sp++].dist = 0;
+
+	while(sp > 0) {
+		StackItem item = stack[--sp];
+		if(item.dist > tmax) continue;
+
+		const BvhNode *n = &nodes[item.node];
+		float tnear[BVH_WIDTH];
+		int mask = test_ray(n, org, inv_dir, tmax, tnear);
+
+		for(int i=0; i<BVH_WIDTH; i++) {
+			if(!(mask & (1 << i)) || n->count[i] <= 0) continue;
+
+			for(int j=0; j<n->count[i]; j++) {
+				int tri = tris[n->child[i] + j];
+				Vec3 a, b, c;
+				get_tri(tri, &a, &b, &c);
+				float t;
+				if(ray_triangle(org, dir, a, b, c, &t) && t <= tmax) {
+					tmax = t;
+					hit->tri = tri;
+					found = true;
+				}
+			}
+		}
+
+		/* nearest inner child on top */
+		int order[BVH_WIDTH], num = 0;
+		for(int i=0; i<BVH_WIDTH; i++) {
+			if((mask & (1 << i)) && n->count[i] == 0 && tnear[i] <= tmax) {
+				int j = num++;
+				for(; j>0 && tnear[order[j - 1]] < tnear[i]; j--) {
+					order[j] = order[j - 1];
+				}
+				order[j] = i;
+			}
+		}
+		for(int i=0; i<num; i++) {
+			stack[sp].node = n->child[order[i]];
+			stack[sp++].dist = tnear[order[i]];
+		}
+	}
+
+	if(found) {
+		hit->dist = tmax;
+		hit->pos = org + dir * tmax;
+	}
+	return found;
+}
+
+int Bvh::find_sphere(const Vec3 &center, float rad, std::vector<int> *res) const
+{
+	if(nodes.empty()) return 0;
+
+	float rsq = rad * rad;
+	int found = 0;
+
+	int stack[BVH_STACK];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	while(sp > 0) {
+		const BvhNode *n = &nodes[stack[--sp]];
+		float dsq[BVH_WIDTH];
+		int mask = test_boxes(n, center, rsq, dsq);
+
+		for(int i=0; i<BVH_WIDTH; i++) {
+			if(!(mask & (1 << i))) continue;
+
+			if(n->count[i] == 0) {
+				stack[sp++] = n->child[i];
+				continue;
+			}
+			for(int j=0; j<n->count[i]; j++) {
+				int tri = tris[n->child[i] + j];
+				Vec3 a, b, c;
+				get_tri(tri, &a, &b, &c);
+				if(distance_sq(center, closest_point_triangle(center, a, b, c)) <= rsq) {
+					res->push_back(tri);
+					found++;
+				}
+			}
+		}
+	}
+	return found;
+}
+
+static float surface_area(const Aabb &box)
+{
+	Vec3 d = box.v1 - box.v0;
+	if(d.x < 0) return 0;
+	return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static void grow_box(Aabb *box, const Vec3 &bmin, const Vec3 &bmax)
+{
+	for(int i=0; i<3; i++) {
+		box->v0[i] = std::min(box->v0[i], bmin[i]);
+		box->v1[i] = std::max(box->v1[i], bmax[i]);
+	}
+}
+
+static void set_slot(BvhNode *n, int slot, const Aabb &box)
+{
+	for(int i=0; i<3; i++) {
+		n->bmin[i][slot] = box.v0[i];
+		n->bmax[i][slot] = box.v1[i];
+	}
+}
+
+/* squared distances from p to the child boxes, returns the mask of the
+ * used slots closer than max_dsq */
+static int test_boxes(const BvhNode *n, const Vec3 &p, float max_dsq, float *dsq)
+{
+	int mask;
+
+#ifdef __SSE__
+	__m128 zero = _mm_setzero_ps();
+	__m128 sum = zero;
+	for(int i=0; i<3; i++) {
+		__m128 pv = _mm_set1_ps(p[i]);
+		__m128 lo = _mm_sub_ps(_mm_loadu_ps(n->bmin[i]), pv);
+		__m128 hi = _mm_sub_ps(pv, _mm_loadu_ps(n->bmax[i]));
+		__m128 d = _mm_max_ps(_mm_max_ps(lo, hi), zero);
+		sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+	}
+	_mm_storeu_ps(dsq, sum);
+	mask = _mm_movemask_ps(_mm_cmplt_ps(sum, _mm_set1_ps(max_dsq)));
+#else
+	mask = 0;
+	for(int j=0; j<BVH_WIDTH; j++) {
+		dsq[j] = 0;
+		for(int i=0; i<3; i++) {
+			float d = std::max(std::max(n->bmin[i][j] - p[i], p[i] - n->bmax[i][j]), 0.0f);
+			dsq[j] += d * d;
+		}
+		if(dsq[j] < max_dsq) mask |= 1 << j;
+	}
+#endif
+
+	for(int j=0; j<BVH_WIDTH; j++) {
+		if(n->count[j] < 0) mask &= ~(1 << j);
+	}
+	return mask;
+}
+
+/* slab test of the ray against the child boxes, returns the mask of the
+ * used slots it enters before tmax, and where */
+static int test_ray(const BvhNode *n, const Vec3 &org, const Vec3 &inv_dir, float tmax, float *tnear)
+{
+	int mask;
+
+#ifdef __SSE__
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(tmax);
+	for(int i=0; i<3; i++) {
+		__m128 o = _mm_set1_ps(org[i]);
+		__m128 inv = _mm_set1_ps(inv_dir[i]);
+		__m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bmin[i]), o), inv);
+		__m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bmax[i]), o), inv);
+		t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+		t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+	}
+	_mm_storeu_ps(tnear, t0);
+	mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+	mask = 0;
+	for(int j=0; j<BVH_WIDTH; j++) {
+		float t0 = 0, t1 = tmax;
+		for(int i=0; i<3; i++) {
+			float ta = (n->bmin[i][j] - org[i]) * inv_dir[i];
+			float tb = (n->bmax[i][j] - org[i]) * inv_dir[i];
+			t0 = std::max(t0, std::min(ta, tb));
+			t1 = std::min(t1, std::max(ta, tb));
+		}
+		tnear[j] = t0;
+		if(t0 <= t1) mask |= 1 << j;
+	}
+#endif
+
+	for(int j=0; j<BVH_WIDTH; j++) {
+		if(n->count[j] < 0) mask &= ~(1 << j);
+	}
+	return mask;
+}
+
+/* Moller-Trumbore, either side */
+static bool ray_triangle(const Vec3 &org, const Vec3 &dir, const Vec3 &a, const Vec3 &b,
+		const Vec3 &c, float *t)
+{
+	Vec3 e1 = b - a, e2 = c - a;
+	Vec3 pv = cross(dir, e2);
+	float det = dot(e1, pv);
+	if(fabs(det) < 1e-12) return false;
+	float inv_det = 1.0 / det;
+
+	Vec3 tv = org - a;
+	float u = dot(tv, pv) * inv_det;
+	if(u < 0 || u > 1) return false;
+
+	Vec3 qv = cross(tv, e1);
+	float v = dot(dir, qv) * inv_det;
+	if(v < 0 || u + v > 1) return false;
+
+	*t = dot(e2, qv) * inv_det;
+	return *t >= 0;
+}
@@ -0,0 +1,67 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <stdint.h>
+#include <vector>
+#include <gmath/gmath.h>
+
+#include "mesh.h"
+
+/* Bounding volume hierarchy over the triangles of a mesh.
+ *
+ * It's built top-down with the surface area heuristic over binned
+ * centroids, with the subtrees built in parallel, and then collapsed to
+ * 4-wide nodes, so that a query tests the four child boxes of a node at
+ * once with SSE. Nodes are stored depth first, children after their parent.
+ *
+ * The tree refers to the mesh, which must outlive it. When the vertices
+ * move (skinning), refit updates the boxes without rebuilding the tree.
+ */
+
+#define BVH_WIDTH	4
+
+struct BvhNode {
+	float bmin[3][BVH_WIDTH];
+	float bmax[3][BVH_WIDTH];
+	/* inner child: node index and count 0, leaf: first entry of the
+	 * triangle list and the number of triangles. Unused slots have count -1 */
+	int32_t child[BVH_WIDTH];
+	int32_t count[BVH_WIDTH];
+};
+
+struct BvhHit {
+	int tri;	/* index in Mesh::indices / 3 */
+	Vec3 pos;	/* closest point, or intersection */
+	float dist;	/* distance to the query point, or ray parameter */
+};
+
+class Bvh {
+private:
+	const Mesh *mesh;
+	std::vector<BvhNode> nodes;
+	std::vector<int> tris;	/* triangle indices, in leaf order */
+
+	inline void get_tri(int tri, Vec3 *a, Vec3 *b, Vec3 *c) const;
+
+public:
+	Bvh();
+
+	bool build(const Mesh *m);
+	/* updates the boxes to the current vertices of the mesh */
+	void refit();
+
+	bool is_empty() const;
+	const Mesh *get_mesh() const;
+	int get_node_count() const;
+
+	/* closest point of the mesh to p, no further than max_dist */
+	bool closest_point(const Vec3 &p, float max_dist, BvhHit *hit) const;
+	/* first hit of the ray org + dir * t for t in [0, tmax], either side
+	 * of the triangles */
+	bool intersect_ray(const Vec3 &org, const Vec3 &dir, float tmax, BvhHit *hit) const;
+	/* appends the triangles within rad of center to tris, returns how many
+	 * there were */
+	int find_sphere(const Vec3 &center, float rad, std::vector<int> *tris) const;
+};
+
+#endif // BVH_H_
@@ -0,0 +1,106 @@
+#include <string.h>
+#include <algorithm>
+
+#include "ensemble.h"
+#include "hair_kern.h"
+
+struct HairEnsemble::Member {
+	Hair *hair;
+	bool active;	/* simulated this step, not played back */
+	KernParams kp;
+	std::vector<KernSphere> spheres;
+	KernStats stats;
+};
+
+struct HairEnsemble::WorkItem {
+	Member *mem;
+	int start, end;
+	KernStats stats;
+};
+
+HairEnsemble::HairEnsemble()
+{
+}
+
+HairEnsemble::~HairEnsemble()
+{
+	for(size_t i=0; i<members.size(); i++) {
+		delete members[i];
+	}
+}
+
+void HairEnsemble::add(Hair *hair)
+{
+	Member *mem = new Member;
+	mem->hair = hair;
+	mem->active = false;
+	members.push_back(mem);
+}
+
+void HairEnsemble::remove(Hair *hair)
+{
+	for(size_t i=0; i<members.size(); i++) {
+		if(members[i]->hair == hair) {
+			delete members[i];
+			members.erase(members.begin() + i);
+			return;
+		}
+	}
+}
+
+int HairEnsemble::get_count() const
+{
+	return members.size();
+}
+
+Hair *HairEnsemble::get(int idx) const
+{
+	return members[idx]->hair;
+}
+
+void HairEnsemble::update(float dt)
+{
+	/* the per-member setup is cheap, and changes the active strand counts */
+	items.clear();
+	for(size_t i=0; i<members.size(); i++) {
+		Member *mem = members[i];
+		Hair *hair = mem->hair;
+
+		hair->sync();
+		mem->active = hair->begin_step(dt, &mem->kp, &mem->spheres);
+		if(!mem->active) continue;
+
+		for(int start=0; start<hair->num_active; start+=STEP_BLOCK) {
+			WorkItem item;
+			item.mem = mem;
+			item.start = start;
+			item.end = std::min(start + STEP_BLOCK, hair->num_active);
+			items.push_back(item);
+		}
+	}
+
+	int num_items = items.size();
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_items; i++) {
+		WorkItem *item = &items[i];
+		Member *mem = item->mem;
+		mem->hair->step_block(item->start, item->end, &mem->kp,
+				mem->spheres.empty() ? 0 : &mem->spheres[0], mem->spheres.size(), &item->stats);
+	}
+
+	for(size_t i=0; i<members.size(); i++) {
+		memset(&members[i]->stats, 0, sizeof members[i]->stats);
+	}
+	for(int i=0; i<num_items; i++) {
+		kern_merge_stats(&items[i].mem->stats, items[i].stats);
+	}
+
+	for(size_t i=0; i<members.size(); i++) {
+		Member *mem = members[i];
+		if(mem->active) {
+			mem->hair->end_step(dt, mem->stats);
+		}
+		mem->hair->flip();
+	}
+}
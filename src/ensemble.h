@@ -0,0 +1,36 @@
+#ifndef ENSEMBLE_H_
+#define ENSEMBLE_H_
+
+#include <vector>
+#include "hair.h"
+
+/* Steps many Hair instances (parameter sweeps, crowds) as one batch: the
+ * active strands of every member are split in blocks, and all blocks of
+ * all members are spread over the same threads in a single parallel loop.
+ * Small members don't leave threads idle and big ones don't serialize,
+ * so the aggregate throughput is that of one instance with all the strands.
+ */
+class HairEnsemble {
+private:
+	struct Member;
+	struct WorkItem;
+
+	std::vector<Member*> members;
+	std::vector<WorkItem> items;
+
+public:
+	HairEnsemble();
+	~HairEnsemble();
+
+	/* the ensemble doesn't own the instances. Don't use update_async on
+	 * them, and set their transforms and parameters between updates */
+	void add(Hair *hair);
+	void remove(Hair *hair);
+	int get_count() const;
+	Hair *get(int idx) const;
+
+	/* one update of every member, same as calling Hair::update on each */
+	void update(float dt);
+};
+
+#endif // ENSEMBLE_H_
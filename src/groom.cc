@@ -0,0 +1,464 @@
+/* Incremental grooming of the hair strands.
+ *
+ * Edits add and remove strands in place, instead of sampling the whole head
+ * again with Hair::init: the untouched strands keep their simulation state
+ * and their place in the LOD order. Every strand carries an id which stays
+ * with it, and id_strand maps the ids back to the current strand indices.
+ *
+ * min_dist between the roots is enforced with a kd-tree of the roots on the
+ * undeformed mesh, built on the first edit and updated incrementally after.
+ * Since the roots are bound to their triangle by barycentric coordinates,
+ * the undeformed positions don't change while the head is skinned. Removed
+ * strands stay in the tree, and are skipped by their id, until they are
+ * more than the live ones and the tree is built again.
+ */
+#include <algorithm>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kdtree.h"
+#include "hair.h"
+
+/* darts in a row which miss before add_strands takes the region as full */
+#define ADD_MAX_MISSES	1000
+
+static bool is_spawn_tri(const Mesh *m, int tri, float thresh);
+static Vec3 rest_point(const Mesh *m, int tri, const Vec3 &bary);
+static bool less_x(const Vec3 &a, const Vec3 &b);
+
+/* gives the strands ids in their current order, after init or load_state */
+void Hair::reset_ids()
+{
+	int num = spawns.size();
+	id_strand.resize(num);
+	for(int i=0; i<num; i++) {
+		spawns[i].id = i;
+		id_strand[i] = i;
+	}
+	next_id = num;
+	wind_valid = 0;
+	relayout_export();
+
+	if(groom_index) {
+		kd_free(groom_index);
+		groom_index = 0;
+	}
+	groom_dead = 0;
+}
+
+int Hair::get_strand_id(int idx) const
+{
+	if(idx < 0 || idx >= (int)spawns.size()) {
+		return -1;
+	}
+	return spawns[idx].id;
+}
+
+/* waits for the update in flight, and prepares the index and the bvh of m
+ * for adding strands. Edits which only remove strands pass a null mesh */
+bool Hair::begin_groom(const Mesh *m)
+{
+	sync();
+
+	/* the cache frames are for the old strands */
+	stop_playback();
+	if(bake) {
+		fprintf(stderr, "strands edited, baking stopped\n");
+		end_bake();
+	}
+	for(int i=0; i<2; i++) {
+		frames[i].pos.resize(hair.size());
+	}
+
+	if(!m) return true;
+
+	if(m->indices.empty()) {
+		fprintf(stderr, "%s: the mesh has no triangles\n", __func__);
+		return false;
+	}
+	if(m != groom_mesh || !groom_index) {
+		groom_mesh = m;
+		build_groom_index();
+	}
+	return prepare_groom_bvh(m);
+}
+
+/* builds the bvh of m, or refits it to the skinned vertices */
+bool Hair::prepare_groom_bvh(const Mesh *m)
+{
+	if(groom_bvh.get_mesh() != m || groom_bvh.is_empty()) {
+		if(!groom_bvh.build(m)) {
+			return false;
+		}
+	} else if(m->is_skinned()) {
+		groom_bvh.refit();
+	}
+	return true;
+}
+
+void Hair::end_groom()
+{
+	prepare_spawns();
+	/* the visible indices are stale until the next cull, and the air at
+	 * the strands until it's sampled again */
+	culled = false;
+	wind_valid = 0;
+	relayout_export();
+}
+
+void Hair::build_groom_index()
+{
+	if(groom_index) {
+		kd_free(groom_index);
+	}
+	groom_index = kd_create(3);
+	groom_dead = 0;
+
+	/* in LOD order, which is spread evenly, so the tree comes out balanced */
+	for(size_t i=0; i<spawns.size(); i++) {
+		Vec3 p = rest_point(groom_mesh, spawns[i].tri, spawns[i].bary);
+		kd_insert3f(groom_index, p.x, p.y, p.z, (void*)(intptr_t)(spawns[i].id + 1));
+	}
+}
+
+/* true if a live strand has its undeformed root within dist of p */
+bool Hair::rest_taken(const Vec3 &p, float dist) const
+{
+	kdres *res = kd_nearest_range3f(groom_index, p.x, p.y, p.z, dist);
+	if(!res) return true;
+
+	bool taken = false;
+	while(!kd_res_end(res)) {
+		int id = (int)(intptr_t)kd_res_item_data(res) - 1;
+		if(id_strand[id] >= 0) {
+			taken = true;
+			break;
+		}
+		kd_res_next(res);
+	}
+	kd_res_free(res);
+	return taken;
+}
+
+/* removes the strands at the sorted indices idx, keeping the order of the
+ * rest, and the active counts of the simulation and both frames in step */
+void Hair::erase_strands(const std::vector<int> &idx)
+{
+	if(idx.empty()) return;
+
+	int num = hair.size();
+	int removed_active = 0;
+	int removed_frame[2] = {0, 0};
+	size_t next = 0;
+	int dst = idx[0];
+
+	for(int i=idx[0]; i<num; i++) {
+		if(next < idx.size() && idx[next] == i) {
+			id_strand[spawns[i].id] = -1;
+			groom_dead++;
+			if(i < num_active) removed_active++;
+			for(int j=0; j<2; j++) {
+				if(i < frames[j].num_active) removed_frame[j]++;
+			}
+			next++;
+			continue;
+		}
+
+		hair[dst] = hair[i];
+		spawns[dst] = spawns[i];
+		frames[0].pos[dst] = frames[0].pos[i];
+		frames[1].pos[dst] = frames[1].pos[i];
+		id_strand[spawns[dst].id] = dst;
+		dst++;
+	}
+
+	hair.resize(dst);
+	spawns.resize(dst);
+	num_active -= removed_active;
+	for(int i=0; i<2; i++) {
+		frames[i].pos.resize(dst);
+		frames[i].num_active -= removed_frame[i];
+	}
+
+	/* build the index again once it's mostly removed strands */
+	if(groom_index && groom_dead > dst) {
+		kd_free(groom_index);
+		groom_index = 0;
+	}
+}
+
+/* inserts the strands spread evenly through the LOD order, so that the
+ * same fraction of them is active as of the rest, and keeps the active
+ * counts of the simulation and both frames in step */
+void Hair::insert_strands(const std::vector<HairSpawn> &new_spawns, const std::vector<HairStrand> &new_hair)
+{
+	int count = new_spawns.size();
+	if(count <= 0) return;
+
+	int num = hair.size();
+	int total = num + count;
+
+	int *active[3] = {&num_active, &frames[0].num_active, &frames[1].num_active};
+	int prev_active[3];
+	for(int i=0; i<3; i++) {
+		prev_active[i] = *active[i];
+		if(prev_active[i] >= num) {
+			*active[i] = total;
+		}
+	}
+
+	hair.resize(total);
+	spawns.resize(total);
+	for(int i=0; i<2; i++) {
+		frames[i].pos.resize(total);
+	}
+
+	/* from the back, the k-th new strand goes to (k + 0.5) * total / count,
+	 * and the old ones move up by the number placed before them. An active
+	 * count ends where the first inactive strand lands */
+	int src = num - 1;
+	int k = count - 1;
+	for(int dst=total - 1; k >= 0; dst--) {
+		if(dst == (int)((2 * (int64_t)k + 1) * total / (2 * count))) {
+			hair[dst] = new_hair[k];
+			spawns[dst] = new_spawns[k];
+			frames[0].pos[dst] = frames[1].pos[dst] = new_hair[k].pos;
+			k--;
+		} else {
+			for(int i=0; i<3; i++) {
+				if(src == prev_active[i]) *active[i] = dst;
+			}
+			hair[dst] = hair[src];
+			spawns[dst] = spawns[src];
+			frames[0].pos[dst] = frames[0].pos[src];
+			frames[1].pos[dst] = frames[1].pos[src];
+			src--;
+		}
+		id_strand[spawns[dst].id] = dst;
+	}
+}
+
+int Hair::add_strands(const Mesh *m, const Vec3 &center, float radius, int count)
+{
+	if(count <= 0 || radius <= 0) {
+		return 0;
+	}
+	if(!begin_groom(m)) {
+		return 0;
+	}
+
+	/* the spawn triangles touching the region, picked by area */
+	std::vector<int> tris;
+	groom_bvh.find_sphere(center, radius, &tris);
+
+	std::vector<int> cand;
+	std::vector<float> cdf;
+	float total = 0;
+
+	for(size_t i=0; i<tris.size(); i++) {
+		if(!is_spawn_tri(m, tris[i], spawn_thresh)) continue;
+
+		const uint32_t *vidx = &m->indices[tris[i] * 3];
+		const Vec3 &a = m->vertices[vidx[0]];
+		float area = length(cross(m->vertices[vidx[1]] - a, m->vertices[vidx[2]] - a)) * 0.5;
+		if(area <= 0) continue;
+
+		total += area;
+		cand.push_back(tris[i]);
+		cdf.push_back(total);
+	}
+	if(cand.empty()) {
+		end_groom();
+		return 0;
+	}
+
+	float min_dist = params.min_dist;
+	int added = 0;
+	int misses = 0;
+	std::vector<HairSpawn> new_spawns;
+	std::vector<HairStrand> new_hair;
+
+	while(added < count && misses < ADD_MAX_MISSES) {
+		misses++;
+
+		float x = (float)rand() / (float)RAND_MAX * total;
+		size_t sel = std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin();
+		if(sel >= cand.size()) sel = cand.size() - 1;
+		int tri = cand[sel];
+
+		/* same distribution as the sampling of init */
+		float u = (float)rand() / (float)RAND_MAX;
+		float v = (float)rand() / (float)RAND_MAX;
+		if(u + v > 1) {
+			u = 1 - u;
+			v = 1 - v;
+		}
+		Vec3 bary = Vec3(u, v, 1 - (u + v));
+
+		const uint32_t *vidx = &m->indices[tri * 3];
+		Vec3 pt = m->vertices[vidx[0]] * bary.x + m->vertices[vidx[1]] * bary.y +
+			m->vertices[vidx[2]] * bary.z;
+		if(distance_sq(pt, center) > radius * radius) {
+			continue;
+		}
+
+		Vec3 rp = rest_point(m, tri, bary);
+		if(rest_taken(rp, min_dist)) {
+			continue;
+		}
+
+		HairSpawn spawn;
+		spawn.pt = pt;
+		spawn.dir = normalize(m->normals[vidx[0]] * bary.x + m->normals[vidx[1]] * bary.y +
+				m->normals[vidx[2]] * bary.z);
+		spawn.tri = tri;
+		spawn.bary = bary;
+		spawn.id = next_id++;
+
+		/* new strands start at rest, in both frames */
+		HairStrand strand;
+		strand.pos = xform * (pt + spawn.dir * params.hair_length);
+		strand.velocity = Vec3(0, 0, 0);
+
+		/* live for rest_taken, insert_strands gives the final index */
+		id_strand.push_back(hair.size() + new_spawns.size());
+		new_spawns.push_back(spawn);
+		new_hair.push_back(strand);
+
+		kd_insert3f(groom_index, rp.x, rp.y, rp.z, (void*)(intptr_t)(spawn.id + 1));
+		added++;
+		misses = 0;
+	}
+	insert_strands(new_spawns, new_hair);
+
+	end_groom();
+	return added;
+}
+
+bool Hair::remove_strand(int id)
+{
+	if(id < 0 || id >= (int)id_strand.size() || id_strand[id] < 0) {
+		return false;
+	}
+	begin_groom(0);
+
+	std::vector<int> idx(1, id_strand[id]);
+	erase_strands(idx);
+
+	end_groom();
+	return true;
+}
+
+int Hair::remove_strands(const Vec3 &center, float radius)
+{
+	begin_groom(0);
+
+	std::vector<int> idx;
+	float rad_sq = radius * radius;
+	for(size_t i=0; i<spawns.size(); i++) {
+		if(distance_sq(spawns[i].pt, center) <= rad_sq) {
+			idx.push_back(i);
+		}
+	}
+	erase_strands(idx);
+
+	end_groom();
+	return idx.size();
+}
+
+int Hair::scale_density(const Mesh *m, const Vec3 &center, float radius, float factor)
+{
+	if(factor < 0) factor = 0;
+
+	std::vector<int> idx;
+	float rad_sq = radius * radius;
+	sync();
+	for(size_t i=0; i<spawns.size(); i++) {
+		if(distance_sq(spawns[i].pt, center) <= rad_sq) {
+			idx.push_back(i);
+		}
+	}
+	int num = idx.size();
+
+	if(factor > 1) {
+		return add_strands(m, center, radius, (int)(num * (factor - 1) + 0.5));
+	}
+
+	/* keep the first strands in LOD order, the rest fill the gaps between
+	 * them, and can go without leaving holes */
+	int keep = (int)(num * factor + 0.5);
+	if(keep >= num) {
+		return 0;
+	}
+	begin_groom(0);
+	idx.erase(idx.begin(), idx.begin() + keep);
+	erase_strands(idx);
+	end_groom();
+	return idx.size();
+}
+
+bool Hair::pick(const Mesh *m, const Vec3 &org, const Vec3 &dir, Vec3 *pt)
+{
+	if(m->indices.empty() || !prepare_groom_bvh(m)) {
+		return false;
+	}
+	BvhHit hit;
+	if(!groom_bvh.intersect_ray(org, dir, FLT_MAX, &hit)) {
+		return false;
+	}
+	*pt = hit.pos;
+	return true;
+}
+
+/* sweeps the roots sorted by x, independent of groom_index */
+int Hair::count_close_roots(const Mesh *m, float dist) const
+{
+	int num = spawns.size();
+	std::vector<Vec3> pts(num);
+	for(int i=0; i<num; i++) {
+		pts[i] = rest_point(m, spawns[i].tri, spawns[i].bary);
+	}
+	std::sort(pts.begin(), pts.end(), less_x);
+
+	/* a margin for the rounding of the kd-tree distances */
+	float dsq = dist * dist * (1.0 - 1e-4);
+	int close = 0;
+	for(int i=0; i<num; i++) {
+		for(int j=i + 1; j<num && pts[j].x - pts[i].x < dist; j++) {
+			if(distance_sq(pts[i], pts[j]) < dsq) {
+				close++;
+			}
+		}
+	}
+	return close;
+}
+
+/* same test as the sampling of init: every vertex darker than thresh */
+static bool is_spawn_tri(const Mesh *m, int tri, float thresh)
+{
+	if(m->colors.empty()) {
+		return true;
+	}
+	for(int i=0; i<3; i++) {
+		const Vec3 &c = m->colors[m->indices[tri * 3 + i]];
+		if((c.x + c.y + c.z) / 3 >= thresh) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* position of a root on the undeformed mesh */
+static Vec3 rest_point(const Mesh *m, int tri, const Vec3 &bary)
+{
+	const std::vector<Vec3> &vert = m->is_skinned() ? m->bind_vertices : m->vertices;
+	const uint32_t *vidx = &m->indices[tri * 3];
+	return vert[vidx[0]] * bary.x + vert[vidx[1]] * bary.y + vert[vidx[2]] * bary.z;
+}
+
+static bool less_x(const Vec3 &a, const Vec3 &b)
+{
+	return a.x < b.x;
+}
@@ -1,37 +1,134 @@
 #include <GL/glew.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include <algorithm>
 #include <float.h>
 #include <gmath/gmath.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 
 #include "kdtree.h"
 #include "hair.h"
+#include "hair_kern.h"
+#include "shmexport.h"
+
+/* LOD transitions: rate at which the active fraction follows the target
+ * (per second), and the fraction of the active strands which fade out
+ * while it drops, at the faster LOD_FADE_RATE to stay ahead of it */
+#define LOD_RATE 4.0
+#define LOD_FADE 0.2
+#define LOD_FADE_RATE 16.0
+
+/* strands whose spawn normal faces away from the viewer by more than this
+ * (cosine) are hidden behind the head */
+#define BACKFACE_COS -0.2
+
+/* strands per parallel work item of the tessellation for drawing */
+#define TESS_BLOCK 2048
 
-/* spring constant */
+/* substeps: the semi-implicit Euler spring is stable up to dt * omega = 2,
+ * plan for half of that. A block whose energy grows by more than
+ * ENERGY_GROWTH between substeps is unstable anyway, and halves its step */
+#define STABLE_STEP 1.0
+#define ENERGY_GROWTH 1.5
 
-#define K_ANC 4.0
-#define DAMPING 1.5
+/* runaway limits: hair lengths per substep, and the distance from the
+ * anchor in sizes of the strand bounds, which a strand merely lagging
+ * behind the head never gets to */
+#define RUNAWAY_MOVE 2.0
+#define RUNAWAY_STRETCH 2.0
 
 struct Triangle {
 	Vec3 v[3];
 	Vec3 n[3];
+	int idx;
 };
 
 Hair::Hair()
 {
-	hair_length = 0.5;
+	default_params(&params);
+	have_sdf = false;
+	have_stree = false;
+	step_update = 0;
+	step_sdf = step_tree = step_wind = false;
+	wind_valid = wind_phase = wind_tick = 0;
+	wind_fresh = false;
+	max_speed = max_stretch = 0;
+	reset_step_stats();
+	substep_floor = 1;
+
+	lod_target = lod = lod_opaque = 1;
+	num_active = 0;
+
+	num_visible = 0;
+	culled = false;
+
+	view_scale = 0;
+	tess_vbo = 0;
+	tess_vbo_size = 0;
+
+	next_id = 0;
+	spawn_thresh = params.thresh;
+	groom_mesh = 0;
+	groom_index = 0;
+	groom_dead = 0;
+
+	front = 0;
+	for(int i=0; i<2; i++) {
+		frames[i].num_active = 0;
+		frames[i].lod = frames[i].lod_opaque = 1;
+		frames[i].at_rest = false;
+	}
+
+	bake = 0;
+	playback = 0;
+	play_time = 0;
+	shm = 0;
+	sim_time = 0;
+
+	worker_running = false;
+	job_pending = job_done = false;
+	worker_quit = false;
+	job_dt = 0;
+	pthread_mutex_init(&job_mutex, 0);
+	pthread_cond_init(&job_cond, 0);
 }
 
 Hair::~Hair()
 {
+	if(worker_running) {
+		pthread_mutex_lock(&job_mutex);
+		worker_quit = true;
+		pthread_cond_broadcast(&job_cond);
+		pthread_mutex_unlock(&job_mutex);
+
+		pthread_join(worker, 0);
+	}
+	end_bake();
+	delete playback;
+	delete shm;
+
+	for(size_t i=0; i<own_colliders.size(); i++) {
+		delete own_colliders[i];
+	}
+	if(groom_index) {
+		kd_free(groom_index);
+	}
+	if(tess_vbo) {
+		glDeleteBuffers(1, &tess_vbo);
+	}
+	pthread_mutex_destroy(&job_mutex);
+	pthread_cond_destroy(&job_cond);
 }
 
-static Vec3 calc_rand_point(const Triangle &tr, Vec3 *bary)
+/* point of the triangle at u, v in [0, 1], uniformly distributed over it */
+static Vec3 calc_rand_point(const Triangle &tr, float u, float v, Vec3 *bary)
 {
-	float u = (float)rand() / (float)RAND_MAX;
-	float v = (float)rand() / (float)RAND_MAX;
-
 	if(u + v > 1) {
 		u = 1 - u;
 		v = 1 - v;
@@ -48,6 +145,235 @@ static Vec3 calc_rand_point(const Triangle &tr, Vec3 *bary)
 	return rp;
 }
 
+/* counter based random numbers in [0, 1): the n-th number of the stream
+ * seed, with no state for threads to share or to advance in order */
+static inline float hash_randf(uint32_t seed, uint32_t n)
+{
+	uint32_t x = n + seed * 0x9e3779b9u;
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/* A cell of the grid used by select_poisson. Cells wider than the radius
+ * can keep any number of points, up to all of them, so the points kept are
+ * listed in the slots of the cell's entries in a shared array */
+#define GRID_AXIS_BITS	20
+
+struct GridCell {
+	uint64_t key;
+	int start, end;	/* its points in the sorted entries */
+	int num_kept;	/* its kept points, from start in the kept array */
+};
+
+static inline uint64_t cell_key(int x, int y, int z)
+{
+	return (uint64_t)x | ((uint64_t)y << GRID_AXIS_BITS) | ((uint64_t)z << (GRID_AXIS_BITS * 2));
+}
+
+/* the phase group of a cell: cells of the same phase are two cells apart,
+ * and never test the same neighbors */
+static inline int cell_phase(uint64_t key)
+{
+	return (key & 1) | ((key >> (GRID_AXIS_BITS - 1)) & 2) | ((key >> (GRID_AXIS_BITS * 2 - 2)) & 4);
+}
+
+static int find_cell(const std::vector<GridCell> &cells, const int *phase_start, uint64_t key)
+{
+	int ph = cell_phase(key);
+	int lo = phase_start[ph], hi = phase_start[ph + 1];
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(cells[mid].key < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < phase_start[ph + 1] && cells[lo].key == key ? lo : -1;
+}
+
+/* Dart throwing in parallel: sets keep[i] for the points which are no
+ * closer than rad to a point kept before them. The first num_fixed points
+ * are kept regardless, the rest are taken in order within each grid cell.
+ *
+ * The grid cells are at least rad wide, so a point only conflicts with the
+ * points of the 27 cells around it. The cells are split in 8 phase groups
+ * by the parity of their coordinates, and the cells of a group are filled
+ * in parallel, since none of them is a neighbor of another. The result
+ * depends on the points alone, not on the threads or their timing */
+static void select_poisson(const Vec3 *pts, int num_fixed, int num, float rad, unsigned char *keep)
+{
+	if(rad <= 0 || num <= 0) {
+		memset(keep, 1, num);
+		return;
+	}
+
+	float x0 = FLT_MAX, y0 = FLT_MAX, z0 = FLT_MAX;
+	float x1 = -FLT_MAX, y1 = -FLT_MAX, z1 = -FLT_MAX;
+
+#pragma omp parallel for schedule(static, 8192) reduction(min:x0, y0, z0) reduction(max:x1, y1, z1)
+	for(int i=0; i<num; i++) {
+		x0 = pts[i].x < x0 ? pts[i].x : x0;
+		y0 = pts[i].y < y0 ? pts[i].y : y0;
+		z0 = pts[i].z < z0 ? pts[i].z : z0;
+		x1 = pts[i].x > x1 ? pts[i].x : x1;
+		y1 = pts[i].y > y1 ? pts[i].y : y1;
+		z1 = pts[i].z > z1 ? pts[i].z : z1;
+	}
+
+	/* wider cells are fine, as long as the coordinates fit the keys */
+	float ext = x1 - x0;
+	if(y1 - y0 > ext) ext = y1 - y0;
+	if(z1 - z0 > ext) ext = z1 - z0;
+	float cell = rad;
+	float min_cell = ext / ((1 << GRID_AXIS_BITS) - 2);
+	if(cell < min_cell) cell = min_cell;
+	float inv_cell = 1.0f / cell;
+
+	/* points sorted by phase, then cell, then order */
+	std::vector<std::pair<uint64_t, int> > entries(num);
+
+#pragma omp parallel for schedule(static, 8192)
+	for(int i=0; i<num; i++) {
+		int x = (int)((pts[i].x - x0) * inv_cell) + 1;
+		int y = (int)((pts[i].y - y0) * inv_cell) + 1;
+		int z = (int)((pts[i].z - z0) * inv_cell) + 1;
+		uint64_t key = cell_key(x, y, z);
+		entries[i].first = ((uint64_t)cell_phase(key) << 61) | key;
+		entries[i].second = i;
+		keep[i] = i < num_fixed ? 1 : 0;
+	}
+	std::sort(entries.begin(), entries.end());
+
+	std::vector<GridCell> cells;
+	int phase_start[9];
+	int ph = 0;
+	for(int i=0; i<num; i++) {
+		uint64_t key = entries[i].first & (((uint64_t)1 << 61) - 1);
+		if(cells.empty() || cells.back().key != key) {
+			while(ph <= cell_phase(key)) {
+				phase_start[ph++] = cells.size();
+			}
+			GridCell c;
+			c.key = key;
+			c.start = i;
+			c.num_kept = 0;
+			cells.push_back(c);
+		}
+		cells.back().end = i + 1;
+	}
+	while(ph <= 8) {
+		phase_start[ph++] = cells.size();
+	}
+
+	float rad_sq = rad * rad;
+	const uint64_t axis_mask = ((uint64_t)1 << GRID_AXIS_BITS) - 1;
+	std::vector<int> kept(num);
+
+	for(int i=0; i<8; i++) {
+#pragma omp parallel for schedule(dynamic, 16)
+		for(int j=phase_start[i]; j<phase_start[i + 1]; j++) {
+			GridCell *c = &cells[j];
+			int *ckept = &kept[c->start];
+
+			/* fixed points come first in a cell, and need no tests */
+			if(entries[c->end - 1].second < num_fixed) {
+				for(int k=c->start; k<c->end; k++) {
+					ckept[c->num_kept++] = entries[k].second;
+				}
+				continue;
+			}
+
+			int cx = c->key & axis_mask;
+			int cy = (c->key >> GRID_AXIS_BITS) & axis_mask;
+			int cz = c->key >> (GRID_AXIS_BITS * 2);
+
+			/* the cells around, coordinates start at 1 so none is negative */
+			int nb[27];
+			int num_nb = 0;
+			for(int k=0; k<27; k++) {
+				int n = find_cell(cells, phase_start, cell_key(cx + k % 3 - 1, cy + k / 3 % 3 - 1, cz + k / 9 - 1));
+				if(n >= 0) nb[num_nb++] = n;
+			}
+
+			for(int k=c->start; k<c->end; k++) {
+				int idx = entries[k].second;
+				bool taken = false;
+
+				for(int n=0; n<num_nb && !taken && idx >= num_fixed; n++) {
+					const GridCell *nc = &cells[nb[n]];
+					const int *nkept = &kept[nc->start];
+					for(int m=0; m<nc->num_kept; m++) {
+						if(distance_sq(pts[nkept[m]], pts[idx]) < rad_sq) {
+							taken = true;
+							break;
+						}
+					}
+				}
+				if(!taken) {
+					keep[idx] = 1;
+					ckept[c->num_kept++] = idx;
+				}
+			}
+		}
+	}
+}
+
+/* Reorders the strands so that every prefix of the array is roughly a
+ * Poisson disk distribution: repeated dart throwing passes over the
+ * remaining strands with a shrinking radius, each one filling the gaps
+ * left by the previous.
+ */
+static void sort_progressive(std::vector<HairSpawn> *spawns, float min_dist, const Aabb &bbox)
+{
+	std::vector<HairSpawn> sorted;
+	std::vector<HairSpawn> rest = *spawns;
+	std::vector<HairSpawn> next;
+	std::vector<Vec3> pts;
+	std::vector<unsigned char> keep;
+
+	sorted.reserve(spawns->size());
+
+	float rad = length(bbox.v1 - bbox.v0) * 0.25;
+	while(!rest.empty()) {
+		if(rad < min_dist) {
+			/* the rest already satisfy min_dist */
+			sorted.insert(sorted.end(), rest.begin(), rest.end());
+			break;
+		}
+
+		/* the strands sorted so far stay, the rest try to fit between */
+		int num_sorted = sorted.size();
+		int num = num_sorted + rest.size();
+		pts.resize(num);
+		keep.resize(num);
+		for(int i=0; i<num_sorted; i++) {
+			pts[i] = sorted[i].pt;
+		}
+		for(size_t i=0; i<rest.size(); i++) {
+			pts[num_sorted + i] = rest[i].pt;
+		}
+		select_poisson(&pts[0], num_sorted, num, rad, &keep[0]);
+
+		next.clear();
+		for(size_t i=0; i<rest.size(); i++) {
+			if(keep[num_sorted + i]) {
+				sorted.push_back(rest[i]);
+			} else {
+				next.push_back(rest[i]);
+			}
+		}
+		rest.swap(next);
+		rad *= M_SQRT1_2;
+	}
+
+	spawns->swap(sorted);
+}
+
 static void get_spawn_triangles(const Mesh *m, float thresh, std::vector<Triangle> *faces)
 {
 	if (!m) {
@@ -79,6 +405,7 @@ static void get_spawn_triangles(const Mesh *m, float thresh, std::vector<Triangl
 				if(t.v[j].y > max_y)
 					max_y = t.v[j].y;
 			}
+			t.idx = i;
 			faces->push_back(t);
 		}
 	}
@@ -87,9 +414,12 @@ static void get_spawn_triangles(const Mesh *m, float thresh, std::vector<Triangl
 
 bool Hair::init(const Mesh *m, int max_num_spawns, float thresh)
 {
+	if(!kern_init()) {
+		return false;
+	}
+
 	std::vector<Triangle> faces;
-	kdtree *kd = kd_create(3);
-	const float min_dist = 0.05;
+	float min_dist = params.min_dist;
 
 	if(!m) {
 		fprintf(stderr, "Func %s: invalid mesh.\n", __func__);
@@ -97,115 +427,1114 @@ bool Hair::init(const Mesh *m, int max_num_spawns, float thresh)
 	}
 
 	get_spawn_triangles(m, thresh, &faces);
+	if(faces.empty()) {
+		fprintf(stderr, "Func %s: no spawn triangles darker than %g.\n", __func__, thresh);
+		return false;
+	}
 
-	for(int i = 0; i < max_num_spawns; i++) {
-		// Poisson
-		int rnum = (float)((float)rand() / (float)RAND_MAX) * faces.size();
-		Triangle rtriangle = faces[rnum];
-		Vec3 bary;
-		Vec3 rpoint = calc_rand_point(rtriangle, &bary);
+	/* pick the triangles by area, for the same density everywhere */
+	std::vector<float> area_cdf(faces.size());
+	float total_area = 0;
+	for(size_t i=0; i<faces.size(); i++) {
+		const Triangle &t = faces[i];
+		total_area += length(cross(t.v[1] - t.v[0], t.v[2] - t.v[0])) * 0.5;
+		area_cdf[i] = total_area;
+	}
 
-		kdres *res = kd_nearest3f(kd, rpoint.x, rpoint.y, rpoint.z);
+	/* throw the darts in parallel, then keep the ones that are min_dist
+	 * apart. rand() seeds the darts, so srand still picks the groom */
+	uint32_t seed = rand();
+	int num_darts = max_num_spawns > 0 ? max_num_spawns : 0;
+	std::vector<HairSpawn> darts(num_darts);
+	std::vector<Vec3> dart_pts(num_darts);
 
-		if (res && !kd_res_end(res)) {
-			Vec3 nearest;
-			kd_res_item3f(res, &nearest.x, &nearest.y, &nearest.z);
-			kd_res_free(res);
-			if(distance_sq(rpoint, nearest) < min_dist * min_dist)
-				continue;
-		}
+#pragma omp parallel for schedule(static, 4096)
+	for(int i=0; i<num_darts; i++) {
+		float r = hash_randf(seed, i * 3) * total_area;
+		size_t sel = std::upper_bound(area_cdf.begin(), area_cdf.end(), r) - area_cdf.begin();
+		if(sel >= faces.size()) sel = faces.size() - 1;
+		const Triangle &tr = faces[sel];
 
-		HairStrand strand;
+		HairSpawn *spawn = &darts[i];
+		spawn->pt = calc_rand_point(tr, hash_randf(seed, i * 3 + 1), hash_randf(seed, i * 3 + 2), &spawn->bary);
 		/* weighted sum of the triangle's vertex normals */
-		strand.spawn_dir = normalize(rtriangle.n[0] * bary.x + rtriangle.n[1] * bary.y + rtriangle.n[2] * bary.z);
-		strand.spawn_pt = rpoint;
-		hair.push_back(strand);
+		spawn->dir = normalize(tr.n[0] * spawn->bary.x + tr.n[1] * spawn->bary.y + tr.n[2] * spawn->bary.z);
+		spawn->tri = tr.idx;
+		spawn->id = 0;
+		dart_pts[i] = spawn->pt;
+	}
+
+	std::vector<unsigned char> keep(num_darts);
+	if(num_darts > 0) {
+		select_poisson(&dart_pts[0], 0, num_darts, min_dist, &keep[0]);
+	}
 
-		kd_insert3f(kd, rpoint.x, rpoint.y, rpoint.z, 0);
+	spawns.clear();
+	for(int i=0; i<num_darts; i++) {
+		if(keep[i]) {
+			spawns.push_back(darts[i]);
+		}
 	}
 
-	kd_free(kd);
+	sort_progressive(&spawns, min_dist, m->bbox);
+	num_active = spawns.size();
+	prepare_spawns();
+
+	spawn_thresh = thresh;
+	groom_mesh = m;
+	reset_ids();
 
+	hair.resize(spawns.size());
 	for(size_t i=0; i<hair.size(); i++) {
-		hair[i].pos = hair[i].spawn_pt + hair[i].spawn_dir * hair_length;
+		hair[i].pos = spawns[i].pt + spawns[i].dir * params.hair_length;
+		hair[i].velocity = Vec3(0, 0, 0);
 	}
+
+	reset_frames();
 	return true;
 }
 
-static Vec3 dbg_force;
-void Hair::draw() const
+/* fills both frames with the current simulation state */
+void Hair::reset_frames()
 {
-	glPushAttrib(GL_ENABLE_BIT);
-//	glDisable(GL_DEPTH_TEST);
+	for(int i=0; i<2; i++) {
+		HairFrame *frm = frames + i;
+		frm->pos.resize(hair.size());
+		for(size_t j=0; j<hair.size(); j++) {
+			frm->pos[j] = hair[j].pos;
+		}
+		frm->xform = xform;
+		frm->num_active = num_active;
+		frm->lod = lod;
+		frm->lod_opaque = lod_opaque;
+		frm->at_rest = false;
+	}
+	draw_xform = xform;
+}
+
+void Hair::update_spawns(const Mesh *m)
+{
+	const uint32_t *idx = &m->indices[0];
+	const Vec3 *vert = &m->vertices[0];
+	const Vec3 *norm = &m->normals[0];
+	int num = spawns.size();
+
+#pragma omp parallel for schedule(static, 1024)
+	for(int i=0; i<num; i++) {
+		HairSpawn *s = &spawns[i];
+		const uint32_t *tri = idx + s->tri * 3;
+		const Vec3 &b = s->bary;
+
+		s->pt = vert[tri[0]] * b.x + vert[tri[1]] * b.y + vert[tri[2]] * b.z;
+		s->dir = normalize(norm[tri[0]] * b.x + norm[tri[1]] * b.y + norm[tri[2]] * b.z);
+	}
+	prepare_spawns();
+}
+
+void Hair::prepare_spawns()
+{
+	float x0 = FLT_MAX, y0 = FLT_MAX, z0 = FLT_MAX;
+	float x1 = -FLT_MAX, y1 = -FLT_MAX, z1 = -FLT_MAX;
+	int num = spawns.size();
+
+#pragma omp parallel for schedule(static, 8192) reduction(min:x0, y0, z0) reduction(max:x1, y1, z1)
+	for(int i=0; i<num; i++) {
+		const Vec3 &p = spawns[i].pt;
+		x0 = p.x < x0 ? p.x : x0;
+		y0 = p.y < y0 ? p.y : y0;
+		z0 = p.z < z0 ? p.z : z0;
+		x1 = p.x > x1 ? p.x : x1;
+		y1 = p.y > y1 ? p.y : y1;
+		z1 = p.z > z1 ? p.z : z1;
+	}
+
+	if(num > 0) {
+		spawn_box.v0 = Vec3(x0, y0, z0);
+		spawn_box.v1 = Vec3(x1, y1, z1);
+	} else {
+		spawn_box.v0 = spawn_box.v1 = Vec3(0, 0, 0);
+	}
+
+	/* only the compact kernels read the packed spawns */
+	if(params.compact && num > 0) {
+		packed_spawns.resize(num);
+		kern_pack_spawns(&packed_spawns[0], &spawns[0], num, spawn_box);
+	} else {
+		packed_spawns.clear();
+	}
+}
+
+void Hair::draw()
+{
+	const HairFrame *frm = frames + front;
+	int nactive = frm->num_active;
+
+	/* visible is sorted, drop any strands past the active ones */
+	int num = nactive;
+	const int *idx = 0;
+	if(culled) {
+		num = std::lower_bound(visible.begin(), visible.begin() + num_visible, nactive) - visible.begin();
+		idx = &visible[0];
+	}
+	if(num <= 0) return;
+
+	KernTess tp;
+	/* the roots are in head space, and the simulated tips are moved to
+	 * the latched head transform */
+	kern_set_tess_xform(&tp, draw_xform, draw_xform * inverse(frm->xform));
+	tp.hair_length = params.hair_length;
+	tp.cam[0] = view_pos.x;
+	tp.cam[1] = view_pos.y;
+	tp.cam[2] = view_pos.z;
+	tp.seg_scale = view_scale / params.tess_pixels;
+	tp.max_segs = params.tess_segs;
+
+	/* strands being added or about to be dropped by the LOD fade */
+	float fade_start = frm->lod_opaque * hair.size();
+	float fade_len = frm->lod * hair.size() - fade_start;
+	tp.fade_start = fade_start;
+	tp.fade_scale = fade_len > 0 ? 1.0 / fade_len : 0;
+
+	/* fit the curves and count the points of every block, then each block
+	 * is tessellated into its place in the buffer */
+	int num_blocks = (num + TESS_BLOCK - 1) / TESS_BLOCK;
+	tess_curves.resize(num);
+	tess_first.resize(num);
+	tess_count.resize(num);
+	tess_offs.resize(num_blocks + 1);
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_blocks; i++) {
+		int start = i * TESS_BLOCK;
+		int end = start + TESS_BLOCK < num ? start + TESS_BLOCK : num;
+		hair_kern->fit_curves(&spawns[0], &frm->pos[0], idx, start, end - start, &tp, &tess_curves[start]);
+
+		int points = 0;
+		for(int j=start; j<end; j++) {
+			tess_count[j] = tess_curves[j].segs + 1;
+			points += tess_count[j];
+		}
+		tess_offs[i + 1] = points;
+	}
+
+	tess_offs[0] = 0;
+	for(int i=0; i<num_blocks; i++) {
+		tess_offs[i + 1] += tess_offs[i];
+	}
+	int num_points = tess_offs[num_blocks];
+	size_t size = num_points * (3 * sizeof(float) + sizeof(uint32_t));
+
+	/* orphan the buffer, so that the draw of the last frame doesn't stall
+	 * the writes, and map it */
+	if(!tess_vbo) {
+		glGenBuffers(1, &tess_vbo);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, tess_vbo);
+	if(size > tess_vbo_size) {
+		tess_vbo_size = size + size / 4;
+	}
+	glBufferData(GL_ARRAY_BUFFER, tess_vbo_size, 0, GL_STREAM_DRAW);
+
+	unsigned char *buf = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	bool mapped = buf != 0;
+	if(!mapped) {
+		tess_scratch.resize(size);
+		buf = &tess_scratch[0];
+	}
+	float *pos = (float*)buf;
+	uint32_t *color = (uint32_t*)(buf + num_points * 3 * sizeof(float));
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_blocks; i++) {
+		int start = i * TESS_BLOCK;
+		int end = start + TESS_BLOCK < num ? start + TESS_BLOCK : num;
+		int offs = tess_offs[i];
+		hair_kern->tessellate(&tess_curves[start], end - start, pos + offs * 3, color + offs);
+
+		for(int j=start; j<end; j++) {
+			tess_first[j] = offs;
+			offs += tess_count[j];
+		}
+	}
+
+	/* unmapping fails if the contents were lost, e.g. on a mode switch */
+	if(!mapped) {
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, buf);
+	} else if(!glUnmapBuffer(GL_ARRAY_BUFFER)) {
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+
+	glPushAttrib(GL_ENABLE_BIT | GL_LINE_BIT);
 	glDisable(GL_LIGHTING);
-	glPointSize(5);
-	glLineWidth(3);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	glBegin(GL_LINES);
-	for(size_t i=0; i<hair.size(); i++) {
-		glColor3f(1, 0, 1);
-		Vec3 p = xform * hair[i].spawn_pt;
-		glVertex3f(p.x, p.y, p.z);
-		Vec3 dir = normalize(hair[i].pos - p) * hair_length;
-		Vec3 end = p + dir;
-		glColor3f(1, 1, 0);
-		glVertex3f(end.x, end.y, end.z);
-/*
-		glColor3f(1, 1, 0);
-		glVertex3f(hair[i].pos.x, hair[i].pos.y, hair[i].pos.z);
-		Vec3 fend = hair[i].pos + dbg_force * 2.0;
-		glVertex3f(fend.x, fend.y, fend.z);
-		*/
-	}
-	glEnd();
-
-	/*
-	glBegin(GL_POINTS);
-	glColor3f(0.5, 1.0, 0.5);
-	for(size_t i = 0; i < hair.size(); i++) {
-		Vec3 p = xform * (hair[i].spawn_pt + hair[i].spawn_dir * hair_length);
-		glVertex3f(p.x, p.y, p.z);
-	}
-	glEnd();*/
+	/* fewer strands at lower LOD, widen them to keep the apparent density */
+	float width = 3.0;
+	if(nactive > 0 && frm->lod < 1) {
+		width *= sqrt((float)hair.size() / (float)nactive);
+		if(width > 8.0) width = 8.0;
+	}
+	glLineWidth(width);
+
+	glVertexPointer(3, GL_FLOAT, 0, 0);
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, (void*)(num_points * 3 * sizeof(float)));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glMultiDrawArrays(GL_LINE_STRIP, &tess_first[0], &tess_count[0], num);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
 
 	glPopAttrib();
 }
 
+void Hair::set_view(const Vec3 &cam_pos, float pixel_scale)
+{
+	view_pos = cam_pos;
+	view_scale = pixel_scale;
+}
+
 void Hair::set_transform(Mat4 &xform)
 {
 	this->xform = xform;
 }
 
+void Hair::latch_transform(const Mat4 &xform)
+{
+	draw_xform = xform;
+}
+
 void Hair::update(float dt)
 {
-	for(size_t i = 0; i < hair.size(); i++) {
-		/* in local space */
-		Vec3 hair_end = hair[i].spawn_pt + hair[i].spawn_dir * hair_length;
-		Vec3 anchor = xform * hair_end;
+	sync();
+	simulate(dt);
+	flip();
+}
 
-		Vec3 force = (anchor - hair[i].pos) * K_ANC;
+/* makes the back frame current */
+void Hair::flip()
+{
+	front = !front;
+	draw_xform = frames[front].xform;
+}
 
-		Vec3 accel = force; /* mass 1 */
-		hair[i].velocity += ((-hair[i].velocity * DAMPING) + accel) * dt;
-		Vec3 new_pos = hair[i].pos + hair[i].velocity * dt;
+void Hair::update_async(float dt)
+{
+	sync();
 
-		/* collision detection with the head */
-		Vec3 normal = xform.upper3x3() * hair[i].spawn_dir;
-		Vec3 root = xform * hair[i].spawn_pt;
-		Vec3 dir = new_pos - root;
+	if(!worker_running) {
+		if(pthread_create(&worker, 0, worker_func, this) != 0) {
+			fprintf(stderr, "failed to start the hair update thread, updating synchronously\n");
+			update(dt);
+			return;
+		}
+		worker_running = true;
+	}
 
-		normal.normalize();
+	pthread_mutex_lock(&job_mutex);
+	job_dt = dt;
+	job_pending = true;
+	job_done = false;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_mutex);
+}
 
-		/* angle that will cause the hair to be rendered inside the head */
-		float d = dot(dir, normal);
-		if(d < 0) {
-			new_pos += -d * normal;
+void Hair::sync()
+{
+	if(!worker_running) return;
+
+	pthread_mutex_lock(&job_mutex);
+	if(!job_pending && !job_done) {
+		/* nothing in flight */
+		pthread_mutex_unlock(&job_mutex);
+		return;
+	}
+	while(!job_done) {
+		pthread_cond_wait(&job_cond, &job_mutex);
+	}
+	job_done = false;
+	pthread_mutex_unlock(&job_mutex);
+
+	flip();
+}
+
+void *Hair::worker_func(void *cls)
+{
+	Hair *hair = (Hair*)cls;
+
+	pthread_mutex_lock(&hair->job_mutex);
+	for(;;) {
+		while(!hair->job_pending && !hair->worker_quit) {
+			pthread_cond_wait(&hair->job_cond, &hair->job_mutex);
+		}
+		if(hair->worker_quit) break;
+
+		float dt = hair->job_dt;
+		pthread_mutex_unlock(&hair->job_mutex);
+
+		hair->simulate(dt);
+
+		pthread_mutex_lock(&hair->job_mutex);
+		hair->job_pending = false;
+		hair->job_done = true;
+		pthread_cond_broadcast(&hair->job_cond);
+	}
+	pthread_mutex_unlock(&hair->job_mutex);
+	return 0;
+}
+
+/* advances the simulation state, and writes the result to the back frame */
+void Hair::simulate(float dt)
+{
+	KernParams kp;
+	std::vector<KernSphere> spheres;
+	if(!begin_step(dt, &kp, &spheres)) {
+		return;
+	}
+
+	/* strand blocks in parallel, the kernels vectorize within a block.
+	 * Blocks take as many substeps as their own motion needs */
+	int num_blocks = (num_active + STEP_BLOCK - 1) / STEP_BLOCK;
+	std::vector<KernStats> bstats(num_blocks);
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_blocks; i++) {
+		int start = i * STEP_BLOCK;
+		int end = start + STEP_BLOCK < num_active ? start + STEP_BLOCK : num_active;
+
+		step_block(start, end, &kp, spheres.empty() ? 0 : &spheres[0], spheres.size(), &bstats[i]);
+	}
+
+	KernStats stats;
+	memset(&stats, 0, sizeof stats);
+	for(int i=0; i<num_blocks; i++) {
+		kern_merge_stats(&stats, bstats[i]);
+	}
+	end_step(dt, stats);
+}
+
+/* substeps for an update of length dt, from the spring stability limit
+ * and the fastest any strand may get: its current speed, or the energy of
+ * the stretch left by the last update and the head motion since, turned
+ * into speed. That keeps the strands from skipping through the colliders */
+int Hair::plan_substeps(float dt) const
+{
+	if(dt <= 0) return 1;
+
+	float omega = sqrt(params.k_anc);
+	float n = 1;
+	if(params.integrator == INTEG_SYMPLECTIC) {
+		float damping = params.damping + (wind_enabled(params) ? params.wind_drag : 0);
+		n = dt * (omega + damping * 0.5) / STABLE_STEP;
+	}
+
+	/* the anchor displacement is largest at a corner of their bounds */
+	const Mat4 &prev_xform = frames[front].xform;
+	float len = params.hair_length;
+	float shift_sq = 0;
+	for(int i=0; i<8; i++) {
+		Vec3 c;
+		c.x = (i & 1) ? spawn_box.v1.x + len : spawn_box.v0.x - len;
+		c.y = (i & 2) ? spawn_box.v1.y + len : spawn_box.v0.y - len;
+		c.z = (i & 4) ? spawn_box.v1.z + len : spawn_box.v0.z - len;
+		float dsq = distance_sq(xform * c, prev_xform * c);
+		if(dsq > shift_sq) shift_sq = dsq;
+	}
+
+	float speed = omega * (max_stretch + sqrt(shift_sq));
+	if(max_speed > speed) speed = max_speed;
+	float cfl_n = speed * dt / (params.cfl * len);
+	if(cfl_n > n) n = cfl_n;
+
+	if(n < substep_floor) n = substep_floor;
+
+	if(!(n < params.max_substeps)) {
+		return params.max_substeps;	/* also catches nan from a broken state */
+	}
+	return n > 1 ? (int)ceil(n) : 1;
+}
+
+/* first part of simulate: prepares the kernel parameters. Returns false if
+ * there's nothing to simulate, because a cached frame was played instead */
+bool Hair::begin_step(float dt, KernParams *kp, std::vector<KernSphere> *spheres)
+{
+	update_lod(dt);
+	sim_time += dt;
+
+	HairFrame *frm = frames + !front;
+	frm->pos.resize(hair.size());
+
+	if(playback) {
+		play_frame(dt);
+		export_frame();
+		return false;
+	}
+
+	kern_set_xform(kp, xform);
+	kern_set_spawn_box(kp, spawn_box);
+	kp->hair_length = params.hair_length;
+	kp->k_anc = params.k_anc;
+	kp->damping = params.damping;
+	kp->wind_drag = params.wind_drag;
+	kp->dt = dt;
+	kp->max_stretch = (length(spawn_box.v1 - spawn_box.v0) + params.hair_length * 2) * RUNAWAY_STRETCH;
+	kp->substeps = plan_substeps(dt);
+	kp->max_substeps = params.max_substeps;
+
+	/* pick the kernels once, the blocks just call them */
+	step_update = kern_update_func(hair_kern, params);
+	step_sdf = params.coll_mode == COLL_SDF && have_sdf;
+	step_tree = params.coll_mode == COLL_TREE && have_stree;
+	step_wind = wind_enabled(params);
+
+	/* the air around the hair: the anchors are a hair length from the
+	 * roots, and the strands rarely stray further than that from them.
+	 * Any that do get the air at the boundary. Between builds, the strands
+	 * which need it sample the last grid */
+	wind_fresh = step_wind && (++wind_tick >= hair_kern->wind_interval || wind_valid == 0);
+	if(wind_fresh) {
+		wind_tick = 0;
+		float len = params.hair_length * 2;
+		Aabb box;
+		box.v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		box.v1 = Vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for(int i=0; i<8; i++) {
+			Vec3 c;
+			c.x = (i & 1) ? spawn_box.v1.x + len : spawn_box.v0.x - len;
+			c.y = (i & 2) ? spawn_box.v1.y + len : spawn_box.v0.y - len;
+			c.z = (i & 4) ? spawn_box.v1.z + len : spawn_box.v0.z - len;
+			c = xform * c;
+			for(int j=0; j<3; j++) {
+				if(c[j] < box.v0[j]) box.v0[j] = c[j];
+				if(c[j] > box.v1[j]) box.v1[j] = c[j];
+			}
+		}
+		build_wind(&wind, hair_kern, params, box, sim_time);
+	}
+	if(step_wind) {
+		if(wind_vel.size() != hair.size() * 3) {
+			wind_vel.resize(hair.size() * 3);
+			wind_valid = 0;
+		}
+	} else {
+		wind_valid = 0;
+	}
+
+	spheres->clear();
+	if(params.coll_mode == COLL_SPHERES) {
+		spheres->resize(colliders.size());
+		for(size_t i=0; i<colliders.size(); i++) {
+			(*spheres)[i].x = colliders[i]->center.x;
+			(*spheres)[i].y = colliders[i]->center.y;
+			(*spheres)[i].z = colliders[i]->center.z;
+			(*spheres)[i].radius = colliders[i]->radius;
 		}
+	}
+	return true;
+}
+
+/* updates active strands [start, end) and copies them to the back frame.
+ * Blocks are independent, and may run in parallel.
+ *
+ * The block starts with the substeps planned by begin_step, and shortens
+ * them if it turns out faster than planned, or if its energy grows while
+ * the anchors stay put, which only an unstable step does. The whole block
+ * stays in cache across its substeps */
+void Hair::step_block(int start, int end, const KernParams *kp, const KernSphere *spheres,
+		int num_spheres, KernStats *stats)
+{
+	memset(stats, 0, sizeof *stats);
+	if(end <= start) return;
+
+	HairStrand *blk = &hair[start];
+	const HairSpawn *blk_spawns = &spawns[start];
+	const KernSpawn *blk_packed = params.compact ? &packed_spawns[start] : 0;
+	int num = end - start;
 
-        hair[i].pos = new_pos;
-//		hair[i].pos = handle_collision(new_pos);
+	KernSdf ksdf;
+	if(step_sdf) {
+		ksdf.dist = &sdf.dist[0];
+		ksdf.xsz = sdf.xsz;
+		ksdf.ysz = sdf.ysz;
+		ksdf.zsz = sdf.zsz;
+		ksdf.origin[0] = sdf.origin.x;
+		ksdf.origin[1] = sdf.origin.y;
+		ksdf.origin[2] = sdf.origin.z;
+		ksdf.cell = sdf.cell;
+	}
+
+	/* samples the air for one part of the block in turns after each grid
+	 * build, and for the strands which weren't simulated in the last
+	 * update. It holds through the substeps */
+	if(step_wind) {
+		KernWind kwind;
+		kwind.vel = &wind.vel[0];
+		kwind.xsz = wind.xsz;
+		kwind.ysz = wind.ysz;
+		kwind.zsz = wind.zsz;
+		kwind.origin[0] = wind.origin.x;
+		kwind.origin[1] = wind.origin.y;
+		kwind.origin[2] = wind.origin.z;
+		kwind.cell = wind.cell;
+
+		if(wind_fresh) {
+			int part = (num + WIND_REFRESH - 1) / WIND_REFRESH;
+			int lo = start + part * wind_phase;
+			int hi = lo + part < end ? lo + part : end;
+			if(lo < hi) {
+				hair_kern->sample_wind(&hair[lo], hi - lo, &kwind, &wind_vel[lo * 3]);
+			}
+		}
+		if(wind_valid < end) {
+			int lo = wind_valid > start ? wind_valid : start;
+			hair_kern->sample_wind(&hair[lo], end - lo, &kwind, &wind_vel[lo * 3]);
+		}
+	}
+
+	KernParams skp = *kp;
+	float min_step = kp->dt / kp->max_substeps;
+	float step = kp->dt / kp->substeps;
+	float max_move = params.cfl * params.hair_length;
+	float left = kp->dt;
+	int count = 0;
+
+	/* energy changes below this are noise of a block at rest */
+	float rest_energy = num * 0.5 * params.rest_speed * params.rest_speed;
+
+	while(left > 0) {
+		/* the last one takes the rest, rather than leaving a sliver */
+		float h = step < left ? step : left;
+		if(left - h < step * 0.01 || count == kp->max_substeps - 1) {
+			h = left;
+		}
+		skp.dt = h;
+		skp.max_speed = params.hair_length * RUNAWAY_MOVE / h;
+
+		KernStats sub;
+		step_update(blk, blk_spawns, blk_packed, step_wind ? &wind_vel[start * 3] : 0, num, &skp, &sub);
+		if(num_spheres > 0) {
+			hair_kern->collide(blk, num, &skp, spheres, num_spheres);
+		}
+		if(step_sdf) {
+			hair_kern->collide_sdf(blk, num, &skp, &ksdf);
+		}
+		if(step_tree) {
+			hair_kern->collide_tree(blk, num, &skp, &stree.nodes[0]);
+		}
+		stats->clamps += sub.clamps;
+		left -= h;
+
+		/* the head moves the anchors in the first substep only */
+		if(count > 0 && sub.energy > stats->energy * ENERGY_GROWTH + rest_energy) {
+			step *= 0.5;
+		}
+		float speed = sqrt(sub.max_speed_sq);
+		if(speed * step > max_move) {
+			step = max_move / speed;
+		}
+		if(step < min_step) {
+			step = min_step;
+		}
+
+		stats->max_speed_sq = sub.max_speed_sq;
+		stats->max_stretch_sq = sub.max_stretch_sq;
+		stats->energy = sub.energy;
+		count++;
+	}
+	stats->substeps = count;
+	stats->refined = count > kp->substeps ? 1 : 0;
+
+	Vec3 *pos = &frames[!front].pos[0];
+	for(int i=start; i<end; i++) {
+		pos[i] = hair[i].pos;
+	}
+}
+
+/* last part of simulate, with the motion statistics of every block */
+void Hair::end_step(float dt, const KernStats &stats)
+{
+	max_speed = sqrt(stats.max_speed_sq);
+	max_stretch = sqrt(stats.max_stretch_sq);
+
+	step_stats.updates++;
+	step_stats.substeps += stats.substeps;
+	step_stats.refined += stats.refined;
+	step_stats.clamps += stats.clamps;
+	step_stats.last_substeps = stats.substeps;
+
+	if(step_wind) {
+		wind_valid = num_active;
+		if(wind_fresh) {
+			wind_phase = (wind_phase + 1) % WIND_REFRESH;
+		}
+	}
+
+	/* the next plan starts from what this update needed, more if strands
+	 * still ran away, and relaxes once the motion calms down */
+	if(stats.clamps > 0) {
+		substep_floor = stats.substeps * 2;
+	} else if(stats.refined > 0) {
+		substep_floor = stats.substeps;
+	} else if(substep_floor > 1) {
+		substep_floor /= 2;
+	}
+
+	HairFrame *frm = frames + !front;
+	frm->xform = xform;
+	frm->num_active = num_active;
+	frm->lod = lod;
+	frm->lod_opaque = lod_opaque;
+	/* not while strands are still fading */
+	frm->at_rest = max_speed < params.rest_speed && max_stretch < params.rest_stretch && lod == lod_target &&
+		lod_opaque == lod;
+
+	if(bake && !bake->write_frame(&frm->pos[0], xform, dt)) {
+		fprintf(stderr, "failed to write the hair cache, baking stopped\n");
+		end_bake();
+	}
+	export_frame();
+}
+
+/* publishes the back frame */
+void Hair::export_frame()
+{
+	if(!shm) return;
+
+	const HairFrame *frm = frames + !front;
+	if(frm->num_active > 0) {
+		shm->publish(&spawns[0], &frm->pos[0], frm->num_active, frm->xform, (float)sim_time);
+	}
+}
+
+void Hair::relayout_export()
+{
+	if(shm && !shm->relayout(spawns.size())) {
+		fprintf(stderr, "export stopped\n");
+		delete shm;
+		shm = 0;
+	}
+}
+
+bool Hair::start_export(const char *name)
+{
+	sync();
+	stop_export();
+
+	shm = new ShmExport;
+	if(!shm->open(name, hair.size())) {
+		delete shm;
+		shm = 0;
+		return false;
+	}
+	return true;
+}
+
+void Hair::stop_export()
+{
+	sync();
+	delete shm;
+	shm = 0;
+}
+
+/* decodes the cached frame at the current playback time to the back frame */
+void Hair::play_frame(float dt)
+{
+	play_time += dt;
+	int idx = playback->frame_at(play_time);
+
+	HairFrame *frm = frames + !front;
+	frm->pos.resize(hair.size());
+	frm->xform = playback->read_frame(idx, &frm->pos[0]);
+	frm->num_active = num_active;
+	frm->lod = lod;
+	frm->lod_opaque = lod_opaque;
+	frm->at_rest = false;
+}
+
+Aabb Hair::calc_strand_bounds(const Aabb &bbox) const
+{
+	/* room for the tips to lag a whole hair length behind the rest pose */
+	float rad = params.hair_length * 2;
+	Vec3 grow = Vec3(rad, rad, rad);
+
+	Aabb bounds;
+	bounds.v0 = bbox.v0 - grow;
+	bounds.v1 = bbox.v1 + grow;
+	return bounds;
+}
+
+bool Hair::start_bake(const char *fname, const Aabb &bbox)
+{
+	if(hair.empty()) {
+		fprintf(stderr, "no strands to bake\n");
+		return false;
+	}
+	end_bake();
+
+	bake = new HCacheWriter;
+	if(!bake->open(fname, hair.size(), calc_strand_hash(), calc_strand_bounds(bbox))) {
+		delete bake;
+		bake = 0;
+		return false;
+	}
+
+	/* activate every strand right away, instead of fading them in */
+	lod_target = lod = lod_opaque = 1;
+	update_lod(0);
+	return true;
+}
+
+bool Hair::end_bake()
+{
+	if(!bake) return false;
+
+	bool res = bake->close();
+	delete bake;
+	bake = 0;
+	return res;
+}
+
+bool Hair::start_playback(const char *fname)
+{
+	stop_playback();
+
+	HCacheReader *rd = new HCacheReader;
+	if(!rd->open(fname)) {
+		delete rd;
+		return false;
+	}
+	if(rd->get_num_strands() != (int)hair.size() || rd->get_strand_hash() != calc_strand_hash()) {
+		fprintf(stderr, "%s was baked for different strands\n", fname);
+		delete rd;
+		return false;
+	}
+
+	playback = rd;
+	play_time = 0;
+	return true;
+}
+
+void Hair::stop_playback()
+{
+	if(!playback) return;
+
+	/* carry on simulating from the last played frame */
+	const HairFrame *frm = frames + front;
+	for(int i=0; i<frm->num_active; i++) {
+		hair[i].pos = frm->pos[i];
+		hair[i].velocity = Vec3(0, 0, 0);
+	}
+
+	delete playback;
+	playback = 0;
+}
+
+bool Hair::is_playing() const
+{
+	return playback != 0;
+}
+
+const Mat4 &Hair::get_frame_xform() const
+{
+	return frames[front].xform;
+}
+
+/* FNV-1a over the spawn locations, to match caches with the strands */
+uint32_t Hair::calc_strand_hash() const
+{
+	uint32_t hash = 2166136261u;
+
+	for(size_t i=0; i<spawns.size(); i++) {
+		float data[4] = {(float)spawns[i].tri, spawns[i].bary.x, spawns[i].bary.y, spawns[i].bary.z};
+		const unsigned char *ptr = (const unsigned char*)data;
+		for(size_t j=0; j<sizeof data; j++) {
+			hash = (hash ^ ptr[j]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+void Hair::set_params(const HairParams &params)
+{
+	bool repack = params.compact != this->params.compact;
+	this->params = params;
+	if(repack) {
+		prepare_spawns();
+	}
+}
+
+const HairParams &Hair::get_params() const
+{
+	return params;
+}
+
+const HairStepStats &Hair::get_step_stats() const
+{
+	return step_stats;
+}
+
+void Hair::reset_step_stats()
+{
+	memset(&step_stats, 0, sizeof step_stats);
+}
+
+void Hair::set_hair_length(float len)
+{
+	params.hair_length = len;
+}
+
+float Hair::get_hair_length() const
+{
+	return params.hair_length;
+}
+
+void Hair::set_spring(float k_anc, float damping)
+{
+	params.k_anc = k_anc;
+	params.damping = damping;
+}
+
+bool Hair::build_sdf(const Mesh *m)
+{
+	sync();
+	have_sdf = ::build_sdf(&sdf, m, params.sdf_res);
+	if(have_sdf) {
+		printf("collision sdf: %dx%dx%d\n", sdf.xsz, sdf.ysz, sdf.zsz);
+	}
+	return have_sdf;
+}
+
+bool Hair::build_sphere_tree(const Mesh *m, const char *cache_fname)
+{
+	sync();
+	if(cache_fname && load_sphere_tree(&stree, m, params.sdf_res, cache_fname)) {
+		have_stree = true;
+		printf("collision sphere tree: %d leaves, depth %d (cached in %s)\n", stree.num_leaves,
+				stree.depth, cache_fname);
+		return true;
+	}
+
+	have_stree = fit_sphere_tree(&stree, m, params.sdf_res);
+	if(!have_stree) {
+		return false;
+	}
+	printf("collision sphere tree: %d leaves, depth %d\n", stree.num_leaves, stree.depth);
+
+	if(cache_fname && save_sphere_tree(&stree, m, cache_fname)) {
+		printf("sphere tree cached in %s\n", cache_fname);
+	}
+	return true;
+}
+
+const HairFrame *Hair::get_frame() const
+{
+	return frames + front;
+}
+
+bool Hair::at_rest() const
+{
+	return frames[front].at_rest;
+}
+
+void Hair::set_lod(float frac)
+{
+	if(bake) return;	/* the cache needs every strand */
+
+	if(frac < 0) frac = 0;
+	if(frac > 1) frac = 1;
+	lod_target = frac;
+}
+
+int Hair::get_num_active() const
+{
+	return frames[front].num_active;
+}
+
+struct CullParams {
+	Vec3 cam;	/* camera position in head space */
+	float plane[6][4];	/* frustum planes in head space */
+	float radius;	/* bounding radius of a strand around its root */
+};
+
+static inline bool strand_visible(const HairSpawn &s, const CullParams &cp)
+{
+	Vec3 view = cp.cam - s.pt;
+	float d = dot(s.dir, view);
+	if(d < BACKFACE_COS * length(view)) {
+		return false;
+	}
+
+	for(int i=0; i<6; i++) {
+		const float *pl = cp.plane[i];
+		if(pl[0] * s.pt.x + pl[1] * s.pt.y + pl[2] * s.pt.z + pl[3] < -cp.radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* culls strands [start, end) and writes the visible indices to out,
+ * returns their count */
+static int cull_range(const HairSpawn *spawns, int start, int end, const CullParams &cp, int *out)
+{
+	int count = 0;
+	int i = start;
+
+#ifdef __SSE__
+	__m128 cam_x = _mm_set1_ps(cp.cam.x);
+	__m128 cam_y = _mm_set1_ps(cp.cam.y);
+	__m128 cam_z = _mm_set1_ps(cp.cam.z);
+	__m128 back_cos = _mm_set1_ps(BACKFACE_COS);
+	__m128 neg_rad = _mm_set1_ps(-cp.radius);
+
+	for(; i + 4 <= end; i += 4) {
+		/* transpose the roots and normals of 4 strands to SoA. The 4th
+		 * lane is whatever follows the Vec3 in HairSpawn, and it's
+		 * discarded. */
+		__m128 px = _mm_loadu_ps(&spawns[i].pt.x);
+		__m128 py = _mm_loadu_ps(&spawns[i + 1].pt.x);
+		__m128 pz = _mm_loadu_ps(&spawns[i + 2].pt.x);
+		__m128 pw = _mm_loadu_ps(&spawns[i + 3].pt.x);
+		_MM_TRANSPOSE4_PS(px, py, pz, pw);
+
+		__m128 nx = _mm_loadu_ps(&spawns[i].dir.x);
+		__m128 ny = _mm_loadu_ps(&spawns[i + 1].dir.x);
+		__m128 nz = _mm_loadu_ps(&spawns[i + 2].dir.x);
+		__m128 nw = _mm_loadu_ps(&spawns[i + 3].dir.x);
+		_MM_TRANSPOSE4_PS(nx, ny, nz, nw);
+
+		/* backface: dot(n, view) >= BACKFACE_COS * |view| */
+		__m128 vx = _mm_sub_ps(cam_x, px);
+		__m128 vy = _mm_sub_ps(cam_y, py);
+		__m128 vz = _mm_sub_ps(cam_z, pz);
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, vx), _mm_mul_ps(ny, vy)), _mm_mul_ps(nz, vz));
+		__m128 vlen = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)),
+					_mm_mul_ps(vz, vz)));
+		__m128 vis = _mm_cmpge_ps(d, _mm_mul_ps(back_cos, vlen));
+
+		for(int j=0; j<6; j++) {
+			const float *pl = cp.plane[j];
+			__m128 pd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(pl[0]), px),
+						_mm_mul_ps(_mm_set1_ps(pl[1]), py)),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(pl[2]), pz), _mm_set1_ps(pl[3])));
+			vis = _mm_and_ps(vis, _mm_cmpge_ps(pd, neg_rad));
+		}
+
+		int mask = _mm_movemask_ps(vis);
+		for(int j=0; j<4; j++) {
+			if(mask & (1 << j)) {
+				out[count++] = i + j;
+			}
+		}
+	}
+#endif
+
+	for(; i<end; i++) {
+		if(strand_visible(spawns[i], cp)) {
+			out[count++] = i;
+		}
+	}
+	return count;
+}
+
+void Hair::cull(const Vec3 &cam_pos, const Vec4 *planes)
+{
+	/* do the tests in head space, to avoid transforming every strand */
+	CullParams cp;
+	cp.cam = inverse(draw_xform) * cam_pos;
+	cp.radius = params.hair_length;
+
+	Mat3 rot = draw_xform.upper3x3();
+	Vec3 axis[3] = {rot * Vec3(1, 0, 0), rot * Vec3(0, 1, 0), rot * Vec3(0, 0, 1)};
+	Vec3 trans = draw_xform * Vec3(0, 0, 0);
+
+	int nactive = frames[front].num_active;
+
+	for(int i=0; i<6; i++) {
+		Vec3 n = Vec3(planes[i].x, planes[i].y, planes[i].z);
+		cp.plane[i][0] = dot(axis[0], n);
+		cp.plane[i][1] = dot(axis[1], n);
+		cp.plane[i][2] = dot(axis[2], n);
+		cp.plane[i][3] = dot(trans, n) + planes[i].w;
+	}
+
+	visible.resize(nactive);
+	if(!nactive) {
+		num_visible = 0;
+		culled = true;
+		return;
+	}
+
+	/* cull blocks in parallel, each into its own part of visible, then
+	 * compact the blocks */
+	const int block_size = 4096;
+	int num_blocks = (nactive + block_size - 1) / block_size;
+	std::vector<int> block_count(num_blocks);
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_blocks; i++) {
+		int start = i * block_size;
+		int end = start + block_size < nactive ? start + block_size : nactive;
+		block_count[i] = cull_range(&spawns[0], start, end, cp, &visible[start]);
+	}
+
+	num_visible = block_count[0];
+	for(int i=1; i<num_blocks; i++) {
+		if(block_count[i]) {
+			memmove(&visible[num_visible], &visible[i * block_size], block_count[i] * sizeof(int));
+			num_visible += block_count[i];
+		}
+	}
+	culled = true;
+}
+
+void Hair::disable_culling()
+{
+	culled = false;
+}
+
+int Hair::get_num_visible() const
+{
+	return culled ? num_visible : frames[front].num_active;
+}
+
+void Hair::update_lod(float dt)
+{
+	float t = dt * LOD_RATE;
+	if(t > 1 || fabs(lod_target - lod) < 1e-3) {
+		lod = lod_target;
+	} else {
+		lod += (lod_target - lod) * t;
+	}
+
+	/* added strands fade in behind lod, and while it drops, the last
+	 * LOD_FADE of the active ones fade out ahead of being dropped. Once
+	 * the LOD settles they all become opaque at the same rate */
+	float opaque = lod > lod_target ? lod * (1.0 - LOD_FADE) : lod;
+	float ft = opaque < lod_opaque ? dt * LOD_FADE_RATE : t;
+	if(ft > 1 || fabs(opaque - lod_opaque) < 1e-3) {
+		lod_opaque = opaque;
+	} else {
+		lod_opaque += (opaque - lod_opaque) * ft;
+	}
+	if(lod_opaque > lod) {
+		lod_opaque = lod;
+	}
+
+	int prev_active = num_active;
+	num_active = (int)(lod * hair.size() + 0.5);
+	if(num_active < 1 && !hair.empty()) {
+		num_active = 1;
+	}
 
-		dbg_force = force;
+	/* strands that weren't simulated while inactive, start them at rest */
+	for(int i=prev_active; i<num_active; i++) {
+		hair[i].pos = xform * (spawns[i].pt + spawns[i].dir * params.hair_length);
+		hair[i].velocity = Vec3(0, 0, 0);
 	}
 }
 
@@ -1,34 +1,335 @@
 #ifndef PARTICLES_H_
 #define PARTICLES_H_
 
+#include <pthread.h>
 #include <gmath/gmath.h>
 
+#include "bvh.h"
 #include "mesh.h"
 #include "object.h"
+#include "hcache.h"
+#include "params.h"
+#include "sdf.h"
+#include "spheretree.h"
+#include "wind.h"
 
+struct kdtree;
+class ShmExport;
+class HairEnsemble;
+struct KernParams;
+struct KernSphere;
+struct KernSpawn;
+struct KernStats;
+struct KernCurve;
+
+/* strands per parallel work item of an update. Blocks pick their substeps
+ * on their own, so HairEnsemble splits its members the same way to get the
+ * same result as Hair::update */
+#define STEP_BLOCK 4096
+
+/* simulated state of a strand, in world space */
 struct HairStrand {
 	Vec3 pos;
 	Vec3 velocity;
-	Vec3 spawn_pt;
-	Vec3 spawn_dir;
+};
+
+/* root of a strand in head space. It's kept apart from the simulated state,
+ * since it only changes when the head mesh deforms (see update_spawns) */
+struct HairSpawn {
+	Vec3 pt;
+	Vec3 dir;
+
+	/* spawn triangle (index in Mesh::indices / 3) and the barycentric
+	 * coordinates of pt in it */
+	int tri;
+	Vec3 bary;
+
+	/* stays with the strand while others are added and removed */
+	int id;
+};
+
+/* simulation output used by cull and draw. It's double buffered, so that
+ * the next update can run while the previous result is being drawn */
+struct HairFrame {
+	std::vector<Vec3> pos;
+	Mat4 xform;	/* head transform pos was simulated against */
+	int num_active;
+	float lod;
+	float lod_opaque;	/* strands past this fraction fade out towards lod */
+	bool at_rest;
+};
+
+/* substepping counters, see Hair::get_step_stats */
+struct HairStepStats {
+	long updates;		/* simulated updates */
+	long substeps;		/* substeps taken, by the busiest block of each update */
+	long refined;		/* blocks which needed more substeps than planned */
+	long clamps;		/* strands which hit a runaway limit */
+	int last_substeps;	/* substeps of the last update */
 };
 
 class Hair {
 private:
-	float hair_length;
+	HairParams params;
 	std::vector<HairStrand> hair;
+	std::vector<HairSpawn> spawns;
+	/* spawns quantized for the update kernel, with the compact param */
+	std::vector<KernSpawn> packed_spawns;
 	Mat4 xform;
 	std::vector<CollSphere *> colliders;
+	std::vector<CollSphere *> own_colliders;	/* allocated by load_state */
+
+	/* motion statistics of the last update, see at_rest */
+	float max_speed;
+	float max_stretch;
+
+	/* head space bounds of the strand roots, for bounding the anchor
+	 * motion between updates, and quantizing the packed spawns */
+	Aabb spawn_box;
+	HairStepStats step_stats;
+	/* fewest substeps to plan, raised by updates which needed more */
+	int substep_floor;
+
+	/* computes spawn_box and packed_spawns after the spawns change */
+	void prepare_spawns();
+	int plan_substeps(float dt) const;
+
+	/* level of detail: strands are stored in progressive (blue noise)
+	 * order, and only the first num_active are simulated and drawn */
+	float lod_target;
+	float lod;
+	/* the strands from lod_opaque to lod are drawn fading out, see
+	 * update_lod. It catches up with lod once the LOD settles */
+	float lod_opaque;
+	int num_active;
+
+	void update_lod(float dt);
+
+	HairFrame frames[2];
+	int front;
+	Mat4 draw_xform;
+
+	void simulate(float dt);
+	void reset_frames();
+	void flip();
+
+	/* collision field for COLL_SDF, in head space */
+	Sdf sdf;
+	bool have_sdf;
+	/* collision proxy for COLL_TREE, in head space */
+	SphereTree stree;
+	bool have_stree;
+
+	/* air velocity of the external forces, rebuilt by begin_step every
+	 * wind_interval updates of the kernels, and sampled at the strands in
+	 * turns after each build (see WIND_REFRESH). wind_vel has 3 per strand,
+	 * and is current for the first wind_valid strands */
+	WindGrid wind;
+	std::vector<float> wind_vel;
+	int wind_valid;
+	int wind_phase;
+	int wind_tick;	/* updates since the last build */
+	bool wind_fresh;	/* built in this update */
+
+	/* kernels picked by begin_step for the current params */
+	void (*step_update)(HairStrand *hair, const HairSpawn *spawns, const KernSpawn *packed,
+			const float *wind, int count, const KernParams *kp, KernStats *stats);
+	bool step_sdf;
+	bool step_tree;
+	bool step_wind;
+
+	/* simulate in parts, so that HairEnsemble can batch many instances */
+	bool begin_step(float dt, KernParams *kp, std::vector<KernSphere> *spheres);
+	void step_block(int start, int end, const KernParams *kp, const KernSphere *spheres,
+			int num_spheres, KernStats *stats);
+	void end_step(float dt, const KernStats &stats);
+
+	friend class HairEnsemble;
+
+	/* update_async worker */
+	pthread_t worker;
+	pthread_mutex_t job_mutex;
+	pthread_cond_t job_cond;
+	bool worker_running;
+	bool job_pending;
+	bool job_done;
+	bool worker_quit;
+	float job_dt;
+
+	static void *worker_func(void *cls);
+
+	/* baked animation cache, see hcache.h */
+	HCacheWriter *bake;
+	HCacheReader *playback;
+	float play_time;
+
+	uint32_t calc_strand_hash() const;
+	void play_frame(float dt);
+
+	/* shared memory export, see shmproto.h */
+	ShmExport *shm;
+	/* in double, in float the dt of a frame gets lost after a few days */
+	double sim_time;
+
+	void export_frame();
+	/* tells the readers that the strands changed, see ShmExport::relayout */
+	void relayout_export();
+
+	/* compacted indices of the strands which survived culling */
+	std::vector<int> visible;
+	int num_visible;
+	bool culled;
+
+	/* drawing: every frame the strands are tessellated into curves, in
+	 * blocks of TESS_BLOCK, and streamed to tess_vbo, which holds the
+	 * positions of all the points followed by their colors */
+	Vec3 view_pos;
+	float view_scale;
+	std::vector<KernCurve> tess_curves;
+	std::vector<int> tess_first, tess_count;	/* point range of each strand */
+	std::vector<int> tess_offs;	/* first point of each block */
+	std::vector<unsigned char> tess_scratch;	/* for when mapping fails */
+	unsigned int tess_vbo;
+	size_t tess_vbo_size;
+
+	/* grooming, see groom.cc. The index holds the roots on the undeformed
+	 * mesh, so it stays valid while the head is skinned */
+	int next_id;
+	std::vector<int> id_strand;	/* strand index of every id, -1 once removed */
+	float spawn_thresh;
+	const Mesh *groom_mesh;
+	kdtree *groom_index;	/* data is the id + 1 */
+	int groom_dead;	/* removed strands still in groom_index */
+	Bvh groom_bvh;
+
+	void reset_ids();
+	bool begin_groom(const Mesh *m);
+	void end_groom();
+	bool prepare_groom_bvh(const Mesh *m);
+	void build_groom_index();
+	bool rest_taken(const Vec3 &p, float dist) const;
+	void erase_strands(const std::vector<int> &idx);
+	void insert_strands(const std::vector<HairSpawn> &new_spawns, const std::vector<HairStrand> &new_hair);
 
 public:
 	Hair();
 	~Hair();
 
+	/* samples the strand roots on m, with the min_dist of the params */
 	bool init(const Mesh *m, int num_spawns, float thresh = 0.4);
-	void draw() const;
+	void draw();
+
+	/* camera for drawing: world space position, and pixels per world unit
+	 * at unit distance. Strands get fewer segments as they get smaller on
+	 * screen (see tess_pixels), with pixel_scale 0 all get tess_segs */
+	void set_view(const Vec3 &cam_pos, float pixel_scale);
 
+	/* re-evaluates the spawn points and directions from the (deformed)
+	 * mesh that was used in init */
+	void update_spawns(const Mesh *m);
+
+	/* grooming: edits of the strands which leave the simulation state of
+	 * the rest alone, instead of sampling everything again with init.
+	 * m is the mesh of init, regions are spheres in its current (skinned)
+	 * space. min_dist holds between the roots on the undeformed mesh.
+	 * Added strands are spread through the LOD order, so that the LOD
+	 * keeps the same fraction of them active as of the rest, and start at
+	 * rest. Each returns the number of strands added or removed */
+	int add_strands(const Mesh *m, const Vec3 &center, float radius, int count);
+	bool remove_strand(int id);
+	int remove_strands(const Vec3 &center, float radius);
+	/* thins out (factor < 1) or fills in (factor > 1) a region. Thinning
+	 * drops the strands last in the LOD order, so the rest stay spread */
+	int scale_density(const Mesh *m, const Vec3 &center, float radius, float factor);
+	/* ids are assigned in order by init and load_state */
+	int get_strand_id(int idx) const;
+	/* first point of m hit by the ray org + dir * t, t >= 0, in the space
+	 * of m, for picking the region of an edit */
+	bool pick(const Mesh *m, const Vec3 &org, const Vec3 &dir, Vec3 *pt);
+	/* pairs of strands with their roots on the undeformed m closer than
+	 * dist, counted by brute force, to check the spacing of the edits */
+	int count_close_roots(const Mesh *m, float dist) const;
+
+	/* head transform for the next update */
 	void set_transform(Mat4 &xform);
+	/* draws with a newer head transform than the one the current frame
+	 * was simulated against, carrying the strands rigidly along */
+	void latch_transform(const Mat4 &xform);
+
 	void update(float dt);
+	/* runs the update on a worker thread. Until sync returns, only draw,
+	 * cull and latch_transform may be called, and they keep using the
+	 * previous frame */
+	void update_async(float dt);
+	/* waits for update_async to finish and makes its result current */
+	void sync();
+
+	/* simulation parameters, applied on the next update */
+	void set_params(const HairParams &params);
+	const HairParams &get_params() const;
+	void set_hair_length(float len);
+	float get_hair_length() const;
+	void set_spring(float k_anc, float damping);
+
+	/* builds the signed distance field used with COLL_SDF from the head
+	 * mesh, at the sdf_res of the params */
+	bool build_sdf(const Mesh *m);
+	/* fits the sphere tree used with COLL_TREE to the head mesh, at the
+	 * sdf_res of the params. A tree cached in cache_fname for the same mesh
+	 * and resolution is loaded instead, and a newly fitted one is cached */
+	bool build_sphere_tree(const Mesh *m, const char *cache_fname = 0);
+
+	/* result of the last update, the positions of its first num_active
+	 * strands are valid */
+	const HairFrame *get_frame() const;
+
+	/* substeps and runaway clamps since the last reset_step_stats */
+	const HairStepStats &get_step_stats() const;
+	void reset_step_stats();
+
+	/* true if the last update barely moved any strand */
+	bool at_rest() const;
+
+	/* fraction of the strands to simulate and draw, the active strand
+	 * count follows it gradually */
+	void set_lod(float frac);
+	int get_num_active() const;
+
+	/* drops strands facing away from the camera or outside the view
+	 * frustum (world space planes, inside when dot(n, p) + d >= 0) from
+	 * the next draw. Must be called after update, every frame. */
+	void cull(const Vec3 &cam_pos, const Vec4 *planes);
+	void disable_culling();
+	int get_num_visible() const;
+	/* checkpoint of the full simulation state, in a versioned binary file
+	 * (see hairstate.cc). load_state replaces init, and restores the
+	 * colliders into the ones already added if their number matches. The
+	 * saved strands must be on triangles of m, the mesh init would get */
+	bool save_state(const char *fname);
+	bool load_state(const char *fname, const Mesh *m);
+
+	/* head space box the strands stay in, given the head bounding box */
+	Aabb calc_strand_bounds(const Aabb &bbox) const;
+
+	/* records every following update to a cache file. bbox is the head
+	 * bounding box, see calc_strand_bounds. While baking all strands are
+	 * simulated, regardless of the LOD */
+	bool start_bake(const char *fname, const Aabb &bbox);
+	bool end_bake();
+
+	/* replaces the simulation with the frames of a cache baked for the
+	 * same strands. Updates advance the playback time, looping */
+	bool start_playback(const char *fname);
+	void stop_playback();
+	bool is_playing() const;
+	/* head transform of the current frame, to follow a played back cache */
+	const Mat4 &get_frame_xform() const;
+
+	/* publishes the strand roots and tips of every following update to
+	 * the POSIX shared memory object name, for other processes */
+	bool start_export(const char *name);
+	void stop_export();
+
 	void add_collider(CollSphere *cobj);
 	Vec3 handle_collision(const Vec3 &v) const;
 };
@@ -0,0 +1,168 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hair_kern.h"
+#include "wind.h"
+
+const HairKernels *hair_kern = &kern_sse2;
+
+static const HairKernels *kern_table[NUM_KERN_ISA] = {
+	&kern_sse2, &kern_avx2, &kern_avx512
+};
+
+static bool cpu_has_isa(int isa)
+{
+	__builtin_cpu_init();
+
+	switch(isa) {
+	case KERN_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case KERN_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case KERN_AVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+			__builtin_cpu_supports("avx512dq");
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool select_kernels();
+
+bool kern_init()
+{
+	static int status = -1;
+	if(status == -1) {
+		status = select_kernels() ? 1 : 0;
+	}
+	return status == 1;
+}
+
+static bool select_kernels()
+{
+	const char *env = getenv("HAIR_ISA");
+	if(env) {
+		for(int i=0; i<NUM_KERN_ISA; i++) {
+			if(strcmp(env, kern_table[i]->name) == 0) {
+				if(!cpu_has_isa(i)) {
+					fprintf(stderr, "HAIR_ISA: this cpu doesn't support %s\n", env);
+					return false;
+				}
+				hair_kern = kern_table[i];
+				printf("hair kernels: %s (forced)\n", hair_kern->name);
+				return true;
+			}
+		}
+		fprintf(stderr, "HAIR_ISA: unknown instruction set %s, ignoring\n", env);
+	}
+
+	for(int i=NUM_KERN_ISA-1; i>=0; i--) {
+		if(cpu_has_isa(i)) {
+			hair_kern = kern_table[i];
+			break;
+		}
+	}
+	printf("hair kernels: %s\n", hair_kern->name);
+	return true;
+}
+
+const HairKernels *kern_get(int isa)
+{
+	if(isa < 0 || isa >= NUM_KERN_ISA || !cpu_has_isa(isa)) {
+		return 0;
+	}
+	return kern_table[isa];
+}
+
+static void store_xform(float *dst, const Mat4 &m)
+{
+	/* columns by transforming the basis, which doesn't depend on the
+	 * element layout of Mat4 */
+	Vec3 t = m * Vec3(0, 0, 0);
+	Vec3 col[3] = {m * Vec3(1, 0, 0) - t, m * Vec3(0, 1, 0) - t, m * Vec3(0, 0, 1) - t};
+
+	for(int i=0; i<3; i++) {
+		dst[i * 3] = col[i].x;
+		dst[i * 3 + 1] = col[i].y;
+		dst[i * 3 + 2] = col[i].z;
+	}
+	dst[9] = t.x;
+	dst[10] = t.y;
+	dst[11] = t.z;
+}
+
+void kern_set_xform(KernParams *kp, const Mat4 &xform)
+{
+	store_xform(kp->xform, xform);
+	store_xform(kp->inv_xform, inverse(xform));
+}
+
+void kern_set_tess_xform(KernTess *tp, const Mat4 &root_xform, const Mat4 &tip_xform)
+{
+	store_xform(tp->root_xform, root_xform);
+	store_xform(tp->tip_xform, tip_xform);
+}
+
+void kern_set_spawn_box(KernParams *kp, const Aabb &box)
+{
+	for(int i=0; i<3; i++) {
+		kp->spawn_origin[i] = box.v0[i];
+		kp->spawn_scale[i] = (box.v1[i] - box.v0[i]) / 65535.0f;
+	}
+}
+
+void kern_pack_spawns(KernSpawn *packed, const HairSpawn *spawns, int count, const Aabb &box)
+{
+	float qscale[3];
+	for(int i=0; i<3; i++) {
+		float ext = box.v1[i] - box.v0[i];
+		qscale[i] = ext > 0 ? 65535.0f / ext : 0.0f;
+	}
+
+#pragma omp parallel for schedule(static, 8192)
+	for(int i=0; i<count; i++) {
+		const HairSpawn *s = spawns + i;
+		KernSpawn *ks = packed + i;
+
+		for(int j=0; j<3; j++) {
+			float q = (s->pt[j] - box.v0[j]) * qscale[j] + 0.5f;
+			ks->pt[j] = q < 0 ? 0 : (q > 65535 ? 65535 : (uint16_t)q);
+		}
+
+		/* project to the octahedron, and fold the lower half over */
+		const Vec3 &d = s->dir;
+		float len1 = fabs(d.x) + fabs(d.y) + fabs(d.z);
+		float u = len1 > 0 ? d.x / len1 : 0;
+		float v = len1 > 0 ? d.y / len1 : 0;
+		if(d.z < 0) {
+			float fu = (1.0f - fabs(v)) * (u >= 0 ? 1.0f : -1.0f);
+			float fv = (1.0f - fabs(u)) * (v >= 0 ? 1.0f : -1.0f);
+			u = fu;
+			v = fv;
+		}
+		ks->dir[0] = (int16_t)floor(u * 32767.0f + 0.5f);
+		ks->dir[1] = (int16_t)floor(v * 32767.0f + 0.5f);
+	}
+}
+
+KernUpdateFunc kern_update_func(const HairKernels *kern, const HairParams &params)
+{
+	int integ = params.integrator >= 0 && params.integrator < NUM_INTEG ? params.integrator : 0;
+	bool halfspace = params.coll_mode != COLL_NONE;
+	bool damp = params.damping > 0;
+	bool wind = wind_enabled(params);
+	return kern->update[integ][halfspace][damp][params.compact][wind];
+}
+
+void kern_merge_stats(KernStats *dest, const KernStats &src)
+{
+	dest->max_speed_sq = src.max_speed_sq > dest->max_speed_sq ? src.max_speed_sq : dest->max_speed_sq;
+	dest->max_stretch_sq = src.max_stretch_sq > dest->max_stretch_sq ? src.max_stretch_sq : dest->max_stretch_sq;
+	dest->energy += src.energy;
+	dest->clamps += src.clamps;
+	dest->substeps = src.substeps > dest->substeps ? src.substeps : dest->substeps;
+	dest->refined += src.refined;
+}
@@ -0,0 +1,187 @@
+#ifndef HAIR_KERN_H_
+#define HAIR_KERN_H_
+
+#include "hair.h"
+
+/* The strand update and collision kernels are compiled once per instruction
+ * set (kern_<isa>.cc, see the Makefile) and picked at startup from cpuid.
+ * Setting HAIR_ISA to sse2, avx2 or avx512 forces a specific one.
+ *
+ * The update kernel is also specialized on the integrator, the half-space
+ * collision, damping, compact spawns and wind (see HairParams), so that the
+ * inner loop has no branches for them. kern_update_func picks one once per step.
+ */
+
+enum {
+	KERN_SSE2,
+	KERN_AVX2,
+	KERN_AVX512,
+
+	NUM_KERN_ISA
+};
+
+struct KernParams {
+	/* head transform and its inverse as 3 columns followed by the translation */
+	float xform[12];
+	float inv_xform[12];
+
+	float hair_length;
+	float k_anc;
+	float damping;
+	float wind_drag;
+	float dt;
+
+	/* runaway limits: faster strands are slowed down to max_speed, and
+	 * strands further than max_stretch from their anchor are reset */
+	float max_speed;
+	float max_stretch;
+
+	/* substeps per update planned by Hair::begin_step, and the most any
+	 * block may take. dt is the whole update */
+	int substeps;
+	int max_substeps;
+
+	/* dequantization of KernSpawn::pt: origin + pt * scale */
+	float spawn_origin[3];
+	float spawn_scale[3];
+};
+
+/* HairSpawn packed for the compact update kernels: the point in 16 bits per
+ * axis within the bounds of all the spawns, and the direction octahedral
+ * encoded in 2x16 bits. 10 bytes instead of 24 */
+struct KernSpawn {
+	uint16_t pt[3];
+	int16_t dir[2];
+};
+
+struct KernStats {
+	float max_speed_sq;
+	float max_stretch_sq;
+	float energy;	/* kinetic and spring energy, summed over the strands */
+	int clamps;	/* strands which hit a runaway limit */
+
+	/* filled in by Hair::step_block: substeps taken, and the number of
+	 * blocks which took more than planned */
+	int substeps;
+	int refined;
+};
+
+/* collision sphere in head space */
+struct KernSphere {
+	float x, y, z;
+	float radius;
+};
+
+/* signed distance grid in head space, negative inside. Sample (x, y, z) is
+ * at origin + (x, y, z) * cell, and stored at dist[(z * ysz + y) * xsz + x] */
+struct KernSdf {
+	const float *dist;
+	int xsz, ysz, zsz;
+	float origin[3];
+	float cell;
+};
+
+/* air velocity grid in world space, see WindGrid */
+struct KernWind {
+	const float *vel;
+	int xsz, ysz, zsz;
+	float origin[3];
+	float cell;
+};
+
+/* lattice cells after which the noise repeats, a power of two. Offsets
+ * into the noise can wrap to it and stay small enough for float precision */
+#define NOISE_PERIOD	256
+
+/* strand tessellation, all in world space. The roots are carried by
+ * root_xform (3 columns and the translation, like KernParams::xform), and
+ * the simulated tips by tip_xform */
+struct KernTess {
+	float root_xform[12];
+	float tip_xform[12];
+	float hair_length;
+
+	/* strands get hair_length * seg_scale / (distance to cam) segments,
+	 * 1 to max_segs of them. 0 gives all of them max_segs */
+	float cam[3];
+	float seg_scale;
+	int max_segs;
+
+	/* alpha of strand i: 1 - (i - fade_start) * fade_scale, in [0, 1] */
+	float fade_start;
+	float fade_scale;
+};
+
+/* cubic p(t) = ((a t + b) t + c) t + d of a strand, from the root at t = 0
+ * to the tip at t = 1 */
+struct KernCurve {
+	float a[3], b[3], c[3], d[3];
+	float alpha;
+	int segs;
+};
+
+/* reads the spawns from spawns, or from packed for the compact variants.
+ * The wind variants drag the strands towards the air velocity wind, 3
+ * floats per strand */
+typedef void (*KernUpdateFunc)(HairStrand *hair, const HairSpawn *spawns, const KernSpawn *packed,
+		const float *wind, int count, const KernParams *kp, KernStats *stats);
+
+struct HairKernels {
+	const char *name;
+
+	/* spring integration, by integrator, half-space collision on/off,
+	 * damping on/off, compact on/off and wind on/off */
+	KernUpdateFunc update[NUM_INTEG][2][2][2][2];
+	/* pushes strand tips out of the collision spheres */
+	void (*collide)(HairStrand *hair, int count, const KernParams *kp,
+			const KernSphere *spheres, int num_spheres);
+	/* pushes strand tips out of the signed distance field */
+	void (*collide_sdf)(HairStrand *hair, int count, const KernParams *kp, const KernSdf *sdf);
+	/* pushes strand tips out of the leaves of a head space sphere tree */
+	void (*collide_tree)(HairStrand *hair, int count, const KernParams *kp, const SphereNode *nodes);
+
+	/* air velocity at the strand tips, trilinear in the wind grid */
+	void (*sample_wind)(const HairStrand *hair, int count, const KernWind *wind, float *vel);
+	/* gradient noise in [-1, 1] at count points, repeating every
+	 * NOISE_PERIOD along each axis */
+	void (*noise)(const float *x, const float *y, const float *z, int count, float *res);
+	/* updates per wind grid build, more where the noise is slow, see
+	 * Hair::begin_step */
+	int wind_interval;
+
+	/* fits the curves of strands idx[start, start + count), or of
+	 * [start, start + count) if idx is null, and picks their segment counts */
+	void (*fit_curves)(const HairSpawn *spawns, const Vec3 *tips, const int *idx, int start,
+			int count, const KernTess *tp, KernCurve *curves);
+	/* evaluates the curves at segs + 1 points each, one after the other:
+	 * 3 floats of position, and the color in RGBA8, magenta at the root to
+	 * yellow at the tip. Returns the number of points */
+	int (*tessellate)(const KernCurve *curves, int count, float *pos, uint32_t *color);
+};
+
+extern const HairKernels kern_sse2;
+extern const HairKernels kern_avx2;
+extern const HairKernels kern_avx512;
+
+/* currently selected kernels, set by kern_init */
+extern const HairKernels *hair_kern;
+
+/* selects the kernels for this cpu (or HAIR_ISA), can be called repeatedly */
+bool kern_init();
+/* kernels for a specific instruction set, or null if the cpu lacks it */
+const HairKernels *kern_get(int isa);
+
+void kern_set_xform(KernParams *kp, const Mat4 &xform);
+void kern_set_tess_xform(KernTess *tp, const Mat4 &root_xform, const Mat4 &tip_xform);
+
+/* quantizes spawns within box, and sets the matching dequantization in kp */
+void kern_pack_spawns(KernSpawn *packed, const HairSpawn *spawns, int count, const Aabb &box);
+void kern_set_spawn_box(KernParams *kp, const Aabb &box);
+
+/* combines the stats of two sets of strands into dest */
+void kern_merge_stats(KernStats *dest, const KernStats &src);
+
+/* update kernel specialization for these parameters */
+KernUpdateFunc kern_update_func(const HairKernels *kern, const HairParams &params);
+
+#endif // HAIR_KERN_H_
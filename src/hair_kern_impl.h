@@ -0,0 +1,660 @@
+/* Kernel bodies, included by the kern_<isa>.cc files which are compiled with
+ * different -m flags. KERN_TABLE and KERN_NAME must be defined before
+ * including this.
+ *
+ * Only use plain arithmetic here: any inline function from a header that
+ * gets instantiated in these files may be picked by the linker for the rest
+ * of the program too, with instructions the cpu might not have.
+ */
+#include <math.h>
+#include <stdint.h>
+#include "hair_kern.h"
+
+template <int INTEG, bool HALFSPACE, bool DAMP, bool PACKED, bool WIND>
+static void update(HairStrand *hair, const HairSpawn *spawns, const KernSpawn *packed,
+		const float *wind, int count, const KernParams *kp, KernStats *stats)
+{
+	const float *m = kp->xform;
+	float len = kp->hair_length;
+	float k = kp->k_anc;
+	float damping = DAMP ? kp->damping : 0.0f;
+	float drag = WIND ? kp->wind_drag : 0.0f;
+	float dt = kp->dt;
+	float speed_lim = kp->max_speed;
+	float speed_lim_sq = speed_lim * speed_lim;
+	float stretch_lim_sq = kp->max_stretch * kp->max_stretch;
+	float max_speed_sq = 0;
+	float max_stretch_sq = 0;
+	float energy = 0;
+	int clamps = 0;
+
+	/* the drag towards the air velocity w, drag * (w - v), is the same as
+	 * moving the anchor by drag / k * w and adding drag to the damping.
+	 * The strands then come to rest in steady wind, and the energy only
+	 * grows when a step is unstable, as without wind */
+	float wind_shift = WIND ? drag / k : 0.0f;
+	damping += drag;
+
+	/* backward Euler of the damped spring, solved for the new velocity:
+	 * v' = (v + dt * k * (anchor - x)) / (1 + dt * damping + dt^2 * k) */
+	float impl_scale = 1.0f / (1.0f + dt * damping + dt * dt * k);
+
+	const float *qo = kp->spawn_origin;
+	const float *qs = kp->spawn_scale;
+
+#pragma omp simd reduction(max:max_speed_sq, max_stretch_sq) reduction(+:energy, clamps)
+	for(int i=0; i<count; i++) {
+		HairStrand *s = hair + i;
+
+		float sx, sy, sz, dx, dy, dz;
+		if(PACKED) {
+			const KernSpawn *ks = packed + i;
+			sx = qo[0] + ks->pt[0] * qs[0];
+			sy = qo[1] + ks->pt[1] * qs[1];
+			sz = qo[2] + ks->pt[2] * qs[2];
+
+			/* unfold the octahedron, the length is normalized below */
+			dx = ks->dir[0] * (1.0f / 32767.0f);
+			dy = ks->dir[1] * (1.0f / 32767.0f);
+			dz = 1.0f - fabsf(dx) - fabsf(dy);
+			float fold = fmaxf(-dz, 0.0f);
+			dx -= copysignf(fold, dx);
+			dy -= copysignf(fold, dy);
+		} else {
+			const HairSpawn *sp = spawns + i;
+			sx = sp->pt.x;
+			sy = sp->pt.y;
+			sz = sp->pt.z;
+			dx = sp->dir.x;
+			dy = sp->dir.y;
+			dz = sp->dir.z;
+		}
+
+		/* root and direction in world space */
+		float rx = m[0] * sx + m[3] * sy + m[6] * sz + m[9];
+		float ry = m[1] * sx + m[4] * sy + m[7] * sz + m[10];
+		float rz = m[2] * sx + m[5] * sy + m[8] * sz + m[11];
+		float nx = m[0] * dx + m[3] * dy + m[6] * dz;
+		float ny = m[1] * dx + m[4] * dy + m[7] * dz;
+		float nz = m[2] * dx + m[5] * dy + m[8] * dz;
+		float ninv = 1.0f / sqrtf(nx * nx + ny * ny + nz * nz);
+		nx *= ninv;
+		ny *= ninv;
+		nz *= ninv;
+
+		/* the anchor is the tip of the hair in rest position */
+		float tx = rx + nx * len, ty = ry + ny * len, tz = rz + nz * len;
+		if(WIND) {
+			tx += wind[i * 3] * wind_shift;
+			ty += wind[i * 3 + 1] * wind_shift;
+			tz += wind[i * 3 + 2] * wind_shift;
+		}
+		float ax = tx - s->pos.x;
+		float ay = ty - s->pos.y;
+		float az = tz - s->pos.z;
+		float stretch_sq = ax * ax + ay * ay + az * az;
+
+		/* a strand which ran away (or went nan) starts over at rest at its
+		 * anchor, the comparison is false for nan */
+		bool runaway = !(stretch_sq <= stretch_lim_sq);
+		float ox = runaway ? tx : s->pos.x;
+		float oy = runaway ? ty : s->pos.y;
+		float oz = runaway ? tz : s->pos.z;
+		float ux = runaway ? 0.0f : s->velocity.x;
+		float uy = runaway ? 0.0f : s->velocity.y;
+		float uz = runaway ? 0.0f : s->velocity.z;
+		ax = runaway ? 0.0f : ax;
+		ay = runaway ? 0.0f : ay;
+		az = runaway ? 0.0f : az;
+		stretch_sq = runaway ? 0.0f : stretch_sq;
+		max_stretch_sq = stretch_sq > max_stretch_sq ? stretch_sq : max_stretch_sq;
+
+		/* mass 1 */
+		float vx, vy, vz;
+		if(INTEG == INTEG_IMPLICIT) {
+			vx = (ux + ax * k * dt) * impl_scale;
+			vy = (uy + ay * k * dt) * impl_scale;
+			vz = (uz + az * k * dt) * impl_scale;
+		} else if(DAMP || WIND) {
+			vx = ux + (ax * k - ux * damping) * dt;
+			vy = uy + (ay * k - uy * damping) * dt;
+			vz = uz + (az * k - uz * damping) * dt;
+		} else {
+			vx = ux + ax * k * dt;
+			vy = uy + ay * k * dt;
+			vz = uz + az * k * dt;
+		}
+		float speed_sq = vx * vx + vy * vy + vz * vz;
+
+		/* no strand moves further than the limit in one step */
+		bool fast = speed_sq > speed_lim_sq;
+		float vscale = fast ? speed_lim / sqrtf(speed_sq) : 1.0f;
+		vx *= vscale;
+		vy *= vscale;
+		vz *= vscale;
+		speed_sq = fast ? speed_lim_sq : speed_sq;
+		clamps += runaway || fast ? 1 : 0;
+
+		max_speed_sq = speed_sq > max_speed_sq ? speed_sq : max_speed_sq;
+		energy += 0.5f * (speed_sq + k * stretch_sq);
+
+		float px = ox + vx * dt;
+		float py = oy + vy * dt;
+		float pz = oz + vz * dt;
+
+		if(HALFSPACE) {
+			/* keep the hair out of the head, in the half-space above the root */
+			float d = (px - rx) * nx + (py - ry) * ny + (pz - rz) * nz;
+			d = d < 0 ? d : 0;
+			px -= d * nx;
+			py -= d * ny;
+			pz -= d * nz;
+		}
+		s->pos.x = px;
+		s->pos.y = py;
+		s->pos.z = pz;
+
+		s->velocity.x = vx;
+		s->velocity.y = vy;
+		s->velocity.z = vz;
+	}
+
+	stats->max_speed_sq = max_speed_sq;
+	stats->max_stretch_sq = max_stretch_sq;
+	stats->energy = energy;
+	stats->clamps = clamps;
+}
+
+#define COLL_BLOCK	256
+
+static void collide(HairStrand *hair, int count, const KernParams *kp,
+		const KernSphere *spheres, int num_spheres)
+{
+	const float *m = kp->xform;
+	const float *inv = kp->inv_xform;
+	float x[COLL_BLOCK], y[COLL_BLOCK], z[COLL_BLOCK];
+
+	/* work in head space, spheres would become spheroids if we transformed
+	 * them instead. Strands are processed in blocks, so that the loops over
+	 * the strands are the inner ones. */
+	for(int start=0; start<count; start+=COLL_BLOCK) {
+		HairStrand *blk = hair + start;
+		int num = count - start < COLL_BLOCK ? count - start : COLL_BLOCK;
+
+#pragma omp simd
+		for(int i=0; i<num; i++) {
+			float wx = blk[i].pos.x, wy = blk[i].pos.y, wz = blk[i].pos.z;
+			x[i] = inv[0] * wx + inv[3] * wy + inv[6] * wz + inv[9];
+			y[i] = inv[1] * wx + inv[4] * wy + inv[7] * wz + inv[10];
+			z[i] = inv[2] * wx + inv[5] * wy + inv[8] * wz + inv[11];
+		}
+
+		for(int j=0; j<num_spheres; j++) {
+			float cx = spheres[j].x;
+			float cy = spheres[j].y;
+			float cz = spheres[j].z;
+			float r = spheres[j].radius;
+
+#pragma omp simd
+			for(int i=0; i<num; i++) {
+				float dx = x[i] - cx;
+				float dy = y[i] - cy;
+				float dz = z[i] - cz;
+				float dsq = dx * dx + dy * dy + dz * dz;
+
+				float scale = dsq > 0 && dsq < r * r ? r / sqrtf(dsq) : 1.0f;
+				x[i] = cx + dx * scale;
+				y[i] = cy + dy * scale;
+				z[i] = cz + dz * scale;
+			}
+		}
+
+#pragma omp simd
+		for(int i=0; i<num; i++) {
+			blk[i].pos.x = m[0] * x[i] + m[3] * y[i] + m[6] * z[i] + m[9];
+			blk[i].pos.y = m[1] * x[i] + m[4] * y[i] + m[7] * z[i] + m[10];
+			blk[i].pos.z = m[2] * x[i] + m[5] * y[i] + m[8] * z[i] + m[11];
+		}
+	}
+}
+
+/* trilinear sample of the distance field, clamped to the grid. NaN fails
+ * the first test and lands inside too, but -ffast-math assumes there are
+ * none and may drop it, so the cell index is kept from going negative as
+ * well: x86 converts NaN to INT_MIN. Indexed from the grid start like
+ * wind_lerp, gcc doesn't vectorize the gathers through a pointer */
+static inline float sdf_sample(const KernSdf *sdf, float x, float y, float z)
+{
+	int xsz = sdf->xsz;
+	float xmax = xsz - 1.001f, ymax = sdf->ysz - 1.001f, zmax = sdf->zsz - 1.001f;
+	x = !(x >= 0) ? 0 : (x > xmax ? xmax : x);
+	y = !(y >= 0) ? 0 : (y > ymax ? ymax : y);
+	z = !(z >= 0) ? 0 : (z > zmax ? zmax : z);
+
+	int ix = (int)x, iy = (int)y, iz = (int)z;
+	float tx = x - ix, ty = y - iy, tz = z - iz;
+	ix = ix < 0 ? 0 : ix;
+	iy = iy < 0 ? 0 : iy;
+	iz = iz < 0 ? 0 : iz;
+
+	const float *d = sdf->dist;
+	int slice = xsz * sdf->ysz;
+	int idx = iz * slice + iy * xsz + ix;
+
+	float d00 = d[idx] + (d[idx + 1] - d[idx]) * tx;
+	float d10 = d[idx + xsz] + (d[idx + xsz + 1] - d[idx + xsz]) * tx;
+	float d01 = d[idx + slice] + (d[idx + slice + 1] - d[idx + slice]) * tx;
+	float d11 = d[idx + slice + xsz] + (d[idx + slice + xsz + 1] - d[idx + slice + xsz]) * tx;
+
+	float d0 = d00 + (d10 - d00) * ty;
+	float d1 = d01 + (d11 - d01) * ty;
+	return d0 + (d1 - d0) * tz;
+}
+
+static void collide_sdf(HairStrand *hair, int count, const KernParams *kp, const KernSdf *sdf)
+{
+	const float *m = kp->xform;
+	const float *inv = kp->inv_xform;
+	float cell = sdf->cell;
+	float inv_cell = 1.0f / cell;
+	float ox = sdf->origin[0], oy = sdf->origin[1], oz = sdf->origin[2];
+	float x[COLL_BLOCK], y[COLL_BLOCK], z[COLL_BLOCK], d[COLL_BLOCK];
+	int inside[COLL_BLOCK];
+	bool moved[COLL_BLOCK];
+
+	/* in blocks like sample_wind. Every strand needs the distance, but only
+	 * the few inside need the gradient, so those are packed to the front of
+	 * the block for a second, shorter loop, instead of taking six more
+	 * samples for all of them */
+	for(int start=0; start<count; start+=COLL_BLOCK) {
+		HairStrand *blk = hair + start;
+		int num = count - start < COLL_BLOCK ? count - start : COLL_BLOCK;
+
+		for(int i=0; i<num; i++) {
+			x[i] = blk[i].pos.x;
+			y[i] = blk[i].pos.y;
+			z[i] = blk[i].pos.z;
+		}
+
+#pragma omp simd
+		for(int i=0; i<num; i++) {
+			float wx = x[i], wy = y[i], wz = z[i];
+
+			/* grid coordinates */
+			x[i] = ((inv[0] * wx + inv[3] * wy + inv[6] * wz + inv[9]) - ox) * inv_cell;
+			y[i] = ((inv[1] * wx + inv[4] * wy + inv[7] * wz + inv[10]) - oy) * inv_cell;
+			z[i] = ((inv[2] * wx + inv[5] * wy + inv[8] * wz + inv[11]) - oz) * inv_cell;
+			d[i] = sdf_sample(sdf, x[i], y[i], z[i]);
+		}
+
+		int num_inside = 0;
+		for(int i=0; i<num; i++) {
+			if(d[i] < 0) {
+				x[num_inside] = x[i];
+				y[num_inside] = y[i];
+				z[num_inside] = z[i];
+				d[num_inside] = d[i];
+				inside[num_inside++] = i;
+			}
+		}
+
+#pragma omp simd
+		for(int i=0; i<num_inside; i++) {
+			float gx = x[i], gy = y[i], gz = z[i];
+
+			/* push out along the gradient, by central differences. It
+			 * vanishes deep inside, past the band, but the half-space test
+			 * keeps the strands from getting there */
+			float nx = sdf_sample(sdf, gx + 0.5f, gy, gz) - sdf_sample(sdf, gx - 0.5f, gy, gz);
+			float ny = sdf_sample(sdf, gx, gy + 0.5f, gz) - sdf_sample(sdf, gx, gy - 0.5f, gz);
+			float nz = sdf_sample(sdf, gx, gy, gz + 0.5f) - sdf_sample(sdf, gx, gy, gz - 0.5f);
+			float nlen_sq = nx * nx + ny * ny + nz * nz;
+			moved[i] = nlen_sq > 0;
+
+			float scale = moved[i] ? -d[i] * inv_cell / sqrtf(nlen_sq) : 0.0f;
+			float hx = ox + (gx + nx * scale) * cell;
+			float hy = oy + (gy + ny * scale) * cell;
+			float hz = oz + (gz + nz * scale) * cell;
+			x[i] = m[0] * hx + m[3] * hy + m[6] * hz + m[9];
+			y[i] = m[1] * hx + m[4] * hy + m[7] * hz + m[10];
+			z[i] = m[2] * hx + m[5] * hy + m[8] * hz + m[11];
+		}
+
+		for(int i=0; i<num_inside; i++) {
+			if(moved[i]) {
+				HairStrand *s = blk + inside[i];
+				s->pos.x = x[i];
+				s->pos.y = y[i];
+				s->pos.z = z[i];
+			}
+		}
+	}
+}
+
+static void collide_tree(HairStrand *hair, int count, const KernParams *kp, const SphereNode *nodes)
+{
+	const float *m = kp->xform;
+	const float *inv = kp->inv_xform;
+	int stack[STREE_STACK];
+
+	for(int i=0; i<count; i++) {
+		HairStrand *s = hair + i;
+		float wx = s->pos.x, wy = s->pos.y, wz = s->pos.z;
+		float x = inv[0] * wx + inv[3] * wy + inv[6] * wz + inv[9];
+		float y = inv[1] * wx + inv[4] * wy + inv[7] * wz + inv[10];
+		float z = inv[2] * wx + inv[5] * wy + inv[8] * wz + inv[11];
+		bool moved = false;
+
+		/* descend only into the nodes containing the tip */
+		int sp = 0;
+		stack[sp++] = 0;
+		while(sp > 0) {
+			const SphereNode *n = nodes + stack[--sp];
+			float dx = x - n->center[0];
+			float dy = y - n->center[1];
+			float dz = z - n->center[2];
+			float dsq = dx * dx + dy * dy + dz * dz;
+			float r = n->radius;
+			if(dsq >= r * r) continue;
+
+			if(n->num_child) {
+				for(int j=0; j<n->num_child; j++) {
+					stack[sp++] = n->child + j;
+				}
+			} else if(dsq > 0) {
+				float scale = r / sqrtf(dsq);
+				x = n->center[0] + dx * scale;
+				y = n->center[1] + dy * scale;
+				z = n->center[2] + dz * scale;
+				moved = true;
+			}
+		}
+
+		if(moved) {
+			s->pos.x = m[0] * x + m[3] * y + m[6] * z + m[9];
+			s->pos.y = m[1] * x + m[4] * y + m[7] * z + m[10];
+			s->pos.z = m[2] * x + m[5] * y + m[8] * z + m[11];
+		}
+	}
+}
+
+/* trilinear interpolation of one component of the wind grid, idx is the
+ * sample at the low corner, dy and dz the strides of a row and a slice */
+static inline float wind_lerp(const float *v, int idx, int dy, int dz, float tx, float ty, float tz)
+{
+	float v00 = v[idx] + (v[idx + 3] - v[idx]) * tx;
+	float v10 = v[idx + dy] + (v[idx + dy + 3] - v[idx + dy]) * tx;
+	float v01 = v[idx + dz] + (v[idx + dz + 3] - v[idx + dz]) * tx;
+	float v11 = v[idx + dy + dz] + (v[idx + dy + dz + 3] - v[idx + dy + dz]) * tx;
+
+	float v0 = v00 + (v10 - v00) * ty;
+	float v1 = v01 + (v11 - v01) * ty;
+	return v0 + (v1 - v0) * tz;
+}
+
+static void sample_wind(const HairStrand *hair, int count, const KernWind *wind, float *vel)
+{
+	const float *grid = wind->vel;
+	int xsz = wind->xsz, ysz = wind->ysz, zsz = wind->zsz;
+	int slice = xsz * ysz;
+	float inv_cell = 1.0f / wind->cell;
+	float ox = wind->origin[0], oy = wind->origin[1], oz = wind->origin[2];
+	float xmax = xsz - 1.001f, ymax = ysz - 1.001f, zmax = zsz - 1.001f;
+	float x[COLL_BLOCK], y[COLL_BLOCK], z[COLL_BLOCK];
+	float vx[COLL_BLOCK], vy[COLL_BLOCK], vz[COLL_BLOCK];
+
+	/* in blocks like collide, the positions alone don't vectorize, and
+	 * without AVX neither do the interleaved stores */
+	for(int start=0; start<count; start+=COLL_BLOCK) {
+		const HairStrand *blk = hair + start;
+		float *bvel = vel + start * 3;
+		int num = count - start < COLL_BLOCK ? count - start : COLL_BLOCK;
+
+		for(int i=0; i<num; i++) {
+			x[i] = blk[i].pos.x;
+			y[i] = blk[i].pos.y;
+			z[i] = blk[i].pos.z;
+		}
+
+#pragma omp simd
+		for(int i=0; i<num; i++) {
+			/* strands outside of the grid get the air at its boundary, and
+			 * NaN ones some cell inside it, see sdf_sample */
+			float gx = (x[i] - ox) * inv_cell;
+			float gy = (y[i] - oy) * inv_cell;
+			float gz = (z[i] - oz) * inv_cell;
+			gx = !(gx >= 0) ? 0 : (gx > xmax ? xmax : gx);
+			gy = !(gy >= 0) ? 0 : (gy > ymax ? ymax : gy);
+			gz = !(gz >= 0) ? 0 : (gz > zmax ? zmax : gz);
+
+			int ix = (int)gx, iy = (int)gy, iz = (int)gz;
+			float tx = gx - ix, ty = gy - iy, tz = gz - iz;
+			ix = ix < 0 ? 0 : ix;
+			iy = iy < 0 ? 0 : iy;
+			iz = iz < 0 ? 0 : iz;
+			int idx = (iz * slice + iy * xsz + ix) * 3;
+
+			vx[i] = wind_lerp(grid, idx, xsz * 3, slice * 3, tx, ty, tz);
+			vy[i] = wind_lerp(grid, idx + 1, xsz * 3, slice * 3, tx, ty, tz);
+			vz[i] = wind_lerp(grid, idx + 2, xsz * 3, slice * 3, tx, ty, tz);
+		}
+
+		for(int i=0; i<num; i++) {
+			bvel[i * 3] = vx[i];
+			bvel[i * 3 + 1] = vy[i];
+			bvel[i * 3 + 2] = vz[i];
+		}
+	}
+}
+
+#ifndef KERN_WIND_INTERVAL
+#define KERN_WIND_INTERVAL	1
+#endif
+
+#define NOISE_PX	0x8da6b343u
+#define NOISE_PY	0xd8163841u
+#define NOISE_PZ	0xcb1ab31fu
+
+/* offset from a lattice point dotted with a gradient in a cube. h is the
+ * sum of the coordinates times NOISE_P*, mixed here, and 10 bits of it give
+ * each component. The mix shifts and adds instead of multiplying, and the
+ * components are converted instead of picked, SSE2 has neither a 32 bit
+ * vector multiply nor blends. Scaled to the spread of the cube edge
+ * gradients of improved Perlin noise */
+static inline float noise_grad(uint32_t h, float x, float y, float z)
+{
+	h ^= h >> 15;
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+	h ^= h >> 7;
+	h += h << 5;
+
+	float gx = (float)(int)((h >> 22) & 0x3ff) - 511.5f;
+	float gy = (float)(int)((h >> 12) & 0x3ff) - 511.5f;
+	float gz = (float)(int)((h >> 2) & 0x3ff) - 511.5f;
+	return (gx * x + gy * y + gz * z) * (1.41421356f / 511.5f);
+}
+
+/* gradient noise with hashed gradients instead of a permutation table, so
+ * that it vectorizes without gathers */
+static void noise(const float *px, const float *py, const float *pz, int count, float *res)
+{
+#pragma omp simd
+	for(int i=0; i<count; i++) {
+		/* floor by truncation, floorf doesn't vectorize without SSE4.1 */
+		int ix = (int)px[i], iy = (int)py[i], iz = (int)pz[i];
+		ix -= px[i] < ix ? 1 : 0;
+		iy -= py[i] < iy ? 1 : 0;
+		iz -= pz[i] < iz ? 1 : 0;
+		float x = px[i] - ix, y = py[i] - iy, z = pz[i] - iz;
+
+		/* quintic fade, continuous second derivatives */
+		float sx = x * x * x * (x * (x * 6.0f - 15.0f) + 10.0f);
+		float sy = y * y * y * (y * (y * 6.0f - 15.0f) + 10.0f);
+		float sz = z * z * z * (z * (z * 6.0f - 15.0f) + 10.0f);
+
+		/* the corners share the products of the coordinates, which
+		 * wrap to the period */
+		uint32_t wx = (uint32_t)ix & (NOISE_PERIOD - 1);
+		uint32_t wy = (uint32_t)iy & (NOISE_PERIOD - 1);
+		uint32_t wz = (uint32_t)iz & (NOISE_PERIOD - 1);
+		uint32_t hx0 = wx * NOISE_PX, hx1 = wx == NOISE_PERIOD - 1 ? 0 : hx0 + NOISE_PX;
+		uint32_t hy0 = wy * NOISE_PY, hy1 = wy == NOISE_PERIOD - 1 ? 0 : hy0 + NOISE_PY;
+		uint32_t hz0 = wz * NOISE_PZ, hz1 = wz == NOISE_PERIOD - 1 ? 0 : hz0 + NOISE_PZ;
+
+		float g000 = noise_grad(hx0 + hy0 + hz0, x, y, z);
+		float g100 = noise_grad(hx1 + hy0 + hz0, x - 1, y, z);
+		float g010 = noise_grad(hx0 + hy1 + hz0, x, y - 1, z);
+		float g110 = noise_grad(hx1 + hy1 + hz0, x - 1, y - 1, z);
+		float g001 = noise_grad(hx0 + hy0 + hz1, x, y, z - 1);
+		float g101 = noise_grad(hx1 + hy0 + hz1, x - 1, y, z - 1);
+		float g011 = noise_grad(hx0 + hy1 + hz1, x, y - 1, z - 1);
+		float g111 = noise_grad(hx1 + hy1 + hz1, x - 1, y - 1, z - 1);
+
+		float g00 = g000 + (g100 - g000) * sx;
+		float g10 = g010 + (g110 - g010) * sx;
+		float g01 = g001 + (g101 - g001) * sx;
+		float g11 = g011 + (g111 - g011) * sx;
+		float g0 = g00 + (g10 - g00) * sy;
+		float g1 = g01 + (g11 - g01) * sy;
+		res[i] = g0 + (g1 - g0) * sz;
+	}
+}
+
+/* Catmull-Rom through the root and the tip, with phantom points before the
+ * root and past the tip: one which makes the curve leave the root along its
+ * direction, and one which continues the chord at the tip. A strand which
+ * points along its root direction comes out straight */
+static void fit_curves(const HairSpawn *spawns, const Vec3 *tips, const int *idx, int start,
+		int count, const KernTess *tp, KernCurve *curves)
+{
+	const float *r = tp->root_xform;
+	const float *m = tp->tip_xform;
+	float len = tp->hair_length;
+	float cam_x = tp->cam[0], cam_y = tp->cam[1], cam_z = tp->cam[2];
+	float seg_len = len * tp->seg_scale;
+	int max_segs = tp->max_segs;
+	float rx[COLL_BLOCK], ry[COLL_BLOCK], rz[COLL_BLOCK];
+	float nx[COLL_BLOCK], ny[COLL_BLOCK], nz[COLL_BLOCK];
+	float qx[COLL_BLOCK], qy[COLL_BLOCK], qz[COLL_BLOCK];
+	float si[COLL_BLOCK];
+
+	for(int bstart=0; bstart<count; bstart+=COLL_BLOCK) {
+		KernCurve *blk = curves + bstart;
+		int num = count - bstart < COLL_BLOCK ? count - bstart : COLL_BLOCK;
+
+		/* gather, the strands are picked out by idx */
+		for(int i=0; i<num; i++) {
+			int s = start + bstart + i;
+			if(idx) s = idx[s];
+			rx[i] = spawns[s].pt.x;
+			ry[i] = spawns[s].pt.y;
+			rz[i] = spawns[s].pt.z;
+			nx[i] = spawns[s].dir.x;
+			ny[i] = spawns[s].dir.y;
+			nz[i] = spawns[s].dir.z;
+			qx[i] = tips[s].x;
+			qy[i] = tips[s].y;
+			qz[i] = tips[s].z;
+			si[i] = s;
+		}
+
+#pragma omp simd
+		for(int i=0; i<num; i++) {
+			float px = r[0] * rx[i] + r[3] * ry[i] + r[6] * rz[i] + r[9];
+			float py = r[1] * rx[i] + r[4] * ry[i] + r[7] * rz[i] + r[10];
+			float pz = r[2] * rx[i] + r[5] * ry[i] + r[8] * rz[i] + r[11];
+			/* the head transform is rigid, the direction stays unit length */
+			float dx = (r[0] * nx[i] + r[3] * ny[i] + r[6] * nz[i]) * len;
+			float dy = (r[1] * nx[i] + r[4] * ny[i] + r[7] * nz[i]) * len;
+			float dz = (r[2] * nx[i] + r[5] * ny[i] + r[8] * nz[i]) * len;
+
+			/* the tip at hair_length from the root, towards the simulated one */
+			float cx = m[0] * qx[i] + m[3] * qy[i] + m[6] * qz[i] + m[9] - px;
+			float cy = m[1] * qx[i] + m[4] * qy[i] + m[7] * qz[i] + m[10] - py;
+			float cz = m[2] * qx[i] + m[5] * qy[i] + m[8] * qz[i] + m[11] - pz;
+			float clen_sq = cx * cx + cy * cy + cz * cz;
+			float s = clen_sq > 0 ? len / sqrtf(clen_sq) : 0;
+			cx = clen_sq > 0 ? cx * s : dx;
+			cy = clen_sq > 0 ? cy * s : dy;
+			cz = clen_sq > 0 ? cz * s : dz;
+
+			/* Hermite form, tangent d at the root and c at the tip */
+			blk[i].a[0] = dx - cx;
+			blk[i].a[1] = dy - cy;
+			blk[i].a[2] = dz - cz;
+			blk[i].b[0] = 2.0f * (cx - dx);
+			blk[i].b[1] = 2.0f * (cy - dy);
+			blk[i].b[2] = 2.0f * (cz - dz);
+			blk[i].c[0] = dx;
+			blk[i].c[1] = dy;
+			blk[i].c[2] = dz;
+			blk[i].d[0] = px;
+			blk[i].d[1] = py;
+			blk[i].d[2] = pz;
+
+			float vx = cam_x - px, vy = cam_y - py, vz = cam_z - pz;
+			float dist = sqrtf(vx * vx + vy * vy + vz * vz);
+			blk[i].segs = seg_len > 0 && seg_len < max_segs * dist ? (int)(seg_len / dist) + 1 : max_segs;
+
+			float alpha = 1.0f - (si[i] - tp->fade_start) * tp->fade_scale;
+			blk[i].alpha = alpha < 0 ? 0 : (alpha > 1 ? 1 : alpha);
+		}
+	}
+}
+
+static int tessellate(const KernCurve *curves, int count, float *pos, uint32_t *color)
+{
+	int total = 0;
+
+	/* vectorized along each strand, the points are independent */
+	for(int i=0; i<count; i++) {
+		const KernCurve *cv = curves + i;
+		float ax = cv->a[0], ay = cv->a[1], az = cv->a[2];
+		float bx = cv->b[0], by = cv->b[1], bz = cv->b[2];
+		float cx = cv->c[0], cy = cv->c[1], cz = cv->c[2];
+		float dx = cv->d[0], dy = cv->d[1], dz = cv->d[2];
+		int segs = cv->segs;
+		float dt = 1.0f / segs;
+		/* RGBA8 in memory, little endian */
+		uint32_t alpha = (uint32_t)(cv->alpha * 255.0f + 0.5f) << 24;
+
+#pragma omp simd
+		for(int j=0; j<=segs; j++) {
+			float t = j * dt;
+			pos[j * 3] = ((ax * t + bx) * t + cx) * t + dx;
+			pos[j * 3 + 1] = ((ay * t + by) * t + cy) * t + dy;
+			pos[j * 3 + 2] = ((az * t + bz) * t + cz) * t + dz;
+
+			uint32_t g = (uint32_t)(t * 255.0f + 0.5f);
+			color[j] = 0xff | g << 8 | (255 - g) << 16 | alpha;
+		}
+		pos += (segs + 1) * 3;
+		color += segs + 1;
+		total += segs + 1;
+	}
+	return total;
+}
+
+#define UPDATE_WIND(integ, hs, damp, packed) \
+	{update<integ, hs, damp, packed, false>, update<integ, hs, damp, packed, true>}
+
+#define UPDATE_VARIANTS(integ) \
+	{{{UPDATE_WIND(integ, false, false, false), UPDATE_WIND(integ, false, false, true)}, \
+	{UPDATE_WIND(integ, false, true, false), UPDATE_WIND(integ, false, true, true)}}, \
+	{{UPDATE_WIND(integ, true, false, false), UPDATE_WIND(integ, true, false, true)}, \
+	{UPDATE_WIND(integ, true, true, false), UPDATE_WIND(integ, true, true, true)}}}
+
+extern const HairKernels KERN_TABLE = {
+	KERN_NAME,
+	{UPDATE_VARIANTS(INTEG_SYMPLECTIC), UPDATE_VARIANTS(INTEG_IMPLICIT)},
+	collide,
+	collide_sdf,
+	collide_tree,
+	sample_wind,
+	noise,
+	KERN_WIND_INTERVAL,
+	fit_curves,
+	tessellate
+};
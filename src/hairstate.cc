@@ -0,0 +1,290 @@
+/* Hair simulation state checkpoints.
+ *
+ * File layout, all in the byte order of the writer (checked with the endian
+ * field), sections aligned to STATE_ALIGN bytes so the file can be used
+ * straight from a memory mapping:
+ *   StateHeader
+ *   num_colliders x StateCollider, at collider_offs
+ *   num_strands x StateStrand, at strand_offs
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hair.h"
+#include "hair_kern.h"
+
+#define STATE_MAGIC		"HAIRSTAT"
+#define STATE_VERSION	1
+#define STATE_ENDIAN	0x01020304
+#define STATE_ALIGN		64
+
+struct StateHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+
+	uint32_t num_strands;
+	uint32_t num_active;
+	uint32_t num_colliders;
+	uint32_t pad;
+	uint64_t collider_offs;
+	uint64_t strand_offs;
+
+	float hair_length;
+	float lod;
+	float lod_target;
+	float xform[16];
+};
+
+struct StateCollider {
+	float center[3];
+	float radius;
+};
+
+struct StateStrand {
+	float pos[3];
+	float velocity[3];
+	float spawn_pt[3];
+	float spawn_dir[3];
+	int32_t tri;
+	float bary[3];
+};
+
+static uint64_t align_offs(uint64_t offs)
+{
+	return (offs + STATE_ALIGN - 1) & ~(uint64_t)(STATE_ALIGN - 1);
+}
+
+static void copy_vec(float *dst, const Vec3 &v)
+{
+	dst[0] = v.x;
+	dst[1] = v.y;
+	dst[2] = v.z;
+}
+
+static bool write_pad(FILE *fp, uint64_t offs)
+{
+	static const char zeros[STATE_ALIGN] = {0};
+	long cur = ftell(fp);
+	return cur <= (long)offs && fwrite(zeros, 1, offs - cur, fp) == offs - cur;
+}
+
+bool Hair::save_state(const char *fname)
+{
+	sync();
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	StateHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, STATE_MAGIC, sizeof hdr.magic);
+	hdr.version = STATE_VERSION;
+	hdr.endian = STATE_ENDIAN;
+	hdr.num_strands = hair.size();
+	hdr.num_active = num_active;
+	hdr.num_colliders = colliders.size();
+	hdr.collider_offs = align_offs(sizeof hdr);
+	hdr.strand_offs = align_offs(hdr.collider_offs + colliders.size() * sizeof(StateCollider));
+	hdr.hair_length = params.hair_length;
+	hdr.lod = lod;
+	hdr.lod_target = lod_target;
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			hdr.xform[i * 4 + j] = xform[i][j];
+		}
+	}
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1 || !write_pad(fp, hdr.collider_offs)) {
+		goto err;
+	}
+
+	for(size_t i=0; i<colliders.size(); i++) {
+		StateCollider col;
+		copy_vec(col.center, colliders[i]->center);
+		col.radius = colliders[i]->radius;
+		if(fwrite(&col, sizeof col, 1, fp) != 1) {
+			goto err;
+		}
+	}
+	if(!write_pad(fp, hdr.strand_offs)) {
+		goto err;
+	}
+
+	{
+		const int chunk_size = 4096;
+		StateStrand chunk[chunk_size];
+
+		for(size_t start=0; start<hair.size(); start+=chunk_size) {
+			int num = hair.size() - start < (size_t)chunk_size ? hair.size() - start : chunk_size;
+
+			for(int i=0; i<num; i++) {
+				const HairStrand &s = hair[start + i];
+				const HairSpawn &sp = spawns[start + i];
+				StateStrand *rec = chunk + i;
+				copy_vec(rec->pos, s.pos);
+				copy_vec(rec->velocity, s.velocity);
+				copy_vec(rec->spawn_pt, sp.pt);
+				copy_vec(rec->spawn_dir, sp.dir);
+				rec->tri = sp.tri;
+				copy_vec(rec->bary, sp.bary);
+			}
+			if(fwrite(chunk, sizeof *chunk, num, fp) != (size_t)num) {
+				goto err;
+			}
+		}
+	}
+
+	if(fclose(fp) != 0) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		return false;
+	}
+	return true;
+
+err:
+	fprintf(stderr, "failed to write %s\n", fname);
+	fclose(fp);
+	return false;
+}
+
+bool Hair::load_state(const char *fname, const Mesh *m)
+{
+	int fd;
+	struct stat st;
+	void *map;
+
+	if(!kern_init()) {
+		return false;
+	}
+	sync();
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s\n", fname);
+		return false;
+	}
+	fstat(fd, &st);
+
+	if((size_t)st.st_size < sizeof(StateHeader)) {
+		fprintf(stderr, "%s: not a hair state file\n", fname);
+		close(fd);
+		return false;
+	}
+
+	map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s\n", fname);
+		return false;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	const char *data = (const char*)map;
+	uint64_t size = st.st_size;
+	const StateHeader *hdr = (const StateHeader*)data;
+
+	if(memcmp(hdr->magic, STATE_MAGIC, sizeof hdr->magic) != 0) {
+		fprintf(stderr, "%s: not a hair state file\n", fname);
+		goto err;
+	}
+	if(hdr->endian != STATE_ENDIAN) {
+		fprintf(stderr, "%s: written on a machine with different byte order\n", fname);
+		goto err;
+	}
+	if(hdr->version != STATE_VERSION) {
+		fprintf(stderr, "%s: unsupported version %u\n", fname, hdr->version);
+		goto err;
+	}
+	/* subtract instead of adding the offsets to the section sizes, a
+	 * corrupted offset near 2^64 would wrap around the sum */
+	if(hdr->num_active > hdr->num_strands ||
+			hdr->collider_offs > size || hdr->strand_offs > size ||
+			hdr->num_colliders > (size - hdr->collider_offs) / sizeof(StateCollider) ||
+			hdr->num_strands > (size - hdr->strand_offs) / sizeof(StateStrand)) {
+		fprintf(stderr, "%s: truncated or corrupted\n", fname);
+		goto err;
+	}
+
+	/* the spawn triangles index the mesh we are restored onto, a state
+	 * saved with a different head would read past its index buffer */
+	{
+		const StateStrand *rec = (const StateStrand*)(data + hdr->strand_offs);
+		int num_tris = m->indices.size() / 3;
+		for(uint32_t i=0; i<hdr->num_strands; i++) {
+			if(rec[i].tri < 0 || rec[i].tri >= num_tris) {
+				fprintf(stderr, "%s: strand %u is on triangle %d, the mesh has %d\n",
+						fname, i, (int)rec[i].tri, num_tris);
+				goto err;
+			}
+		}
+	}
+
+	params.hair_length = hdr->hair_length;
+	lod = hdr->lod;
+	lod_target = hdr->lod_target;
+	lod_opaque = lod;
+	num_active = hdr->num_active;
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			xform[i][j] = hdr->xform[i * 4 + j];
+		}
+	}
+
+	{
+		const StateCollider *col = (const StateCollider*)(data + hdr->collider_offs);
+		int num_col = hdr->num_colliders;
+
+		if(!colliders.empty() && (int)colliders.size() != num_col) {
+			fprintf(stderr, "%s: %d colliders saved, %d present, keeping the current ones\n",
+					fname, num_col, (int)colliders.size());
+		} else {
+			for(int i=0; i<num_col; i++) {
+				if(i >= (int)colliders.size()) {
+					CollSphere *cs = new CollSphere;
+					own_colliders.push_back(cs);
+					colliders.push_back(cs);
+				}
+				colliders[i]->center = Vec3(col[i].center[0], col[i].center[1], col[i].center[2]);
+				colliders[i]->radius = col[i].radius;
+			}
+		}
+	}
+
+	{
+		const StateStrand *rec = (const StateStrand*)(data + hdr->strand_offs);
+		int num = hdr->num_strands;
+		hair.resize(num);
+		spawns.resize(num);
+
+#pragma omp parallel for schedule(static, 8192)
+		for(int i=0; i<num; i++) {
+			HairStrand *s = &hair[i];
+			HairSpawn *sp = &spawns[i];
+			const StateStrand *r = rec + i;
+			s->pos = Vec3(r->pos[0], r->pos[1], r->pos[2]);
+			s->velocity = Vec3(r->velocity[0], r->velocity[1], r->velocity[2]);
+			sp->pt = Vec3(r->spawn_pt[0], r->spawn_pt[1], r->spawn_pt[2]);
+			sp->dir = Vec3(r->spawn_dir[0], r->spawn_dir[1], r->spawn_dir[2]);
+			sp->tri = r->tri;
+			sp->bary = Vec3(r->bary[0], r->bary[1], r->bary[2]);
+		}
+	}
+	munmap(map, st.st_size);
+
+	prepare_spawns();
+	reset_ids();
+	reset_frames();
+	culled = false;
+	return true;
+
+err:
+	munmap(map, st.st_size);
+	return false;
+}
@@ -0,0 +1,510 @@
+#include <math.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hcache.h"
+#include "hair_kern.h"
+
+#define HCACHE_MAGIC	"HAIRBAKE"
+#define HCACHE_VERSION	1
+#define HCACHE_ENDIAN	0x01020304
+
+/* worst case encoded size of a strand: 3 components of up to 3 bytes */
+#define MAX_STRAND_BYTES	9
+
+static int encode_block(const uint16_t *cur, const uint16_t *prev, int num, unsigned char *out);
+static const unsigned char *decode_block(const unsigned char *src, const unsigned char *end,
+		uint16_t *cur, int num, bool key);
+static void store_matrix(float *dst, const Mat4 &m);
+static Mat4 load_matrix(const float *src);
+
+HCacheWriter::HCacheWriter()
+{
+	fp = 0;
+	num_strands = 0;
+	strand_hash = 0;
+	time = 0;
+	num_clipped = 0;
+}
+
+HCacheWriter::~HCacheWriter()
+{
+	if(fp) close();
+}
+
+bool HCacheWriter::open(const char *fname, int num_strands, uint32_t strand_hash, const Aabb &bounds)
+{
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	this->num_strands = num_strands;
+	this->strand_hash = strand_hash;
+	this->bounds = bounds;
+	bmin = bounds.v0;
+	Vec3 ext = bounds.v1 - bounds.v0;
+	for(int i=0; i<3; i++) {
+		bscale[i] = ext[i] > 0 ? 65535.0 / ext[i] : 0;
+	}
+
+	prev.resize(num_strands * 3);
+	cur.resize(num_strands * 3);
+	blocks.resize((num_strands + HCACHE_BLOCK - 1) / HCACHE_BLOCK);
+	frames.clear();
+	time = 0;
+	num_clipped = 0;
+
+	/* placeholder, rewritten by close */
+	HCacheHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		fclose(fp);
+		fp = 0;
+		return false;
+	}
+	return true;
+}
+
+bool HCacheWriter::write_frame(const Vec3 *pos, const Mat4 &xform, float dt)
+{
+	if(!fp) return false;
+
+	int idx = frames.size();
+	bool key = idx % HCACHE_CHUNK_FRAMES == 0;
+	int num_blocks = blocks.size();
+
+	long clipped = quantize_positions(pos, num_strands, xform, bmin, bscale, &cur[0]);
+	num_clipped += clipped;
+
+	std::vector<uint32_t> block_offs(num_blocks + 1);
+
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_blocks; i++) {
+		int start = i * HCACHE_BLOCK;
+		int num = num_strands - start < HCACHE_BLOCK ? num_strands - start : HCACHE_BLOCK;
+
+		blocks[i].resize(num * MAX_STRAND_BYTES);
+		int size = encode_block(&cur[start * 3], key ? 0 : &prev[start * 3], num, &blocks[i][0]);
+		blocks[i].resize(size);
+	}
+
+	uint32_t offs = (num_blocks + 1) * sizeof(uint32_t);
+	for(int i=0; i<num_blocks; i++) {
+		block_offs[i] = offs;
+		offs += blocks[i].size();
+	}
+	block_offs[num_blocks] = offs;
+
+	HCacheFrame frm;
+	frm.offs = ftell(fp);
+	frm.size = offs;
+	frm.time = time;
+	store_matrix(frm.xform, xform);
+
+	if(fwrite(&block_offs[0], sizeof(uint32_t), num_blocks + 1, fp) != (size_t)num_blocks + 1) {
+		return false;
+	}
+	for(int i=0; i<num_blocks; i++) {
+		if(!blocks[i].empty() && fwrite(&blocks[i][0], 1, blocks[i].size(), fp) != blocks[i].size()) {
+			return false;
+		}
+	}
+
+	frames.push_back(frm);
+	prev.swap(cur);
+	time += dt;
+	return true;
+}
+
+bool HCacheWriter::close()
+{
+	if(!fp) return false;
+
+	HCacheHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, HCACHE_MAGIC, sizeof hdr.magic);
+	hdr.version = HCACHE_VERSION;
+	hdr.endian = HCACHE_ENDIAN;
+	hdr.num_strands = num_strands;
+	hdr.num_frames = frames.size();
+	hdr.chunk_frames = HCACHE_CHUNK_FRAMES;
+	hdr.block_size = HCACHE_BLOCK;
+	hdr.strand_hash = strand_hash;
+	for(int i=0; i<3; i++) {
+		hdr.bmin[i] = bounds.v0[i];
+		hdr.bmax[i] = bounds.v1[i];
+	}
+
+	/* keep the index 8-byte aligned for the reader */
+	long offs = ftell(fp);
+	while(offs & 7) {
+		fputc(0, fp);
+		offs++;
+	}
+	hdr.index_offs = offs;
+
+	bool res = true;
+	if(!frames.empty() && fwrite(&frames[0], sizeof(HCacheFrame), frames.size(), fp) != frames.size()) {
+		res = false;
+	}
+	if(fseek(fp, 0, SEEK_SET) == -1 || fwrite(&hdr, sizeof hdr, 1, fp) != 1) {
+		res = false;
+	}
+	if(fclose(fp) != 0) {
+		res = false;
+	}
+	fp = 0;
+
+	if(!res) {
+		fprintf(stderr, "failed to write the hair cache\n");
+	}
+	if(num_clipped) {
+		fprintf(stderr, "hair cache: %ld positions were outside the bounds and got clamped\n", num_clipped);
+	}
+	return res;
+}
+
+
+HCacheReader::HCacheReader()
+{
+	map = 0;
+	map_size = 0;
+	hdr = 0;
+	frames = 0;
+	cur_frame = cur_chunk = -1;
+}
+
+HCacheReader::~HCacheReader()
+{
+	close();
+}
+
+bool HCacheReader::open(const char *fname)
+{
+	int fd;
+	struct stat st;
+
+	close();
+
+	if((fd = ::open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "failed to open %s\n", fname);
+		return false;
+	}
+	fstat(fd, &st);
+	map_size = st.st_size;
+
+	if(map_size < sizeof(HCacheHeader)) {
+		fprintf(stderr, "%s: not a hair cache\n", fname);
+		::close(fd);
+		return false;
+	}
+
+	void *ptr = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(ptr == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s\n", fname);
+		return false;
+	}
+	map = (const unsigned char*)ptr;
+	hdr = (const HCacheHeader*)map;
+
+	if(memcmp(hdr->magic, HCACHE_MAGIC, sizeof hdr->magic) != 0 || hdr->endian != HCACHE_ENDIAN ||
+			hdr->version != HCACHE_VERSION) {
+		fprintf(stderr, "%s: not a hair cache, or unsupported version\n", fname);
+		close();
+		return false;
+	}
+	if(!hdr->num_frames || !hdr->chunk_frames || hdr->block_size != HCACHE_BLOCK ||
+			hdr->index_offs > map_size ||
+			hdr->num_frames > (map_size - hdr->index_offs) / sizeof(HCacheFrame)) {
+		fprintf(stderr, "%s: truncated or corrupted\n", fname);
+		close();
+		return false;
+	}
+	frames = (const HCacheFrame*)(map + hdr->index_offs);
+
+	/* every frame must fit in the file with room for its block offset table,
+	 * decode_frame and release_chunk address the map through these */
+	{
+		uint64_t table_size = (uint64_t)(num_frame_blocks() + 1) * sizeof(uint32_t);
+		for(uint32_t i=0; i<hdr->num_frames; i++) {
+			if(frames[i].offs > map_size || frames[i].size > map_size - frames[i].offs ||
+					frames[i].size < table_size) {
+				fprintf(stderr, "%s: frame %u out of bounds\n", fname, i);
+				close();
+				return false;
+			}
+		}
+	}
+
+	bmin = Vec3(hdr->bmin[0], hdr->bmin[1], hdr->bmin[2]);
+	for(int i=0; i<3; i++) {
+		bstep[i] = (hdr->bmax[i] - hdr->bmin[i]) / 65535.0;
+	}
+
+	cur.resize(hdr->num_strands * 3);
+	cur_frame = cur_chunk = -1;
+
+	/* frames are streamed in order, the kernel can read ahead */
+	madvise(ptr, map_size, MADV_SEQUENTIAL);
+	return true;
+}
+
+void HCacheReader::close()
+{
+	if(map) {
+		munmap((void*)map, map_size);
+		map = 0;
+	}
+	hdr = 0;
+	frames = 0;
+	cur.clear();
+	cur_frame = cur_chunk = -1;
+}
+
+int HCacheReader::get_num_strands() const
+{
+	return hdr ? hdr->num_strands : 0;
+}
+
+int HCacheReader::get_num_frames() const
+{
+	return hdr ? hdr->num_frames : 0;
+}
+
+uint32_t HCacheReader::get_strand_hash() const
+{
+	return hdr ? hdr->strand_hash : 0;
+}
+
+float HCacheReader::get_duration() const
+{
+	if(!hdr) return 0;
+
+	int last = hdr->num_frames - 1;
+	/* the last frame lasts as long as the one before it */
+	float last_dt = last > 0 ? frames[last].time - frames[last - 1].time : 0;
+	return frames[last].time + last_dt;
+}
+
+int HCacheReader::frame_at(float t) const
+{
+	if(!hdr) return -1;
+
+	float dur = get_duration();
+	if(dur > 0) {
+		t = fmod(t, dur);
+	}
+
+	/* binary search for the last frame starting before t */
+	int lo = 0, hi = hdr->num_frames - 1;
+	while(lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if(frames[mid].time <= t) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+Mat4 HCacheReader::read_frame(int idx, Vec3 *pos)
+{
+	if(idx != cur_frame) {
+		int chunk_frames = hdr->chunk_frames;
+
+		if(idx != cur_frame + 1 || idx % chunk_frames == 0) {
+			/* not the next one, start from its keyframe */
+			int key = idx - idx % chunk_frames;
+			for(int i=key; i<idx; i++) {
+				decode_frame(i);
+			}
+		}
+		decode_frame(idx);
+	}
+
+	const HCacheFrame *frm = frames + idx;
+	Mat4 xform = load_matrix(frm->xform);
+
+	KernParams kp;
+	kern_set_xform(&kp, xform);
+	const float *m = kp.xform;
+	int num = hdr->num_strands;
+
+#pragma omp parallel for schedule(static, 4096)
+	for(int i=0; i<num; i++) {
+		float x = bmin.x + cur[i * 3] * bstep.x;
+		float y = bmin.y + cur[i * 3 + 1] * bstep.y;
+		float z = bmin.z + cur[i * 3 + 2] * bstep.z;
+
+		pos[i].x = m[0] * x + m[3] * y + m[6] * z + m[9];
+		pos[i].y = m[1] * x + m[4] * y + m[7] * z + m[10];
+		pos[i].z = m[2] * x + m[5] * y + m[8] * z + m[11];
+	}
+	return xform;
+}
+
+int HCacheReader::num_frame_blocks() const
+{
+	return (hdr->num_strands + HCACHE_BLOCK - 1) / HCACHE_BLOCK;
+}
+
+bool HCacheReader::decode_frame(int idx)
+{
+	const HCacheFrame *frm = frames + idx;
+	const unsigned char *data = map + frm->offs;
+	const uint32_t *block_offs = (const uint32_t*)data;
+	bool key = idx % hdr->chunk_frames == 0;
+	int num_strands = hdr->num_strands;
+	int num_blocks = num_frame_blocks();
+
+	/* the blocks follow the offset table in order, and the extra last offset
+	 * is the end of the frame. open checked the frame is inside the map */
+	bool valid = block_offs[0] >= (num_blocks + 1) * sizeof(uint32_t) &&
+		block_offs[num_blocks] <= frm->size;
+	for(int i=0; i<num_blocks && valid; i++) {
+		valid = block_offs[i] <= block_offs[i + 1];
+	}
+	if(!valid) {
+		fprintf(stderr, "hair cache frame %d: corrupted block offsets\n", idx);
+	}
+
+	if(valid) {
+		int failed = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+		for(int i=0; i<num_blocks; i++) {
+			int start = i * HCACHE_BLOCK;
+			int num = num_strands - start < HCACHE_BLOCK ? num_strands - start : HCACHE_BLOCK;
+			if(!decode_block(data + block_offs[i], data + block_offs[i + 1], &cur[start * 3], num, key)) {
+				failed++;
+			}
+		}
+		if(failed) {
+			fprintf(stderr, "hair cache frame %d: %d truncated blocks\n", idx, failed);
+			valid = false;
+		}
+	}
+	cur_frame = idx;
+
+	/* drop the pages of the chunk we left, to keep memory use flat */
+	int chunk = idx / hdr->chunk_frames;
+	if(chunk != cur_chunk) {
+		if(cur_chunk >= 0) {
+			release_chunk(cur_chunk);
+		}
+		cur_chunk = chunk;
+	}
+	return valid;
+}
+
+void HCacheReader::release_chunk(int chunk)
+{
+	int first = chunk * hdr->chunk_frames;
+	int last = first + hdr->chunk_frames - 1;
+	if(last >= (int)hdr->num_frames) {
+		last = hdr->num_frames - 1;
+	}
+
+	long pgsz = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)(map + frames[first].offs);
+	uintptr_t end = (uintptr_t)(map + frames[last].offs + frames[last].size);
+	start = (start + pgsz - 1) & ~(uintptr_t)(pgsz - 1);
+	end &= ~(uintptr_t)(pgsz - 1);
+
+	if(end > start) {
+		madvise((void*)start, end - start, MADV_DONTNEED);
+	}
+}
+
+long quantize_positions(const Vec3 *pos, int num, const Mat4 &xform, const Vec3 &bmin,
+		const Vec3 &scale, uint16_t *out)
+{
+	KernParams kp;
+	kern_set_xform(&kp, xform);
+	const float *inv = kp.inv_xform;
+	long clipped = 0;
+
+#pragma omp parallel for schedule(static, 4096) reduction(+:clipped)
+	for(int i=0; i<num; i++) {
+		const Vec3 &p = pos[i];
+		float lp[3];
+		lp[0] = inv[0] * p.x + inv[3] * p.y + inv[6] * p.z + inv[9];
+		lp[1] = inv[1] * p.x + inv[4] * p.y + inv[7] * p.z + inv[10];
+		lp[2] = inv[2] * p.x + inv[5] * p.y + inv[8] * p.z + inv[11];
+
+		for(int j=0; j<3; j++) {
+			float q = (lp[j] - bmin[j]) * scale[j] + 0.5;
+			if(q < 0 || q > 65535.5) {
+				clipped++;
+			}
+			out[i * 3 + j] = q < 0 ? 0 : (q > 65535 ? 65535 : (uint16_t)q);
+		}
+	}
+	return clipped;
+}
+
+static int encode_block(const uint16_t *cur, const uint16_t *prev, int num, unsigned char *out)
+{
+	unsigned char *ptr = out;
+
+	for(int i=0; i<num * 3; i++) {
+		int delta = (int)cur[i] - (prev ? (int)prev[i] : 0);
+		unsigned int zz = (unsigned int)((delta << 1) ^ (delta >> 31));
+
+		while(zz >= 0x80) {
+			*ptr++ = (zz & 0x7f) | 0x80;
+			zz >>= 7;
+		}
+		*ptr++ = zz;
+	}
+	return ptr - out;
+}
+
+/* returns 0 if the block runs past end, what was decoded up to there is kept */
+static const unsigned char *decode_block(const unsigned char *src, const unsigned char *end,
+		uint16_t *cur, int num, bool key)
+{
+	for(int i=0; i<num * 3; i++) {
+		unsigned int zz = 0;
+		int shift = 0;
+		unsigned char c;
+		do {
+			if(src >= end || shift > 28) {
+				return 0;
+			}
+			c = *src++;
+			zz |= (c & 0x7f) << shift;
+			shift += 7;
+		} while(c & 0x80);
+
+		int delta = (int)(zz >> 1) ^ -(int)(zz & 1);
+		cur[i] = key ? delta : cur[i] + delta;
+	}
+	return src;
+}
+
+static void store_matrix(float *dst, const Mat4 &m)
+{
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			dst[i * 4 + j] = m[i][j];
+		}
+	}
+}
+
+static Mat4 load_matrix(const float *src)
+{
+	Mat4 m;
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			m[i][j] = src[i * 4 + j];
+		}
+	}
+	return m;
+}
@@ -0,0 +1,115 @@
+#ifndef HCACHE_H_
+#define HCACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <gmath/gmath.h>
+
+#include "mesh.h"
+
+/* Baked strand animation cache.
+ *
+ * Every frame stores the head transform and the strand positions in head
+ * space, quantized to 16 bits inside the cache bounds (the head bounding box
+ * grown to fit the strands). Positions are delta-encoded against the
+ * previous frame as zigzag varints, and every HCACHE_CHUNK_FRAMES frames
+ * there's a keyframe (delta from zero) to allow seeking. Each frame is split
+ * in blocks of HCACHE_BLOCK strands, which are encoded and decoded in
+ * parallel.
+ */
+
+#define HCACHE_CHUNK_FRAMES	32
+#define HCACHE_BLOCK		4096
+
+struct HCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+
+	uint32_t num_strands;
+	uint32_t num_frames;
+	uint32_t chunk_frames;
+	uint32_t block_size;
+	uint32_t strand_hash;	/* identifies the strands the cache was baked for */
+	uint32_t pad;
+
+	float bmin[3], bmax[3];
+	uint64_t index_offs;	/* num_frames HCacheFrame entries */
+};
+
+struct HCacheFrame {
+	uint64_t offs;	/* block offset table, followed by the blocks */
+	uint32_t size;
+	float time;	/* seconds since the first frame */
+	float xform[16];
+};
+
+/* quantizes world space positions, simulated against xform, to 16 bit head
+ * space coordinates: q = (p - bmin) * scale. Returns the number of clamped
+ * coordinates */
+long quantize_positions(const Vec3 *pos, int num, const Mat4 &xform, const Vec3 &bmin,
+		const Vec3 &scale, uint16_t *out);
+
+class HCacheWriter {
+private:
+	FILE *fp;
+	int num_strands;
+	uint32_t strand_hash;
+	Vec3 bmin, bscale;
+	Aabb bounds;
+
+	std::vector<HCacheFrame> frames;
+	std::vector<uint16_t> prev;	/* previous frame, quantized */
+	std::vector<uint16_t> cur;
+	std::vector<std::vector<unsigned char> > blocks;
+	float time;
+	long num_clipped;	/* positions clamped to the bounds */
+
+public:
+	HCacheWriter();
+	~HCacheWriter();
+
+	bool open(const char *fname, int num_strands, uint32_t strand_hash, const Aabb &bounds);
+	/* pos are world space positions, simulated against xform */
+	bool write_frame(const Vec3 *pos, const Mat4 &xform, float dt);
+	bool close();
+};
+
+class HCacheReader {
+private:
+	const unsigned char *map;
+	size_t map_size;
+
+	const HCacheHeader *hdr;
+	const HCacheFrame *frames;
+	Vec3 bmin, bstep;
+
+	std::vector<uint16_t> cur;	/* last decoded frame, quantized */
+	int cur_frame;
+	int cur_chunk;
+
+	int num_frame_blocks() const;
+	/* false if the frame is corrupted, cur is left partially decoded */
+	bool decode_frame(int idx);
+	void release_chunk(int chunk);
+
+public:
+	HCacheReader();
+	~HCacheReader();
+
+	bool open(const char *fname);
+	void close();
+
+	int get_num_strands() const;
+	int get_num_frames() const;
+	uint32_t get_strand_hash() const;
+	float get_duration() const;
+
+	/* index of the frame shown at time t (seconds, looping) */
+	int frame_at(float t) const;
+	/* decodes frame idx to world space positions, returns its transform */
+	Mat4 read_frame(int idx, Vec3 *pos);
+};
+
+#endif // HCACHE_H_
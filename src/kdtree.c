@@ -40,18 +40,18 @@ OF SUCH DAMAGE.
 #include <malloc.h>
 #endif
 
-#ifdef USE_LIST_NODE_ALLOCATOR
-
 #ifndef NO_PTHREADS
 #include <pthread.h>
-#else
-
-#ifndef I_WANT_THREAD_BUGS
-#error "You are compiling with the fast list node allocator, with pthreads disabled! This WILL break if used from multiple threads."
-#endif	/* I want thread bugs */
+#endif
 
-#endif	/* pthread support */
-#endif	/* use list node allocator */
+/* Concurrency: inserts only ever link a new, fully initialized leaf into a
+ * null child pointer, so they're published with a release store, and
+ * queries walk the tree with acquire loads and never take a lock. Inserts
+ * are serialized by the tree's mutex. The bounding hyperrect only grows,
+ * one coordinate at a time: a query that copied it before an insert may
+ * miss the new point, but the bounds still hold for everything older. */
+#define LOAD_PTR(p)			__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define PUBLISH_PTR(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
 
 struct kdhyperrect {
 	int dim;
@@ -77,6 +77,9 @@ struct kdtree {
 	struct kdnode *root;
 	struct kdhyperrect *rect;
 	void (*destr)(void*);
+#ifndef NO_PTHREADS
+	pthread_mutex_t insert_lock;
+#endif
 };
 
 struct kdres {
@@ -95,7 +98,7 @@ static void clear_results(struct kdres *set);
 
 static struct kdhyperrect* hyperrect_create(int dim, const double *min, const double *max);
 static void hyperrect_free(struct kdhyperrect *rect);
-static struct kdhyperrect* hyperrect_duplicate(const struct kdhyperrect *rect);
+static struct kdhyperrect* hyperrect_snapshot(const struct kdhyperrect *rect);
 static void hyperrect_extend(struct kdhyperrect *rect, const double *pos);
 static double hyperrect_dist_sq(struct kdhyperrect *rect, const double *pos);
 
@@ -121,6 +124,9 @@ struct kdtree *kd_create(int k)
 	tree->root = 0;
 	tree->destr = 0;
 	tree->rect = 0;
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&tree->insert_lock, 0);
+#endif
 
 	return tree;
 }
@@ -129,6 +135,9 @@ void kd_free(struct kdtree *tree)
 {
 	if(tree) {
 		kd_clear(tree);
+#ifndef NO_PTHREADS
+		pthread_mutex_destroy(&tree->insert_lock);
+#endif
 		free(tree);
 	}
 }
@@ -181,7 +190,7 @@ static int insert_rec(struct kdnode **nptr, const double *pos, void *data, int d
 		node->data = data;
 		node->dir = dir;
 		node->left = node->right = 0;
-		*nptr = node;
+		PUBLISH_PTR(*nptr, node);
 		return 0;
 	}
 
@@ -195,22 +204,38 @@ static int insert_rec(struct kdnode **nptr, const double *pos, void *data, int d
 
 int kd_insert(struct kdtree *tree, const double *pos, void *data)
 {
-	if (insert_rec(&tree->root, pos, data, 0, tree->dim)) {
-		return -1;
-	}
+	int res = 0;
 
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&tree->insert_lock);
+#endif
+
+	/* grow the bounds before the node is visible */
 	if (tree->rect == 0) {
-		tree->rect = hyperrect_create(tree->dim, pos, pos);
+		struct kdhyperrect *rect = hyperrect_create(tree->dim, pos, pos);
+		if(!rect) {
+			res = -1;
+			goto end;
+		}
+		PUBLISH_PTR(tree->rect, rect);
 	} else {
 		hyperrect_extend(tree->rect, pos);
 	}
 
-	return 0;
+	if (insert_rec(&tree->root, pos, data, 0, tree->dim)) {
+		res = -1;
+	}
+
+end:
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&tree->insert_lock);
+#endif
+	return res;
 }
 
 int kd_insertf(struct kdtree *tree, const float *pos, void *data)
 {
-	static double sbuf[16];
+	double sbuf[16];
 	double *bptr, *buf = 0;
 	int res, dim = tree->dim;
 
@@ -263,6 +288,7 @@ static int find_nearest(struct kdnode *node, const double *pos, double range, st
 {
 	double dist_sq, dx;
 	int i, ret, added_res = 0;
+	struct kdnode *left, *right;
 
 	if(!node) return 0;
 
@@ -279,10 +305,13 @@ static int find_nearest(struct kdnode *node, const double *pos, double range, st
 
 	dx = pos[node->dir] - node->pos[node->dir];
 
-	ret = find_nearest(dx <= 0.0 ? node->left : node->right, pos, range, list, ordered, dim);
+	left = LOAD_PTR(node->left);
+	right = LOAD_PTR(node->right);
+
+	ret = find_nearest(dx <= 0.0 ? left : right, pos, range, list, ordered, dim);
 	if(ret >= 0 && fabs(dx) < range) {
 		added_res += ret;
-		ret = find_nearest(dx <= 0.0 ? node->right : node->left, pos, range, list, ordered, dim);
+		ret = find_nearest(dx <= 0.0 ? right : left, pos, range, list, ordered, dim);
 	}
 	if(ret == -1) {
 		return -1;
@@ -348,18 +377,19 @@ static void kd_nearest_i(struct kdnode *node, const double *pos, struct kdnode *
 	int i;
 	double dummy, dist_sq;
 	struct kdnode *nearer_subtree, *farther_subtree;
+	struct kdnode *left = LOAD_PTR(node->left), *right = LOAD_PTR(node->right);
 	double *nearer_hyperrect_coord, *farther_hyperrect_coord;
 
 	/* Decide whether to go left or right in the tree */
 	dummy = pos[dir] - node->pos[dir];
 	if (dummy <= 0) {
-		nearer_subtree = node->left;
-		farther_subtree = node->right;
+		nearer_subtree = left;
+		farther_subtree = right;
 		nearer_hyperrect_coord = rect->max + dir;
 		farther_hyperrect_coord = rect->min + dir;
 	} else {
-		nearer_subtree = node->right;
-		farther_subtree = node->left;
+		nearer_subtree = right;
+		farther_subtree = left;
 		nearer_hyperrect_coord = rect->min + dir;
 		farther_hyperrect_coord = rect->max + dir;
 	}
@@ -403,14 +433,16 @@ static void kd_nearest_i(struct kdnode *node, const double *pos, struct kdnode *
 
 struct kdres *kd_nearest(struct kdtree *kd, const double *pos)
 {
-	struct kdhyperrect *rect;
-	struct kdnode *result;
+	struct kdhyperrect *rect, *kdrect;
+	struct kdnode *root, *result;
 	struct kdres *rset;
 	double dist_sq;
 	int i;
 
 	if (!kd) return 0;
-	if (!kd->rect) return 0;
+	/* the bounds are published before the root, so load them first */
+	if (!(kdrect = LOAD_PTR(kd->rect))) return 0;
+	if (!(root = LOAD_PTR(kd->root))) return 0;
 
 	/* Allocate result set */
 	if(!(rset = malloc(sizeof *rset))) {
@@ -423,20 +455,20 @@ struct kdres *kd_nearest(struct kdtree *kd, const double *pos)
 	rset->rlist->next = 0;
 	rset->tree = kd;
 
-	/* Duplicate the bounding hyperrectangle, we will work on the copy */
-	if (!(rect = hyperrect_duplicate(kd->rect))) {
+	/* Copy the bounding hyperrectangle, we will work on the copy */
+	if (!(rect = hyperrect_snapshot(kdrect))) {
 		kd_res_free(rset);
 		return 0;
 	}
 
 	/* Our first guesstimate is the root node */
-	result = kd->root;
+	result = root;
 	dist_sq = 0;
 	for (i = 0; i < kd->dim; i++)
 		dist_sq += SQ(result->pos[i] - pos[i]);
 
 	/* Search for the nearest neighbour recursively */
-	kd_nearest_i(kd->root, pos, &result, &dist_sq, rect);
+	kd_nearest_i(root, pos, &result, &dist_sq, rect);
 
 	/* Free the copy of the hyperrect */
 	hyperrect_free(rect);
@@ -458,7 +490,7 @@ struct kdres *kd_nearest(struct kdtree *kd, const double *pos)
 
 struct kdres *kd_nearestf(struct kdtree *tree, const float *pos)
 {
-	static double sbuf[16];
+	double sbuf[16];
 	double *bptr, *buf = 0;
 	int dim = tree->dim;
 	struct kdres *res;
@@ -549,7 +581,7 @@ struct kdres *kd_nearest_range(struct kdtree *kd, const double *pos, double rang
 	rset->rlist->next = 0;
 	rset->tree = kd;
 
-	if((ret = find_nearest(kd->root, pos, range, rset->rlist, 0, kd->dim)) == -1) {
+	if((ret = find_nearest(LOAD_PTR(kd->root), pos, range, rset->rlist, 0, kd->dim)) == -1) {
 		kd_res_free(rset);
 		return 0;
 	}
@@ -560,7 +592,7 @@ struct kdres *kd_nearest_range(struct kdtree *kd, const double *pos, double rang
 
 struct kdres *kd_nearest_rangef(struct kdtree *kd, const float *pos, float range)
 {
-	static double sbuf[16];
+	double sbuf[16];
 	double *bptr, *buf = 0;
 	int dim = kd->dim;
 	struct kdres *res;
@@ -666,9 +698,9 @@ void *kd_res_itemf(struct kdres *rset, float *pos)
 void *kd_res_item3(struct kdres *rset, double *x, double *y, double *z)
 {
 	if(rset->riter) {
-		if(*x) *x = rset->riter->item->pos[0];
-		if(*y) *y = rset->riter->item->pos[1];
-		if(*z) *z = rset->riter->item->pos[2];
+		if(x) *x = rset->riter->item->pos[0];
+		if(y) *y = rset->riter->item->pos[1];
+		if(z) *z = rset->riter->item->pos[2];
 		return rset->riter->item->data;
 	}
 	return 0;
@@ -677,9 +709,9 @@ void *kd_res_item3(struct kdres *rset, double *x, double *y, double *z)
 void *kd_res_item3f(struct kdres *rset, float *x, float *y, float *z)
 {
 	if(rset->riter) {
-		if(*x) *x = rset->riter->item->pos[0];
-		if(*y) *y = rset->riter->item->pos[1];
-		if(*z) *z = rset->riter->item->pos[2];
+		if(x) *x = rset->riter->item->pos[0];
+		if(y) *y = rset->riter->item->pos[1];
+		if(z) *z = rset->riter->item->pos[2];
 		return rset->riter->item->data;
 	}
 	return 0;
@@ -723,9 +755,31 @@ static void hyperrect_free(struct kdhyperrect *rect)
 	free(rect);
 }
 
-static struct kdhyperrect* hyperrect_duplicate(const struct kdhyperrect *rect)
+/* copies a hyperrect which may be growing under a concurrent insert */
+static struct kdhyperrect* hyperrect_snapshot(const struct kdhyperrect *rect)
 {
-	return hyperrect_create(rect->dim, rect->min, rect->max);
+	int i;
+	size_t size = rect->dim * sizeof(double);
+	struct kdhyperrect *res;
+
+	if (!(res = malloc(sizeof(struct kdhyperrect)))) {
+		return 0;
+	}
+	res->dim = rect->dim;
+	if (!(res->min = malloc(size))) {
+		free(res);
+		return 0;
+	}
+	if (!(res->max = malloc(size))) {
+		free(res->min);
+		free(res);
+		return 0;
+	}
+	for(i=0; i<rect->dim; i++) {
+		__atomic_load(rect->min + i, res->min + i, __ATOMIC_RELAXED);
+		__atomic_load(rect->max + i, res->max + i, __ATOMIC_RELAXED);
+	}
+	return res;
 }
 
 static void hyperrect_extend(struct kdhyperrect *rect, const double *pos)
@@ -734,10 +788,10 @@ static void hyperrect_extend(struct kdhyperrect *rect, const double *pos)
 
 	for (i=0; i < rect->dim; i++) {
 		if (pos[i] < rect->min[i]) {
-			rect->min[i] = pos[i];
+			__atomic_store(rect->min + i, (double*)pos + i, __ATOMIC_RELAXED);
 		}
 		if (pos[i] > rect->max[i]) {
-			rect->max[i] = pos[i];
+			__atomic_store(rect->max + i, (double*)pos + i, __ATOMIC_RELAXED);
 		}
 	}
 }
@@ -761,48 +815,58 @@ static double hyperrect_dist_sq(struct kdhyperrect *rect, const double *pos)
 /* ---- static helpers ---- */
 
 #ifdef USE_LIST_NODE_ALLOCATOR
-/* special list node allocators. */
-static struct res_node *free_nodes;
+/* special list node allocators. Every thread keeps its own free list, so
+ * there's no lock to contend for. A node freed by another thread than the
+ * one which allocated it just moves to the other list. */
+static __thread struct res_node *free_nodes;
 
 #ifndef NO_PTHREADS
-static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t free_nodes_key;
+static pthread_once_t free_nodes_once = PTHREAD_ONCE_INIT;
+
+/* runs in the exiting thread, on its own list */
+static void free_thread_nodes(void *unused)
+{
+	struct res_node *node;
+
+	while(free_nodes) {
+		node = free_nodes;
+		free_nodes = node->next;
+		free(node);
+	}
+}
+
+static void create_free_nodes_key(void)
+{
+	pthread_key_create(&free_nodes_key, free_thread_nodes);
+}
 #endif
 
 static struct res_node *alloc_resnode(void)
 {
 	struct res_node *node;
 
+	if(!free_nodes) {
 #ifndef NO_PTHREADS
-	pthread_mutex_lock(&alloc_mutex);
+		/* the destructor only runs for a non-null value */
+		pthread_once(&free_nodes_once, create_free_nodes_key);
+		if(!pthread_getspecific(free_nodes_key)) {
+			pthread_setspecific(free_nodes_key, &free_nodes);
+		}
 #endif
-
-	if(!free_nodes) {
 		node = malloc(sizeof *node);
 	} else {
 		node = free_nodes;
 		free_nodes = free_nodes->next;
 		node->next = 0;
 	}
-
-#ifndef NO_PTHREADS
-	pthread_mutex_unlock(&alloc_mutex);
-#endif
-
 	return node;
 }
 
 static void free_resnode(struct res_node *node)
 {
-#ifndef NO_PTHREADS
-	pthread_mutex_lock(&alloc_mutex);
-#endif
-
 	node->next = free_nodes;
 	free_nodes = node;
-
-#ifndef NO_PTHREADS
-	pthread_mutex_unlock(&alloc_mutex);
-#endif
 }
 #endif	/* list node allocator or not */
 
@@ -34,6 +34,13 @@ extern "C" {
 struct kdtree;
 struct kdres;
 
+/* Thread safety: queries (kd_nearest*, and the kd_res_* calls on their
+ * results) may run from any number of threads, concurrently with each other
+ * and with kd_insert*. Inserts from several threads are serialized. A query
+ * that overlaps an insert may or may not see the new node, but it sees
+ * every node inserted before it started. kd_clear, kd_free and
+ * kd_data_destructor must not overlap any other call on the same tree.
+ */
 
 /* create a kd-tree for "k"-dimensional data */
 struct kdtree *kd_create(int k);
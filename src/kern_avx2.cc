@@ -0,0 +1,4 @@
+#define KERN_TABLE	kern_avx2
+#define KERN_NAME	"avx2"
+
+#include "hair_kern_impl.h"
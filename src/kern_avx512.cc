@@ -0,0 +1,4 @@
+#define KERN_TABLE	kern_avx512
+#define KERN_NAME	"avx512"
+
+#include "hair_kern_impl.h"
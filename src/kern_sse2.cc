@@ -0,0 +1,7 @@
+#define KERN_TABLE	kern_sse2
+#define KERN_NAME	"sse2"
+/* the noise takes 3 times as long without AVX, the wind grid is rebuilt
+ * every other update to keep turbulence under a fifth of the update */
+#define KERN_WIND_INTERVAL	2
+
+#include "hair_kern_impl.h"
@@ -1,9 +1,11 @@
 #include <GL/glew.h>
 #include <GL/glut.h>
+#include <GL/glx.h>
 
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 
 #include <gmath/gmath.h>
@@ -11,10 +13,32 @@
 #include "mesh.h"
 #include "hair.h"
 #include "object.h"
+#include "timer.h"
+#include "ptrinput.h"
+#include "bench.h"
+#include "server.h"
 
-#define MAX_NUM_SPAWNS 1600
-#define THRESH 0.5
+/* how often to check the parameter file for changes */
+#define CONF_POLL_MSEC 500
 
+/* sphere tree fitted to the head mesh, for the tree collision mode */
+#define STREE_CACHE "data/head.stree"
+
+/* consecutive resting frames before we stop redrawing continuously */
+#define REST_FRAMES 30
+
+/* hair LOD: all strands are used while the projected head radius is at
+ * least this fraction of the window height, never less than LOD_MIN */
+#define LOD_FULL_COVERAGE 0.125
+#define LOD_MIN 0.05
+
+/* grooming with the mouse: radius of the edited region, as a fraction of
+ * the head bounding box diagonal, and the strands added by a click */
+#define GROOM_RADIUS 0.05
+#define GROOM_ADD 100
+
+static bool parse_args(int argc, char **argv);
+static int run_headless_server(const char *path, float tick_rate);
 static bool init();
 static void cleanup();
 static void display();
@@ -23,7 +47,12 @@ static void keydown(unsigned char key, int x, int y);
 static void keyup(unsigned char key, int x, int y);
 static void mouse(int bn, int st, int x, int y);
 static void motion(int x, int y);
+static void groom(int bn, int mod, int x, int y);
 static void idle();
+static void check_conf(int val);
+static bool apply_params(const HairParams &prev);
+static void wake();
+static void set_swap_interval(int interval);
 static void sball_motion(int x, int y, int z);
 static void sball_rotate(int x, int y, int z);
 static void sball_button(int bn, int st);
@@ -31,10 +60,21 @@ static void sball_button(int bn, int st);
 static unsigned int gen_grad_tex(int sz, const Vec3 &c0, const Vec3 &c1);
 static void draw_text(const char *text, int x, int y, float sz, const Vec3 &color);
 static void update_sball_matrix();
+static void note_input();
+static void rotate_head(int dx, int dy);
+static bool latch_input();
+static void apply_sball();
+static Mat4 calc_head_xform();
+static float calc_hair_lod();
+static Vec3 calc_cam_pos();
+static void calc_frustum(Vec4 *planes);
+static void print_latency();
 
 static std::vector<Mesh*> meshes;
 static Mesh *mesh_head;
 static Hair hair;
+static Skeleton skel;
+static float anim_time;
 
 static unsigned int grad_tex;
 
@@ -42,6 +82,16 @@ static int win_width, win_height;
 static float cam_theta, cam_phi = 25, cam_dist = 8;
 static float head_rz, head_rx; /* rot angles x, z axis */
 static Mat4 head_xform;
+static bool hair_culling = true;
+static bool pipeline = true;	/* simulate the next frame while drawing */
+static const char *state_fname = "hair.state";
+static bool load_state;
+static const char *bake_fname;	/* record the simulation to a cache */
+static const char *play_fname;	/* play a cache back instead of simulating */
+static const char *export_name;	/* shared memory object to publish the strands to */
+static HairParams params;
+static const char *conf_fname;	/* parameter file, reloaded when modified */
+static long long conf_mtime;
 //static CollSphere coll_sphere; /* sphere used for collision detection */
 
 // spaceball (6dof control) state
@@ -50,10 +100,61 @@ static Quat sball_rot;
 static Mat4 sball_xform;
 static bool sball_update_pending;
 
+/* last queued pointer position of a head drag, see latch_input */
+static bool head_drag;
+static int head_drag_x, head_drag_y;
+
+/* input to swap latency statistics */
+static bool show_latency;
+static unsigned long pending_input_usec;	/* oldest applied, not yet displayed event */
+static unsigned long latency_sum, latency_max;
+static int latency_count;
+static unsigned long latency_report_usec;
+
+// frame scheduling
+static float frame_rate = 60;	/* frames per second, ignored with vsync */
+static bool vsync;
+static unsigned long next_frame_usec;
+static int rest_frames;
+static bool idle_running;
+static bool time_resync;
 
 int main(int argc, char **argv)
 {
+	/* headless modes, the server takes -conf too */
+	for(int i=1; i<argc - 1; i++) {
+		if(strcmp(argv[i], "-conf") == 0) {
+			conf_fname = argv[i + 1];
+		}
+	}
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-bench") == 0 && i < argc - 1 && strcmp(argv[i + 1], "ensemble") == 0) {
+			int num = i < argc - 2 ? atoi(argv[i + 2]) : 0;
+			return run_bench_ensemble(num > 0 ? num : 16);
+		}
+		if(strcmp(argv[i], "-bench") == 0 && i < argc - 1 && strcmp(argv[i + 1], "groom") == 0) {
+			int num = i < argc - 2 ? atoi(argv[i + 2]) : 0;
+			return run_bench_groom(num > 0 ? num : 100000);
+		}
+		if(strcmp(argv[i], "-bench") == 0 && i < argc - 1 && strcmp(argv[i + 1], "bvh") == 0) {
+			int num = i < argc - 2 ? atoi(argv[i + 2]) : 0;
+			return run_bench_bvh(num > 0 ? num : 2000);
+		}
+		if(strcmp(argv[i], "-bench") == 0) {
+			int num = i < argc - 1 ? atoi(argv[i + 1]) : 0;
+			return run_bench(num > 0 ? num : 100000);
+		}
+		if(strcmp(argv[i], "-server") == 0 && i < argc - 1) {
+			float rate = i < argc - 2 ? atof(argv[i + 2]) : 0;
+			return run_headless_server(argv[i + 1], rate > 0 ? rate : 60);
+		}
+	}
+
 	glutInit(&argc, argv);
+	if(!parse_args(argc, argv)) {
+		return 1;
+	}
+
 	glutInitWindowSize(800, 600);
 	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
 	glutCreateWindow("hair test");
@@ -67,7 +168,6 @@ int main(int argc, char **argv)
 	glutKeyboardUpFunc(keyup);
 	glutMouseFunc(mouse);
 	glutMotionFunc(motion);
-	glutIdleFunc(idle);
 	glutSpaceballMotionFunc(sball_motion);
 	glutSpaceballRotateFunc(sball_rotate);
 	glutSpaceballButtonFunc(sball_button);
@@ -77,13 +177,94 @@ int main(int argc, char **argv)
 	}
 	atexit(cleanup);
 
+	wake();
 	glutMainLoop();
 	return 0;
 }
 
+static bool parse_args(int argc, char **argv)
+{
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-fps") == 0 && i < argc - 1) {
+			frame_rate = atof(argv[++i]);
+		} else if(strcmp(argv[i], "-vsync") == 0) {
+			vsync = true;
+		} else if(strcmp(argv[i], "-latency") == 0) {
+			show_latency = true;
+		} else if(strcmp(argv[i], "-nopipeline") == 0) {
+			pipeline = false;
+		} else if(strcmp(argv[i], "-state") == 0 && i < argc - 1) {
+			state_fname = argv[++i];
+			load_state = true;
+		} else if(strcmp(argv[i], "-bake") == 0 && i < argc - 1) {
+			bake_fname = argv[++i];
+		} else if(strcmp(argv[i], "-play") == 0 && i < argc - 1) {
+			play_fname = argv[++i];
+		} else if(strcmp(argv[i], "-export") == 0 && i < argc - 1) {
+			export_name = argv[++i];
+		} else if(strcmp(argv[i], "-conf") == 0 && i < argc - 1) {
+			conf_fname = argv[++i];
+		} else {
+			fprintf(stderr, "unknown argument: %s\n", argv[i]);
+			fprintf(stderr, "usage: %s [-fps <rate>] [-vsync] [-latency] [-nopipeline] [-state <file>]\n", argv[0]);
+			fprintf(stderr, "       [-bake <file> | -play <file>] [-export <shm name>]\n");
+			fprintf(stderr, "       [-conf <file>]\n");
+			fprintf(stderr, "       %s -bench [num strands]\n", argv[0]);
+			fprintf(stderr, "       %s -bench ensemble [num instances]\n", argv[0]);
+			fprintf(stderr, "       %s -bench groom [num strands]\n", argv[0]);
+			fprintf(stderr, "       %s -bench bvh [num queries]\n", argv[0]);
+			fprintf(stderr, "       %s -server <socket> [tick rate] [-conf <file>]\n", argv[0]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* simulates without a window, for the clients of a Unix socket */
+static int run_headless_server(const char *path, float tick_rate)
+{
+	meshes = load_meshes("data/head.fbx", 0, false);
+	for(size_t i=0; i<meshes.size(); i++) {
+		if(meshes[i]->name == "head") {
+			mesh_head = meshes[i];
+		}
+	}
+	if(!mesh_head) {
+		fprintf(stderr, "Failed to find the head mesh.\n");
+		return 1;
+	}
+	mesh_head->calc_bbox();
+
+	default_params(&params);
+	if(conf_fname && !load_params(&params, conf_fname)) {
+		return 1;
+	}
+	hair.set_params(params);
+	if(!hair.init(mesh_head, params.max_spawns, params.thresh)) {
+		fprintf(stderr, "Failed to initialize hair\n");
+		return 1;
+	}
+	if(params.coll_mode == COLL_SDF) {
+		hair.build_sdf(mesh_head);
+	} else if(params.coll_mode == COLL_TREE) {
+		hair.build_sphere_tree(mesh_head, STREE_CACHE);
+	}
+	int res = run_server(&hair, path, tick_rate, mesh_head->bbox);
+
+	for(size_t i=0; i<meshes.size(); i++) {
+		delete meshes[i];
+	}
+	return res;
+}
+
 static bool init()
 {
 	glewInit();
+	set_swap_interval(vsync ? 1 : 0);
+
+	if(!start_pointer_input()) {
+		fprintf(stderr, "head motion follows the GLUT events, without the late latch\n");
+	}
 
 	grad_tex = gen_grad_tex(32, Vec3(0, 0, 1), Vec3(0, 1, 0));
 
@@ -95,7 +276,7 @@ static bool init()
 	glEnable(GL_LIGHT0);
 
 	glClearColor(0.5, 0.5, 0.5, 1);
-	meshes = load_meshes("data/head.fbx");
+	meshes = load_meshes("data/head.fbx", &skel);
 	if (meshes.empty()) {
 		fprintf(stderr, "Failed to load mesh.\n");
 		return false;
@@ -129,18 +310,69 @@ static bool init()
 //	coll_sphere.radius = 1.0;
 //	coll_sphere.center = Vec3(0, 0.6, 0.53);
 
-	if(!hair.init(mesh_head, MAX_NUM_SPAWNS, THRESH)) {
+	default_params(&params);
+	if(conf_fname) {
+		if(!reload_params(&params, conf_fname, &conf_mtime)) {
+			return false;
+		}
+		glutTimerFunc(CONF_POLL_MSEC, check_conf, 0);
+	}
+	hair.set_params(params);
+	for(size_t i=0; i<meshes.size(); i++) {
+		meshes[i]->set_compact(params.compact);
+	}
+
+	/* start from a saved, already settled state if we have one */
+	if(load_state && hair.load_state(state_fname, mesh_head)) {
+		printf("hair state restored from %s\n", state_fname);
+	} else if(!hair.init(mesh_head, params.max_spawns, params.thresh)) {
 		fprintf(stderr, "Failed to initialize hair\n");
 		return false;
 	}
+	if(params.coll_mode == COLL_SDF) {
+		hair.build_sdf(mesh_head);
+	} else if(params.coll_mode == COLL_TREE) {
+		hair.build_sphere_tree(mesh_head, STREE_CACHE);
+	}
 
 //	hair.add_collider(&coll_sphere);
 
+	if(play_fname) {
+		if(!hair.start_playback(play_fname)) {
+			return false;
+		}
+		printf("playing back the hair cache %s\n", play_fname);
+	} else if(bake_fname) {
+		if(!hair.start_bake(bake_fname, mesh_head->bbox)) {
+			return false;
+		}
+		printf("baking the hair animation to %s\n", bake_fname);
+	}
+	if(export_name) {
+		if(!hair.start_export(export_name)) {
+			return false;
+		}
+		printf("exporting the hair strands to shared memory: %s\n", export_name);
+	}
+
 	return true;
 }
 
 static void cleanup()
 {
+	hair.sync();
+	if(bake_fname && hair.end_bake()) {
+		printf("hair cache written to %s\n", bake_fname);
+	}
+	hair.stop_export();
+	stop_pointer_input();
+
+	const HairStepStats &ss = hair.get_step_stats();
+	if(ss.updates > 0) {
+		printf("hair: %ld updates, %.2f substeps per update, %ld blocks refined, %ld strands clamped\n",
+				ss.updates, (double)ss.substeps / ss.updates, ss.refined, ss.clamps);
+	}
+
 	for(size_t i=0; i<meshes.size(); i++) {
 		delete meshes[i];
 	}
@@ -151,26 +383,77 @@ static void display()
 {
 	static unsigned long prev_time;
 	unsigned long msec = glutGet(GLUT_ELAPSED_TIME);
+	if(time_resync) {
+		/* first frame after resting, don't simulate the idle time */
+		prev_time = msec;
+		time_resync = false;
+	}
 	float dt = (float)(msec - prev_time) / 1000.0;
 	prev_time = msec;
 
-	if(sball_update_pending) {
-		update_sball_matrix();
-		sball_update_pending = false;
+	/* finish the hair update started last frame, its result is drawn in
+	 * this one while the next update runs */
+	hair.sync();
+
+	if(!skel.anims.empty()) {
+		anim_time += dt;
+		skel.eval(0, anim_time);
+
+		for(size_t i=0; i<meshes.size(); i++) {
+			if(meshes[i]->is_skinned()) {
+				meshes[i]->skin(&skel);
+				meshes[i]->update_vbo(MESH_VERTEX | MESH_NORMAL);
+			}
+		}
+		if(mesh_head->is_skinned()) {
+			hair.update_spawns(mesh_head);
+		}
 	}
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	latch_input();
+	apply_sball();
+	head_xform = calc_head_xform();
+
+	hair.set_transform(head_xform);
+	hair.set_lod(calc_hair_lod());
+	if(pipeline) {
+		hair.update_async(dt);
+	} else {
+		hair.update(dt);
+	}
 
-	head_xform = Mat4::identity;
-	head_xform.rotate_x(gph::deg_to_rad(head_rx));
-	head_xform.rotate_z(-gph::deg_to_rad(head_rz));
-	head_xform *= sball_xform;
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 	glTranslatef(0, 0, -cam_dist);
 	glRotatef(cam_phi, 1, 0, 0);
 	glRotatef(cam_theta, 0, 1, 0);
+
+	/* late latch: head motion which arrived while simulating moves the head
+	 * right before the frame is submitted. The hair, which was simulated
+	 * against an older transform (the previous frame's, in pipelined mode),
+	 * moves rigidly along with it */
+	if(latch_input()) {
+		head_xform = calc_head_xform();
+	}
+	if(hair.is_playing()) {
+		/* the head follows the motion the cache was baked with */
+		head_xform = hair.get_frame_xform();
+	}
+	hair.latch_transform(head_xform);
+	/* pixels per unit at unit distance, for the 50 degree vertical field
+	 * of view set in reshape */
+	hair.set_view(calc_cam_pos(), win_height / (2.0 * tan(gph::deg_to_rad(25.0))));
+
+	if(hair_culling) {
+		Vec4 frustum[6];
+		calc_frustum(frustum);
+		hair.cull(calc_cam_pos(), frustum);
+	} else {
+		hair.disable_culling();
+	}
+
 	/* multiplying with the head rot matrix */
 	glPushMatrix();
 	glMultMatrixf(head_xform[0]);
@@ -194,8 +477,6 @@ static void display()
 
 	glPopMatrix();
 
-	hair.set_transform(head_xform);
-	hair.update(dt);
 	hair.draw();
 
 /*
@@ -256,6 +537,26 @@ static void display()
 
 	glutSwapBuffers();
 	assert(glGetError() == GL_NO_ERROR);
+
+	if(pending_input_usec) {
+		unsigned long lat = get_time_usec() - pending_input_usec;
+		latency_sum += lat;
+		if(lat > latency_max) latency_max = lat;
+		latency_count++;
+		pending_input_usec = 0;
+
+		if(show_latency) print_latency();
+	}
+
+	/* nothing moves: stop redrawing until the next input event */
+	if(hair.at_rest() && skel.anims.empty()) {
+		if(++rest_frames >= REST_FRAMES && idle_running) {
+			glutIdleFunc(0);
+			idle_running = false;
+		}
+	} else {
+		rest_frames = 0;
+	}
 }
 
 static void reshape(int x, int y)
@@ -263,6 +564,7 @@ static void reshape(int x, int y)
 	glViewport(0, 0, x, y);
 	win_width = x;
 	win_height = y;
+	wake();
 
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
@@ -277,6 +579,18 @@ static void keydown(unsigned char key, int /*x*/, int /*y*/)
 	case 'H':
 		hpressed = true;
 		break;
+	case 's':
+	case 'S':
+		if(hair.save_state(state_fname)) {
+			printf("hair state saved to %s\n", state_fname);
+		}
+		break;
+	case 'c':
+	case 'C':
+		hair_culling = !hair_culling;
+		printf("hair culling %s\n", hair_culling ? "on" : "off");
+		wake();
+		break;
 	case 27:
 		exit(0);
 	default:
@@ -301,9 +615,26 @@ int prev_x, prev_y;
 
 static void mouse(int bn, int st, int x, int y)
 {
+	int mod = glutGetModifiers();
+	if(st == GLUT_DOWN && (mod & (GLUT_ACTIVE_SHIFT | GLUT_ACTIVE_CTRL))) {
+		groom(bn, mod, x, y);
+		wake();
+		return;
+	}
+
 	bnstate[bn] = st == GLUT_DOWN;
 	prev_x = x;
 	prev_y = y;
+
+	/* a head drag starts from the press, the motion queued before it
+	 * doesn't count */
+	if(bn == GLUT_LEFT_BUTTON && st == GLUT_DOWN && hpressed && pointer_input_running()) {
+		latch_input();
+		head_drag = true;
+		head_drag_x = x;
+		head_drag_y = y;
+	}
+	wake();
 }
 
 static void motion(int x, int y)
@@ -314,17 +645,13 @@ static void motion(int x, int y)
 	prev_y = y;
 
 	if(!dx && !dy) return;
+	wake();
 
 	if(hpressed) {
-		if(bnstate[0]) {
-			head_rz += dx * 0.5;
-			head_rx += dy * 0.5;
-
-			if(head_rx < -45) head_rx = -45;
-			if(head_rx > 45) head_rx = 45;
-
-			if(head_rz < -90) head_rz = -90;
-			if(head_rz > 90) head_rz = 30;
+		/* with the input thread, display takes the motion from its queue */
+		if(bnstate[0] && !pointer_input_running()) {
+			rotate_head(dx, dy);
+			note_input();
 		}
 	}
 	else {
@@ -342,17 +669,160 @@ static void motion(int x, int y)
 	}
 }
 
+/* edits the strands around the point of the head under the mouse:
+ * shift+click adds strands (right button removes them), ctrl+click thins
+ * them out (right button fills them in) */
+static void groom(int bn, int mod, int x, int y)
+{
+	if(bn != GLUT_LEFT_BUTTON && bn != GLUT_RIGHT_BUTTON) return;
+	if(win_width <= 0 || win_height <= 0) return;
+
+	/* view space ray through the pixel, for the 50 degree vertical field of
+	 * view set in reshape */
+	float t = tan(gph::deg_to_rad(25.0));
+	float aspect = (float)win_width / (float)win_height;
+	Vec3 v = Vec3((2.0 * (x + 0.5) / win_width - 1.0) * t * aspect,
+			(1.0 - 2.0 * (y + 0.5) / win_height) * t, -1);
+
+	/* to world space, undoing the rotations of the view set up in display,
+	 * rot_y(-cam_theta) * rot_x(-cam_phi) */
+	float theta = gph::deg_to_rad(cam_theta);
+	float phi = gph::deg_to_rad(cam_phi);
+	Vec3 vx = Vec3(v.x, v.y * cos(phi) + v.z * sin(phi), v.z * cos(phi) - v.y * sin(phi));
+	Vec3 dir = Vec3(vx.x * cos(theta) - vx.z * sin(theta), vx.y, vx.x * sin(theta) + vx.z * cos(theta));
+
+	/* and to the space of the head mesh, where the strand roots are */
+	Mat4 inv = inverse(head_xform);
+	Vec3 cam = calc_cam_pos();
+	Vec3 org = inv * cam;
+	Vec3 center;
+	if(!hair.pick(mesh_head, org, inv * (cam + dir) - org, &center)) {
+		return;
+	}
+
+	float rad = length(mesh_head->bbox.v1 - mesh_head->bbox.v0) * GROOM_RADIUS;
+	unsigned long start = get_time_usec();
+	int num;
+	const char *what;
+
+	if(mod & GLUT_ACTIVE_SHIFT) {
+		if(bn == GLUT_LEFT_BUTTON) {
+			num = hair.add_strands(mesh_head, center, rad, GROOM_ADD);
+			what = "added";
+		} else {
+			num = hair.remove_strands(center, rad);
+			what = "removed";
+		}
+	} else {
+		if(bn == GLUT_LEFT_BUTTON) {
+			num = hair.scale_density(mesh_head, center, rad, 0.5);
+			what = "thinned out";
+		} else {
+			num = hair.scale_density(mesh_head, center, rad, 2.0);
+			what = "filled in";
+		}
+	}
+	printf("%d strands %s in %.2f ms\n", num, what, (get_time_usec() - start) / 1000.0);
+}
+
 static void idle()
 {
+	if(!vsync && frame_rate > 0) {
+		unsigned long frame_usec = 1000000 / frame_rate;
+		unsigned long now = get_time_usec();
+
+		if(now < next_frame_usec) {
+			sleep_until_usec(next_frame_usec);
+			next_frame_usec += frame_usec;
+		} else {
+			/* running late, don't try to catch up with a burst of frames */
+			next_frame_usec = now + frame_usec;
+		}
+	}
+	glutPostRedisplay();
+}
+
+/* hot reload of the parameter file */
+static void check_conf(int val)
+{
+	HairParams prev = params;
+	if(reload_params(&params, conf_fname, &conf_mtime)) {
+		printf("reloaded %s\n", conf_fname);
+		if(!apply_params(prev)) {
+			params = prev;
+		}
+		wake();
+	}
+	glutTimerFunc(CONF_POLL_MSEC, check_conf, 0);
+}
+
+static bool apply_params(const HairParams &prev)
+{
+	hair.sync();
+	hair.set_params(params);
+
+	/* the strands need sampling again if the sampling parameters changed */
+	if(params.max_spawns != prev.max_spawns || params.thresh != prev.thresh ||
+			params.min_dist != prev.min_dist) {
+		if(!hair.init(mesh_head, params.max_spawns, params.thresh)) {
+			fprintf(stderr, "failed to sample the hair again, keeping the previous parameters\n");
+			hair.set_params(prev);
+			return false;
+		}
+		printf("hair sampled again: %d strands\n", hair.get_num_active());
+	}
+
+	if(params.compact != prev.compact) {
+		for(size_t i=0; i<meshes.size(); i++) {
+			meshes[i]->set_compact(params.compact);
+		}
+	}
+
+	if(params.coll_mode == COLL_SDF && (prev.coll_mode != COLL_SDF || params.sdf_res != prev.sdf_res)) {
+		hair.build_sdf(mesh_head);
+	}
+	if(params.coll_mode == COLL_TREE && (prev.coll_mode != COLL_TREE || params.sdf_res != prev.sdf_res)) {
+		hair.build_sphere_tree(mesh_head, STREE_CACHE);
+	}
+	return true;
+}
+
+/* resume continuous redraw, called from the input callbacks */
+static void wake()
+{
+	rest_frames = 0;
+	if(!idle_running) {
+		glutIdleFunc(idle);
+		idle_running = true;
+		time_resync = true;
+		next_frame_usec = get_time_usec();
+	}
 	glutPostRedisplay();
 }
 
+static void set_swap_interval(int interval)
+{
+	typedef int (*swap_interval_func)(int);
+	swap_interval_func swap_interval;
+
+	swap_interval = (swap_interval_func)glXGetProcAddress((const unsigned char*)"glXSwapIntervalMESA");
+	if(!swap_interval) {
+		/* the SGI variant doesn't accept 0 */
+		if(!interval) return;
+		swap_interval = (swap_interval_func)glXGetProcAddress((const unsigned char*)"glXSwapIntervalSGI");
+	}
+	if(!swap_interval || swap_interval(interval) != 0) {
+		fprintf(stderr, "failed to set the swap interval to %d\n", interval);
+	}
+}
+
 static void sball_motion(int x, int y, int z)
 {
 	sball_pos.x += (float)x * 0.001;
 	sball_pos.y += (float)y * 0.001;
 	sball_pos.z -= (float)z * 0.001;
 	sball_update_pending = true;
+	note_input();
 }
 
 static void sball_rotate(int x, int y, int z)
@@ -364,6 +834,7 @@ static void sball_rotate(int x, int y, int z)
 		q.set_rotation(axis / axis_len, axis_len * 0.001);
 		sball_rot = q * sball_rot;
 		sball_update_pending = true;
+		note_input();
 	}
 }
 
@@ -374,6 +845,8 @@ static void sball_button(int bn, int st)
 	sball_pos = Vec3(0, 0, 0);
 	sball_rot = Quat::identity;
 	sball_xform = Mat4::identity;
+	sball_update_pending = false;
+	note_input();
 }
 
 static unsigned int gen_grad_tex(int sz, const Vec3 &c0, const Vec3 &c1)
@@ -447,3 +920,146 @@ static void update_sball_matrix()
 
 	sball_xform = rot * trans;
 }
+
+/* stamps the first head motion since the last swap, for the latency
+ * statistics */
+static void note_input()
+{
+	if(!pending_input_usec) {
+		pending_input_usec = get_time_usec();
+	}
+	wake();
+}
+
+static void rotate_head(int dx, int dy)
+{
+	head_rz += dx * 0.5;
+	head_rx += dy * 0.5;
+
+	if(head_rx < -45) head_rx = -45;
+	if(head_rx > 45) head_rx = 45;
+
+	if(head_rz < -90) head_rz = -90;
+	if(head_rz > 90) head_rz = 30;
+}
+
+/* applies the queued pointer motion of the input thread to the head, while
+ * h and the left button are held. Returns true if the head moved */
+static bool latch_input()
+{
+	PointerEvent ev;
+	bool moved = false;
+
+	while(pop_pointer_input(&ev)) {
+		if(!hpressed || !(ev.buttons & PTR_LEFT)) {
+			head_drag = false;
+			continue;
+		}
+		if(head_drag && (ev.x != head_drag_x || ev.y != head_drag_y)) {
+			rotate_head(ev.x - head_drag_x, ev.y - head_drag_y);
+			if(!pending_input_usec) {
+				pending_input_usec = ev.time_usec;
+			}
+			moved = true;
+		}
+		head_drag = true;
+		head_drag_x = ev.x;
+		head_drag_y = ev.y;
+	}
+	return moved;
+}
+
+static void apply_sball()
+{
+	if(sball_update_pending) {
+		update_sball_matrix();
+		sball_update_pending = false;
+	}
+}
+
+static Mat4 calc_head_xform()
+{
+	Mat4 xform = Mat4::identity;
+	xform.rotate_x(gph::deg_to_rad(head_rx));
+	xform.rotate_z(-gph::deg_to_rad(head_rz));
+	xform *= sball_xform;
+	return xform;
+}
+
+/* fraction of hair strands worth simulating, from the projected head size */
+static float calc_hair_lod()
+{
+	if(win_height <= 0) return 1;
+
+	const Aabb &box = mesh_head->bbox;
+	float rad = length(box.v1 - box.v0) * 0.5;
+	float dist = cam_dist > rad ? cam_dist : rad;
+
+	/* projected radius over window height, for the 50 degree vertical
+	 * field of view set in reshape */
+	float cov = rad / (dist * tan(gph::deg_to_rad(25.0)) * 2.0);
+	float frac = (cov * cov) / (LOD_FULL_COVERAGE * LOD_FULL_COVERAGE);
+
+	if(frac < LOD_MIN) return LOD_MIN;
+	return frac > 1 ? 1 : frac;
+}
+
+/* world space camera position, inverse of the view transform set up in
+ * display: translate(0, 0, -cam_dist) * rot_x(cam_phi) * rot_y(cam_theta) */
+static Vec3 calc_cam_pos()
+{
+	float theta = gph::deg_to_rad(cam_theta);
+	float phi = gph::deg_to_rad(cam_phi);
+
+	return Vec3(-cam_dist * cos(phi) * sin(theta),
+			cam_dist * sin(phi),
+			cam_dist * cos(phi) * cos(theta));
+}
+
+/* extracts the world space frustum planes from the current projection
+ * and modelview matrices */
+static void calc_frustum(Vec4 *planes)
+{
+	float proj[16], mv[16], m[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+
+	/* m = proj * mv, column-major */
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			m[i * 4 + j] = proj[j] * mv[i * 4] + proj[4 + j] * mv[i * 4 + 1] +
+				proj[8 + j] * mv[i * 4 + 2] + proj[12 + j] * mv[i * 4 + 3];
+		}
+	}
+
+	for(int i=0; i<3; i++) {
+		for(int j=0; j<2; j++) {
+			float sign = j ? -1 : 1;
+			Vec4 *p = planes + i * 2 + j;
+			p->x = m[3] + sign * m[i];
+			p->y = m[7] + sign * m[4 + i];
+			p->z = m[11] + sign * m[8 + i];
+			p->w = m[15] + sign * m[12 + i];
+
+			float len = sqrt(p->x * p->x + p->y * p->y + p->z * p->z);
+			p->x /= len;
+			p->y /= len;
+			p->z /= len;
+			p->w /= len;
+		}
+	}
+}
+
+static void print_latency()
+{
+	unsigned long now = get_time_usec();
+	if(now - latency_report_usec < 1000000) {
+		return;
+	}
+	latency_report_usec = now;
+
+	printf("input to swap latency: avg %.2f ms, max %.2f ms (%d frames)\n",
+			latency_sum / 1000.0 / latency_count, latency_max / 1000.0, latency_count);
+	latency_sum = latency_max = 0;
+	latency_count = 0;
+}
@@ -8,11 +8,29 @@
 #include <assimp/mesh.h>
 
 #include <float.h>
+#include <math.h>
+#include <string.h>
 #include <imago2.h>
 
-#include "mesh.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
-static bool check_tex_opaque(unsigned int tex);
+#include "mesh.h"
+#include "texbc.h"
+#include "timer.h"
+
+static unsigned int upload_texture(const uint32_t *pixels, int xsz, int ysz);
+static unsigned int upload_texture_bc(const TexBc *bc);
+static void convert_mesh(const aiMesh *amesh, const aiMaterial *amtl, const Skeleton *skel, Mesh *mesh);
+static void upload_buffer(unsigned int target, const void *data, size_t size, bool realloc, unsigned int usage);
+static void calc_pack_xform(const std::vector<Vec3> &v, Vec3 *center, float *scale);
+static void pack_snorm8(int8_t *dst, const Vec3 &n);
+static void pack_unorm8(uint8_t *dst, const Vec3 &c);
+static Mat4 conv_matrix(const aiMatrix4x4 &am);
+static void load_nodes(const aiNode *anode, int parent, Skeleton *skel);
+static void load_anims(const aiScene *scene, Skeleton *skel);
+static void load_bones(const aiMesh *amesh, const Skeleton *skel, Mesh *mesh);
 
 Mesh::Mesh()
 {
@@ -25,7 +43,13 @@ Mesh::Mesh()
 	num_vertices = 0;
 	num_indices = 0;
 
+	compact = false;
+	pack_center = Vec3(0, 0, 0);
+	pack_scale = 1;
+
 	mtl.tex = 0;
+	mtl.tex_opaque = true;
+	memset(mtl.tex_alpha, 0, sizeof mtl.tex_alpha);
 	mtl.diffuse = Vec3(1, 1, 1);
 	mtl.shininess = 50;
 }
@@ -49,6 +73,110 @@ Mesh::~Mesh()
 	colors.clear();
 }
 
+bool Mesh::is_skinned() const
+{
+	return !bones.empty() && !weights.empty();
+}
+
+void Mesh::skin(const Skeleton *skel)
+{
+	if(!is_skinned())
+		return;
+
+	/* palette of skinning matrices, stored as 4 columns of 4 floats.
+	 * The extra last entry is the identity, used by vertices without
+	 * any bone influences.
+	 */
+	int num_bones = bones.size();
+	std::vector<float> palette((num_bones + 1) * 16);
+
+	for(int i=0; i<=num_bones; i++) {
+		Mat4 m;
+		if(i < num_bones) {
+			m = skel->nodes[bones[i].node].global_xform * bones[i].offset;
+		}
+		float *pal = &palette[i * 16];
+		for(int j=0; j<4; j++) {
+			pal[j * 4] = m[j][0];
+			pal[j * 4 + 1] = m[j][1];
+			pal[j * 4 + 2] = m[j][2];
+			pal[j * 4 + 3] = 0;
+		}
+	}
+
+	const float *pal = &palette[0];
+	const VertexWeights *vw = &weights[0];
+	const Vec3 *src_vert = &bind_vertices[0];
+	const Vec3 *src_norm = bind_normals.empty() ? 0 : &bind_normals[0];
+	Vec3 *dst_vert = &vertices[0];
+	Vec3 *dst_norm = src_norm ? &normals[0] : 0;
+	int num_verts = bind_vertices.size();
+
+	/* linear blend skinning. Normals are transformed with the blended
+	 * matrix too, which is fine as long as the bones are not scaled
+	 * non-uniformly.
+	 */
+#pragma omp parallel for schedule(static, 4096)
+	for(int i=0; i<num_verts; i++) {
+#ifdef __SSE__
+		__m128 col0 = _mm_setzero_ps();
+		__m128 col1 = col0, col2 = col0, col3 = col0;
+
+		for(int j=0; j<MAX_BONE_INFLUENCES; j++) {
+			float w = vw[i].weight[j];
+			if(w <= 0) break;	/* weights are sorted by decreasing influence */
+
+			__m128 mw = _mm_set1_ps(w);
+			const float *m = pal + vw[i].bone[j] * 16;
+			col0 = _mm_add_ps(col0, _mm_mul_ps(mw, _mm_loadu_ps(m)));
+			col1 = _mm_add_ps(col1, _mm_mul_ps(mw, _mm_loadu_ps(m + 4)));
+			col2 = _mm_add_ps(col2, _mm_mul_ps(mw, _mm_loadu_ps(m + 8)));
+			col3 = _mm_add_ps(col3, _mm_mul_ps(mw, _mm_loadu_ps(m + 12)));
+		}
+
+		float res[4];
+		const Vec3 &v = src_vert[i];
+		__m128 pv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(col0, _mm_set1_ps(v.x)),
+					_mm_mul_ps(col1, _mm_set1_ps(v.y))),
+				_mm_add_ps(_mm_mul_ps(col2, _mm_set1_ps(v.z)), col3));
+		_mm_storeu_ps(res, pv);
+		dst_vert[i] = Vec3(res[0], res[1], res[2]);
+
+		if(src_norm) {
+			const Vec3 &n = src_norm[i];
+			__m128 pn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(col0, _mm_set1_ps(n.x)),
+						_mm_mul_ps(col1, _mm_set1_ps(n.y))),
+					_mm_mul_ps(col2, _mm_set1_ps(n.z)));
+			_mm_storeu_ps(res, pn);
+			dst_norm[i] = normalize(Vec3(res[0], res[1], res[2]));
+		}
+#else
+		float m[16] = {0};
+		for(int j=0; j<MAX_BONE_INFLUENCES; j++) {
+			float w = vw[i].weight[j];
+			if(w <= 0) break;
+
+			const float *bm = pal + vw[i].bone[j] * 16;
+			for(int k=0; k<16; k++) {
+				m[k] += w * bm[k];
+			}
+		}
+
+		const Vec3 &v = src_vert[i];
+		dst_vert[i] = Vec3(m[0] * v.x + m[4] * v.y + m[8] * v.z + m[12],
+				m[1] * v.x + m[5] * v.y + m[9] * v.z + m[13],
+				m[2] * v.x + m[6] * v.y + m[10] * v.z + m[14]);
+
+		if(src_norm) {
+			const Vec3 &n = src_norm[i];
+			dst_norm[i] = normalize(Vec3(m[0] * n.x + m[4] * n.y + m[8] * n.z,
+					m[1] * n.x + m[5] * n.y + m[9] * n.z,
+					m[2] * n.x + m[6] * n.y + m[10] * n.z));
+		}
+#endif
+	}
+}
+
 void Mesh::draw() const
 {
 	/* set material */
@@ -75,12 +203,31 @@ void Mesh::draw() const
 		}
 	}
 
+	bool packed = use_compact();
+	if(packed) {
+		/* the scale is uniform, so that GL_NORMALIZE undoes its effect
+		 * on the normals */
+		glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		glTranslatef(pack_center.x, pack_center.y, pack_center.z);
+		glScalef(pack_scale, pack_scale, pack_scale);
+		glEnable(GL_NORMALIZE);
+	}
+
 	glBindBuffer(GL_ARRAY_BUFFER, vbo_vertices);
-	glVertexPointer(3, GL_FLOAT, 0, 0);
+	if(packed) {
+		glVertexPointer(3, GL_SHORT, 4 * sizeof(int16_t), 0);
+	} else {
+		glVertexPointer(3, GL_FLOAT, 0, 0);
+	}
 
 	if(vbo_normals) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo_normals);
-		glNormalPointer(GL_FLOAT, 0, 0);
+		if(packed) {
+			glNormalPointer(GL_BYTE, 4, 0);
+		} else {
+			glNormalPointer(GL_FLOAT, 0, 0);
+		}
 		glEnableClientState(GL_NORMAL_ARRAY);
 	}
 
@@ -92,7 +239,11 @@ void Mesh::draw() const
 
 	if(vbo_colors) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo_colors);
-		glColorPointer(3, GL_FLOAT, 0, 0);
+		if(packed) {
+			glColorPointer(4, GL_UNSIGNED_BYTE, 0, 0);
+		} else {
+			glColorPointer(3, GL_FLOAT, 0, 0);
+		}
 		glEnableClientState(GL_COLOR_ARRAY);
 	}
 
@@ -102,7 +253,7 @@ void Mesh::draw() const
 
 	if(ibo) {
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_SHORT, 0);
+		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	} else {
 		glDrawArrays(GL_TRIANGLES, 0, num_vertices);
@@ -113,6 +264,9 @@ void Mesh::draw() const
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 	glDisableClientState(GL_COLOR_ARRAY);
 
+	if(packed) {
+		glPopMatrix();
+	}
 	glPopAttrib();
 }
 
@@ -123,9 +277,17 @@ void Mesh::update_vbo(unsigned int which)
 			glGenBuffers(1, &vbo_normals);
 		}
 		glBindBuffer(GL_ARRAY_BUFFER, vbo_normals);
-		if(num_vertices != (int)normals.size()) {
+		if(use_compact()) {
+			std::vector<int8_t> packed(normals.size() * 4);
+			for(size_t i=0; i<normals.size(); i++) {
+				pack_snorm8(&packed[i * 4], normals[i]);
+			}
+			upload_buffer(GL_ARRAY_BUFFER, &packed[0], packed.size(),
+					num_vertices != (int)normals.size(), GL_STATIC_DRAW);
+		}
+		else if(num_vertices != (int)normals.size()) {
 			glBufferData(GL_ARRAY_BUFFER, normals.size() * 3 * sizeof(float),
-					&normals[0], GL_STATIC_DRAW);
+					&normals[0], is_skinned() ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
 		}
 		else {
 			glBufferSubData(GL_ARRAY_BUFFER, 0, normals.size() * 3 * sizeof(float),
@@ -153,7 +315,15 @@ void Mesh::update_vbo(unsigned int which)
 			glGenBuffers(1, &vbo_colors);
 		}
 		glBindBuffer(GL_ARRAY_BUFFER, vbo_colors);
-		if(num_vertices != (int)colors.size()) {
+		if(use_compact()) {
+			std::vector<uint8_t> packed(colors.size() * 4);
+			for(size_t i=0; i<colors.size(); i++) {
+				pack_unorm8(&packed[i * 4], colors[i]);
+			}
+			upload_buffer(GL_ARRAY_BUFFER, &packed[0], packed.size(),
+					num_vertices != (int)colors.size(), GL_STATIC_DRAW);
+		}
+		else if(num_vertices != (int)colors.size()) {
 			glBufferData(GL_ARRAY_BUFFER, colors.size() * 3 * sizeof(float),
 					&colors[0], GL_STATIC_DRAW);
 		}
@@ -170,9 +340,22 @@ void Mesh::update_vbo(unsigned int which)
 			glGenBuffers(1, &vbo_vertices);
 		}
 		glBindBuffer(GL_ARRAY_BUFFER, vbo_vertices);
-		if(num_vertices != (int)vertices.size()) {
+		if(use_compact()) {
+			calc_pack_xform(vertices, &pack_center, &pack_scale);
+			std::vector<int16_t> packed(vertices.size() * 4);
+			for(size_t i=0; i<vertices.size(); i++) {
+				Vec3 q = (vertices[i] - pack_center) / pack_scale;
+				packed[i * 4] = (int16_t)roundf(q.x);
+				packed[i * 4 + 1] = (int16_t)roundf(q.y);
+				packed[i * 4 + 2] = (int16_t)roundf(q.z);
+				packed[i * 4 + 3] = 0;
+			}
+			upload_buffer(GL_ARRAY_BUFFER, &packed[0], packed.size() * sizeof(int16_t),
+					num_vertices != (int)vertices.size(), GL_STATIC_DRAW);
+		}
+		else if(num_vertices != (int)vertices.size()) {
 			glBufferData(GL_ARRAY_BUFFER, vertices.size() * 3 * sizeof(float),
-					&vertices[0], GL_STATIC_DRAW);
+					&vertices[0], is_skinned() ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
 		}
 		else {
 			glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * 3 * sizeof(float),
@@ -187,116 +370,196 @@ void Mesh::update_vbo(unsigned int which)
 		}
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 		if(num_indices != (int)indices.size()) {
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * 2,
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof indices[0],
 					&indices[0], GL_STATIC_DRAW);
 		}
 		else {
-			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indices.size() * 2,
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indices.size() * sizeof indices[0],
 					&indices[0]);
 		}
 		num_indices = indices.size();
 	}
 }
 
-std::vector<Mesh*> load_meshes(const char *fname)
+bool Mesh::use_compact() const
 {
-	std::vector<Mesh*> meshes;
-	unsigned int ai_flags = aiProcessPreset_TargetRealtime_Quality;
-	const aiScene *scene = aiImportFile(fname, ai_flags);
-
-	for(unsigned int j=0; j<scene->mNumMeshes; j++) {
-		aiMesh *amesh = scene->mMeshes[j];
-		aiMaterial *amtl = scene->mMaterials[amesh->mMaterialIndex];
+	return compact && !is_skinned();
+}
 
-		if(!amesh->HasPositions() || !amesh->mNumFaces)
-			continue;
+void Mesh::set_compact(bool c)
+{
+	if(c == compact) return;
+	compact = c;
 
-		Mesh *mesh = new Mesh;
-		mesh->name = std::string(amesh->mName.C_Str());
-		printf("loading mesh: %s\n", mesh->name.c_str());
+	/* upload everything again, with the new sizes */
+	if(num_vertices) {
+		num_vertices = 0;
+		update_vbo(MESH_ALL);
+	}
+}
 
-		for(unsigned int i=0; i<amesh->mNumVertices; i++) {
-			Vec3 vertex = Vec3(amesh->mVertices[i].x,
-					amesh->mVertices[i].y,
-					amesh->mVertices[i].z);
-			mesh->vertices.push_back(vertex);
-		}
-		printf(" %u vertices\n", amesh->mNumVertices);
+/* a texture decoded, or loaded compressed from the cache, by a worker
+ * thread, waiting for the GL upload */
+struct TexJob {
+	std::string path;
+	uint32_t *pixels;
+	int xsz, ysz;
+	TexAlpha alpha;
+	TexBc bc;
+	bool have_bc, bc_cached;
+	unsigned int tex;
+};
 
-		if(amesh->HasNormals()) {
-			for(unsigned int i=0; i<amesh->mNumVertices; i++) {
-				Vec3 normal = Vec3(amesh->mNormals[i].x,
-						           amesh->mNormals[i].y,
-								   amesh->mNormals[i].z);
-				mesh->normals.push_back(normal);
-			}
-		}
+std::vector<Mesh*> load_meshes(const char *fname, Skeleton *skel, bool load_tex)
+{
+	std::vector<Mesh*> meshes;
+	unsigned int ai_flags = aiProcessPreset_TargetRealtime_Quality | aiProcess_LimitBoneWeights;
 
-		if(amesh->HasTextureCoords(0)) {
-			for(unsigned int i=0; i<amesh->mNumVertices; i++) {
-				Vec2 tc = Vec2(amesh->mTextureCoords[0][i].x,
-							   1.0f - amesh->mTextureCoords[0][i].y);
-				mesh->texcoords.push_back(tc);
-			}
-		}
+	unsigned long t0 = get_time_usec();
+	const aiScene *scene = aiImportFile(fname, ai_flags);
+	if(!scene) {
+		fprintf(stderr, "Failed to import %s: %s\n", fname, aiGetErrorString());
+		return meshes;
+	}
+	unsigned long t_import = get_time_usec();
 
-		if(amesh->HasVertexColors(0)) {
-			for(unsigned int i=0; i<amesh->mNumVertices; i++) {
-				Vec3 color = Vec3(amesh->mColors[0][i].r,
-								  amesh->mColors[0][i].g,
-								  amesh->mColors[0][i].b);
-				mesh->colors.push_back(color);
-			}
+	if(skel) {
+		load_nodes(scene->mRootNode, -1, skel);
+		load_anims(scene, skel);
+		if(!skel->anims.empty()) {
+			printf("%d animations, %d nodes\n", (int)skel->anims.size(), (int)skel->nodes.size());
 		}
-
-		for(unsigned int i=0; i<amesh->mNumFaces; i++) {
-			for(int j=0; j<3; j++) {
-				mesh->indices.push_back(amesh->mFaces[i].mIndices[j]);
-			}
+	}
+	unsigned long t_skel = get_time_usec();
+
+	std::vector<const aiMesh*> amesh_list;
+	for(unsigned int i=0; i<scene->mNumMeshes; i++) {
+		const aiMesh *amesh = scene->mMeshes[i];
+		if(amesh->HasPositions() && amesh->mNumFaces) {
+			amesh_list.push_back(amesh);
+			meshes.push_back(new Mesh);
 		}
-		printf(" %d faces\n", amesh->mNumFaces);
-
-		aiColor4D acol;
-		aiGetMaterialColor(amtl, AI_MATKEY_COLOR_DIFFUSE, &acol);
-		mesh->mtl.diffuse = Vec3(acol.r, acol.g, acol.b);
+	}
+	int num_meshes = meshes.size();
 
-		float sstr;
-		aiGetMaterialFloat(amtl, AI_MATKEY_SHININESS_STRENGTH, &sstr);
+	/* the meshes don't depend on each other, convert them in parallel */
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_meshes; i++) {
+		convert_mesh(amesh_list[i], scene->mMaterials[amesh_list[i]->mMaterialIndex], skel,
+				meshes[i]);
+	}
+	unsigned long t_conv = get_time_usec();
 
-		aiGetMaterialColor(amtl, AI_MATKEY_COLOR_SPECULAR, &acol);
-		mesh->mtl.specular = sstr * Vec3(acol.r, acol.g, acol.b) * 0.3;
+	/* texture of every mesh, -1 for none. Meshes sharing a texture share
+	 * the job */
+	std::vector<int> tex_job(num_meshes, -1);
+	std::vector<TexJob> jobs;
 
-		float shin;
-		aiGetMaterialFloat(amtl, AI_MATKEY_SHININESS, &shin);
-		mesh->mtl.shininess = shin * 6;
+	for(int i=0; i<num_meshes; i++) {
+		const aiMesh *amesh = amesh_list[i];
+		Mesh *mesh = meshes[i];
+		printf("loading mesh: %s\n", mesh->name.c_str());
+		printf(" %u vertices\n", amesh->mNumVertices);
+		printf(" %d faces\n", amesh->mNumFaces);
+		if(!mesh->bones.empty()) {
+			printf(" %d bones\n", (int)mesh->bones.size());
+		}
 
 		aiString astr;
-		if(aiGetMaterialTexture(amtl, aiTextureType_DIFFUSE, 0, &astr) == 0) {
-			char *fname = astr.data;
-			char *slash;
-			char *path;
+		const aiMaterial *amtl = scene->mMaterials[amesh->mMaterialIndex];
+		if(load_tex && aiGetMaterialTexture(amtl, aiTextureType_DIFFUSE, 0, &astr) == 0) {
+			const char *tex_fname = astr.data;
+			const char *slash;
 
-			if((slash = strrchr(fname, '/'))) {
-				fname = slash + 1;
+			if((slash = strrchr(tex_fname, '/'))) {
+				tex_fname = slash + 1;
+			}
+			if((slash = strrchr(tex_fname, '\\'))) {
+				tex_fname = slash + 1;
 			}
-			if((slash = strrchr(fname, '\\'))) {
-				fname = slash + 1;
+			std::string path = std::string("data/") + tex_fname;
+
+			for(size_t j=0; j<jobs.size(); j++) {
+				if(jobs[j].path == path) {
+					tex_job[i] = j;
+					break;
+				}
 			}
-			path = new char[strlen(fname) + 6];
-			sprintf(path, "data/%s", fname);
-			if(!(mesh->mtl.tex = img_gltexture_load(path))) {
-				fprintf(stderr, "Failed to load texture %s\n", path);
-			} else {
-				mesh->mtl.tex_opaque = check_tex_opaque(mesh->mtl.tex);
-				printf(" texture: %s (%s)\n", path, mesh->mtl.tex_opaque ? "opaque" : "transparent");
+			if(tex_job[i] == -1) {
+				TexJob job;
+				job.path = path;
+				job.pixels = 0;
+				job.have_bc = job.bc_cached = false;
+				job.tex = 0;
+				tex_job[i] = jobs.size();
+				jobs.push_back(job);
 			}
-			delete [] path;
 		}
+	}
+	aiReleaseImport(scene);
 
-		meshes.push_back(mesh);
+	/* with S3TC the textures are block compressed, and cached that way
+	 * next to the images. A cached texture isn't decoded at all */
+	bool use_bc = load_tex && GLEW_EXT_texture_compression_s3tc;
+
+	/* decode the images on the worker threads, and analyze their alpha
+	 * and transcode them there too, unless that's cached already */
+	int num_jobs = jobs.size();
+#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<num_jobs; i++) {
+		TexJob *job = &jobs[i];
+		std::string alpha_fname = job->path + ".alpha";
+		std::string bc_fname = job->path + ".bc";
+
+		if(use_bc && load_tex_alpha(&job->alpha, job->path.c_str(), alpha_fname.c_str()) &&
+				load_tex_bc(&job->bc, job->path.c_str(), bc_fname.c_str())) {
+			job->have_bc = job->bc_cached = true;
+			continue;
+		}
+
+		job->pixels = (uint32_t*)img_load_pixels(job->path.c_str(), &job->xsz, &job->ysz, IMG_FMT_RGBA32);
+		if(!job->pixels) continue;
+
+		if(!load_tex_alpha(&job->alpha, job->path.c_str(), alpha_fname.c_str())) {
+			calc_tex_alpha(&job->alpha, job->pixels, job->xsz * job->ysz);
+			save_tex_alpha(&job->alpha, job->path.c_str(), alpha_fname.c_str());
+		}
+		if(use_bc && encode_tex_bc(&job->bc, job->pixels, job->xsz, job->ysz, !job->alpha.opaque)) {
+			job->have_bc = true;
+			save_tex_bc(&job->bc, job->path.c_str(), bc_fname.c_str());
+		}
 	}
+	unsigned long t_decode = get_time_usec();
+
+	/* only the upload needs the GL context, which is this thread's */
+	for(int i=0; i<num_jobs; i++) {
+		TexJob *job = &jobs[i];
+		if(job->have_bc) {
+			job->tex = upload_texture_bc(&job->bc);
+			printf(" texture: %s (%s, %s%s)\n", job->path.c_str(), job->alpha.opaque ? "opaque" : "transparent",
+					job->bc.fmt == TEX_BC3 ? "BC3" : "BC1", job->bc_cached ? ", cached" : "");
+		} else if(job->pixels) {
+			job->tex = upload_texture(job->pixels, job->xsz, job->ysz);
+			printf(" texture: %s (%s)\n", job->path.c_str(), job->alpha.opaque ? "opaque" : "transparent");
+		} else {
+			fprintf(stderr, "Failed to load texture %s\n", job->path.c_str());
+		}
+		if(job->pixels) {
+			img_free_pixels(job->pixels);
+		}
+	}
+	for(int i=0; i<num_meshes; i++) {
+		if(tex_job[i] >= 0) {
+			meshes[i]->mtl.tex = jobs[tex_job[i]].tex;
+			meshes[i]->mtl.tex_opaque = jobs[tex_job[i]].alpha.opaque;
+			memcpy(meshes[i]->mtl.tex_alpha, jobs[tex_job[i]].alpha.hist, sizeof meshes[i]->mtl.tex_alpha);
+		}
+	}
+	unsigned long t_upload = get_time_usec();
 
-	aiReleaseImport(scene);
+	printf("%s: import %.1f ms, skeleton %.1f ms, meshes %.1f ms, textures %.1f ms, "
+			"upload %.1f ms\n", fname, (t_import - t0) / 1000.0, (t_skel - t_import) / 1000.0,
+			(t_conv - t_skel) / 1000.0, (t_decode - t_conv) / 1000.0, (t_upload - t_decode) / 1000.0);
 	return meshes;
 }
 
@@ -322,25 +585,303 @@ void Mesh::calc_bbox()
 	}
 }
 
-static bool check_tex_opaque(unsigned int tex)
+static unsigned int upload_texture(const uint32_t *pixels, int xsz, int ysz)
 {
-	int xsz, ysz;
-	uint32_t *pixels, *pptr;
+	unsigned int tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, xsz, ysz, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	return tex;
+}
+
+static unsigned int upload_texture_bc(const TexBc *bc)
+{
+	unsigned int fmt = bc->fmt == TEX_BC3 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
 
+	unsigned int tex;
+	glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
-	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &xsz);
-	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &ysz);
-	assert(xsz > 0 && ysz > 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, bc->num_levels - 1);
+	for(int i=0; i<bc->num_levels; i++) {
+		const TexBcLevel *lvl = bc->levels + i;
+		glCompressedTexImage2D(GL_TEXTURE_2D, i, fmt, lvl->xsz, lvl->ysz, 0, lvl->size,
+				&bc->data[lvl->offs]);
+	}
+	return tex;
+}
+
+static void upload_buffer(unsigned int target, const void *data, size_t size, bool realloc, unsigned int usage)
+{
+	if(realloc) {
+		glBufferData(target, size, data, usage);
+	} else {
+		glBufferSubData(target, 0, size, data);
+	}
+}
+
+/* maps the vertices to [-32767, 32767] with the same scale on every axis */
+static void calc_pack_xform(const std::vector<Vec3> &v, Vec3 *center, float *scale)
+{
+	Vec3 v0 = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vec3 v1 = -v0;
+
+	for(size_t i=0; i<v.size(); i++) {
+		for(int j=0; j<3; j++) {
+			if(v[i][j] < v0[j]) v0[j] = v[i][j];
+			if(v[i][j] > v1[j]) v1[j] = v[i][j];
+		}
+	}
+
+	Vec3 ext = (v1 - v0) * 0.5;
+	float maxext = ext.x > ext.y ? ext.x : ext.y;
+	if(ext.z > maxext) maxext = ext.z;
+
+	*center = (v0 + v1) * 0.5;
+	*scale = maxext > 0 ? maxext / 32767.0f : 1.0f;
+}
+
+/* padded to 4 bytes, drivers prefer aligned attributes */
+static void pack_snorm8(int8_t *dst, const Vec3 &n)
+{
+	for(int i=0; i<3; i++) {
+		float x = n[i] < -1.0f ? -1.0f : (n[i] > 1.0f ? 1.0f : n[i]);
+		dst[i] = (int8_t)roundf(x * 127.0f);
+	}
+	dst[3] = 0;
+}
+
+static void pack_unorm8(uint8_t *dst, const Vec3 &c)
+{
+	for(int i=0; i<3; i++) {
+		float x = c[i] < 0.0f ? 0.0f : (c[i] > 1.0f ? 1.0f : c[i]);
+		dst[i] = (uint8_t)roundf(x * 255.0f);
+	}
+	dst[3] = 255;
+}
+
+/* fills mesh from amesh, safe to call for different meshes at once */
+static void convert_mesh(const aiMesh *amesh, const aiMaterial *amtl, const Skeleton *skel, Mesh *mesh)
+{
+	int num_verts = amesh->mNumVertices;
+	mesh->name = std::string(amesh->mName.C_Str());
+
+	/* aiVector3D is 3 floats, unless assimp was built with doubles */
+	mesh->vertices.resize(num_verts);
+	if(sizeof(aiVector3D) == sizeof(Vec3)) {
+		memcpy(&mesh->vertices[0].x, amesh->mVertices, num_verts * sizeof(Vec3));
+	} else {
+		for(int i=0; i<num_verts; i++) {
+			mesh->vertices[i] = Vec3(amesh->mVertices[i].x, amesh->mVertices[i].y,
+					amesh->mVertices[i].z);
+		}
+	}
 
-	pptr = pixels = new uint32_t[xsz * ysz];
-	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	if(amesh->HasNormals()) {
+		mesh->normals.resize(num_verts);
+		if(sizeof(aiVector3D) == sizeof(Vec3)) {
+			memcpy(&mesh->normals[0].x, amesh->mNormals, num_verts * sizeof(Vec3));
+		} else {
+			for(int i=0; i<num_verts; i++) {
+				mesh->normals[i] = Vec3(amesh->mNormals[i].x, amesh->mNormals[i].y,
+						amesh->mNormals[i].z);
+			}
+		}
+	}
 
-	for(int i=0; i<xsz * ysz; i++) {
-		if((*pptr++ & 0xff000000) != 0xff000000) {
-			delete [] pixels;
-			return false;
+	if(amesh->HasTextureCoords(0)) {
+		mesh->texcoords.resize(num_verts);
+		const aiVector3D *atc = amesh->mTextureCoords[0];
+		for(int i=0; i<num_verts; i++) {
+			mesh->texcoords[i] = Vec2(atc[i].x, 1.0f - atc[i].y);
 		}
 	}
-	delete [] pixels;
-	return true;
+
+	if(amesh->HasVertexColors(0)) {
+		mesh->colors.resize(num_verts);
+		const aiColor4D *acol = amesh->mColors[0];
+		for(int i=0; i<num_verts; i++) {
+			mesh->colors[i] = Vec3(acol[i].r, acol[i].g, acol[i].b);
+		}
+	}
+
+	/* triangulated by the import preset */
+	int num_faces = amesh->mNumFaces;
+	mesh->indices.resize(num_faces * 3);
+	uint32_t *idx = &mesh->indices[0];
+	for(int i=0; i<num_faces; i++) {
+		const unsigned int *fidx = amesh->mFaces[i].mIndices;
+		*idx++ = fidx[0];
+		*idx++ = fidx[1];
+		*idx++ = fidx[2];
+	}
+
+	if(skel && amesh->HasBones()) {
+		load_bones(amesh, skel, mesh);
+	}
+
+	aiColor4D acol;
+	aiGetMaterialColor(amtl, AI_MATKEY_COLOR_DIFFUSE, &acol);
+	mesh->mtl.diffuse = Vec3(acol.r, acol.g, acol.b);
+
+	float sstr;
+	aiGetMaterialFloat(amtl, AI_MATKEY_SHININESS_STRENGTH, &sstr);
+
+	aiGetMaterialColor(amtl, AI_MATKEY_COLOR_SPECULAR, &acol);
+	mesh->mtl.specular = sstr * Vec3(acol.r, acol.g, acol.b) * 0.3;
+
+	float shin;
+	aiGetMaterialFloat(amtl, AI_MATKEY_SHININESS, &shin);
+	mesh->mtl.shininess = shin * 6;
+}
+
+/* aiMatrix4x4 is row-major with the translation in the 4th column */
+static Mat4 conv_matrix(const aiMatrix4x4 &am)
+{
+	Mat4 m;
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			m[i][j] = am[j][i];
+		}
+	}
+	return m;
+}
+
+static void load_nodes(const aiNode *anode, int parent, Skeleton *skel)
+{
+	SkelNode node;
+	node.name = std::string(anode->mName.C_Str());
+	node.parent = parent;
+	node.rest_xform = conv_matrix(anode->mTransformation);
+	node.local_xform = node.global_xform = node.rest_xform;
+	if(parent >= 0) {
+		node.global_xform = skel->nodes[parent].global_xform * node.rest_xform;
+	}
+
+	int idx = skel->nodes.size();
+	skel->nodes.push_back(node);
+
+	for(unsigned int i=0; i<anode->mNumChildren; i++) {
+		load_nodes(anode->mChildren[i], idx, skel);
+	}
+}
+
+static void load_anims(const aiScene *scene, Skeleton *skel)
+{
+	for(unsigned int i=0; i<scene->mNumAnimations; i++) {
+		const aiAnimation *aanim = scene->mAnimations[i];
+		float tps = aanim->mTicksPerSecond > 0 ? aanim->mTicksPerSecond : 25.0;
+
+		Animation anim;
+		anim.name = std::string(aanim->mName.C_Str());
+		anim.duration = aanim->mDuration / tps;
+
+		for(unsigned int j=0; j<aanim->mNumChannels; j++) {
+			const aiNodeAnim *ach = aanim->mChannels[j];
+
+			AnimChannel ch;
+			if((ch.node = skel->find_node(ach->mNodeName.C_Str())) == -1) {
+				fprintf(stderr, "animation %s: unknown node %s\n", anim.name.c_str(),
+						ach->mNodeName.C_Str());
+				continue;
+			}
+
+			for(unsigned int k=0; k<ach->mNumPositionKeys; k++) {
+				const aiVectorKey &key = ach->mPositionKeys[k];
+				ch.pos_times.push_back(key.mTime / tps);
+				ch.pos_keys.push_back(Vec3(key.mValue.x, key.mValue.y, key.mValue.z));
+			}
+			for(unsigned int k=0; k<ach->mNumRotationKeys; k++) {
+				const aiQuatKey &key = ach->mRotationKeys[k];
+				Quat q;
+				q.x = key.mValue.x;
+				q.y = key.mValue.y;
+				q.z = key.mValue.z;
+				q.w = key.mValue.w;
+				ch.rot_times.push_back(key.mTime / tps);
+				ch.rot_keys.push_back(q);
+			}
+			for(unsigned int k=0; k<ach->mNumScalingKeys; k++) {
+				const aiVectorKey &key = ach->mScalingKeys[k];
+				ch.scl_times.push_back(key.mTime / tps);
+				ch.scl_keys.push_back(Vec3(key.mValue.x, key.mValue.y, key.mValue.z));
+			}
+			anim.channels.push_back(ch);
+		}
+		skel->anims.push_back(anim);
+	}
+}
+
+static void load_bones(const aiMesh *amesh, const Skeleton *skel, Mesh *mesh)
+{
+	int num_bones = 0;
+	int num_verts = amesh->mNumVertices;
+
+	VertexWeights zero_vw;
+	memset(&zero_vw, 0, sizeof zero_vw);
+	mesh->weights.resize(num_verts, zero_vw);
+
+	for(unsigned int i=0; i<amesh->mNumBones; i++) {
+		const aiBone *abone = amesh->mBones[i];
+
+		MeshBone bone;
+		if((bone.node = skel->find_node(abone->mName.C_Str())) == -1) {
+			fprintf(stderr, "mesh %s: bone %s has no node\n", mesh->name.c_str(),
+					abone->mName.C_Str());
+			continue;
+		}
+		bone.offset = conv_matrix(abone->mOffsetMatrix);
+
+		/* keep the strongest MAX_BONE_INFLUENCES, sorted by weight */
+		for(unsigned int j=0; j<abone->mNumWeights; j++) {
+			const aiVertexWeight &aw = abone->mWeights[j];
+			VertexWeights *vw = &mesh->weights[aw.mVertexId];
+
+			int k = MAX_BONE_INFLUENCES;
+			while(k > 0 && vw->weight[k - 1] < aw.mWeight) {
+				if(k < MAX_BONE_INFLUENCES) {
+					vw->weight[k] = vw->weight[k - 1];
+					vw->bone[k] = vw->bone[k - 1];
+				}
+				k--;
+			}
+			if(k < MAX_BONE_INFLUENCES) {
+				vw->weight[k] = aw.mWeight;
+				vw->bone[k] = num_bones;
+			}
+		}
+
+		mesh->bones.push_back(bone);
+		num_bones++;
+	}
+
+	for(int i=0; i<num_verts; i++) {
+		VertexWeights *vw = &mesh->weights[i];
+
+		float sum = 0;
+		for(int j=0; j<MAX_BONE_INFLUENCES; j++) {
+			sum += vw->weight[j];
+		}
+		if(sum <= 0) {
+			/* no influences, use the identity at the end of the palette */
+			vw->bone[0] = num_bones;
+			vw->weight[0] = 1;
+			continue;
+		}
+		for(int j=0; j<MAX_BONE_INFLUENCES; j++) {
+			vw->weight[j] /= sum;
+		}
+	}
+
+	if(mesh->bones.empty()) {
+		mesh->weights.clear();
+		return;
+	}
+
+	mesh->bind_vertices = mesh->vertices;
+	mesh->bind_normals = mesh->normals;
 }
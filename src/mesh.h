@@ -5,6 +5,9 @@
 #include <vector>
 #include <gmath/gmath.h>
 
+#include "skeleton.h"
+#include "texalpha.h"
+
 #define MESH_ALL (0xffffffff)
 
 enum {
@@ -20,6 +23,18 @@ struct Aabb {
 	Vec3 v1;
 };
 
+#define MAX_BONE_INFLUENCES	4
+
+struct MeshBone {
+	int node;	/* index in Skeleton::nodes */
+	Mat4 offset;	/* mesh space -> bone space in bind pose */
+};
+
+struct VertexWeights {
+	uint16_t bone[MAX_BONE_INFLUENCES];
+	float weight[MAX_BONE_INFLUENCES];
+};
+
 struct Material {
 	Vec3 diffuse;
 	Vec3 specular;
@@ -27,6 +42,7 @@ struct Material {
 
 	unsigned int tex;
 	bool tex_opaque;
+	uint32_t tex_alpha[TEX_ALPHA_BINS];	/* histogram of the texture alpha */
 };
 
 class Mesh {
@@ -40,6 +56,14 @@ private:
 	int num_vertices;
 	int num_indices;
 
+	/* compact vertex buffers: 16 bit positions relative to pack_center,
+	 * scaled by pack_scale, 8 bit normals and colors */
+	bool compact;
+	Vec3 pack_center;
+	float pack_scale;
+
+	bool use_compact() const;
+
 public:
 	Mesh();
 	~Mesh();
@@ -48,18 +72,35 @@ public:
 	Material mtl;
 
 	std::string name;
-	std::vector<uint16_t> indices;
+	std::vector<uint32_t> indices;
 	std::vector<Vec3> vertices;
 	std::vector<Vec2> texcoords;
 	std::vector<Vec3> normals;
 	std::vector<Vec3> colors;
 
+	/* skinning data, bones is empty for rigid meshes */
+	std::vector<MeshBone> bones;
+	std::vector<VertexWeights> weights;
+	std::vector<Vec3> bind_vertices;
+	std::vector<Vec3> bind_normals;
+
+	bool is_skinned() const;
+	/* deforms vertices/normals from the bind pose with the current
+	 * global_xform of the skeleton nodes (see Skeleton::eval) */
+	void skin(const Skeleton *skel);
+
 	void draw() const;
 	void update_vbo(unsigned int which);
+	/* static meshes only, skinned ones keep float buffers. Uploads the
+	 * buffers again if they exist already */
+	void set_compact(bool c);
 
 	void calc_bbox();
 };
 
-std::vector<Mesh*> load_meshes(const char *fname);
+/* if skel is not null, the node hierarchy, bones and animations are
+ * imported as well. Textures need a GL context, pass load_tex = false
+ * without one */
+std::vector<Mesh*> load_meshes(const char *fname, Skeleton *skel = 0, bool load_tex = true);
 
 #endif // MESH_H_
@@ -0,0 +1,240 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "params.h"
+
+static const char *coll_names[] = {"none", "halfspace", "spheres", "sdf", "tree"};
+static const char *integ_names[] = {"symplectic", "implicit"};
+
+static char *strip(char *s);
+static int find_name(const char *val, const char **names, int count);
+static bool parse_vec3(const char *val, float *res);
+
+void default_params(HairParams *p)
+{
+	p->hair_length = 0.5;
+	p->k_anc = 4.0;
+	p->damping = 1.5;
+	p->integrator = INTEG_SYMPLECTIC;
+	p->coll_mode = COLL_SPHERES;
+	p->sdf_res = 32;
+	p->max_substeps = 16;
+	p->cfl = 0.25;
+	p->rest_speed = 1e-3;
+	p->rest_stretch = 1e-3;
+	p->compact = false;
+
+	p->wind[0] = p->wind[1] = p->wind[2] = 0;
+	p->wind_drag = 1.0;
+	p->fan_pos[0] = 0;
+	p->fan_pos[1] = 0;
+	p->fan_pos[2] = 2;
+	p->fan_speed = 0;
+	p->fan_radius = 0.5;
+	p->turb_speed = 0;
+	p->turb_scale = 0.5;
+	p->turb_rate = 0.5;
+	p->wind_res = 16;
+
+	p->tess_segs = 8;
+	p->tess_pixels = 6;
+
+	p->max_spawns = 1600;
+	p->thresh = 0.5;
+	p->min_dist = 0.05;
+}
+
+bool load_params(HairParams *p, const char *fname)
+{
+	FILE *fp = fopen(fname, "r");
+	if(!fp) {
+		fprintf(stderr, "failed to open parameter file %s\n", fname);
+		return false;
+	}
+
+	/* parse into a copy, so that errors don't leave p half updated */
+	HairParams np = *p;
+	bool res = true;
+	char buf[256];
+	int line = 0;
+
+	while(fgets(buf, sizeof buf, fp)) {
+		line++;
+
+		char *ptr = strchr(buf, '#');
+		if(ptr) *ptr = 0;
+
+		char *name = strip(buf);
+		if(!*name) continue;
+
+		char *val = strchr(name, '=');
+		if(!val) {
+			fprintf(stderr, "%s:%d: expected name = value\n", fname, line);
+			res = false;
+			continue;
+		}
+		*val++ = 0;
+		name = strip(name);
+		val = strip(val);
+
+		char *end;
+		float fval = strtod(val, &end);
+		bool is_num = *val && !*end;
+
+		if(strcmp(name, "integrator") == 0) {
+			int idx = find_name(val, integ_names, NUM_INTEG);
+			if(idx >= 0) {
+				np.integrator = idx;
+				continue;
+			}
+		} else if(strcmp(name, "collision") == 0) {
+			int idx = find_name(val, coll_names, NUM_COLL_MODES);
+			if(idx >= 0) {
+				np.coll_mode = idx;
+				continue;
+			}
+		} else if(strcmp(name, "wind") == 0) {
+			if(parse_vec3(val, np.wind)) {
+				continue;
+			}
+		} else if(strcmp(name, "fan_pos") == 0) {
+			if(parse_vec3(val, np.fan_pos)) {
+				continue;
+			}
+		} else if(is_num) {
+			if(strcmp(name, "hair_length") == 0 && fval > 0) {
+				np.hair_length = fval;
+				continue;
+			} else if(strcmp(name, "k_anc") == 0 && fval >= 0) {
+				np.k_anc = fval;
+				continue;
+			} else if(strcmp(name, "damping") == 0 && fval >= 0) {
+				np.damping = fval;
+				continue;
+			} else if(strcmp(name, "sdf_res") == 0 && fval >= 4) {
+				np.sdf_res = fval;
+				continue;
+			} else if(strcmp(name, "max_substeps") == 0 && fval >= 1) {
+				np.max_substeps = fval;
+				continue;
+			} else if(strcmp(name, "cfl") == 0 && fval > 0) {
+				np.cfl = fval;
+				continue;
+			} else if(strcmp(name, "rest_speed") == 0 && fval >= 0) {
+				np.rest_speed = fval;
+				continue;
+			} else if(strcmp(name, "rest_stretch") == 0 && fval >= 0) {
+				np.rest_stretch = fval;
+				continue;
+			} else if(strcmp(name, "compact") == 0 && (fval == 0 || fval == 1)) {
+				np.compact = fval != 0;
+				continue;
+			} else if(strcmp(name, "wind_drag") == 0 && fval >= 0) {
+				np.wind_drag = fval;
+				continue;
+			} else if(strcmp(name, "fan_speed") == 0) {
+				np.fan_speed = fval;
+				continue;
+			} else if(strcmp(name, "fan_radius") == 0 && fval > 0) {
+				np.fan_radius = fval;
+				continue;
+			} else if(strcmp(name, "turb_speed") == 0 && fval >= 0) {
+				np.turb_speed = fval;
+				continue;
+			} else if(strcmp(name, "turb_scale") == 0 && fval > 0) {
+				np.turb_scale = fval;
+				continue;
+			} else if(strcmp(name, "turb_rate") == 0 && fval >= 0) {
+				np.turb_rate = fval;
+				continue;
+			} else if(strcmp(name, "wind_res") == 0 && fval >= 2 && fval <= 128) {
+				np.wind_res = fval;
+				continue;
+			} else if(strcmp(name, "tess_segs") == 0 && fval >= 1 && fval <= TESS_MAX_SEGS) {
+				np.tess_segs = fval;
+				continue;
+			} else if(strcmp(name, "tess_pixels") == 0 && fval > 0) {
+				np.tess_pixels = fval;
+				continue;
+			} else if(strcmp(name, "max_spawns") == 0 && fval >= 1) {
+				np.max_spawns = fval;
+				continue;
+			} else if(strcmp(name, "thresh") == 0) {
+				np.thresh = fval;
+				continue;
+			} else if(strcmp(name, "min_dist") == 0 && fval >= 0) {
+				np.min_dist = fval;
+				continue;
+			}
+		}
+		fprintf(stderr, "%s:%d: invalid parameter: %s = %s\n", fname, line, name, val);
+		res = false;
+	}
+	fclose(fp);
+
+	if(res) {
+		*p = np;
+	}
+	return res;
+}
+
+bool reload_params(HairParams *p, const char *fname, long long *mtime)
+{
+	struct stat st;
+	if(stat(fname, &st) == -1) {
+		return false;
+	}
+
+	long long t = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	if(t == *mtime) {
+		return false;
+	}
+	*mtime = t;
+	return load_params(p, fname);
+}
+
+static char *strip(char *s)
+{
+	while(*s && isspace(*s)) s++;
+
+	char *end = s + strlen(s);
+	while(end > s && isspace(end[-1])) {
+		*--end = 0;
+	}
+	return s;
+}
+
+static int find_name(const char *val, const char **names, int count)
+{
+	for(int i=0; i<count; i++) {
+		if(strcmp(val, names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* three numbers separated by spaces or commas */
+static bool parse_vec3(const char *val, float *res)
+{
+	float v[3];
+	for(int i=0; i<3; i++) {
+		char *end;
+		v[i] = strtod(val, &end);
+		if(end == val) {
+			return false;
+		}
+		val = end;
+		while(*val && (isspace(*val) || *val == ',')) val++;
+	}
+	if(*val) {
+		return false;
+	}
+	for(int i=0; i<3; i++) {
+		res[i] = v[i];
+	}
+	return true;
+}
@@ -0,0 +1,93 @@
+#ifndef PARAMS_H_
+#define PARAMS_H_
+
+/* collision modes, each one includes the ones before it except for none:
+ * half-space keeps the strands above their root, spheres adds the collider
+ * spheres, sdf adds the signed distance field of the head instead, and tree
+ * a sphere tree fitted to the head instead of either */
+enum {
+	COLL_NONE,
+	COLL_HALFSPACE,
+	COLL_SPHERES,
+	COLL_SDF,
+	COLL_TREE,
+
+	NUM_COLL_MODES
+};
+
+/* most segments a strand is drawn with, see tess_segs */
+#define TESS_MAX_SEGS	32
+
+enum {
+	INTEG_SYMPLECTIC,	/* semi-implicit Euler */
+	INTEG_IMPLICIT,		/* backward Euler, stable with stiff springs */
+
+	NUM_INTEG
+};
+
+struct HairParams {
+	/* simulation, applied on the next update */
+	float hair_length;
+	float k_anc;	/* anchor spring constant */
+	float damping;	/* 0 disables damping */
+	int integrator;
+	int coll_mode;
+	int sdf_res;	/* voxels along the longest side of the head, for the
+					 * sdf and for fitting the sphere tree */
+
+	/* adaptive substepping: an update is split so that strands move at
+	 * most cfl hair lengths per substep, in up to max_substeps substeps */
+	int max_substeps;
+	float cfl;
+
+	/* the hair is at rest (and stops being redrawn) once no strand moves
+	 * faster than rest_speed or is stretched past rest_stretch */
+	float rest_speed;
+	float rest_stretch;
+
+	/* the update kernel reads the strand roots quantized to 16 bits, which
+	 * cuts the memory it streams through per strand by a third, for when
+	 * it's bandwidth bound: many cores and more strands than fit in cache */
+	bool compact;
+
+	/* external forces, as an air velocity in world space which drags the
+	 * strands along with wind_drag (0, or no anchor spring, disables
+	 * them): uniform wind, a fan
+	 * blowing out from fan_pos at fan_speed, slowing down with the square
+	 * of the distance past fan_radius, and curl noise turbulence of about
+	 * turb_speed, with eddies turb_scale across which drift with the wind
+	 * and change at turb_rate. The air is sampled on a grid of wind_res
+	 * cells along the longest side of the hair, once per update */
+	float wind[3];
+	float wind_drag;
+	float fan_pos[3];
+	float fan_speed;
+	float fan_radius;
+	float turb_speed;
+	float turb_scale;
+	float turb_rate;
+	int wind_res;
+
+	/* drawing: strands are drawn as curves of up to tess_segs segments,
+	 * fewer as they get smaller on screen, about tess_pixels long each.
+	 * 1 draws them straight */
+	int tess_segs;
+	float tess_pixels;
+
+	/* strand sampling, applied by Hair::init */
+	int max_spawns;
+	float thresh;	/* vertex colors darker than this grow hair */
+	float min_dist;	/* minimum distance between strand roots */
+};
+
+void default_params(HairParams *p);
+
+/* reads "name = value" lines, # starts a comment. Parameters missing from
+ * the file keep their current value */
+bool load_params(HairParams *p, const char *fname);
+
+/* reloads fname into p if its modification time differs from *mtime
+ * (start from 0), and updates *mtime. Returns true if p was reloaded */
+bool reload_params(HairParams *p, const char *fname, long long *mtime);
+
+#endif // PARAMS_H_
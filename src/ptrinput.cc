@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <atomic>
+#include <X11/Xlib.h>
+#include <GL/glx.h>
+
+#include "ptrinput.h"
+#include "spsc.h"
+#include "timer.h"
+
+/* how long the thread waits for events before checking for stop */
+#define POLL_MSEC	100
+
+static void *input_func(void *arg);
+
+/* used by the input thread alone while it runs */
+static Display *dpy;
+static pthread_t thread;
+static bool running;
+static std::atomic<bool> quit;
+
+static SpscQueue<PointerEvent, 1024> queue;
+
+bool start_pointer_input()
+{
+	if(running) return true;
+
+	Display *gl_dpy = glXGetCurrentDisplay();
+	GLXDrawable win = glXGetCurrentDrawable();
+	if(!gl_dpy || !win) {
+		fprintf(stderr, "%s: no current GLX window\n", __func__);
+		return false;
+	}
+
+	/* a connection of its own, Xlib connections aren't shared by threads.
+	 * Motion goes to every client which selects it, GLUT still gets it */
+	if(!(dpy = XOpenDisplay(DisplayString(gl_dpy)))) {
+		fprintf(stderr, "%s: failed to connect to the X server\n", __func__);
+		return false;
+	}
+	XSelectInput(dpy, win, PointerMotionMask);
+	XFlush(dpy);
+
+	quit = false;
+	if(pthread_create(&thread, 0, input_func, 0) != 0) {
+		fprintf(stderr, "%s: failed to start the input thread\n", __func__);
+		XCloseDisplay(dpy);
+		dpy = 0;
+		return false;
+	}
+	running = true;
+	return true;
+}
+
+void stop_pointer_input()
+{
+	if(!running) return;
+
+	quit = true;
+	pthread_join(thread, 0);
+	XCloseDisplay(dpy);
+	dpy = 0;
+	running = false;
+}
+
+bool pointer_input_running()
+{
+	return running;
+}
+
+bool pop_pointer_input(PointerEvent *ev)
+{
+	return queue.pop(ev);
+}
+
+static void *input_func(void *arg)
+{
+	struct pollfd pfd;
+	pfd.fd = ConnectionNumber(dpy);
+	pfd.events = POLLIN;
+
+	while(!quit) {
+		while(XPending(dpy)) {
+			XEvent xev;
+			XNextEvent(dpy, &xev);
+			if(xev.type != MotionNotify) continue;
+
+			PointerEvent ev;
+			ev.x = xev.xmotion.x;
+			ev.y = xev.xmotion.y;
+			ev.buttons = 0;
+			if(xev.xmotion.state & Button1Mask) ev.buttons |= PTR_LEFT;
+			if(xev.xmotion.state & Button2Mask) ev.buttons |= PTR_MIDDLE;
+			if(xev.xmotion.state & Button3Mask) ev.buttons |= PTR_RIGHT;
+			ev.time_usec = get_time_usec();
+
+			/* the positions are absolute, so if the main thread stalled
+			 * and the queue is full, the next one makes up for this */
+			queue.push(ev);
+		}
+		poll(&pfd, 1, POLL_MSEC);
+	}
+	return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef PTRINPUT_H_
+#define PTRINPUT_H_
+
+/* Pointer motion of the current GLX window, read on a thread with its own
+ * connection to the X server, and queued lock-free for the main thread.
+ *
+ * GLUT only hands the main thread the motion it received before display
+ * started. The queue also has the motion which arrived while drawing, so
+ * display can pick it up right before submitting the frame.
+ */
+
+#define PTR_LEFT	1
+#define PTR_MIDDLE	2
+#define PTR_RIGHT	4
+
+struct PointerEvent {
+	int x, y;	/* window coordinates */
+	unsigned int buttons;	/* PTR_* held during the motion */
+	unsigned long time_usec;	/* get_time_usec when it was read */
+};
+
+/* starts reading the window of the current GLX context */
+bool start_pointer_input();
+void stop_pointer_input();
+bool pointer_input_running();
+
+/* oldest queued motion, false if there's none */
+bool pop_pointer_input(PointerEvent *ev);
+
+#endif // PTRINPUT_H_
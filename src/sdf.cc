@@ -0,0 +1,173 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "sdf.h"
+#include "bvh.h"
+
+static Vec3 face_normal(const Mesh *m, int tri);
+static void flood_outside(Sdf *sdf, const std::vector<int> &near_tri);
+
+bool build_sdf(Sdf *sdf, const Mesh *m, int res)
+{
+	int num_tri = m->indices.empty() ? m->vertices.size() / 3 : m->indices.size() / 3;
+	if(!num_tri || res < 2) {
+		fprintf(stderr, "build_sdf: empty mesh\n");
+		return false;
+	}
+
+	Aabb box = m->bbox;
+	Vec3 ext = box.v1 - box.v0;
+	float max_ext = std::max(ext.x, std::max(ext.y, ext.z));
+	sdf->cell = max_ext / res;
+
+	/* leave room for the band around the mesh */
+	Vec3 pad = Vec3(1, 1, 1) * (sdf->cell * (SDF_BAND + 1));
+	sdf->origin = box.v0 - pad;
+	sdf->xsz = (int)ceil((ext.x + pad.x * 2) / sdf->cell) + 1;
+	sdf->ysz = (int)ceil((ext.y + pad.y * 2) / sdf->cell) + 1;
+	sdf->zsz = (int)ceil((ext.z + pad.z * 2) / sdf->cell) + 1;
+
+	Bvh bvh;
+	if(!bvh.build(m)) {
+		return false;
+	}
+
+	int xsz = sdf->xsz, ysz = sdf->ysz, zsz = sdf->zsz;
+	float band = SDF_BAND * sdf->cell;
+	sdf->dist.assign(xsz * ysz * zsz, FLT_MAX);
+	std::vector<int> near_tri(xsz * ysz * zsz, -1);
+
+	/* every cell asks the bvh for the closest triangle within the band */
+#pragma omp parallel for schedule(dynamic)
+	for(int z=0; z<zsz; z++) {
+		for(int y=0; y<ysz; y++) {
+			for(int x=0; x<xsz; x++) {
+				Vec3 p = sdf->origin + Vec3(x, y, z) * sdf->cell;
+				BvhHit hit;
+				if(!bvh.closest_point(p, band, &hit)) {
+					continue;
+				}
+
+				int idx = (z * ysz + y) * xsz + x;
+				Vec3 n = face_normal(m, hit.tri);
+				sdf->dist[idx] = dot(p - hit.pos, n) < 0 ? -hit.dist : hit.dist;
+				near_tri[idx] = hit.tri;
+			}
+		}
+	}
+
+	flood_outside(sdf, near_tri);
+	return true;
+}
+
+/* normal of a triangle pointing out of the mesh. Inside and outside are
+ * told by the vertex normals, which don't depend on the winding, and
+ * degenerate triangles have only those */
+static Vec3 face_normal(const Mesh *m, int tri)
+{
+	int i0 = m->indices.empty() ? tri * 3 : m->indices[tri * 3];
+	int i1 = m->indices.empty() ? tri * 3 + 1 : m->indices[tri * 3 + 1];
+	int i2 = m->indices.empty() ? tri * 3 + 2 : m->indices[tri * 3 + 2];
+	const Vec3 &a = m->vertices[i0];
+	const Vec3 &b = m->vertices[i1];
+	const Vec3 &c = m->vertices[i2];
+
+	Vec3 n = cross(b - a, c - a);
+	if(m->normals.size() == m->vertices.size()) {
+		Vec3 vn = m->normals[i0] + m->normals[i1] + m->normals[i2];
+		if(length(n) <= 0) {
+			return vn;
+		}
+		if(dot(vn, n) < 0) {
+			n = -n;
+		}
+	}
+	return n;
+}
+
+/* cells away from the surface get +band if they can be reached from the
+ * border of the grid without crossing it, -band otherwise */
+static void flood_outside(Sdf *sdf, const std::vector<int> &near_tri)
+{
+	int xsz = sdf->xsz, ysz = sdf->ysz, zsz = sdf->zsz;
+	float band = SDF_BAND * sdf->cell;
+	std::vector<bool> outside(sdf->dist.size(), false);
+	std::vector<int> stack;
+
+	for(int z=0; z<zsz; z++) {
+		for(int y=0; y<ysz; y++) {
+			for(int x=0; x<xsz; x++) {
+				if(x == 0 || y == 0 || z == 0 || x == xsz - 1 || y == ysz - 1 || z == zsz - 1) {
+					stack.push_back((z * ysz + y) * xsz + x);
+				}
+			}
+		}
+	}
+
+	while(!stack.empty()) {
+		int idx = stack.back();
+		stack.pop_back();
+		if(outside[idx] || (near_tri[idx] >= 0 && sdf->dist[idx] < 0)) {
+			continue;
+		}
+		outside[idx] = true;
+
+		int x = idx % xsz;
+		int y = (idx / xsz) % ysz;
+		int z = idx / (xsz * ysz);
+		if(x > 0) stack.push_back(idx - 1);
+		if(x < xsz - 1) stack.push_back(idx + 1);
+		if(y > 0) stack.push_back(idx - xsz);
+		if(y < ysz - 1) stack.push_back(idx + xsz);
+		if(z > 0) stack.push_back(idx - xsz * ysz);
+		if(z < zsz - 1) stack.push_back(idx + xsz * ysz);
+	}
+
+	for(size_t i=0; i<sdf->dist.size(); i++) {
+		if(near_tri[i] < 0) {
+			sdf->dist[i] = outside[i] ? band : -band;
+		} else if(sdf->dist[i] > band) {
+			sdf->dist[i] = band;
+		} else if(sdf->dist[i] < -band) {
+			sdf->dist[i] = -band;
+		}
+	}
+}
+
+/* closest point to p on triangle abc (Ericson, Real-Time Collision Detection) */
+Vec3 closest_point_triangle(const Vec3 &p, const Vec3 &a, const Vec3 &b, const Vec3 &c)
+{
+	Vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if(d1 <= 0 && d2 <= 0) return a;
+
+	Vec3 bp = p - b;
+	float d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if(d3 >= 0 && d4 <= d3) return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if(vc <= 0 && d1 >= 0 && d3 <= 0) {
+		return a + ab * (d1 / (d1 - d3));
+	}
+
+	Vec3 cp = p - c;
+	float d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if(d6 >= 0 && d5 <= d6) return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if(vb <= 0 && d2 >= 0 && d6 <= 0) {
+		return a + ac * (d2 / (d2 - d6));
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if(va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	}
+
+	float denom = 1.0f / (va + vb + vc);
+	float v = vb * denom;
+	float w = vc * denom;
+	return a + ab * v + ac * w;
+}
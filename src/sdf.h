@@ -0,0 +1,26 @@
+#ifndef SDF_H_
+#define SDF_H_
+
+#include <vector>
+#include <gmath/gmath.h>
+
+#include "mesh.h"
+
+/* narrow band signed distance grid of a mesh, negative inside. Distances
+ * are exact within SDF_BAND cells of the surface, and clamped to
+ * +/- SDF_BAND cells further away */
+#define SDF_BAND	3
+
+struct Sdf {
+	std::vector<float> dist;
+	int xsz, ysz, zsz;
+	Vec3 origin;	/* position of sample (0, 0, 0) */
+	float cell;
+};
+
+/* res is the number of cells along the longest side of the mesh bounds */
+bool build_sdf(Sdf *sdf, const Mesh *m, int res);
+
+Vec3 closest_point_triangle(const Vec3 &p, const Vec3 &a, const Vec3 &b, const Vec3 &c);
+
+#endif // SDF_H_
@@ -0,0 +1,364 @@
+/* Headless simulation server.
+ *
+ * Any number of clients connect to a Unix stream socket and send head
+ * transforms (SimRequest, see simproto.h). Requests are gathered between
+ * ticks, and every tick runs a single update with the latest transform,
+ * regardless of how many clients sent one. The strand positions are
+ * quantized once per tick into a reference counted buffer, which is sent
+ * to every client behind a small per-client header without copying it
+ * again. A client that can't keep up skips frames instead of stalling the
+ * others.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "server.h"
+#include "simproto.h"
+#include "timer.h"
+
+#define MAX_CLIENTS	64
+
+/* quantized positions of a tick, shared by the clients sending it */
+struct FrameBuf {
+	std::vector<uint16_t> data;
+	int refs;
+};
+
+struct Client {
+	int fd;
+
+	/* partially received request */
+	SimRequest req;
+	int req_bytes;
+	uint32_t ack;
+
+	/* frame being sent, and how much of it is already out */
+	SimFrame hdr;
+	FrameBuf *buf;
+	size_t sent;
+
+	long frames_sent;
+	long frames_dropped;
+};
+
+static volatile sig_atomic_t quit;
+
+static void sig_handler(int sig);
+static int open_socket(const char *path);
+static void accept_clients(int sock, std::vector<Client*> *clients);
+static bool read_requests(Client *c, Mat4 *xform, bool *new_xform);
+static void queue_frame(Client *c, const SimFrame &frm, FrameBuf *buf);
+static bool flush_frame(Client *c);
+static FrameBuf *get_frame_buf(std::vector<FrameBuf*> *pool);
+static void close_client(Client *c);
+
+int run_server(Hair *hair, const char *path, float tick_rate, const Aabb &bbox)
+{
+	int sock = open_socket(path);
+	if(sock == -1) {
+		return 1;
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	Aabb bounds = hair->calc_strand_bounds(bbox);
+	Vec3 bmin = bounds.v0;
+	Vec3 bscale, bstep;
+	for(int i=0; i<3; i++) {
+		float ext = bounds.v1[i] - bounds.v0[i];
+		bstep[i] = ext / 65535.0;
+		bscale[i] = ext > 0 ? 65535.0 / ext : 0;
+	}
+
+	std::vector<Client*> clients;
+	std::vector<pollfd> pfd;
+	std::vector<FrameBuf*> pool;
+	Mat4 xform = Mat4::identity;
+	unsigned int tick = 0;
+	float sim_time = 0;
+
+	float dt = 1.0 / tick_rate;
+	unsigned long tick_usec = 1000000 / tick_rate;
+	unsigned long next_tick = get_time_usec() + tick_usec;
+
+	printf("simulation server listening on %s, %g ticks per second\n", path, tick_rate);
+
+	while(!quit) {
+		/* gather requests until the next tick */
+		unsigned long now;
+		while((now = get_time_usec()) < next_tick && !quit) {
+			pfd.resize(clients.size() + 1);
+			pfd[0].fd = sock;
+			pfd[0].events = POLLIN;
+			for(size_t i=0; i<clients.size(); i++) {
+				pfd[i + 1].fd = clients[i]->fd;
+				pfd[i + 1].events = clients[i]->buf ? POLLIN | POLLOUT : POLLIN;
+			}
+
+			int timeout = (next_tick - now + 999) / 1000;
+			if(poll(&pfd[0], pfd.size(), timeout) <= 0) {
+				continue;
+			}
+
+			for(size_t i=clients.size(); i>0; i--) {
+				if(!pfd[i].revents) continue;
+
+				bool new_xform = false;
+				Mat4 cxform;
+				if(!read_requests(clients[i - 1], &cxform, &new_xform) ||
+						((pfd[i].revents & POLLOUT) && !flush_frame(clients[i - 1]))) {
+					close_client(clients[i - 1]);
+					clients.erase(clients.begin() + i - 1);
+					continue;
+				}
+				if(new_xform) {
+					xform = cxform;
+				}
+			}
+			if(pfd[0].revents & POLLIN) {
+				accept_clients(sock, &clients);
+			}
+		}
+
+		/* don't fall further behind if a tick took too long */
+		next_tick += tick_usec;
+		if(now > next_tick) {
+			next_tick = now + tick_usec;
+		}
+
+		if(clients.empty()) {
+			continue;	/* nobody is watching */
+		}
+
+		hair->set_transform(xform);
+		hair->update(dt);
+		sim_time += dt;
+		tick++;
+
+		const HairFrame *hfrm = hair->get_frame();
+		FrameBuf *fbuf = get_frame_buf(&pool);
+		fbuf->data.resize(hfrm->num_active * 3);
+		if(hfrm->num_active > 0) {
+			quantize_positions(&hfrm->pos[0], hfrm->num_active, hfrm->xform, bmin, bscale,
+					&fbuf->data[0]);
+		}
+
+		SimFrame frm;
+		memset(&frm, 0, sizeof frm);
+		frm.magic = SIM_FRAME_MAGIC;
+		frm.size = fbuf->data.size() * sizeof(uint16_t);
+		frm.tick = tick;
+		frm.num_strands = hfrm->pos.size();
+		frm.num_active = hfrm->num_active;
+		frm.time = sim_time;
+		for(int i=0; i<4; i++) {
+			for(int j=0; j<4; j++) {
+				frm.xform[i * 4 + j] = hfrm->xform[i][j];
+			}
+		}
+		for(int i=0; i<3; i++) {
+			frm.bmin[i] = bmin[i];
+			frm.bstep[i] = bstep[i];
+		}
+
+		for(size_t i=clients.size(); i>0; i--) {
+			Client *c = clients[i - 1];
+			if(c->buf) {
+				c->frames_dropped++;	/* still sending the previous one */
+				continue;
+			}
+			queue_frame(c, frm, fbuf);
+			if(!flush_frame(c)) {
+				close_client(c);
+				clients.erase(clients.begin() + i - 1);
+			}
+		}
+	}
+
+	printf("simulation server shutting down after %u ticks\n", tick);
+	for(size_t i=0; i<clients.size(); i++) {
+		close_client(clients[i]);
+	}
+	for(size_t i=0; i<pool.size(); i++) {
+		delete pool[i];
+	}
+	close(sock);
+	unlink(path);
+	return 0;
+}
+
+static void sig_handler(int sig)
+{
+	quit = 1;
+}
+
+static int open_socket(const char *path)
+{
+	sockaddr_un addr;
+	if(strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock == -1) {
+		perror("failed to create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* a stale socket from a previous run would fail bind */
+	unlink(path);
+	if(bind(sock, (sockaddr*)&addr, sizeof addr) == -1 || listen(sock, 16) == -1) {
+		fprintf(stderr, "failed to listen on %s: %s\n", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	return sock;
+}
+
+static void accept_clients(int sock, std::vector<Client*> *clients)
+{
+	int fd;
+	while((fd = accept(sock, 0, 0)) != -1) {
+		if(clients->size() >= MAX_CLIENTS) {
+			fprintf(stderr, "too many clients, rejecting connection\n");
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		Client *c = new Client;
+		c->fd = fd;
+		c->req_bytes = 0;
+		c->ack = 0;
+		c->buf = 0;
+		c->sent = 0;
+		c->frames_sent = c->frames_dropped = 0;
+		clients->push_back(c);
+		printf("client %d connected (%d total)\n", fd, (int)clients->size());
+	}
+}
+
+/* reads every complete request available, and returns the transform of the
+ * last one. Returns false when the client should be dropped */
+static bool read_requests(Client *c, Mat4 *xform, bool *new_xform)
+{
+	for(;;) {
+		char *dest = (char*)&c->req + c->req_bytes;
+		ssize_t sz = recv(c->fd, dest, sizeof c->req - c->req_bytes, 0);
+		if(sz == 0) {
+			return false;	/* disconnected */
+		}
+		if(sz == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		c->req_bytes += sz;
+		if(c->req_bytes < (int)sizeof c->req) {
+			continue;
+		}
+		c->req_bytes = 0;
+
+		if(c->req.magic != SIM_REQ_MAGIC) {
+			fprintf(stderr, "client %d: invalid request, disconnecting\n", c->fd);
+			return false;
+		}
+		for(int i=0; i<4; i++) {
+			for(int j=0; j<4; j++) {
+				(*xform)[i][j] = c->req.xform[i * 4 + j];
+			}
+		}
+		c->ack = c->req.seq;
+		*new_xform = true;
+	}
+}
+
+static void queue_frame(Client *c, const SimFrame &frm, FrameBuf *buf)
+{
+	c->hdr = frm;
+	c->hdr.ack = c->ack;
+	c->buf = buf;
+	c->sent = 0;
+	buf->refs++;
+}
+
+/* sends as much of the queued frame as the socket takes without blocking,
+ * returns false when the client should be dropped */
+static bool flush_frame(Client *c)
+{
+	if(!c->buf) return true;
+
+	size_t hdr_size = sizeof c->hdr;
+	size_t total = hdr_size + c->hdr.size;
+
+	while(c->sent < total) {
+		iovec iov[2];
+		int num_iov = 0;
+		if(c->sent < hdr_size) {
+			iov[num_iov].iov_base = (char*)&c->hdr + c->sent;
+			iov[num_iov++].iov_len = hdr_size - c->sent;
+		}
+		if(c->hdr.size) {
+			size_t offs = c->sent > hdr_size ? c->sent - hdr_size : 0;
+			iov[num_iov].iov_base = (char*)&c->buf->data[0] + offs;
+			iov[num_iov++].iov_len = c->hdr.size - offs;
+		}
+
+		msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = num_iov;
+
+		ssize_t sz = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sz == -1) {
+			if(errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		c->sent += sz;
+	}
+
+	c->buf->refs--;
+	c->buf = 0;
+	c->frames_sent++;
+	return true;
+}
+
+static FrameBuf *get_frame_buf(std::vector<FrameBuf*> *pool)
+{
+	for(size_t i=0; i<pool->size(); i++) {
+		if(!(*pool)[i]->refs) {
+			return (*pool)[i];
+		}
+	}
+
+	FrameBuf *buf = new FrameBuf;
+	buf->refs = 0;
+	pool->push_back(buf);
+	return buf;
+}
+
+static void close_client(Client *c)
+{
+	printf("client %d disconnected, %ld frames sent, %ld dropped\n", c->fd,
+			c->frames_sent, c->frames_dropped);
+	if(c->buf) {
+		c->buf->refs--;
+	}
+	close(c->fd);
+	delete c;
+}
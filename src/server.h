@@ -0,0 +1,11 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include "hair.h"
+
+/* runs hair headless, driven by clients on a Unix socket at path (see
+ * simproto.h), at tick_rate updates per second until interrupted. bbox is
+ * the head bounding box, used for quantizing the strand positions */
+int run_server(Hair *hair, const char *path, float tick_rate, const Aabb &bbox);
+
+#endif // SERVER_H_
@@ -0,0 +1,165 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shmexport.h"
+#include "hair_kern.h"
+
+static_assert(sizeof(ShmSlot) <= SHM_DATA_OFFS, "ShmSlot doesn't fit before SHM_DATA_OFFS");
+
+static size_t align_size(size_t sz, size_t align)
+{
+	return (sz + align - 1) & ~(align - 1);
+}
+
+ShmExport::ShmExport()
+{
+	map = 0;
+	map_size = 0;
+	hdr = 0;
+	layout = 0;
+}
+
+ShmExport::~ShmExport()
+{
+	close();
+}
+
+bool ShmExport::open(const char *name, int max_strands, int num_slots)
+{
+	close();
+
+	/* shm_open wants a single leading slash */
+	this->name = name[0] == '/' ? name : std::string("/") + name;
+
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	size_t slot_offs = align_size(sizeof(ShmHeader), pgsz);
+	size_t slot_size = align_size(SHM_DATA_OFFS + (size_t)max_strands * 6 * sizeof(float), pgsz);
+	map_size = slot_offs + slot_size * num_slots;
+
+	int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1) {
+		fprintf(stderr, "failed to create shared memory object %s\n", this->name.c_str());
+		return false;
+	}
+	if(ftruncate(fd, map_size) == -1) {
+		fprintf(stderr, "failed to resize shared memory object %s\n", this->name.c_str());
+		::close(fd);
+		shm_unlink(this->name.c_str());
+		return false;
+	}
+
+	void *ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(ptr == MAP_FAILED) {
+		fprintf(stderr, "failed to map shared memory object %s\n", this->name.c_str());
+		shm_unlink(this->name.c_str());
+		return false;
+	}
+	map = (unsigned char*)ptr;
+
+	/* the object is zero filled, which is a valid state for the atomics */
+	hdr = (ShmHeader*)map;
+	hdr->version = SHM_VERSION;
+	hdr->num_slots = num_slots;
+	hdr->max_strands = max_strands;
+	hdr->slot_size = slot_size;
+	hdr->slot_offs = slot_offs;
+	hdr->writer_pid = getpid();
+	hdr->layout.store(layout, std::memory_order_relaxed);
+	hdr->latest.store(0, std::memory_order_relaxed);
+
+	/* readers check the magic last */
+	std::atomic_thread_fence(std::memory_order_release);
+	hdr->magic = SHM_MAGIC;
+	return true;
+}
+
+void ShmExport::close()
+{
+	if(map) {
+		hdr->magic = 0;
+		munmap(map, map_size);
+		shm_unlink(name.c_str());
+		map = 0;
+	}
+	hdr = 0;
+}
+
+bool ShmExport::relayout(int num_strands)
+{
+	if(!hdr) return false;
+
+	layout++;
+	if(num_strands <= (int)hdr->max_strands) {
+		hdr->layout.store(layout, std::memory_order_relaxed);
+		return true;
+	}
+
+	/* with room to spare, so that every stroke that adds strands doesn't
+	 * make the readers open it again */
+	int max_strands = hdr->max_strands + hdr->max_strands / 2;
+	if(max_strands < num_strands) {
+		max_strands = num_strands;
+	}
+	std::string oname = name;
+	return open(oname.c_str(), max_strands, hdr->num_slots);
+}
+
+void ShmExport::publish(const HairSpawn *spawns, const Vec3 *tips, int num, const Mat4 &xform, float time)
+{
+	if(!hdr) return;
+
+	if(num > (int)hdr->max_strands) {
+		num = hdr->max_strands;
+	}
+
+	uint64_t frame = hdr->latest.load(std::memory_order_relaxed) + 1;
+	ShmSlot *slot = (ShmSlot*)(map + hdr->slot_offs + (frame % hdr->num_slots) * hdr->slot_size);
+	float *roots = (float*)((unsigned char*)slot + SHM_DATA_OFFS);
+	float *dtips = roots + hdr->max_strands * 3;
+
+	/* odd seq: readers of this slot will retry */
+	uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	KernParams kp;
+	kern_set_xform(&kp, xform);
+	const float *m = kp.xform;
+	uint32_t checksum = 0;
+
+#pragma omp parallel for schedule(static, 4096) reduction(^:checksum)
+	for(int i=0; i<num; i++) {
+		const Vec3 &s = spawns[i].pt;
+		float *r = roots + i * 3;
+		float *t = dtips + i * 3;
+
+		r[0] = m[0] * s.x + m[3] * s.y + m[6] * s.z + m[9];
+		r[1] = m[1] * s.x + m[4] * s.y + m[7] * s.z + m[10];
+		r[2] = m[2] * s.x + m[5] * s.y + m[8] * s.z + m[11];
+		t[0] = tips[i].x;
+		t[1] = tips[i].y;
+		t[2] = tips[i].z;
+
+		uint32_t bits[6];
+		memcpy(bits, r, 3 * sizeof(float));
+		memcpy(bits + 3, t, 3 * sizeof(float));
+		checksum ^= bits[0] ^ bits[1] ^ bits[2] ^ bits[3] ^ bits[4] ^ bits[5];
+	}
+
+	slot->num_strands = num;
+	slot->frame = frame;
+	slot->time = time;
+	slot->checksum = checksum;
+	slot->layout = hdr->layout.load(std::memory_order_relaxed);
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			slot->xform[i * 4 + j] = xform[i][j];
+		}
+	}
+
+	slot->seq.store(seq + 2, std::memory_order_release);
+	hdr->latest.store(frame, std::memory_order_release);
+}
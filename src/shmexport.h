@@ -0,0 +1,34 @@
+#ifndef SHMEXPORT_H_
+#define SHMEXPORT_H_
+
+#include <string>
+#include "hair.h"
+#include "shmproto.h"
+
+/* publishes strand frames to a POSIX shared memory object, see shmproto.h */
+class ShmExport {
+private:
+	std::string name;
+	unsigned char *map;
+	size_t map_size;
+	ShmHeader *hdr;
+	uint32_t layout;	/* kept across opening it again */
+
+public:
+	ShmExport();
+	~ShmExport();
+
+	bool open(const char *name, int max_strands, int num_slots = SHM_DEF_SLOTS);
+	void close();
+
+	/* the strands were added, removed or reordered, and there are now
+	 * num_strands: bumps the layout generation, and creates the object
+	 * again with more room if they don't fit anymore */
+	bool relayout(int num_strands);
+
+	/* writes the roots of strands [0, num) in head space, transformed by
+	 * xform, and their world space tips to the next slot */
+	void publish(const HairSpawn *spawns, const Vec3 *tips, int num, const Mat4 &xform, float time);
+};
+
+#endif // SHMEXPORT_H_
@@ -0,0 +1,54 @@
+#ifndef SHMPROTO_H_
+#define SHMPROTO_H_
+
+#include <stdint.h>
+#include <atomic>
+
+/* Layout of the shared memory strand export (see shmexport.cc).
+ *
+ * The object starts with a ShmHeader, followed by num_slots slots of
+ * slot_size bytes, the first one at slot_offs. Every slot is a ShmSlot,
+ * followed at SHM_DATA_OFFS by max_strands root positions and then
+ * max_strands tip positions, 3 floats each, in world space.
+ *
+ * Frame n is written to slot n % num_slots, and latest is set to n once
+ * it's complete. Slots are guarded by a seqlock: seq is odd while the slot
+ * is written, so readers copy what they need and retry if seq changed in
+ * the meantime. The writer never waits for the readers.
+ *
+ * Strand i is the same strand from frame to frame, until strands are added,
+ * removed or reordered. Then layout is incremented, and every frame carries
+ * the layout it was written with. When the strands outgrow max_strands,
+ * the writer closes the object, which clears magic, and creates it again
+ * under the same name with room for more; readers open it again.
+ */
+
+#define SHM_MAGIC		0x53524948	/* "HIRS" */
+#define SHM_VERSION		2
+#define SHM_DEF_SLOTS	3
+#define SHM_DATA_OFFS	128
+
+struct ShmHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t max_strands;
+	uint64_t slot_size;
+	uint64_t slot_offs;
+	int32_t writer_pid;
+	std::atomic<uint32_t> layout;	/* strand layout generation */
+
+	alignas(64) std::atomic<uint64_t> latest;	/* last complete frame, 0 for none */
+};
+
+struct ShmSlot {
+	std::atomic<uint32_t> seq;
+	uint32_t num_strands;
+	uint64_t frame;
+	float time;	/* simulation time, seconds */
+	uint32_t checksum;	/* xor of the bits of every root and tip coordinate */
+	uint32_t layout;	/* ShmHeader::layout when it was written */
+	float xform[16];	/* head transform, same element layout as Mat4 */
+};
+
+#endif // SHMPROTO_H_
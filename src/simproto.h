@@ -0,0 +1,38 @@
+#ifndef SIMPROTO_H_
+#define SIMPROTO_H_
+
+#include <stdint.h>
+
+/* Simulation server protocol (see server.cc), over a Unix stream socket, in
+ * the byte order of the server.
+ *
+ * Clients send SimRequest messages with head transforms, whenever they like.
+ * Every tick the server applies the latest transform it received from any
+ * client, runs one update, and sends every client a SimFrame followed by
+ * num_active * 3 uint16_t strand positions. Positions are in head space,
+ * quantized: p = bmin + q * bstep, and then transformed by xform.
+ */
+
+#define SIM_REQ_MAGIC	0x51524948	/* "HIRQ" */
+#define SIM_FRAME_MAGIC	0x46524948	/* "HIRF" */
+
+struct SimRequest {
+	uint32_t magic;
+	uint32_t seq;	/* echoed back in SimFrame::ack once applied */
+	float xform[16];	/* same element layout as Mat4 */
+};
+
+struct SimFrame {
+	uint32_t magic;
+	uint32_t size;	/* bytes of position data following */
+	uint32_t tick;
+	uint32_t ack;	/* seq of the last request of this client applied */
+	uint32_t num_strands;
+	uint32_t num_active;
+	float time;	/* simulation time, seconds */
+	float xform[16];
+	float bmin[3];
+	float bstep[3];
+};
+
+#endif // SIMPROTO_H_
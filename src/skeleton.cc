@@ -0,0 +1,156 @@
+#include <math.h>
+#include <algorithm>
+
+#include "skeleton.h"
+
+static int find_key(const std::vector<float> &times, float t, float *frac);
+static Vec3 sample_vec(const std::vector<float> &times, const std::vector<Vec3> &keys, float t);
+static Quat sample_quat(const std::vector<float> &times, const std::vector<Quat> &keys, float t);
+static Mat4 compose_trs(const Vec3 &pos, const Quat &rot, const Vec3 &scl);
+
+int Skeleton::find_node(const char *name) const
+{
+	for(size_t i=0; i<nodes.size(); i++) {
+		if(nodes[i].name == name)
+			return i;
+	}
+	return -1;
+}
+
+void Skeleton::eval(int anim, float t)
+{
+	for(size_t i=0; i<nodes.size(); i++) {
+		nodes[i].local_xform = nodes[i].rest_xform;
+	}
+
+	if(anim >= 0 && anim < (int)anims.size()) {
+		const Animation &a = anims[anim];
+		if(a.duration > 0) {
+			t = fmod(t, a.duration);
+		}
+
+		for(size_t i=0; i<a.channels.size(); i++) {
+			const AnimChannel &ch = a.channels[i];
+
+			Vec3 pos = sample_vec(ch.pos_times, ch.pos_keys, t);
+			Quat rot = sample_quat(ch.rot_times, ch.rot_keys, t);
+			Vec3 scl = ch.scl_keys.empty() ? Vec3(1, 1, 1) :
+				sample_vec(ch.scl_times, ch.scl_keys, t);
+
+			nodes[ch.node].local_xform = compose_trs(pos, rot, scl);
+		}
+	}
+
+	for(size_t i=0; i<nodes.size(); i++) {
+		SkelNode *n = &nodes[i];
+		if(n->parent >= 0) {
+			n->global_xform = nodes[n->parent].global_xform * n->local_xform;
+		} else {
+			n->global_xform = n->local_xform;
+		}
+	}
+}
+
+/* returns the index of the key before t, and the interpolation factor
+ * towards the next one in frac
+ */
+static int find_key(const std::vector<float> &times, float t, float *frac)
+{
+	int num = times.size();
+
+	if(num <= 1 || t <= times[0]) {
+		*frac = 0;
+		return 0;
+	}
+	if(t >= times[num - 1]) {
+		*frac = 0;
+		return num - 1;
+	}
+
+	int idx = std::upper_bound(times.begin(), times.end(), t) - times.begin() - 1;
+	float dt = times[idx + 1] - times[idx];
+	*frac = dt > 0 ? (t - times[idx]) / dt : 0;
+	return idx;
+}
+
+static Vec3 sample_vec(const std::vector<float> &times, const std::vector<Vec3> &keys, float t)
+{
+	if(keys.empty()) {
+		return Vec3(0, 0, 0);
+	}
+
+	float frac;
+	int idx = find_key(times, t, &frac);
+	if(frac <= 0) {
+		return keys[idx];
+	}
+	return keys[idx] + (keys[idx + 1] - keys[idx]) * frac;
+}
+
+static Quat sample_quat(const std::vector<float> &times, const std::vector<Quat> &keys, float t)
+{
+	if(keys.empty()) {
+		return Quat::identity;
+	}
+
+	float frac;
+	int idx = find_key(times, t, &frac);
+	if(frac <= 0) {
+		return keys[idx];
+	}
+
+	/* normalized lerp, taking the shortest path */
+	const Quat &a = keys[idx];
+	Quat b = keys[idx + 1];
+	if(a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w < 0) {
+		b.x = -b.x;
+		b.y = -b.y;
+		b.z = -b.z;
+		b.w = -b.w;
+	}
+
+	Quat q;
+	q.x = a.x + (b.x - a.x) * frac;
+	q.y = a.y + (b.y - a.y) * frac;
+	q.z = a.z + (b.z - a.z) * frac;
+	q.w = a.w + (b.w - a.w) * frac;
+
+	float len = sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+	q.x /= len;
+	q.y /= len;
+	q.z /= len;
+	q.w /= len;
+	return q;
+}
+
+/* builds T * R * S in the same element layout glMultMatrixf expects
+ * (m[column][row], translation in m[3])
+ */
+static Mat4 compose_trs(const Vec3 &pos, const Quat &q, const Vec3 &scl)
+{
+	float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+	float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+	float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+	Mat4 m;
+	m[0][0] = (1 - 2 * (yy + zz)) * scl.x;
+	m[0][1] = 2 * (xy + wz) * scl.x;
+	m[0][2] = 2 * (xz - wy) * scl.x;
+	m[0][3] = 0;
+
+	m[1][0] = 2 * (xy - wz) * scl.y;
+	m[1][1] = (1 - 2 * (xx + zz)) * scl.y;
+	m[1][2] = 2 * (yz + wx) * scl.y;
+	m[1][3] = 0;
+
+	m[2][0] = 2 * (xz + wy) * scl.z;
+	m[2][1] = 2 * (yz - wx) * scl.z;
+	m[2][2] = (1 - 2 * (xx + yy)) * scl.z;
+	m[2][3] = 0;
+
+	m[3][0] = pos.x;
+	m[3][1] = pos.y;
+	m[3][2] = pos.z;
+	m[3][3] = 1;
+	return m;
+}
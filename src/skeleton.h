@@ -0,0 +1,49 @@
+#ifndef SKELETON_H_
+#define SKELETON_H_
+
+#include <string>
+#include <vector>
+#include <gmath/gmath.h>
+
+struct SkelNode {
+	std::string name;
+	int parent;
+
+	Mat4 rest_xform;	/* local transform when not animated */
+	Mat4 local_xform;
+	Mat4 global_xform;	/* valid after Skeleton::eval */
+};
+
+struct AnimChannel {
+	int node;
+
+	/* key times are in seconds */
+	std::vector<float> pos_times;
+	std::vector<Vec3> pos_keys;
+	std::vector<float> rot_times;
+	std::vector<Quat> rot_keys;
+	std::vector<float> scl_times;
+	std::vector<Vec3> scl_keys;
+};
+
+struct Animation {
+	std::string name;
+	float duration;	/* seconds */
+	std::vector<AnimChannel> channels;
+};
+
+class Skeleton {
+public:
+	/* nodes are stored in pre-order, so parents always precede children */
+	std::vector<SkelNode> nodes;
+	std::vector<Animation> anims;
+
+	int find_node(const char *name) const;
+
+	/* evaluates the global transform of every node at time t (seconds) of
+	 * animation anim. The animation loops. anim < 0 gives the rest pose.
+	 */
+	void eval(int anim, float t);
+};
+
+#endif // SKELETON_H_
@@ -0,0 +1,471 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "spheretree.h"
+#include "sdf.h"
+
+#define STREE_MAGIC		"HAIRSPHT"
+#define STREE_VERSION	1
+#define STREE_ENDIAN	0x01020304
+
+/* a cell is a leaf when its sphere reaches within this many voxels of all
+ * the inside voxels of the cell */
+#define LEAF_TOL	1.0
+
+struct STreeHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t mesh_hash;
+	uint32_t res;
+	uint32_t num_nodes;
+	uint32_t num_leaves;
+	uint32_t depth;
+	uint32_t pad;
+};
+
+struct BuildNode {
+	Vec3 center;
+	float radius;
+	int child[8];
+	int num_child;
+	bool dropped;
+};
+
+struct FitContext {
+	const Sdf *sdf;
+	std::vector<float> depth;	/* distance to the surface, 0 outside */
+	std::vector<BuildNode> nodes;
+	int max_depth;
+};
+
+static void calc_inside_depth(const Sdf *sdf, std::vector<float> *depth);
+static void edt_1d(const double *f, int n, double *d, int *v, double *z);
+static int fit_cell(FitContext *ctx, int x0, int y0, int z0, int size, int level);
+static bool covers_cell(const FitContext *ctx, int x0, int y0, int z0, int x1, int y1, int z1,
+		const Vec3 &center, float reach_sq);
+static void drop_contained(FitContext *ctx);
+static bool bound_children(FitContext *ctx, int idx);
+static uint32_t calc_mesh_hash(const Mesh *m, int res);
+
+bool fit_sphere_tree(SphereTree *tree, const Mesh *m, int res)
+{
+	Sdf sdf;
+	if(!build_sdf(&sdf, m, res)) {
+		return false;
+	}
+
+	FitContext ctx;
+	ctx.sdf = &sdf;
+	calc_inside_depth(&sdf, &ctx.depth);
+
+	/* the octree cube covers the grid, leaf cells stay at least 2 voxels
+	 * wide so that they have a deepest point to pick */
+	int size = 1;
+	ctx.max_depth = 0;
+	while(size < std::max(sdf.xsz, std::max(sdf.ysz, sdf.zsz))) {
+		size <<= 1;
+		ctx.max_depth++;
+	}
+	ctx.max_depth = std::min(ctx.max_depth - 1, STREE_MAX_DEPTH - 1);
+
+	int root = fit_cell(&ctx, 0, 0, 0, size, 0);
+	if(root == -1) {
+		fprintf(stderr, "fit_sphere_tree: the mesh has no inside, is it closed?\n");
+		return false;
+	}
+	drop_contained(&ctx);
+	bound_children(&ctx, root);
+
+	/* flatten breadth first, so that the children of a node are contiguous */
+	tree->nodes.clear();
+	tree->num_leaves = 0;
+	tree->depth = 0;
+	tree->res = res;
+
+	std::vector<int> queue, level;
+	queue.push_back(root);
+	level.push_back(1);
+	tree->nodes.resize(1);
+
+	for(size_t i=0; i<queue.size(); i++) {
+		const BuildNode &bn = ctx.nodes[queue[i]];
+		SphereNode *sn = &tree->nodes[i];
+		sn->center[0] = bn.center.x;
+		sn->center[1] = bn.center.y;
+		sn->center[2] = bn.center.z;
+		sn->radius = bn.radius;
+		sn->num_child = 0;
+		sn->child = -1;
+
+		tree->depth = std::max(tree->depth, level[i]);
+		if(!bn.num_child) {
+			tree->num_leaves++;
+			continue;
+		}
+
+		int first = tree->nodes.size();
+		for(int j=0; j<bn.num_child; j++) {
+			if(ctx.nodes[bn.child[j]].dropped) continue;
+			queue.push_back(bn.child[j]);
+			level.push_back(level[i] + 1);
+			tree->nodes.resize(tree->nodes.size() + 1);
+		}
+		sn = &tree->nodes[i];	/* resize moved it */
+		sn->child = first;
+		sn->num_child = tree->nodes.size() - first;
+	}
+	return true;
+}
+
+/* distance of every inside sample to the surface: exact within the band of
+ * the sdf, and from the distance transform of the inside voxels further in */
+static void calc_inside_depth(const Sdf *sdf, std::vector<float> *depth)
+{
+	int xsz = sdf->xsz, ysz = sdf->ysz, zsz = sdf->zsz;
+	int num = xsz * ysz * zsz;
+	int dim[3] = {xsz, ysz, zsz};
+	int stride[3] = {1, xsz, xsz * ysz};
+
+	/* squared distance to the nearest outside sample, by separable passes
+	 * along x, y and z. The grid border is outside, so the first pass
+	 * already leaves every value finite */
+	std::vector<double> dsq(num);
+	for(int i=0; i<num; i++) {
+		dsq[i] = sdf->dist[i] < 0 ? 1e12 : 0;
+	}
+
+	for(int axis=0; axis<3; axis++) {
+		int n = dim[axis];
+		int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+		int num_lines = dim[a1] * dim[a2];
+
+#pragma omp parallel
+		{
+			std::vector<double> f(n), d(n), z(n + 1);
+			std::vector<int> v(n);
+
+#pragma omp for schedule(static)
+			for(int line=0; line<num_lines; line++) {
+				int start = (line % dim[a1]) * stride[a1] + (line / dim[a1]) * stride[a2];
+				for(int i=0; i<n; i++) {
+					f[i] = dsq[start + i * stride[axis]];
+				}
+				edt_1d(&f[0], n, &d[0], &v[0], &z[0]);
+				for(int i=0; i<n; i++) {
+					dsq[start + i * stride[axis]] = d[i];
+				}
+			}
+		}
+	}
+
+	/* the surface lies within a voxel of the boundary of the inside set */
+	float band = SDF_BAND * sdf->cell;
+	depth->resize(num);
+	for(int i=0; i<num; i++) {
+		float d = sdf->dist[i];
+		if(d >= 0) {
+			(*depth)[i] = 0;
+		} else if(d > -band) {
+			(*depth)[i] = -d;
+		} else {
+			(*depth)[i] = std::max(band, (float)(sqrt(dsq[i]) - 1.0) * sdf->cell);
+		}
+	}
+}
+
+/* squared distance transform of f along one line (Felzenszwalb and
+ * Huttenlocher, Distance Transforms of Sampled Functions) */
+static void edt_1d(const double *f, int n, double *d, int *v, double *z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -1e30;
+	z[1] = 1e30;
+
+	for(int q=1; q<n; q++) {
+		double s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2.0 * (q - v[k]));
+		while(s <= z[k]) {
+			k--;
+			s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2.0 * (q - v[k]));
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = 1e30;
+	}
+
+	k = 0;
+	for(int q=0; q<n; q++) {
+		while(z[k + 1] < q) k++;
+		d[q] = (double)(q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+/* fits the octree cell of size voxels at (x0, y0, z0), returns its node, or
+ * -1 if the cell has nothing inside */
+static int fit_cell(FitContext *ctx, int x0, int y0, int z0, int size, int level)
+{
+	const Sdf *sdf = ctx->sdf;
+	int x1 = std::min(x0 + size, sdf->xsz);
+	int y1 = std::min(y0 + size, sdf->ysz);
+	int z1 = std::min(z0 + size, sdf->zsz);
+
+	/* the deepest inside sample is the center of the cell's sphere */
+	int best = -1;
+	float best_depth = 0;
+	for(int z=z0; z<z1; z++) {
+		for(int y=y0; y<y1; y++) {
+			for(int x=x0; x<x1; x++) {
+				int idx = (z * sdf->ysz + y) * sdf->xsz + x;
+				if(ctx->depth[idx] > best_depth) {
+					best_depth = ctx->depth[idx];
+					best = idx;
+				}
+			}
+		}
+	}
+	if(best == -1) {
+		return -1;
+	}
+
+	int bx = best % sdf->xsz;
+	int by = (best / sdf->xsz) % sdf->ysz;
+	int bz = best / (sdf->xsz * sdf->ysz);
+
+	BuildNode node;
+	node.center = sdf->origin + Vec3(bx, by, bz) * sdf->cell;
+	node.radius = best_depth;
+	node.num_child = 0;
+	node.dropped = false;
+
+	/* leaf if the sphere covers the inside of the cell closely enough */
+	bool leaf = level >= ctx->max_depth || size <= 2;
+	if(!leaf) {
+		float reach = best_depth + LEAF_TOL * sdf->cell;
+		leaf = covers_cell(ctx, x0, y0, z0, x1, y1, z1, node.center, reach * reach);
+	}
+
+	int idx = ctx->nodes.size();
+	ctx->nodes.push_back(node);
+	if(leaf) {
+		return idx;
+	}
+
+	int half = size / 2;
+	for(int i=0; i<8; i++) {
+		int cx = x0 + (i & 1 ? half : 0);
+		int cy = y0 + (i & 2 ? half : 0);
+		int cz = z0 + (i & 4 ? half : 0);
+		if(cx >= sdf->xsz || cy >= sdf->ysz || cz >= sdf->zsz) continue;
+
+		int child = fit_cell(ctx, cx, cy, cz, half, level + 1);
+		if(child != -1) {
+			BuildNode *n = &ctx->nodes[idx];
+			n->child[n->num_child++] = child;
+		}
+	}
+	return idx;
+}
+
+static bool covers_cell(const FitContext *ctx, int x0, int y0, int z0, int x1, int y1, int z1,
+		const Vec3 &center, float reach_sq)
+{
+	const Sdf *sdf = ctx->sdf;
+	for(int z=z0; z<z1; z++) {
+		for(int y=y0; y<y1; y++) {
+			for(int x=x0; x<x1; x++) {
+				int idx = (z * sdf->ysz + y) * sdf->xsz + x;
+				if(ctx->depth[idx] <= 0) continue;
+
+				Vec3 p = sdf->origin + Vec3(x, y, z) * sdf->cell;
+				if(distance_sq(p, center) > reach_sq) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/* leaves inside another leaf add nothing to the volume */
+static void drop_contained(FitContext *ctx)
+{
+	/* biggest first, equal spheres keep the first one */
+	std::vector<std::pair<float, int> > leaves;
+	for(size_t i=0; i<ctx->nodes.size(); i++) {
+		if(!ctx->nodes[i].num_child) {
+			leaves.push_back(std::make_pair(-ctx->nodes[i].radius, (int)i));
+		}
+	}
+	std::sort(leaves.begin(), leaves.end());
+
+	int num = leaves.size();
+#pragma omp parallel for schedule(dynamic, 16)
+	for(int i=1; i<num; i++) {
+		BuildNode *n = &ctx->nodes[leaves[i].second];
+		for(int j=0; j<i; j++) {
+			const BuildNode *big = &ctx->nodes[leaves[j].second];
+			if(distance(n->center, big->center) + n->radius <= big->radius) {
+				n->dropped = true;
+				break;
+			}
+		}
+	}
+}
+
+/* turns inner nodes into bounding spheres of their remaining children, and
+ * drops the ones left without any. Returns false if idx was dropped */
+static bool bound_children(FitContext *ctx, int idx)
+{
+	BuildNode *n = &ctx->nodes[idx];
+	if(!n->num_child) {
+		return !n->dropped;
+	}
+
+	int num = 0;
+	for(int i=0; i<n->num_child; i++) {
+		if(bound_children(ctx, n->child[i])) {
+			n->child[num++] = n->child[i];
+		}
+	}
+	n->num_child = num;
+	if(!num) {
+		n->dropped = true;
+		return false;
+	}
+
+	Vec3 bmin = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vec3 bmax = -bmin;
+	for(int i=0; i<num; i++) {
+		const BuildNode &c = ctx->nodes[n->child[i]];
+		for(int j=0; j<3; j++) {
+			bmin[j] = std::min(bmin[j], c.center[j] - c.radius);
+			bmax[j] = std::max(bmax[j], c.center[j] + c.radius);
+		}
+	}
+	n->center = (bmin + bmax) * 0.5;
+	n->radius = 0;
+	for(int i=0; i<num; i++) {
+		const BuildNode &c = ctx->nodes[n->child[i]];
+		n->radius = std::max(n->radius, distance(n->center, c.center) + c.radius);
+	}
+
+	/* a lone child takes the place of its parent */
+	if(num == 1) {
+		*n = ctx->nodes[n->child[0]];
+	}
+	return true;
+}
+
+bool save_sphere_tree(const SphereTree *tree, const Mesh *m, const char *fname)
+{
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	STreeHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, STREE_MAGIC, sizeof hdr.magic);
+	hdr.version = STREE_VERSION;
+	hdr.endian = STREE_ENDIAN;
+	hdr.mesh_hash = calc_mesh_hash(m, tree->res);
+	hdr.res = tree->res;
+	hdr.num_nodes = tree->nodes.size();
+	hdr.num_leaves = tree->num_leaves;
+	hdr.depth = tree->depth;
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+			fwrite(&tree->nodes[0], sizeof(SphereNode), tree->nodes.size(), fp) != tree->nodes.size()) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		fclose(fp);
+		remove(fname);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+bool load_sphere_tree(SphereTree *tree, const Mesh *m, int res, const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) {
+		return false;	/* not cached yet */
+	}
+
+	STreeHeader hdr;
+	if(fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, STREE_MAGIC, sizeof hdr.magic) != 0 ||
+			hdr.version != STREE_VERSION || hdr.endian != STREE_ENDIAN) {
+		fprintf(stderr, "%s is not a sphere tree cache\n", fname);
+		fclose(fp);
+		return false;
+	}
+	if(hdr.res != (uint32_t)res || hdr.mesh_hash != calc_mesh_hash(m, res)) {
+		/* stale, fitted to another mesh or resolution */
+		fclose(fp);
+		return false;
+	}
+	if(!hdr.num_nodes || hdr.depth > STREE_MAX_DEPTH) {
+		fprintf(stderr, "%s: invalid sphere tree\n", fname);
+		fclose(fp);
+		return false;
+	}
+
+	std::vector<SphereNode> nodes(hdr.num_nodes);
+	if(fread(&nodes[0], sizeof(SphereNode), nodes.size(), fp) != nodes.size()) {
+		fprintf(stderr, "%s is truncated\n", fname);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	/* children come after their parent, which also rules out cycles, and
+	 * the traversal stack only fits STREE_MAX_DEPTH levels */
+	std::vector<int> level(nodes.size(), 1);
+	for(size_t i=0; i<nodes.size(); i++) {
+		const SphereNode &n = nodes[i];
+		if(n.num_child < 0 || n.num_child > 8 || level[i] > STREE_MAX_DEPTH || (n.num_child &&
+				(n.child <= (int)i || n.child + n.num_child > (int)nodes.size()))) {
+			fprintf(stderr, "%s: invalid sphere tree\n", fname);
+			return false;
+		}
+		for(int j=0; j<n.num_child; j++) {
+			level[n.child + j] = std::max(level[n.child + j], level[i] + 1);
+		}
+	}
+
+	tree->nodes.swap(nodes);
+	tree->num_leaves = hdr.num_leaves;
+	tree->depth = hdr.depth;
+	tree->res = res;
+	return true;
+}
+
+static uint32_t calc_mesh_hash(const Mesh *m, int res)
+{
+	uint32_t hash = 2166136261u;
+
+	const unsigned char *ptr = (const unsigned char*)&res;
+	for(size_t i=0; i<sizeof res; i++) {
+		hash = (hash ^ ptr[i]) * 16777619u;
+	}
+	for(size_t i=0; i<m->vertices.size(); i++) {
+		float v[3] = {m->vertices[i].x, m->vertices[i].y, m->vertices[i].z};
+		ptr = (const unsigned char*)v;
+		for(size_t j=0; j<sizeof v; j++) {
+			hash = (hash ^ ptr[j]) * 16777619u;
+		}
+	}
+	if(!m->indices.empty()) {
+		ptr = (const unsigned char*)&m->indices[0];
+		for(size_t i=0; i<m->indices.size() * sizeof m->indices[0]; i++) {
+			hash = (hash ^ ptr[i]) * 16777619u;
+		}
+	}
+	return hash;
+}
@@ -0,0 +1,45 @@
+#ifndef SPHERETREE_H_
+#define SPHERETREE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "mesh.h"
+
+/* Sphere tree collision proxy of a mesh volume.
+ *
+ * The leaves are spheres inscribed in the mesh, each one centered on the
+ * deepest point of an octree cell: a few big spheres fill the inside, and
+ * smaller ones follow the surface down to the fitting resolution. Inner
+ * nodes bound their subtree, so that a query only descends into the nodes
+ * it overlaps.
+ */
+
+#define STREE_MAX_DEPTH	8
+/* enough for a depth first traversal pushing all children of a node */
+#define STREE_STACK		(STREE_MAX_DEPTH * 8)
+
+struct SphereNode {
+	float center[3];
+	float radius;
+	int32_t child;		/* index of the first child, children are contiguous */
+	int32_t num_child;	/* 0 for leaves */
+};
+
+struct SphereTree {
+	std::vector<SphereNode> nodes;	/* nodes[0] is the root */
+	int num_leaves;
+	int depth;
+	int res;
+};
+
+/* fits a tree to the volume of a closed mesh, voxelized with res cells
+ * along the longest side of its bounds */
+bool fit_sphere_tree(SphereTree *tree, const Mesh *m, int res);
+
+/* the cache file stores the tree along with a hash of the mesh and the
+ * resolution it was fitted for. load_sphere_tree fails if they differ */
+bool save_sphere_tree(const SphereTree *tree, const Mesh *m, const char *fname);
+bool load_sphere_tree(SphereTree *tree, const Mesh *m, int res, const char *fname);
+
+#endif // SPHERETREE_H_
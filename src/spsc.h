@@ -0,0 +1,55 @@
+#ifndef SPSC_H_
+#define SPSC_H_
+
+#include <atomic>
+
+/* lock-free single producer, single consumer ring buffer.
+ * size must be a power of two, one slot is always left empty.
+ */
+template <typename T, int size>
+class SpscQueue {
+private:
+	T items[size];
+	alignas(64) std::atomic<unsigned int> head;	/* next slot to read */
+	alignas(64) std::atomic<unsigned int> tail;	/* next slot to write */
+
+public:
+	SpscQueue()
+	{
+		static_assert((size & (size - 1)) == 0, "SpscQueue size must be a power of two");
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	/* producer side, returns false if the queue is full */
+	bool push(const T &item)
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		unsigned int next = (t + 1) & (size - 1);
+		if(next == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		items[t] = item;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	/* consumer side, returns false if the queue is empty */
+	bool pop(T *item)
+	{
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		*item = items[h];
+		head.store((h + 1) & (size - 1), std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+};
+
+#endif // SPSC_H_
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "texalpha.h"
+#include "texbc.h"
+
+#define TXAL_MAGIC		"HAIRTXAL"
+#define TXAL_VERSION	1
+#define TXAL_ENDIAN		0x01020304
+
+struct TexAlphaHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint64_t img_size;
+	uint64_t img_mtime;
+	uint32_t opaque;
+	uint32_t hist[TEX_ALPHA_BINS];
+	uint32_t pad;
+};
+
+static int find_transparent(const uint32_t *pixels, int count);
+
+void calc_tex_alpha(TexAlpha *ta, const uint32_t *pixels, int count)
+{
+	memset(ta->hist, 0, sizeof ta->hist);
+
+	/* most textures are opaque, and most of the rest show it early: find
+	 * the first pixel that isn't, and only histogram from there */
+	int first = find_transparent(pixels, count);
+	ta->opaque = first == count;
+	ta->hist[TEX_ALPHA_BINS - 1] = first;
+
+	for(int i=first; i<count; i++) {
+		ta->hist[(pixels[i] >> 24) * TEX_ALPHA_BINS / 256]++;
+	}
+}
+
+/* index of the first pixel with alpha below 255, or count */
+static int find_transparent(const uint32_t *pixels, int count)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	/* 16 pixels at a time: the and of the group only has full alpha if
+	 * all of them do */
+	__m128i amask = _mm_set1_epi32(0xff000000);
+	for(; i + 16 <= count; i += 16) {
+		const __m128i *ptr = (const __m128i*)(pixels + i);
+		__m128i v = _mm_and_si128(_mm_and_si128(_mm_loadu_si128(ptr), _mm_loadu_si128(ptr + 1)),
+				_mm_and_si128(_mm_loadu_si128(ptr + 2), _mm_loadu_si128(ptr + 3)));
+		v = _mm_cmpeq_epi32(_mm_and_si128(v, amask), amask);
+		if(_mm_movemask_epi8(v) != 0xffff) {
+			break;	/* it's in this group, the loop below finds it */
+		}
+	}
+#endif
+
+	for(; i<count; i++) {
+		if((pixels[i] & 0xff000000) != 0xff000000) {
+			break;
+		}
+	}
+	return i;
+}
+
+bool save_tex_alpha(const TexAlpha *ta, const char *img_fname, const char *fname)
+{
+	TexAlphaHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	if(!get_image_stamp(img_fname, &hdr.img_size, &hdr.img_mtime)) {
+		return false;
+	}
+	memcpy(hdr.magic, TXAL_MAGIC, sizeof hdr.magic);
+	hdr.version = TXAL_VERSION;
+	hdr.endian = TXAL_ENDIAN;
+	hdr.opaque = ta->opaque ? 1 : 0;
+	memcpy(hdr.hist, ta->hist, sizeof hdr.hist);
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		fclose(fp);
+		remove(fname);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+bool load_tex_alpha(TexAlpha *ta, const char *img_fname, const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) {
+		return false;	/* not cached yet */
+	}
+
+	TexAlphaHeader hdr;
+	if(fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, TXAL_MAGIC, sizeof hdr.magic) != 0 ||
+			hdr.version != TXAL_VERSION || hdr.endian != TXAL_ENDIAN) {
+		fprintf(stderr, "%s is not a texture alpha cache\n", fname);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	uint64_t size, mtime;
+	if(!get_image_stamp(img_fname, &size, &mtime) || hdr.img_size != size || hdr.img_mtime != mtime) {
+		return false;	/* stale, the image changed */
+	}
+
+	ta->opaque = hdr.opaque != 0;
+	memcpy(ta->hist, hdr.hist, sizeof ta->hist);
+	return true;
+}
@@ -0,0 +1,24 @@
+#ifndef TEXALPHA_H_
+#define TEXALPHA_H_
+
+#include <stdint.h>
+
+/* alpha of a texture: whether it's opaque, and a histogram of its alpha
+ * values in TEX_ALPHA_BINS equal bins, for deciding how to sort and blend
+ * what it's drawn on */
+#define TEX_ALPHA_BINS	16
+
+struct TexAlpha {
+	bool opaque;
+	uint32_t hist[TEX_ALPHA_BINS];
+};
+
+/* pixels are RGBA32, as loaded by imago */
+void calc_tex_alpha(TexAlpha *ta, const uint32_t *pixels, int count);
+
+/* the cache file is stamped with the size and modification time of the
+ * image, load_tex_alpha fails if the image changed since */
+bool save_tex_alpha(const TexAlpha *ta, const char *img_fname, const char *fname);
+bool load_tex_alpha(TexAlpha *ta, const char *img_fname, const char *fname);
+
+#endif // TEXALPHA_H_
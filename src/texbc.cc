@@ -0,0 +1,385 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "texbc.h"
+
+#define TXBC_MAGIC		"HAIRTXBC"
+#define TXBC_VERSION	1
+#define TXBC_ENDIAN		0x01020304
+
+struct TexBcHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint64_t img_size;
+	uint64_t img_mtime;
+	uint32_t fmt;
+	uint32_t num_levels;
+	uint32_t xsz, ysz;
+	uint32_t data_size;
+	uint32_t pad;
+};
+
+static uint32_t layout_levels(TexBc *bc, int xsz, int ysz);
+static void downsample(const uint32_t *src, int xsz, int ysz, uint32_t *dest);
+static void encode_level(const uint32_t *pixels, int xsz, int ysz, int fmt, unsigned char *dest);
+static void encode_color_block(const unsigned char (*block)[4], unsigned char *dest);
+static void encode_alpha_block(const unsigned char (*block)[4], unsigned char *dest);
+static uint16_t pack_565(const float *col);
+static void unpack_565(uint16_t c, float *col);
+
+bool encode_tex_bc(TexBc *bc, const uint32_t *pixels, int xsz, int ysz, bool alpha)
+{
+	if(xsz <= 0 || ysz <= 0) {
+		fprintf(stderr, "encode_tex_bc: invalid size %dx%d\n", xsz, ysz);
+		return false;
+	}
+
+	bc->fmt = alpha ? TEX_BC3 : TEX_BC1;
+	uint32_t total = layout_levels(bc, xsz, ysz);
+	if(!total) {
+		fprintf(stderr, "encode_tex_bc: %dx%d is too big\n", xsz, ysz);
+		return false;
+	}
+	bc->data.resize(total);
+
+	std::vector<uint32_t> cur(pixels, pixels + xsz * ysz), next;
+	for(int i=0; i<bc->num_levels; i++) {
+		const TexBcLevel *lvl = bc->levels + i;
+		if(i > 0) {
+			const TexBcLevel *prev = lvl - 1;
+			next.resize(lvl->xsz * lvl->ysz);
+			downsample(&cur[0], prev->xsz, prev->ysz, &next[0]);
+			cur.swap(next);
+		}
+		encode_level(&cur[0], lvl->xsz, lvl->ysz, bc->fmt, &bc->data[lvl->offs]);
+	}
+	return true;
+}
+
+/* sets up the mip levels of an xsz by ysz texture in bc->fmt, and returns
+ * the size of their data, 0 if they don't fit in TEX_BC_MAX_LEVELS */
+static uint32_t layout_levels(TexBc *bc, int xsz, int ysz)
+{
+	int block_size = bc->fmt == TEX_BC3 ? 16 : 8;
+	uint32_t total = 0;
+
+	bc->num_levels = 0;
+	for(int w = xsz, h = ysz;; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+		if(bc->num_levels >= TEX_BC_MAX_LEVELS) {
+			return 0;
+		}
+		TexBcLevel *lvl = bc->levels + bc->num_levels++;
+		lvl->xsz = w;
+		lvl->ysz = h;
+		lvl->offs = total;
+		lvl->size = ((w + 3) / 4) * ((h + 3) / 4) * block_size;
+		total += lvl->size;
+
+		if(w == 1 && h == 1) break;
+	}
+	return total;
+}
+
+/* box filter to half size, an odd last row or column is folded into the
+ * one before it */
+static void downsample(const uint32_t *src, int xsz, int ysz, uint32_t *dest)
+{
+	int dxsz = std::max(xsz / 2, 1);
+	int dysz = std::max(ysz / 2, 1);
+
+	for(int y=0; y<dysz; y++) {
+		int y0 = std::min(y * 2, ysz - 1);
+		int y1 = y == dysz - 1 ? ysz - 1 : y * 2 + 1;
+
+		for(int x=0; x<dxsz; x++) {
+			int x0 = std::min(x * 2, xsz - 1);
+			int x1 = x == dxsz - 1 ? xsz - 1 : x * 2 + 1;
+
+			unsigned int sum[4] = {0, 0, 0, 0};
+			int count = 0;
+			for(int sy=y0; sy<=y1; sy++) {
+				for(int sx=x0; sx<=x1; sx++) {
+					uint32_t p = src[sy * xsz + sx];
+					for(int c=0; c<4; c++) {
+						sum[c] += (p >> (c * 8)) & 0xff;
+					}
+					count++;
+				}
+			}
+
+			uint32_t p = 0;
+			for(int c=0; c<4; c++) {
+				p |= ((sum[c] + count / 2) / count) << (c * 8);
+			}
+			dest[y * dxsz + x] = p;
+		}
+	}
+}
+
+static void encode_level(const uint32_t *pixels, int xsz, int ysz, int fmt, unsigned char *dest)
+{
+	int bxsz = (xsz + 3) / 4;
+	int bysz = (ysz + 3) / 4;
+	int block_size = fmt == TEX_BC3 ? 16 : 8;
+
+	for(int by=0; by<bysz; by++) {
+		for(int bx=0; bx<bxsz; bx++) {
+			/* blocks over the edge repeat the last row and column */
+			unsigned char block[16][4];
+			for(int i=0; i<16; i++) {
+				int x = std::min(bx * 4 + (i & 3), xsz - 1);
+				int y = std::min(by * 4 + (i >> 2), ysz - 1);
+				memcpy(block[i], pixels + y * xsz + x, 4);
+			}
+
+			unsigned char *bptr = dest + (by * bxsz + bx) * block_size;
+			if(fmt == TEX_BC3) {
+				encode_alpha_block(block, bptr);
+				bptr += 8;
+			}
+			encode_color_block(block, bptr);
+		}
+	}
+}
+
+/* endpoints at the extremes of the colors along their principal axis,
+ * pulled in a bit since the extremes are rarely the best fit */
+static void encode_color_block(const unsigned char (*block)[4], unsigned char *dest)
+{
+	float mean[3] = {0, 0, 0};
+	for(int i=0; i<16; i++) {
+		for(int c=0; c<3; c++) {
+			mean[c] += block[i][c];
+		}
+	}
+	for(int c=0; c<3; c++) {
+		mean[c] /= 16.0f;
+	}
+
+	float cov[6] = {0, 0, 0, 0, 0, 0};	/* xx xy xz yy yz zz */
+	for(int i=0; i<16; i++) {
+		float r = block[i][0] - mean[0];
+		float g = block[i][1] - mean[1];
+		float b = block[i][2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+
+	/* power iteration, starting from the luminance axis */
+	float axis[3] = {0.299f, 0.587f, 0.114f};
+	for(int i=0; i<8; i++) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = std::max(fabsf(x), std::max(fabsf(y), fabsf(z)));
+		if(len <= 0) break;	/* flat block, any axis will do */
+		axis[0] = x / len;
+		axis[1] = y / len;
+		axis[2] = z / len;
+	}
+
+	float tmin = 1e10, tmax = -1e10;
+	for(int i=0; i<16; i++) {
+		float t = (block[i][0] - mean[0]) * axis[0] + (block[i][1] - mean[1]) * axis[1] +
+			(block[i][2] - mean[2]) * axis[2];
+		tmin = std::min(tmin, t);
+		tmax = std::max(tmax, t);
+	}
+	float inset = (tmax - tmin) / 16.0f;
+	tmin += inset;
+	tmax -= inset;
+
+	float end0[3], end1[3];
+	for(int c=0; c<3; c++) {
+		end0[c] = mean[c] + axis[c] * tmax;
+		end1[c] = mean[c] + axis[c] * tmin;
+	}
+	uint16_t c0 = pack_565(end0);
+	uint16_t c1 = pack_565(end1);
+
+	/* c0 > c1 picks the 4 color mode, which BC1 needs and BC3 ignores */
+	if(c0 < c1) {
+		std::swap(c0, c1);
+	}
+
+	uint32_t indices = 0;
+	if(c0 != c1) {
+		float pal[4][3];
+		unpack_565(c0, pal[0]);
+		unpack_565(c1, pal[1]);
+		for(int c=0; c<3; c++) {
+			pal[2][c] = (2.0f * pal[0][c] + pal[1][c]) / 3.0f;
+			pal[3][c] = (pal[0][c] + 2.0f * pal[1][c]) / 3.0f;
+		}
+
+		for(int i=0; i<16; i++) {
+			int best = 0;
+			float best_dsq = 1e10;
+			for(int j=0; j<4; j++) {
+				float dr = block[i][0] - pal[j][0];
+				float dg = block[i][1] - pal[j][1];
+				float db = block[i][2] - pal[j][2];
+				float dsq = dr * dr + dg * dg + db * db;
+				if(dsq < best_dsq) {
+					best_dsq = dsq;
+					best = j;
+				}
+			}
+			indices |= best << (i * 2);
+		}
+	}
+
+	dest[0] = c0 & 0xff;
+	dest[1] = c0 >> 8;
+	dest[2] = c1 & 0xff;
+	dest[3] = c1 >> 8;
+	for(int i=0; i<4; i++) {
+		dest[4 + i] = (indices >> (i * 8)) & 0xff;
+	}
+}
+
+/* endpoints at the alpha range of the block, in the 8 value mode */
+static void encode_alpha_block(const unsigned char (*block)[4], unsigned char *dest)
+{
+	int amin = 255, amax = 0;
+	for(int i=0; i<16; i++) {
+		amin = std::min(amin, (int)block[i][3]);
+		amax = std::max(amax, (int)block[i][3]);
+	}
+
+	dest[0] = amax;
+	dest[1] = amin;
+
+	uint64_t indices = 0;
+	if(amax > amin) {
+		int pal[8];
+		pal[0] = amax;
+		pal[1] = amin;
+		for(int j=1; j<7; j++) {
+			pal[j + 1] = ((7 - j) * amax + j * amin + 3) / 7;
+		}
+
+		for(int i=0; i<16; i++) {
+			int best = 0, best_diff = 256;
+			for(int j=0; j<8; j++) {
+				int diff = abs(block[i][3] - pal[j]);
+				if(diff < best_diff) {
+					best_diff = diff;
+					best = j;
+				}
+			}
+			indices |= (uint64_t)best << (i * 3);
+		}
+	}
+	for(int i=0; i<6; i++) {
+		dest[2 + i] = (indices >> (i * 8)) & 0xff;
+	}
+}
+
+static uint16_t pack_565(const float *col)
+{
+	int r = (int)(std::max(0.0f, std::min(col[0], 255.0f)) * 31.0f / 255.0f + 0.5f);
+	int g = (int)(std::max(0.0f, std::min(col[1], 255.0f)) * 63.0f / 255.0f + 0.5f);
+	int b = (int)(std::max(0.0f, std::min(col[2], 255.0f)) * 31.0f / 255.0f + 0.5f);
+	return (r << 11) | (g << 5) | b;
+}
+
+static void unpack_565(uint16_t c, float *col)
+{
+	int r = (c >> 11) & 0x1f;
+	int g = (c >> 5) & 0x3f;
+	int b = c & 0x1f;
+	col[0] = (r << 3) | (r >> 2);
+	col[1] = (g << 2) | (g >> 4);
+	col[2] = (b << 3) | (b >> 2);
+}
+
+bool save_tex_bc(const TexBc *bc, const char *img_fname, const char *fname)
+{
+	TexBcHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	if(!get_image_stamp(img_fname, &hdr.img_size, &hdr.img_mtime)) {
+		return false;
+	}
+	memcpy(hdr.magic, TXBC_MAGIC, sizeof hdr.magic);
+	hdr.version = TXBC_VERSION;
+	hdr.endian = TXBC_ENDIAN;
+	hdr.fmt = bc->fmt;
+	hdr.num_levels = bc->num_levels;
+	hdr.xsz = bc->levels[0].xsz;
+	hdr.ysz = bc->levels[0].ysz;
+	hdr.data_size = bc->data.size();
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1 || fwrite(&bc->data[0], 1, bc->data.size(), fp) != bc->data.size()) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		fclose(fp);
+		remove(fname);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+bool load_tex_bc(TexBc *bc, const char *img_fname, const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) {
+		return false;	/* not cached yet */
+	}
+
+	TexBcHeader hdr;
+	if(fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, TXBC_MAGIC, sizeof hdr.magic) != 0 ||
+			hdr.version != TXBC_VERSION || hdr.endian != TXBC_ENDIAN) {
+		fprintf(stderr, "%s is not a compressed texture cache\n", fname);
+		fclose(fp);
+		return false;
+	}
+
+	uint64_t size, mtime;
+	if(!get_image_stamp(img_fname, &size, &mtime) || hdr.img_size != size || hdr.img_mtime != mtime) {
+		fclose(fp);
+		return false;	/* stale, the image changed */
+	}
+
+	/* the levels follow from the size, check that they match the data */
+	uint32_t total = 0;
+	bc->fmt = hdr.fmt;
+	if(hdr.fmt <= TEX_BC3 && hdr.xsz > 0 && hdr.ysz > 0 && hdr.xsz <= 32768 && hdr.ysz <= 32768) {
+		total = layout_levels(bc, hdr.xsz, hdr.ysz);
+	}
+	if(!total || (uint32_t)bc->num_levels != hdr.num_levels || total != hdr.data_size) {
+		fprintf(stderr, "%s: invalid compressed texture\n", fname);
+		fclose(fp);
+		return false;
+	}
+
+	bc->data.resize(total);
+	if(fread(&bc->data[0], 1, total, fp) != total) {
+		fprintf(stderr, "%s is truncated\n", fname);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+bool get_image_stamp(const char *img_fname, uint64_t *size, uint64_t *mtime)
+{
+	struct stat st;
+	if(stat(img_fname, &st) == -1) {
+		return false;
+	}
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return true;
+}
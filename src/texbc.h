@@ -0,0 +1,46 @@
+#ifndef TEXBC_H_
+#define TEXBC_H_
+
+#include <stdint.h>
+#include <vector>
+
+/* Block compressed textures, transcoded on the CPU.
+ *
+ * Opaque images become BC1 (DXT1, 4 bits per pixel), images with alpha
+ * BC3 (DXT5, 8 bits per pixel), with a full mip chain down to 1x1 in
+ * either case. Transcoding is slow next to an upload, so the result is
+ * cached on disk and uploaded as is on the next start.
+ */
+
+enum {
+	TEX_BC1,
+	TEX_BC3
+};
+
+#define TEX_BC_MAX_LEVELS	16
+
+struct TexBcLevel {
+	int xsz, ysz;
+	uint32_t offs, size;	/* in TexBc::data */
+};
+
+struct TexBc {
+	int fmt;
+	int num_levels;
+	TexBcLevel levels[TEX_BC_MAX_LEVELS];
+	std::vector<unsigned char> data;
+};
+
+/* pixels are RGBA32, as loaded by imago */
+bool encode_tex_bc(TexBc *bc, const uint32_t *pixels, int xsz, int ysz, bool alpha);
+
+/* the cache file is stamped with the size and modification time of the
+ * image, load_tex_bc fails if the image changed since */
+bool save_tex_bc(const TexBc *bc, const char *img_fname, const char *fname);
+bool load_tex_bc(TexBc *bc, const char *img_fname, const char *fname);
+
+/* size and modification time of an image, which the texture caches are
+ * stamped with, the alpha cache of texalpha.h too */
+bool get_image_stamp(const char *img_fname, uint64_t *size, uint64_t *mtime);
+
+#endif // TEXBC_H_
@@ -0,0 +1,35 @@
+#include <errno.h>
+#include <time.h>
+
+#include "timer.h"
+
+static struct timespec start_ts;
+static bool started;
+
+unsigned long get_time_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if(!started) {
+		start_ts = ts;
+		started = true;
+	}
+	return (ts.tv_sec - start_ts.tv_sec) * 1000000 + (ts.tv_nsec - start_ts.tv_nsec) / 1000;
+}
+
+void sleep_until_usec(unsigned long usec)
+{
+	get_time_usec();	/* make sure start_ts is valid */
+
+	struct timespec ts;
+	ts.tv_sec = start_ts.tv_sec + usec / 1000000;
+	ts.tv_nsec = start_ts.tv_nsec + (usec % 1000000) * 1000;
+	if(ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	/* absolute deadline, so being interrupted or woken late doesn't drift */
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
@@ -0,0 +1,10 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+/* monotonic time in microseconds since the first call */
+unsigned long get_time_usec();
+
+/* sleeps until get_time_usec() reaches usec */
+void sleep_until_usec(unsigned long usec);
+
+#endif // TIMER_H_
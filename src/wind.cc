@@ -0,0 +1,166 @@
+#include <math.h>
+
+#include "wind.h"
+#include "hair_kern.h"
+
+/* drift of the noise domain of each potential component with time, in
+ * noise cells per unit of turb_rate. They differ, so that the potential
+ * changes shape instead of just sliding along */
+static const float turb_drift[3][3] = {
+	{0.0f, 1.0f, 0.3f},
+	{0.8f, -0.2f, 0.6f},
+	{-0.5f, 0.4f, -0.9f}
+};
+
+/* and an offset, so that the components don't share their lattice */
+static const float turb_offset[3][3] = {
+	{0.0f, 0.0f, 0.0f},
+	{31.7f, 12.3f, 57.1f},
+	{-43.9f, 71.3f, -19.7f}
+};
+
+static void add_turbulence(WindGrid *grid, const HairKernels *kern, const HairParams &p, double t);
+
+bool wind_enabled(const HairParams &p)
+{
+	/* the drag moves the anchors, see the update kernel */
+	if(p.wind_drag <= 0 || p.k_anc <= 0) {
+		return false;
+	}
+	return p.wind[0] != 0 || p.wind[1] != 0 || p.wind[2] != 0 || p.fan_speed != 0 ||
+		p.turb_speed > 0;
+}
+
+void build_wind(WindGrid *grid, const HairKernels *kern, const HairParams &p, const Aabb &box, double t)
+{
+	Vec3 ext = box.v1 - box.v0;
+	float size = ext.x;
+	if(ext.y > size) size = ext.y;
+	if(ext.z > size) size = ext.z;
+	int res = p.wind_res < 2 ? 2 : p.wind_res;
+
+	grid->cell = size > 0 ? size / res : 1.0;
+	grid->origin = box.v0;
+	grid->xsz = (int)ceil(ext.x / grid->cell) + 1;
+	grid->ysz = (int)ceil(ext.y / grid->cell) + 1;
+	grid->zsz = (int)ceil(ext.z / grid->cell) + 1;
+
+	int xsz = grid->xsz, ysz = grid->ysz, zsz = grid->zsz;
+	grid->vel.resize(xsz * ysz * zsz * 3);
+	float *vel = &grid->vel[0];
+
+	Vec3 fan = Vec3(p.fan_pos[0], p.fan_pos[1], p.fan_pos[2]);
+	float fan_rad_sq = p.fan_radius * p.fan_radius;
+
+#pragma omp parallel for
+	for(int i=0; i<zsz; i++) {
+		for(int j=0; j<ysz; j++) {
+			for(int k=0; k<xsz; k++) {
+				float *v = vel + ((i * ysz + j) * xsz + k) * 3;
+				v[0] = p.wind[0];
+				v[1] = p.wind[1];
+				v[2] = p.wind[2];
+
+				if(p.fan_speed == 0) continue;
+
+				/* out from the fan, at fan_speed up to fan_radius, and
+				 * spreading over a sphere past it */
+				Vec3 pos = grid->origin + Vec3(k, j, i) * grid->cell;
+				Vec3 dir = pos - fan;
+				float dsq = length_sq(dir);
+				if(dsq <= 0) continue;
+
+				float speed = p.fan_speed * (dsq > fan_rad_sq ? fan_rad_sq / dsq : 1.0f);
+				dir = dir * (speed / (float)sqrt(dsq));
+				v[0] += dir.x;
+				v[1] += dir.y;
+				v[2] += dir.z;
+			}
+		}
+	}
+
+	if(p.turb_speed > 0) {
+		add_turbulence(grid, kern, p, t);
+	}
+}
+
+/* adds the curl of a vector potential of three noise fields. The potential
+ * is sampled one cell further out than the grid, for the differences */
+static void add_turbulence(WindGrid *grid, const HairKernels *kern, const HairParams &p, double t)
+{
+	int xsz = grid->xsz, ysz = grid->ysz, zsz = grid->zsz;
+	int pxsz = xsz + 2, pysz = ysz + 2, pzsz = zsz + 2;
+	int num_pot = pxsz * pysz * pzsz;
+
+	/* the eddies drift with the uniform wind, and each component of the
+	 * potential along its own direction. The offsets grow with the time,
+	 * so they're taken in double and wrapped to the noise period, which
+	 * keeps the float coordinates precise however long it runs */
+	float inv_scale = 1.0f / p.turb_scale;
+	float step = grid->cell * inv_scale;
+	double drift = t * p.turb_rate;
+	float org[3][3];
+	for(int i=0; i<3; i++) {
+		for(int j=0; j<3; j++) {
+			double o = ((double)grid->origin[j] - grid->cell - p.wind[j] * t) * inv_scale;
+			o = fmod(o + turb_offset[i][j] + turb_drift[i][j] * drift, NOISE_PERIOD);
+			org[i][j] = o < 0 ? o + NOISE_PERIOD : o;
+		}
+	}
+
+	grid->coord.resize(num_pot * 9);
+	grid->pot.resize(num_pot * 3);
+	float *px = &grid->coord[0];
+	float *py = px + num_pot * 3;
+	float *pz = py + num_pot * 3;
+
+#pragma omp parallel for
+	for(int i=0; i<pzsz; i++) {
+		for(int j=0; j<pysz; j++) {
+			for(int k=0; k<pxsz; k++) {
+				int idx = (i * pysz + j) * pxsz + k;
+				for(int c=0; c<3; c++) {
+					px[c * num_pot + idx] = org[c][0] + k * step;
+					py[c * num_pot + idx] = org[c][1] + j * step;
+					pz[c * num_pot + idx] = org[c][2] + i * step;
+				}
+			}
+		}
+	}
+
+	/* in slices, the kernel vectorizes within each */
+	int num_slices = pzsz * 3;
+	int slice = pxsz * pysz;
+#pragma omp parallel for
+	for(int i=0; i<num_slices; i++) {
+		int offs = i * slice;
+		kern->noise(px + offs, py + offs, pz + offs, slice, &grid->pot[offs]);
+	}
+
+	/* the noise gradients are about 1 per noise cell, so the differences
+	 * come out as turb_speed after scaling to world units */
+	const float *pot0 = &grid->pot[0];
+	const float *pot1 = pot0 + num_pot;
+	const float *pot2 = pot1 + num_pot;
+	float scale = p.turb_speed * p.turb_scale / (2.0f * grid->cell);
+	float *vel = &grid->vel[0];
+
+#pragma omp parallel for
+	for(int i=0; i<zsz; i++) {
+		for(int j=0; j<ysz; j++) {
+			for(int k=0; k<xsz; k++) {
+				int idx = ((i + 1) * pysz + j + 1) * pxsz + k + 1;
+				int dx = 1, dy = pxsz, dz = slice;
+
+				float cx = (pot2[idx + dy] - pot2[idx - dy]) - (pot1[idx + dz] - pot1[idx - dz]);
+				float cy = (pot0[idx + dz] - pot0[idx - dz]) - (pot2[idx + dx] - pot2[idx - dx]);
+				float cz = (pot1[idx + dx] - pot1[idx - dx]) - (pot0[idx + dy] - pot0[idx - dy]);
+
+				float *v = vel + ((i * ysz + j) * xsz + k) * 3;
+				v[0] += cx * scale;
+				v[1] += cy * scale;
+				v[2] += cz * scale;
+			}
+		}
+	}
+}
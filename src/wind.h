@@ -0,0 +1,49 @@
+#ifndef WIND_H_
+#define WIND_H_
+
+#include <vector>
+#include <gmath/gmath.h>
+
+#include "mesh.h"
+#include "params.h"
+
+struct HairKernels;
+
+/* Air velocity of the external force fields (uniform wind, fan and curl
+ * noise turbulence, see HairParams), in world space.
+ *
+ * Evaluating the noise per strand and substep would cost more than the
+ * strand update itself, so the fields are sampled on a coarse grid around
+ * the hair once per update instead, and the strands interpolate it. The
+ * turbulence is the curl of a noise potential, taken by central differences
+ * on the grid, which keeps it divergence free: it swirls without blowing
+ * the hair apart or together.
+ *
+ * Even the interpolation costs about half of a strand update, so each
+ * grid build samples the air for 1 / WIND_REFRESH of the strands, and the
+ * rest keep what they got in the last few builds. In that time the strands
+ * move a fraction of a cell, and the air changes as little. Where the
+ * noise is slow, the grid is built every HairKernels::wind_interval
+ * updates.
+ */
+#define WIND_REFRESH	16
+
+struct WindGrid {
+	std::vector<float> vel;	/* 3 per sample */
+	int xsz, ysz, zsz;
+	Vec3 origin;	/* position of sample (0, 0, 0) */
+	float cell;
+
+	/* scratch space of build_wind, kept to avoid reallocating it */
+	std::vector<float> pot;
+	std::vector<float> coord;
+};
+
+/* true if the params have any air motion to drag the strands along */
+bool wind_enabled(const HairParams &p);
+
+/* samples the fields at time t over box, with p.wind_res cells along its
+ * longest side. The noise is evaluated by kern */
+void build_wind(WindGrid *grid, const HairKernels *kern, const HairParams &p, const Aabb &box, double t);
+
+#endif // WIND_H_
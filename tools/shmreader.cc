@@ -0,0 +1,209 @@
+/* Example reader of the shared memory strand export (hair -export <name>).
+ *
+ * Copies every new frame out of the ring without ever blocking the writer,
+ * retrying when the writer overwrote the slot meanwhile, and verifies the
+ * copy against the frame checksum. Follows the writer when grooming
+ * changes the strands: it notes layout changes, and opens the object again
+ * when the writer made it bigger.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "shmproto.h"
+
+static unsigned long get_usec();
+static bool open_export(const std::string &name, const unsigned char **map, size_t *size, bool quiet);
+static bool read_frame(const unsigned char *map, const ShmHeader *hdr, uint64_t frame,
+		std::vector<float> *data, ShmSlot *info);
+
+int main(int argc, char **argv)
+{
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s <shm name> [num frames]\n", argv[0]);
+		return 1;
+	}
+	std::string name = argv[1][0] == '/' ? argv[1] : std::string("/") + argv[1];
+	int num_frames = argc > 2 ? atoi(argv[2]) : 600;
+
+	const unsigned char *map;
+	size_t map_size;
+	if(!open_export(name, &map, &map_size, false)) {
+		return 1;
+	}
+	const ShmHeader *hdr = (const ShmHeader*)map;
+
+	std::vector<float> data;
+	ShmSlot info;
+	uint64_t prev = 0;
+	uint32_t prev_layout = 0;
+	int count = 0, missed = 0, bad = 0, relayouts = 0, reopens = 0;
+	unsigned long start = get_usec();
+	unsigned long idle_start = start;
+
+	while(count < num_frames) {
+		/* closed by the writer, to make room for more strands or for good */
+		if(hdr->magic != SHM_MAGIC) {
+			munmap((void*)map, map_size);
+			map = 0;
+			while(get_usec() - idle_start < 5000000) {
+				if(open_export(name, &map, &map_size, true)) break;
+				usleep(10000);
+			}
+			if(!map) {
+				fprintf(stderr, "the writer is gone\n");
+				break;
+			}
+			hdr = (const ShmHeader*)map;
+			prev = 0;	/* its frames count from 1 again */
+			reopens++;
+			continue;
+		}
+
+		uint64_t frame = hdr->latest.load(std::memory_order_acquire);
+		if(frame == prev) {
+			if(get_usec() - idle_start > 5000000) {
+				fprintf(stderr, "no new frames for 5 seconds, giving up\n");
+				break;
+			}
+			usleep(500);
+			continue;
+		}
+		idle_start = get_usec();
+
+		if(!read_frame(map, hdr, frame, &data, &info)) {
+			continue;	/* overwritten before we got it, try the newer one */
+		}
+
+		/* verify the copy */
+		uint32_t checksum = 0;
+		for(size_t i=0; i<data.size(); i++) {
+			uint32_t bits;
+			memcpy(&bits, &data[i], sizeof bits);
+			checksum ^= bits;
+		}
+		if(checksum != info.checksum) {
+			bad++;
+		}
+
+		if(prev && frame > prev + 1) {
+			missed += frame - prev - 1;
+		}
+		prev = frame;
+
+		/* strand i is another strand from here on */
+		if(count > 0 && info.layout != prev_layout) {
+			printf("frame %lu: strand layout %u, %u strands\n", (unsigned long)frame,
+					info.layout, info.num_strands);
+			relayouts++;
+		}
+		prev_layout = info.layout;
+
+		if(count++ % 60 == 0) {
+			/* tip of the first strand, in world space */
+			const float *tip = &data[info.num_strands * 3];
+			printf("frame %lu: %u strands, %.2f s, tip 0: (%.3f %.3f %.3f)\n", (unsigned long)frame,
+					info.num_strands, info.time, tip[0], tip[1], tip[2]);
+		}
+	}
+
+	double sec = (get_usec() - start) / 1000000.0;
+	printf("%d frames in %.2f s (%.1f fps), %d skipped, %d failed the checksum\n", count, sec,
+			count / sec, missed, bad);
+	printf("%d layout changes, opened again %d times\n", relayouts, reopens);
+
+	if(map) {
+		munmap((void*)map, map_size);
+	}
+	return bad ? 1 : 0;
+}
+
+/* maps the export read only, and checks that it's complete. Quiet while
+ * waiting for the writer to create it again */
+static bool open_export(const std::string &name, const unsigned char **map, size_t *size, bool quiet)
+{
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(fd == -1) {
+		if(!quiet) fprintf(stderr, "failed to open shared memory object %s: %s\n", name.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+
+	void *ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ptr == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s\n", name.c_str());
+		return false;
+	}
+	const ShmHeader *hdr = (const ShmHeader*)ptr;
+
+	if((size_t)st.st_size < sizeof *hdr || hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION) {
+		if(!quiet) fprintf(stderr, "%s is not a hair export, or the writer is gone\n", name.c_str());
+		munmap(ptr, st.st_size);
+		return false;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if(hdr->slot_offs + hdr->slot_size * hdr->num_slots > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s is truncated\n", name.c_str());
+		munmap(ptr, st.st_size);
+		return false;
+	}
+	printf("%s: writer pid %d, %u slots, up to %u strands\n", name.c_str(), hdr->writer_pid,
+			hdr->num_slots, hdr->max_strands);
+
+	*map = (const unsigned char*)ptr;
+	*size = st.st_size;
+	return true;
+}
+
+static unsigned long get_usec()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* copies the roots and then the tips of frame to data. Returns false if the
+ * writer reused its slot meanwhile */
+static bool read_frame(const unsigned char *map, const ShmHeader *hdr, uint64_t frame,
+		std::vector<float> *data, ShmSlot *info)
+{
+	const ShmSlot *slot = (const ShmSlot*)(map + hdr->slot_offs + (frame % hdr->num_slots) * hdr->slot_size);
+	const float *roots = (const float*)((const unsigned char*)slot + SHM_DATA_OFFS);
+	const float *tips = roots + hdr->max_strands * 3;
+
+	for(;;) {
+		uint32_t seq = slot->seq.load(std::memory_order_acquire);
+		if(seq & 1) {
+			return false;	/* the writer is already on it again */
+		}
+
+		uint32_t num = slot->num_strands;
+		if(num > hdr->max_strands) num = hdr->max_strands;
+
+		data->resize(num * 6);
+		memcpy(&(*data)[0], roots, num * 3 * sizeof(float));
+		memcpy(&(*data)[num * 3], tips, num * 3 * sizeof(float));
+
+		info->num_strands = num;
+		info->frame = slot->frame;
+		info->time = slot->time;
+		info->checksum = slot->checksum;
+		info->layout = slot->layout;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(slot->seq.load(std::memory_order_relaxed) == seq) {
+			return info->frame == frame;
+		}
+		/* torn, read it again */
+	}
+}
@@ -0,0 +1,156 @@
+/* Test client for the simulation server (hair -server <socket>).
+ *
+ * Sends a swinging head transform every frame, reads the strand frames
+ * back, checks them, and reports the frame rate and the latency from a
+ * request to the first frame that applied it.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "simproto.h"
+
+#define MAX_PENDING	256
+
+static unsigned long get_usec();
+static bool read_full(int fd, void *buf, size_t size);
+static void make_xform(float *m, float angle);
+
+int main(int argc, char **argv)
+{
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s <socket> [num frames]\n", argv[0]);
+		return 1;
+	}
+	int num_frames = argc > 2 ? atoi(argv[2]) : 600;
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof addr.sun_path - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1 || connect(fd, (sockaddr*)&addr, sizeof addr) == -1) {
+		fprintf(stderr, "failed to connect to %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	/* send times of the requests, by seq */
+	unsigned long req_time[MAX_PENDING];
+	uint32_t seq = 0;
+	uint32_t last_ack = 0;
+	unsigned long lat_sum = 0, lat_max = 0;
+	int lat_count = 0;
+	unsigned int prev_tick = 0;
+	int skipped = 0;
+
+	std::vector<uint16_t> data;
+	unsigned long start = get_usec();
+
+	for(int i=0; i<num_frames; i++) {
+		SimRequest req;
+		req.magic = SIM_REQ_MAGIC;
+		req.seq = ++seq;
+		make_xform(req.xform, sin(i * 0.05) * 0.5);
+		req_time[req.seq % MAX_PENDING] = get_usec();
+		if(send(fd, &req, sizeof req, MSG_NOSIGNAL) != (ssize_t)sizeof req) {
+			fprintf(stderr, "failed to send request\n");
+			return 1;
+		}
+
+		SimFrame frm;
+		if(!read_full(fd, &frm, sizeof frm)) {
+			fprintf(stderr, "server closed the connection\n");
+			return 1;
+		}
+		if(frm.magic != SIM_FRAME_MAGIC || frm.num_active > frm.num_strands ||
+				frm.size != frm.num_active * 3 * sizeof(uint16_t)) {
+			fprintf(stderr, "invalid frame %u\n", frm.tick);
+			return 1;
+		}
+		data.resize(frm.num_active * 3);
+		if(frm.size && !read_full(fd, &data[0], frm.size)) {
+			fprintf(stderr, "server closed the connection\n");
+			return 1;
+		}
+
+		if(prev_tick && frm.tick != prev_tick + 1) {
+			skipped += frm.tick - prev_tick - 1;
+		}
+		prev_tick = frm.tick;
+
+		if(frm.ack != last_ack && seq - frm.ack < MAX_PENDING) {
+			unsigned long lat = get_usec() - req_time[frm.ack % MAX_PENDING];
+			lat_sum += lat;
+			if(lat > lat_max) lat_max = lat;
+			lat_count++;
+			last_ack = frm.ack;
+		}
+
+		/* head space extent of the strands, as a sanity check */
+		float maxz = 0;
+		for(unsigned int j=0; j<frm.num_active; j++) {
+			float z = frm.bmin[2] + data[j * 3 + 2] * frm.bstep[2];
+			if(fabs(z) > maxz) maxz = fabs(z);
+		}
+		if(i % 60 == 0) {
+			printf("tick %u: %u/%u strands, %.2f s, max |z| %.3f\n", frm.tick, frm.num_active,
+					frm.num_strands, frm.time, maxz);
+		}
+	}
+
+	double sec = (get_usec() - start) / 1000000.0;
+	printf("%d frames in %.2f s (%.1f fps), %d server ticks skipped\n", num_frames, sec,
+			num_frames / sec, skipped);
+	if(lat_count) {
+		printf("request to frame latency: avg %.2f ms, max %.2f ms\n",
+				lat_sum / 1000.0 / lat_count, lat_max / 1000.0);
+	}
+
+	close(fd);
+	return 0;
+}
+
+static unsigned long get_usec()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool read_full(int fd, void *buf, size_t size)
+{
+	char *ptr = (char*)buf;
+	while(size > 0) {
+		ssize_t sz = recv(fd, ptr, size, 0);
+		if(sz <= 0) {
+			if(sz == -1 && errno == EINTR) continue;
+			return false;
+		}
+		ptr += sz;
+		size -= sz;
+	}
+	return true;
+}
+
+/* rotation around the z axis, in the Mat4 element layout: m[column * 4 + row] */
+static void make_xform(float *m, float angle)
+{
+	float s = sin(angle);
+	float c = cos(angle);
+
+	memset(m, 0, 16 * sizeof *m);
+	m[0] = c;
+	m[1] = s;
+	m[4] = -s;
+	m[5] = c;
+	m[10] = 1;
+	m[15] = 1;
+}